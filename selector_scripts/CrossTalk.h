@@ -8,13 +8,19 @@
 #ifndef CrossTalk_h
 #define CrossTalk_h
 
+#include <string>
+
 #include "TChain.h"
 #include "TFile.h"
 
 #include "TH1.h"
 #include "TH2.h"
 #include "THnSparse.h"
-#include "TMVA/TSpline1.h"
+
+// from src_scripts, which has to be on the include path (see README.md)
+#include "CalBundle.h"
+#include "HistRegistry.h"
+#include "ResidualTable.h"
 
 // Header file for the classes stored in the TTree if any.
 #include "TGriffin.h"
@@ -28,14 +34,21 @@ class CrossTalk : public TGRSISelector {
 public:
    TGriffin* fGrif;
    TSceptar* fScep;
-   std::vector<TMVA::TSpline1*> fResidualVec;
+   ResidualTable fResiduals; //!
+   bool fCalibrationLoaded; //! once for all trees of the chain
+   // the histograms and the handles of their blocks, see CreateHistograms
+   HistRegistry fHists; //!
+   int fAEdet, fGEdet, fAE2det, fPairs;
+   int fAMult, fGEChan, fAE, fGE, fGEnoCT;
 
-   CrossTalk(TTree* /*tree*/ = 0) : TGRSISelector(), fGrif(0), fScep(0) { SetOutputPrefix("Crosstalk"); }
+   CrossTalk(TTree* /*tree*/ = 0) : TGRSISelector(), fGrif(0), fScep(0), fCalibrationLoaded(false) { SetOutputPrefix("Crosstalk"); }
    virtual ~CrossTalk() {}
    virtual Int_t Version() const { return 2; }
    void          CreateHistograms();
    void          FillHistograms();
    void InitializeBranches(TTree* tree);
+   // the bundle or residuals file of the selector option "cal=<file>", residuals.root without it
+   std::string CalibrationFile() const;
 
    ClassDef(CrossTalk, 2);
 };
@@ -48,23 +61,20 @@ void CrossTalk::InitializeBranches(TTree* tree)
    if(!tree) return;
    tree->SetBranchAddress("TGriffin", &fGrif);
    //tree->SetBranchAddress("TSceptar", &fScep);
-    TFile *pResFile = new TFile( "residuals.root", "READ");
-    if ( pResFile != nullptr ) {
-        pResFile->cd();
-        if ( pResFile->cd("Energy_Residuals") ) {
-            printf("Energy residuals found, loading...\n");
-            TGraph* TempGraph;
-            for (int k = 0 ; k < 64; k++) {
-                gDirectory->GetObject(Form("Graph;%d", k + 1), TempGraph);
-                fResidualVec.push_back( new TMVA::TSpline1("", TempGraph) );
-            }
-        } else {
-            printf("No energy residuals found\n");
-        }
-        pResFile->Close();
-    }
-
+   // every tree of the chain is calibrated by the same file, and the residuals would be read again for each
+   if(!fCalibrationLoaded) {
+      LoadCalibration(nullptr, CalibrationFile().c_str(), &fResiduals);
+      fCalibrationLoaded = true;
+   }
+}
 
+std::string CrossTalk::CalibrationFile() const
+{
+   std::string option = GetOption();
+   size_t start = option.find("cal=");
+   if(start == std::string::npos) return "residuals.root";
+   start += 4;
+   return option.substr(start, option.find_first_of(" ,;", start) - start);
 }
 
 #endif // #ifdef CrossTalk_cxx
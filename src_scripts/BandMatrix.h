@@ -0,0 +1,305 @@
+#ifndef BandMatrix_h
+#define BandMatrix_h
+
+// 2D histogram that only keeps the anti-diagonal bands x + y = sum +- width.
+//
+// The cross-talk matrices of MakeCTMatrices are 2000x2000 bins for each of the
+// 96 crystal pairs, ~1.5 GB, but GriffinCTFix only ever looks at the bins
+// around the line where the energies of the two crystals add up to a full
+// energy peak (e.g. 1332.5 keV of 60Co). BandMatrix keeps, for every x bin,
+// only the y bins whose centre is within the half width of the sums it is
+// given (plus one bin on either side), which is about 35 bins per x bin and
+// sum instead of 2000:
+//
+//     BandMatrix mat("det_1_0_1", "", 2000, 0., 2000., {1173.2, 1332.5}, 15.);
+//     mat.Fill(e1, e2);    // dropped if not in one of the bands
+//     mat.Write();         // det_1_0_1_layout and det_1_0_1_bands
+//     ...
+//     BandMatrix *read = BandMatrix::Read(file, "det_1_0_1");
+//
+// Both axes share the same binning and the bin numbers are the ones of a TH2
+// with these axis parameters. Fills outside the bands or the axis range are
+// dropped, there are no under- and overflow bins. Where two bands overlap, a
+// bin belongs to the first sum. Like SparseMatrix it is a TNamed without a
+// dictionary, writing it writes two vectors, and bin contents are floats.
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "TDirectory.h"
+#include "TH2F.h"
+#include "TNamed.h"
+#include "TVectorD.h"
+#include "TVectorF.h"
+
+class BandMatrix : public TNamed {
+public:
+    BandMatrix(const char *name, const char *title, int nbins, double low,
+               double up, const std::vector<double> &sums, double halfWidth)
+        : TNamed(name, title), fNbins(nbins), fLow(low), fUp(up),
+          fHalfWidth(halfWidth), fSums(sums) {
+        double width = (fUp - fLow) / fNbins;
+        // every y bin centre within the band, plus one bin on either side
+        fBandBins = static_cast<int>(2. * fHalfWidth / width) + 3;
+        size_t offset = 0;
+        for (double sum : fSums) {
+            // no x bin above the sum has anything in the band
+            int nColumns = std::min(fNbins, FindBin(sum + fHalfWidth));
+            fColumns.push_back(std::max(nColumns, 0));
+            fOffsets.push_back(offset);
+            offset += static_cast<size_t>(fColumns.back()) * fBandBins;
+        }
+        fContents.assign(offset, 0.);
+    }
+    ~BandMatrix() override {}
+
+    int GetNbins() const { return fNbins; }
+    double GetLow() const { return fLow; }
+    double GetUp() const { return fUp; }
+    double GetHalfWidth() const { return fHalfWidth; }
+    const std::vector<double> &GetSums() const { return fSums; }
+    double GetEntries() const { return fEntries; }
+    // Memory used by the bin contents in bytes
+    size_t GetMemoryUsage() const { return fContents.size() * sizeof(Float_t); }
+
+    // Same bin numbering as TAxis::FindBin, 0 is underflow, n+1 overflow
+    int FindBin(double x) const {
+        if (x < fLow) {
+            return 0;
+        }
+        if (!(x < fUp)) {
+            return fNbins + 1;
+        }
+        return 1 + static_cast<int>(fNbins * (x - fLow) / (fUp - fLow));
+    }
+    double GetBinCenter(int bin) const {
+        return fLow + (bin - 0.5) * (fUp - fLow) / fNbins;
+    }
+    double GetBinWidth() const { return (fUp - fLow) / fNbins; }
+
+    // The band that holds all of sum +- halfWidth, -1 if there is none
+    int FindBand(double sum, double halfWidth) const {
+        for (size_t band = 0; band < fSums.size(); ++band) {
+            if (fSums[band] - fHalfWidth <= sum - halfWidth &&
+                sum + halfWidth <= fSums[band] + fHalfWidth) {
+                return band;
+            }
+        }
+        return -1;
+    }
+
+    // The y bins [first, last] of x bin binx that the band keeps, first > last
+    // if it keeps none
+    void GetBandRange(int band, int binx, int &first, int &last) const {
+        if (binx < 1 || binx > fColumns[band]) {
+            first = 1;
+            last = 0;
+            return;
+        }
+        int start = FirstBin(band, binx);
+        first = std::max(1, start);
+        last = std::min(fNbins, start + fBandBins - 1);
+    }
+
+    void Fill(double x, double y, double w = 1.) {
+        if (std::isnan(x) || std::isnan(y)) {
+            return;
+        }
+        Float_t *cell = Cell(FindBin(x), FindBin(y));
+        if (cell != nullptr) {
+            *cell += w;
+        }
+        fEntries += 1.;
+    }
+
+    // Content of the bin, 0 outside the bands
+    double GetBinContent(int binx, int biny) const {
+        const Float_t *cell = const_cast<BandMatrix *>(this)->Cell(binx, biny);
+        return (cell != nullptr) ? *cell : 0.;
+    }
+    void SetBinContent(int binx, int biny, double content) {
+        Float_t *cell = Cell(binx, biny);
+        if (cell != nullptr) {
+            *cell = content;
+        }
+    }
+
+    // this += c*other, both matrices need the same binning and bands
+    void Add(const BandMatrix *other, double c = 1.) {
+        for (size_t i = 0; i < fContents.size(); ++i) {
+            fContents[i] += c * other->fContents[i];
+        }
+        fEntries += other->fEntries;
+    }
+
+    void Reset() {
+        std::fill(fContents.begin(), fContents.end(), 0.);
+        fEntries = 0.;
+    }
+
+    // The band of a dense matrix, e.g. of an old MakeCTMatrices file. The
+    // caller owns it.
+    static BandMatrix *FromTH2(const TH2 *hist, const std::vector<double> &sums,
+                               double halfWidth) {
+        const TAxis *axis = hist->GetXaxis();
+        auto *mat = new BandMatrix(hist->GetName(), hist->GetTitle(),
+                                   axis->GetNbins(), axis->GetXmin(),
+                                   axis->GetXmax(), sums, halfWidth);
+        mat->ForEachCell([&](int binx, int biny, Float_t &cell) {
+            cell = hist->GetBinContent(binx, biny);
+        });
+        mat->fEntries = hist->GetEntries();
+        return mat;
+    }
+
+    // Creates a dense TH2F with the bands of this matrix, the caller owns it
+    TH2 *MakeTH2(const char *name = nullptr) const {
+        if (name == nullptr) {
+            name = GetName();
+        }
+        auto *hist = new TH2F(name, GetTitle(), fNbins, fLow, fUp, fNbins,
+                              fLow, fUp);
+        hist->SetDirectory(nullptr);
+        const_cast<BandMatrix *>(this)->ForEachCell(
+            [hist](int binx, int biny, Float_t &cell) {
+                if (cell != 0.) {
+                    hist->SetBinContent(binx, biny, cell);
+                }
+            });
+        hist->ResetStats();
+        if (fEntries > 0.) {
+            hist->SetEntries(fEntries);
+        }
+        return hist;
+    }
+
+    // Writes the matrix as name_layout (binning, half width, entries and
+    // sums) and name_bands (the kept bins)
+    int Write(const char *name = nullptr, int = 0, int = 0) const override {
+        if (name == nullptr) {
+            name = GetName();
+        }
+        TVectorD layout(kSums + fSums.size());
+        layout[0] = fNbins;
+        layout[1] = fLow;
+        layout[2] = fUp;
+        layout[3] = fHalfWidth;
+        layout[4] = fEntries;
+        for (size_t i = 0; i < fSums.size(); ++i) {
+            layout[kSums + i] = fSums[i];
+        }
+        TVectorF contents(std::max<int>(1, fContents.size())); // never empty
+        std::copy(fContents.begin(), fContents.end(),
+                  contents.GetMatrixArray());
+        int nbytes = gDirectory->WriteTObject(&layout, Form("%s_layout", name));
+        nbytes += gDirectory->WriteTObject(&contents, Form("%s_bands", name));
+        return nbytes;
+    }
+    int Write(const char *name = nullptr, int option = 0,
+              int bufsize = 0) override {
+        return const_cast<const BandMatrix *>(this)->Write(name, option,
+                                                          bufsize);
+    }
+
+    // True if the directory has a band matrix of this name
+    static bool IsBandMatrix(TDirectory *dir, const char *name) {
+        return dir->GetKey(Form("%s_layout", name)) != nullptr;
+    }
+
+    // Reads a matrix written by Write, nullptr if it is not in the directory.
+    // The caller owns it.
+    static BandMatrix *Read(TDirectory *dir, const char *name) {
+        TVectorD *layout = nullptr;
+        TVectorF *contents = nullptr;
+        dir->GetObject(Form("%s_layout", name), layout);
+        dir->GetObject(Form("%s_bands", name), contents);
+        BandMatrix *mat = nullptr;
+        if (layout != nullptr && contents != nullptr &&
+            layout->GetNrows() >= kSums) {
+            std::vector<double> sums(layout->GetMatrixArray() + kSums,
+                                     layout->GetMatrixArray() +
+                                         layout->GetNrows());
+            mat = new BandMatrix(name, "", static_cast<int>((*layout)[0]),
+                                 (*layout)[1], (*layout)[2], sums,
+                                 (*layout)[3]);
+            if (contents->GetNrows() <
+                static_cast<int>(mat->fContents.size())) {
+                delete mat;
+                mat = nullptr;
+            } else {
+                std::copy(contents->GetMatrixArray(),
+                          contents->GetMatrixArray() + mat->fContents.size(),
+                          mat->fContents.begin());
+                mat->fEntries = (*layout)[4];
+            }
+        }
+        delete layout;
+        delete contents;
+        return mat;
+    }
+
+private:
+    // number of entries of the layout before the sums
+    static const int kSums = 5;
+
+    // The first y bin (may be below 1) kept in x bin binx of a band
+    int FirstBin(int band, int binx) const {
+        double low = fSums[band] - fHalfWidth - GetBinCenter(binx);
+        return static_cast<int>(std::ceil((low - fLow) / GetBinWidth() + 0.5)) -
+               1;
+    }
+
+    Float_t *Cell(int binx, int biny) {
+        if (binx < 1 || binx > fNbins || biny < 1 || biny > fNbins) {
+            return nullptr;
+        }
+        for (size_t band = 0; band < fSums.size(); ++band) {
+            if (binx > fColumns[band]) {
+                continue;
+            }
+            int offset = biny - FirstBin(band, binx);
+            if (offset >= 0 && offset < fBandBins) {
+                return &fContents[fOffsets[band] +
+                                  static_cast<size_t>(binx - 1) * fBandBins +
+                                  offset];
+            }
+        }
+        return nullptr;
+    }
+
+    // Calls f(binx, biny, cell) for every kept bin, once even where bands
+    // overlap
+    template <typename F> void ForEachCell(F f) {
+        for (size_t band = 0; band < fSums.size(); ++band) {
+            for (int binx = 1; binx <= fColumns[band]; ++binx) {
+                int first;
+                int last;
+                GetBandRange(band, binx, first, last);
+                for (int biny = first; biny <= last; ++biny) {
+                    Float_t *cell = Cell(binx, biny);
+                    if (cell == &fContents[fOffsets[band] +
+                                           static_cast<size_t>(binx - 1) *
+                                               fBandBins +
+                                           biny - FirstBin(band, binx)]) {
+                        f(binx, biny, *cell);
+                    }
+                }
+            }
+        }
+    }
+
+    int fNbins;
+    double fLow;
+    double fUp;
+    double fHalfWidth;
+    std::vector<double> fSums;
+
+    int fBandBins;                // y bins kept per x bin and band
+    std::vector<int> fColumns;    // x bins of every band
+    std::vector<size_t> fOffsets; // first cell of every band
+    std::vector<Float_t> fContents;
+    double fEntries = 0.;
+};
+
+#endif
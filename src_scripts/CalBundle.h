@@ -0,0 +1,436 @@
+#ifndef CalBundle_h
+#define CalBundle_h
+
+// The whole calibration of a run in one binary file.
+//
+// A sort needs the linear calibration and the cross-talk coefficients of every
+// channel and the energy residuals of every crystal, which used to come from
+// the tree (ReadCalFromTree), a text file (ct_correction.cal) and the graphs
+// of residuals.root, each read by its own loop in every script. kMakeCalBundle
+// puts them together into a calibration bundle, which is mapped into memory
+// with one mmap and needs no parsing or deserialization:
+//
+//     kMakeCalBundle -o run12345.calb analysis12345_000.root
+//                    ct_correction.cal residuals.root
+//     kLeanMatrices analysis12345_000.root run12345.calb
+//
+// LoadCalibration is the one loader of all scripts. It reads the calibration
+// of the tree first and then the calibration file on top of it: a bundle
+// replaces the coefficients of its channels and the residuals, a ROOT file
+// only has residuals and a text file is read by TChannel::ReadCalFile. A
+// CalBundle is never changed once it is open, so the worker threads of a sort
+// can share one. GetEnergy() still calibrates through TChannel, which is why
+// LoadCalibration has to run before the threads start.
+//
+// File layout, all numbers in host byte order and every section starting on
+// an 8 byte boundary:
+//
+//     CalBundleHeader
+//     CalBundleChannel channels[nChannels]
+//     CalBundleResidual residuals[nResiduals]
+//     double x[nPoints]        the points of the residual graphs
+//     double y[nPoints]
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "TChannel.h"
+#include "TDirectory.h"
+#include "TFile.h"
+#include "TGraph.h"
+#include "TTree.h"
+
+#include "ResidualTable.h"
+
+struct CalBundleHeader {
+    char magic[8]; // "CALBUNDL"
+    uint32_t version;
+    uint32_t nChannels;
+    uint32_t nResiduals;
+    uint32_t reserved;
+    uint64_t nPoints;
+};
+
+struct CalBundleChannel {
+    static const int kMaxENG = 5;
+    static const int kMaxCT = 4;
+
+    uint32_t address;
+    int32_t number;
+    char name[32];
+    uint32_t nENG;
+    uint32_t nCT;
+    double eng[kMaxENG];
+    double ct[kMaxCT];
+};
+
+// The residual graph of a crystal (GRIFFIN array number 1-64), its points are
+// x[firstPoint] ... x[firstPoint + nPoints - 1]
+struct CalBundleResidual {
+    int32_t arrayNumber;
+    uint32_t nPoints;
+    uint64_t firstPoint;
+};
+
+// The points of a residual graph, with GetN(), GetX() and GetY() like a TGraph
+// for ResidualTable::Build
+struct ResidualPoints {
+    int n;
+    const double *x;
+    const double *y;
+
+    int GetN() const { return n; }
+    const double *GetX() const { return x; }
+    const double *GetY() const { return y; }
+};
+
+// The contents of a bundle while it is put together
+struct CalBundleContents {
+    std::vector<CalBundleChannel> channels;
+    std::vector<CalBundleResidual> residuals;
+    std::vector<double> x;
+    std::vector<double> y;
+
+    // Adds the residual graph of a crystal, replacing an earlier one
+    void AddResidual(int arrayNumber, int n, const double *px,
+                     const double *py) {
+        for (size_t i = 0; i < residuals.size(); ++i) {
+            if (residuals[i].arrayNumber == arrayNumber) {
+                residuals.erase(residuals.begin() + i);
+                break;
+            }
+        }
+        CalBundleResidual residual;
+        residual.arrayNumber = arrayNumber;
+        residual.nPoints = n;
+        residual.firstPoint = x.size();
+        residuals.push_back(residual);
+        x.insert(x.end(), px, px + n);
+        y.insert(y.end(), py, py + n);
+    }
+
+    // Writes the bundle to a temporary file that is renamed when it is
+    // complete, so a sort never maps half a bundle. Returns false if that
+    // failed.
+    bool Write(const std::string &fileName) const {
+        std::string tmpName = fileName + ".tmp";
+        FILE *out = fopen(tmpName.c_str(), "wb");
+        if (out == nullptr) {
+            printf("Failed to open file '%s'!\n", tmpName.c_str());
+            return false;
+        }
+        // points of replaced residuals are left out
+        std::vector<CalBundleResidual> packed(residuals);
+        std::vector<double> packedX;
+        std::vector<double> packedY;
+        for (CalBundleResidual &residual : packed) {
+            size_t first = residual.firstPoint;
+            residual.firstPoint = packedX.size();
+            packedX.insert(packedX.end(), x.begin() + first,
+                           x.begin() + first + residual.nPoints);
+            packedY.insert(packedY.end(), y.begin() + first,
+                           y.begin() + first + residual.nPoints);
+        }
+
+        CalBundleHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "CALBUNDL", 8);
+        header.version = 1;
+        header.nChannels = channels.size();
+        header.nResiduals = packed.size();
+        header.nPoints = packedX.size();
+        bool good = Section(out, &header, 1) &&
+                    Section(out, channels.data(), channels.size()) &&
+                    Section(out, packed.data(), packed.size()) &&
+                    Section(out, packedX.data(), packedX.size()) &&
+                    Section(out, packedY.data(), packedY.size());
+        good = (fclose(out) == 0) && good;
+        if (!good || rename(tmpName.c_str(), fileName.c_str()) != 0) {
+            printf("Failed to write calibration bundle '%s'!\n",
+                   fileName.c_str());
+            remove(tmpName.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // Writes n values and pads them to 8 bytes
+    template <typename T>
+    static bool Section(FILE *out, const T *data, size_t n) {
+        static const char zeros[8] = {};
+        size_t size = n * sizeof(T);
+        return (n == 0 || fwrite(data, sizeof(T), n, out) == n) &&
+               fwrite(zeros, 1, (8 - size % 8) % 8, out) == (8 - size % 8) % 8;
+    }
+};
+
+class CalBundle {
+public:
+    CalBundle() {}
+    ~CalBundle() { Close(); }
+    CalBundle(const CalBundle &) = delete;
+    CalBundle &operator=(const CalBundle &) = delete;
+
+    // True if the file starts like a calibration bundle
+    static bool IsBundle(const std::string &fileName) {
+        char magic[8];
+        FILE *in = fopen(fileName.c_str(), "rb");
+        if (in == nullptr) {
+            return false;
+        }
+        bool bundle = fread(magic, 1, 8, in) == 8 &&
+                      memcmp(magic, "CALBUNDL", 8) == 0;
+        fclose(in);
+        return bundle;
+    }
+
+    // Maps the file into memory, returns false if it isn't a bundle
+    bool Open(const std::string &fileName) {
+        Close();
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            printf("Failed to open calibration bundle '%s'!\n",
+                   fileName.c_str());
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 ||
+            info.st_size < static_cast<off_t>(sizeof(CalBundleHeader))) {
+            printf("'%s' is not a calibration bundle!\n", fileName.c_str());
+            close(fd);
+            return false;
+        }
+        fSize = info.st_size;
+        void *data = mmap(nullptr, fSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            printf("Failed to map calibration bundle '%s'!\n",
+                   fileName.c_str());
+            return false;
+        }
+        fData = static_cast<const char *>(data);
+
+        const auto *header = reinterpret_cast<const CalBundleHeader *>(fData);
+        if (memcmp(header->magic, "CALBUNDL", 8) != 0 ||
+            header->version != 1) {
+            printf("'%s' is not a calibration bundle (or of a different "
+                   "version)!\n",
+                   fileName.c_str());
+            Close();
+            return false;
+        }
+        fNChannels = header->nChannels;
+        fNResiduals = header->nResiduals;
+        size_t pos = (sizeof(CalBundleHeader) + 7) / 8 * 8;
+        fChannels = Section<CalBundleChannel>(pos, fNChannels);
+        fResiduals = Section<CalBundleResidual>(pos, fNResiduals);
+        fX = Section<double>(pos, header->nPoints);
+        fY = Section<double>(pos, header->nPoints);
+        bool good = pos <= fSize;
+        for (size_t i = 0; good && i < fNResiduals; ++i) {
+            good = fResiduals[i].firstPoint + fResiduals[i].nPoints <=
+                   header->nPoints;
+        }
+        for (size_t i = 0; good && i < fNChannels; ++i) {
+            good = fChannels[i].nENG <= CalBundleChannel::kMaxENG &&
+                   fChannels[i].nCT <= CalBundleChannel::kMaxCT;
+        }
+        if (!good) {
+            printf("Calibration bundle '%s' is truncated or broken!\n",
+                   fileName.c_str());
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+        if (fData != nullptr) {
+            munmap(const_cast<char *>(fData), fSize);
+            fData = nullptr;
+        }
+        fNChannels = 0;
+        fNResiduals = 0;
+    }
+
+    bool IsOpen() const { return fData != nullptr; }
+    size_t GetNChannels() const { return fNChannels; }
+    const CalBundleChannel &GetChannel(size_t i) const { return fChannels[i]; }
+    size_t GetNResiduals() const { return fNResiduals; }
+    int GetResidualArrayNumber(size_t i) const {
+        return fResiduals[i].arrayNumber;
+    }
+    ResidualPoints GetResidual(size_t i) const {
+        const CalBundleResidual &residual = fResiduals[i];
+        return {static_cast<int>(residual.nPoints),
+                fX + residual.firstPoint, fY + residual.firstPoint};
+    }
+
+    // Samples the residuals of every crystal into the table
+    void BuildResiduals(ResidualTable &table) const {
+        for (size_t i = 0; i < fNResiduals; ++i) {
+            table.Build(GetResidualArrayNumber(i), GetResidual(i));
+        }
+    }
+
+private:
+    // Pointer to n values at pos, and moves pos past them
+    template <typename T> const T *Section(size_t &pos, uint64_t n) const {
+        const T *data = reinterpret_cast<const T *>(fData + pos);
+        pos += (n * sizeof(T) + 7) / 8 * 8;
+        return pos <= fSize ? data : nullptr;
+    }
+
+    const char *fData = nullptr;
+    size_t fSize = 0;
+    size_t fNChannels = 0;
+    size_t fNResiduals = 0;
+    const CalBundleChannel *fChannels = nullptr;
+    const CalBundleResidual *fResiduals = nullptr;
+    const double *fX = nullptr;
+    const double *fY = nullptr;
+};
+
+// Adds the coefficients of every channel TChannel knows to the contents
+inline void AddChannels(CalBundleContents &contents) {
+    for (auto &entry : *TChannel::GetChannelMap()) {
+        TChannel *chan = entry.second;
+        CalBundleChannel channel;
+        memset(&channel, 0, sizeof(channel));
+        channel.address = chan->GetAddress();
+        channel.number = chan->GetNumber();
+        strncpy(channel.name, chan->GetName(), sizeof(channel.name) - 1);
+        std::vector<Float_t> eng = chan->GetENGCoeff();
+        std::vector<double> ct = chan->GetCTCoeff();
+        if (eng.size() > CalBundleChannel::kMaxENG ||
+            ct.size() > CalBundleChannel::kMaxCT) {
+            printf("Channel %s has too many coefficients, skipping it\n",
+                   chan->GetName());
+            continue;
+        }
+        channel.nENG = eng.size();
+        channel.nCT = ct.size();
+        std::copy(eng.begin(), eng.end(), channel.eng);
+        std::copy(ct.begin(), ct.end(), channel.ct);
+        contents.channels.push_back(channel);
+    }
+}
+
+// Sets the coefficients of the channels of the bundle in TChannel, channels it
+// doesn't know yet are added
+inline void ApplyToChannels(const CalBundle &bundle) {
+    for (size_t i = 0; i < bundle.GetNChannels(); ++i) {
+        const CalBundleChannel &channel = bundle.GetChannel(i);
+        TChannel *chan = TChannel::GetChannel(channel.address);
+        if (chan == nullptr) {
+            chan = new TChannel(channel.name);
+            chan->SetAddress(channel.address);
+            chan->SetNumber(channel.number);
+            TChannel::AddChannel(chan);
+            chan = TChannel::GetChannel(channel.address);
+        }
+        chan->DestroyENGCal();
+        for (uint32_t c = 0; c < channel.nENG; ++c) {
+            chan->AddENGCoefficient(channel.eng[c]);
+        }
+        chan->DestroyCTCal();
+        for (uint32_t c = 0; c < channel.nCT; ++c) {
+            chan->AddCTCoefficient(channel.ct[c]);
+        }
+    }
+}
+
+// Reads the residual graphs of kResidualCalculator (Energy_Residuals/Graph;n
+// is crystal n) into the table and/or the contents of a bundle. Returns false
+// if the file can't be opened.
+inline bool ReadResidualFile(const char *fileName, ResidualTable *table,
+                             CalBundleContents *contents = nullptr) {
+    TDirectory *current = gDirectory;
+    TFile *pResFile = new TFile(fileName, "READ");
+    if (!pResFile->IsOpen()) {
+        printf("Failed to open file '%s'!\n", fileName);
+        delete pResFile;
+        current->cd();
+        return false;
+    }
+    if (pResFile->cd("Energy_Residuals")) {
+        printf("Energy residuals found, loading...\n");
+        for (int k = 1; k <= ResidualTable::kMaxChannel; ++k) {
+            TGraph *graph = nullptr;
+            gDirectory->GetObject(Form("Graph;%d", k), graph);
+            if (graph == nullptr) {
+                continue;
+            }
+            if (table != nullptr) {
+                table->Build(k, *graph);
+            }
+            if (contents != nullptr) {
+                contents->AddResidual(k, graph->GetN(), graph->GetX(),
+                                      graph->GetY());
+            }
+        }
+    } else {
+        printf("No energy residuals found\n");
+    }
+    pResFile->Close();
+    delete pResFile;
+    current->cd();
+    return true;
+}
+
+// The calibration of a sort: the calibration of the tree (if there is one)
+// and then that of the file (if there is one) on top, see above. The
+// residuals go into the table and/or the contents of a bundle. Returns false
+// if the file couldn't be read.
+inline bool LoadCalibration(TTree *tree, const char *fileName,
+                            ResidualTable *residuals,
+                            CalBundleContents *contents = nullptr) {
+    if (tree != nullptr) {
+        TChannel::ReadCalFromTree(tree);
+    }
+    if (fileName == nullptr) {
+        return true;
+    }
+    if (CalBundle::IsBundle(fileName)) {
+        CalBundle bundle;
+        if (!bundle.Open(fileName)) {
+            return false;
+        }
+        ApplyToChannels(bundle);
+        if (residuals != nullptr) {
+            bundle.BuildResiduals(*residuals);
+        }
+        for (size_t i = 0; contents != nullptr && i < bundle.GetNResiduals();
+             ++i) {
+            ResidualPoints points = bundle.GetResidual(i);
+            contents->AddResidual(bundle.GetResidualArrayNumber(i), points.n,
+                                  points.x, points.y);
+        }
+        printf("Calibration of %lu channels and residuals of %lu crystals "
+               "loaded from '%s'\n",
+               static_cast<unsigned long>(bundle.GetNChannels()),
+               static_cast<unsigned long>(bundle.GetNResiduals()), fileName);
+        return true;
+    }
+    std::string name(fileName);
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".root") == 0) {
+        return ReadResidualFile(fileName, residuals, contents);
+    }
+    if (TChannel::ReadCalFile(fileName) < 0) {
+        printf("Failed to read calibration file '%s'!\n", fileName);
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef CalHistCache_h
+#define CalHistCache_h
+
+// Channel spectra of a calibration run, sorted once for all calibration
+// scripts.
+//
+// kLinearGainMatch, kResidualCalculator and kMakeCalMatrices all start from
+// the same channel vs. energy matrix of the calibration run, and each of them
+// used to read the whole tree for it. kMakeCalMatrices now also fills a
+// CalHistCache and writes it as calhist<run>_<subrun>.root, and the other two
+// take that file instead of the analysis tree file.
+//
+// For every multiplicity cut the cache holds the raw charge and the calibrated
+// energy of every channel. The channel is the TChannel number, as in the
+// matrix the gain match used to project from the tree, so the spectrum of a
+// channel belongs to TChannel::GetChannelByNumber(channel):
+//
+//     SingleHit   events with exactly one GRIFFIN hit, the matrix of the
+//                 gain match and the residuals
+//     NoPileup    all hits with the nominal k-value, as Singles_vs_Crystal
+//
+// together with the calibration they were sorted with. The energies are
+// filled before the residuals are applied, so kResidualCalculator measures
+// the whole residuals from them. When the calibration changed since (e.g.
+// after the gain match wrote its coefficients into the cache file), the
+// energy matrices are made again from the charge matrices with the current
+// calibration (see SpectrumRebin.h). That only uses the energy polynomial, see
+// Energy().
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "TChannel.h"
+#include "TFile.h"
+#include "TH2.h"
+#include "TString.h"
+#include "TVectorD.h"
+
+#include "SpectrumRebin.h"
+
+#ifndef __CINT__
+#include "TGriffin.h"
+#endif
+
+class CalHistCache {
+public:
+    enum ECut { kSingleHit, kNoPileup, kNCuts };
+
+    static const int kChannels = 64;
+    static const int kNominalKValue = 700;
+    // 1 keV per bin, the first 5000 are the old matrix of the gain match
+    static const int kEnergyBins = 6000;
+    static constexpr double kEnergyHigh = 6000.;
+    static const int kChargeBins = 16384;
+    static constexpr double kChargeHigh = 16384.;
+    // coefficients of the calibration that are remembered per channel
+    static const int kCoefficients = 3;
+
+    CalHistCache() {
+        bool addDirectory = TH1::AddDirectoryStatus();
+        TH1::AddDirectory(false);
+        for (int cut = 0; cut < kNCuts; ++cut) {
+            fEnergy[cut] = new TH2D(
+                Form("Energy_%s", CutName(cut)),
+                Form("Energy vs. channel, %s", CutTitle(cut)), kChannels, 0,
+                kChannels, kEnergyBins, 0., kEnergyHigh);
+            fCharge[cut] = new TH2D(
+                Form("Charge_%s", CutName(cut)),
+                Form("Charge vs. channel, %s", CutTitle(cut)), kChannels, 0,
+                kChannels, kChargeBins, 0., kChargeHigh);
+        }
+        TH1::AddDirectory(addDirectory);
+        fCalibration.ResizeTo(kChannels * kCoefficients);
+    }
+    ~CalHistCache() {
+        for (int cut = 0; cut < kNCuts; ++cut) {
+            delete fEnergy[cut];
+            delete fCharge[cut];
+        }
+    }
+    CalHistCache(const CalHistCache &) = delete;
+    CalHistCache &operator=(const CalHistCache &) = delete;
+
+    // Adds the GRIFFIN hits of one event. It has to be called before the
+    // residuals are applied (ApplyResiduals), as the cache only remembers the
+    // energy polynomial of the spectra.
+    void Fill(TGriffin *grif) {
+        int mult = grif->GetMultiplicity();
+        for (int i = 0; i < mult; ++i) {
+            TGriffinHit *hit = grif->GetGriffinHit(i);
+            TChannel *chan = hit->GetChannel();
+            if (chan == nullptr) {
+                continue;
+            }
+            int channel = chan->GetNumber();
+            double energy = hit->GetEnergy();
+            double charge = hit->GetCharge();
+            if (mult == 1) {
+                fEnergy[kSingleHit]->Fill(channel, energy);
+                fCharge[kSingleHit]->Fill(channel, charge);
+            }
+            if (hit->GetKValue() == kNominalKValue) {
+                fEnergy[kNoPileup]->Fill(channel, energy);
+                fCharge[kNoPileup]->Fill(channel, charge);
+            }
+        }
+    }
+
+    // Writes the matrices, the calibration they were sorted with (as numbers
+    // and as TChannel) and the cuts. Returns false if the file can not be
+    // written.
+    bool Write(const char *fileName) {
+        TFile file(fileName, "recreate");
+        if (!file.IsOpen()) {
+            printf("Failed to open file '%s'!\n", fileName);
+            return false;
+        }
+        for (int channel = 0; channel < kChannels; ++channel) {
+            std::vector<double> coefficients = CurrentCalibration(channel);
+            for (int k = 0; k < kCoefficients; ++k) {
+                fCalibration[channel * kCoefficients + k] =
+                    (k < (int)coefficients.size()) ? coefficients[k] : 0.;
+            }
+        }
+        TDirectory *dir = file.mkdir(Directory());
+        for (int cut = 0; cut < kNCuts; ++cut) {
+            dir->WriteTObject(fEnergy[cut]);
+            dir->WriteTObject(fCharge[cut]);
+        }
+        dir->WriteTObject(&fCalibration, "Calibration");
+        TNamed cuts("Cuts", Form("SingleHit: GRIFFIN multiplicity == 1; "
+                                 "NoPileup: k-value == %d",
+                                 kNominalKValue));
+        dir->WriteTObject(&cuts);
+        TChannel::WriteToRoot(&file);
+        file.Close();
+        return true;
+    }
+
+    // True if the file has a cache in it
+    static bool IsCache(TFile *file) {
+        return file->GetKey(Directory()) != nullptr;
+    }
+
+    // Reads the cache and the calibration of the file, returns nullptr if
+    // there is none
+    static CalHistCache *Read(TFile *file) {
+        TDirectory *dir = nullptr;
+        file->GetObject(Directory(), dir);
+        if (dir == nullptr) {
+            return nullptr;
+        }
+        auto *cache = new CalHistCache;
+        for (int cut = 0; cut < kNCuts; ++cut) {
+            TH2D *energy = nullptr;
+            TH2D *charge = nullptr;
+            dir->GetObject(Form("Energy_%s", CutName(cut)), energy);
+            dir->GetObject(Form("Charge_%s", CutName(cut)), charge);
+            if (energy == nullptr || charge == nullptr) {
+                printf("Failed to find the %s matrices in '%s'!\n",
+                       CutName(cut), file->GetName());
+                delete cache;
+                return nullptr;
+            }
+            cache->fEnergy[cut]->Add(energy);
+            cache->fCharge[cut]->Add(charge);
+        }
+        TVectorD *calibration = nullptr;
+        dir->GetObject("Calibration", calibration);
+        if (calibration != nullptr) {
+            cache->fCalibration = *calibration;
+        }
+        TChannel::ReadCalFromFile(file);
+        return cache;
+    }
+
+    // The energy matrix with the current calibration of the channels.
+    // Channels whose calibration changed since the cache was sorted are
+    // made again from their charge spectrum with the energy polynomial
+    // alone. Like the sorted spectra they have no residuals, but for the
+    // NoPileup cut they lack the cross-talk correction the sorted spectra
+    // had. The SingleHit spectra of the gain match and the residuals never
+    // had a cross-talk correction, as it needs a second hit in the clover.
+    TH2D *Energy(ECut cut) {
+        int nRebinned = 0;
+        std::vector<double> charge(kChargeBins);
+        std::vector<double> energy(kEnergyBins);
+        for (int channel = 0; channel < kChannels; ++channel) {
+            std::vector<double> coefficients = CurrentCalibration(channel);
+            if (coefficients.empty() ||
+                SameCalibration(channel, coefficients)) {
+                continue;
+            }
+            for (int bin = 0; bin < kChargeBins; ++bin) {
+                charge[bin] = fCharge[cut]->GetBinContent(channel + 1, bin + 1);
+            }
+            std::fill(energy.begin(), energy.end(), 0.);
+            RebinSpectrum(charge.data(), kChargeBins, 0., kChargeHigh,
+                          Polynomial(coefficients), energy.data(), kEnergyBins,
+                          0., kEnergyHigh);
+            for (int bin = 0; bin < kEnergyBins; ++bin) {
+                fEnergy[cut]->SetBinContent(channel + 1, bin + 1, energy[bin]);
+            }
+            ++nRebinned;
+        }
+        if (nRebinned > 0) {
+            printf("The calibration of %d channels changed, made their "
+                   "spectra again from the charge\n",
+                   nRebinned);
+        }
+        return fEnergy[cut];
+    }
+    TH2D *Charge(ECut cut) { return fCharge[cut]; }
+
+    static const char *CutName(int cut) {
+        static const char *names[kNCuts] = {"SingleHit", "NoPileup"};
+        return names[cut];
+    }
+    static const char *CutTitle(int cut) {
+        static const char *titles[kNCuts] = {"GRIFFIN multiplicity 1",
+                                             "no pile-up"};
+        return titles[cut];
+    }
+
+private:
+    static const char *Directory() { return "CalHistCache"; }
+
+    static std::vector<double> CurrentCalibration(int channel) {
+        std::vector<double> coefficients;
+        TChannel *chan = TChannel::GetChannelByNumber(channel);
+        if (chan == nullptr) {
+            return coefficients;
+        }
+        for (Float_t c : chan->GetENGCoeff()) {
+            coefficients.push_back(c);
+        }
+        return coefficients;
+    }
+
+    bool SameCalibration(int channel,
+                         const std::vector<double> &coefficients) const {
+        for (int k = 0; k < kCoefficients; ++k) {
+            double c = (k < (int)coefficients.size()) ? coefficients[k] : 0.;
+            if (c != fCalibration[channel * kCoefficients + k]) {
+                return false;
+            }
+        }
+        return (int)coefficients.size() <= kCoefficients;
+    }
+
+    TH2D *fEnergy[kNCuts];
+    TH2D *fCharge[kNCuts];
+    TVectorD fCalibration;
+};
+
+#endif
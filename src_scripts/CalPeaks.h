@@ -0,0 +1,32 @@
+#ifndef CalPeaks_h
+#define CalPeaks_h
+
+// The source lines the calibration scripts fit, {peak, fit window} in keV.
+// kLinearGainMatch, kResidualCalculator and kRecalibrate all take them from
+// here, so an iterated calibration ends up on the same peaks as the scripts
+// run one after the other. This header does not depend on ROOT.
+
+// The two peaks of the linear gain match
+const double gCalPeaks[2][2] = {{315.42, 20}, {1864.89, 20}};
+
+// Key peaks of 129Sn for the residuals. For a 152Eu source these would be
+//     {121.7817, 16}, {244.6974, 20}, {964.057, 20}, {1085.837, 13},
+//     {1112.076, 13}
+const double gResPeaks[][2] = {
+    {315.42, 20},
+    {511.0, 20},
+    {570.41, 20},
+    {645.2, 20},
+    {728.53, 20},
+    {769.31, 20},
+    // {907.34, 20}, // Double Peak
+    {1008.53, 20},
+    {1054.3, 15},
+    // {1222.51, 20},
+    // {1781.54, 20},
+    {1864.89, 20},
+    {2118.26, 20},
+    {2546.61, 20}};
+const int gNResPeaks = sizeof(gResPeaks) / sizeof(gResPeaks[0]);
+
+#endif
@@ -0,0 +1,416 @@
+#ifndef CalStages_h
+#define CalStages_h
+
+// The stages of the calibration sort (kCalibrationSort.cxx).
+//
+// MakeCTMatrices, kMakeCalMatrices and the CrossTalk selector each read the
+// whole 60Co run, and all of them decode the same hits, count the hits per
+// detector, cut on the k-value and pair the hits in time. The calibration
+// sort decodes every event once into a CalEvent and hands it to a list of
+// stages, each of which fills the histograms of one of the old programs:
+//
+//     CTPairStage     the crystal pair matrices of MakeCTMatrices and the
+//                     CrossTalk selector (band matrices, see BandMatrix.h)
+//     SinglesStage    the singles of every crystal (kMakeCalMatrices and the
+//                     selector)
+//     AddbackStage    the addback of every detector
+//     SumStage        the 180 degree gamma-gamma sum matrix
+//
+// A stage books its histograms into the lists of the output files they are
+// written to, so every file of the old programs is written as before:
+//
+//     CalOutputs outputs;
+//     std::vector<CalStage *> stages = {new SinglesStage, ...};
+//     for (CalStage *stage : stages) stage->Book(outputs, run, subRun);
+//     ... for every entry: event.Fill(grif); stage->Fill(event, stats) ...
+//     outputs.Write();
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Globals.h"
+#include "TFile.h"
+#include "TH1D.h"
+#include "TH1F.h"
+#include "TH2D.h"
+#include "TList.h"
+
+#include "BandMatrix.h"
+#include "HistRegistry.h"
+#include "HitCache.h"
+#include "ResidualTable.h"
+#include "SortStats.h"
+
+#ifndef __CINT__
+#include "TGriffin.h"
+#endif
+
+// The hits of one event, decoded once for all stages
+struct CalEvent {
+    // hits with another k-value are pile-up
+    static const int kNominalKValue = 700;
+
+    HitCache gammas;
+    HitCache addbacks;
+    // GetNoCTEnergy() of the gammas with the residuals, as MakeCTMatrices
+    // fills its matrices
+    std::vector<double> noCTEnergy;
+    std::vector<int> addbackFrags;  // GetNAddbackFrags() of the addbacks
+    int detMultiplicity[17];        // gammas of every detector
+    // what is not cached, e.g. the positions, which only the few prompt
+    // pairs of the sum matrix need
+    TGriffin *grif = nullptr;
+    // the residuals of the sort, the energies of the hits are corrected
+    // already but GetNoCTEnergy() is not
+    const ResidualTable *residuals = nullptr;
+
+    void Fill(TGriffin *griffin) {
+        grif = griffin;
+        grif->ResetAddback();
+        gammas.FillGriffin(grif);
+        addbacks.FillAddback(grif);
+        noCTEnergy.clear();
+        std::fill(detMultiplicity, detMultiplicity + 17, 0);
+        for (int i = 0; i < (int)gammas.size(); ++i) {
+            TGriffinHit *hit = grif->GetGriffinHit(i);
+            double energy = hit->GetNoCTEnergy();
+            if (residuals != nullptr && !residuals->Empty()) {
+                energy = residuals->Correct(hit->GetArrayNumber(), energy);
+            }
+            noCTEnergy.push_back(energy);
+            ++detMultiplicity[gammas.detector[i]];
+        }
+        addbackFrags.clear();
+        for (size_t i = 0; i < addbacks.size(); ++i) {
+            addbackFrags.push_back(grif->GetNAddbackFrags(i));
+        }
+    }
+
+    bool Pileup(const HitCache &hits, int i) const {
+        return hits.kValue[i] != kNominalKValue;
+    }
+};
+
+// The histograms of every output file, by file name
+class CalOutputs {
+public:
+    ~CalOutputs() {
+        for (auto &file : fLists) {
+            delete file.second;
+        }
+    }
+
+    // The list of a file, the histograms in it are written to that file. A
+    // histogram may be in more than one list.
+    TList *List(const std::string &fileName) {
+        TList *&list = fLists[fileName];
+        if (list == nullptr) {
+            list = new TList;
+        }
+        return list;
+    }
+
+    // Writes every list to its file, returns false if a file can not be
+    // written
+    bool Write() const {
+        bool good = true;
+        for (const auto &file : fLists) {
+            TFile outfile(file.first.c_str(), "recreate");
+            if (!outfile.IsOpen()) {
+                printf("Failed to open file '%s'!\n", file.first.c_str());
+                good = false;
+                continue;
+            }
+            printf("Writing to File: " DYELLOW "%s" RESET_COLOR "\n",
+                   file.first.c_str());
+            file.second->Write();
+            outfile.Close();
+        }
+        return good;
+    }
+
+private:
+    std::map<std::string, TList *> fLists;
+};
+
+// One consumer of the calibration sort
+class CalStage {
+public:
+    virtual ~CalStage() {}
+    virtual const char *Name() const = 0;
+    // Creates the histograms and adds them to the outputs
+    virtual void Book(CalOutputs &outputs, int run, int subRun) = 0;
+    virtual void Fill(const CalEvent &event, SortStats &stats) = 0;
+};
+
+// The output files of the old programs. The spectra of the CrossTalk selector
+// go to a file of their own name, as their crystal pair matrices are band
+// matrices instead of the full det_* matrices of the selector.
+inline std::string MatrixFileName(int run, int subRun) {
+    return Form("matrix%05d_%03d.root", run, subRun);
+}
+inline std::string SelectorFileName(int run, int subRun) {
+    return Form("CrosstalkBands%05d_%03d.root", run, subRun);
+}
+inline std::string CTFileName() { return "CrossTalk_histos.root"; }
+
+// The matrices of the two crystals of a clover that are hit in an event with
+// exactly two hits in that clover, as MakeCTMatrices and the CrossTalk
+// selector fill them: without cross-talk correction, the lower crystal number
+// on the x-axis. Only the bands around the sum energies are kept.
+class CTPairStage : public CalStage {
+public:
+    CTPairStage(const std::vector<double> &sums, double halfWidth)
+        : fSums(sums), fHalfWidth(halfWidth) {}
+
+    const char *Name() const override { return "CT pairs"; }
+
+    void Book(CalOutputs &outputs, int run, int subRun) override {
+        TList *ctList = outputs.List(CTFileName());
+        TList *selectorList = outputs.List(SelectorFileName(run, subRun));
+        for (int det = 1; det <= 16; ++det) {
+            for (int low = 0; low < 4; ++low) {
+                for (int high = low + 1; high < 4; ++high) {
+                    int pair = PairIndex(det, low, high);
+                    fMatrices[pair] = new BandMatrix(
+                        Form("det_%d_%d_%d", det, low, high), "", 2000, 0.,
+                        2000., fSums, fHalfWidth);
+                    ctList->Add(fMatrices[pair]);
+                    selectorList->Add(fMatrices[pair]);
+                }
+            }
+        }
+    }
+
+    void Fill(const CalEvent &event, SortStats &) override {
+        const HitCache &gammas = event.gammas;
+        for (int one = 0; one < (int)gammas.size(); ++one) {
+            if (event.Pileup(gammas, one) ||
+                event.detMultiplicity[gammas.detector[one]] != 2) {
+                continue;
+            }
+            for (int two = one + 1; two < (int)gammas.size(); ++two) {
+                if (event.Pileup(gammas, two) ||
+                    gammas.detector[one] != gammas.detector[two] ||
+                    std::fabs(gammas.time[one] - gammas.time[two]) > 300. ||
+                    gammas.crystal[one] == gammas.crystal[two]) {
+                    continue;
+                }
+                int low = one;
+                int high = two;
+                if (gammas.crystal[two] < gammas.crystal[one]) {
+                    low = two;
+                    high = one;
+                }
+                fMatrices[PairIndex(gammas.detector[one], gammas.crystal[low],
+                                    gammas.crystal[high])]
+                    ->Fill(event.noCTEnergy[low], event.noCTEnergy[high]);
+            }
+        }
+    }
+
+private:
+    std::vector<double> fSums;
+    double fHalfWidth;
+    BandMatrix *fMatrices[96];
+};
+
+// The singles of kMakeCalMatrices (6000 keV) and the CrossTalk selector
+// (7000 keV, with and without cross-talk correction). The spectra of the
+// CalHistCache are not filled by a stage, they are filled before the residuals
+// are applied (see CalibrationSort).
+class SinglesStage : public CalStage {
+public:
+    const char *Name() const override { return "singles"; }
+
+    void Book(CalOutputs &outputs, int run, int subRun) override {
+        TList *list = outputs.List(MatrixFileName(run, subRun));
+        fTotal = new TH1D("Singles_total", "#gamma singles for all crystals",
+                          6000, 0., 6000.);
+        list->Add(fTotal);
+        fVsCrystal = new TH2D("Singles_vs_Crystal",
+                              "#gamma singles for each crystal", 64, 0, 64,
+                              6000, 0., 6000.);
+        list->Add(fVsCrystal);
+        for (int i = 0; i < 64; ++i) {
+            fCrystal[i] = new TH1D(Form("Singles_%.2d", i),
+                                   Form("Singles for crystal %d", i), 6000, 0.,
+                                   6000.);
+            list->Add(fCrystal[i]);
+        }
+        fTimeInRun = new TH1F("timeinrun", "Time within run for #gamma singles",
+                              1000, 0., 6.0e12);
+        list->Add(fTimeInRun);
+
+        TList *selector = outputs.List(SelectorFileName(run, subRun));
+        for (int det = 1; det <= 16; ++det) {
+            // the name is the one the selector writes
+            fDetector[det - 1] =
+                new TH1D(Form("geEdet%d", det),
+                         Form("Singles detector %d", det), 7000, 0, 7000);
+            selector->Add(fDetector[det - 1]);
+        }
+        fChannel = new TH2D("gE_chan", "gE_chan", 65, 0, 65, 7000, 0, 7000);
+        selector->Add(fChannel);
+        fSummed = new TH1D("gE", "Summed Singles", 7000, 0, 7000);
+        selector->Add(fSummed);
+        fNoCT = new TH1D("gEnoCT", "Singles, no CT correction", 7000, 0, 7000);
+        selector->Add(fNoCT);
+    }
+
+    void Fill(const CalEvent &event, SortStats &stats) override {
+        const HitCache &gammas = event.gammas;
+        for (int one = 0; one < (int)gammas.size(); ++one) {
+            fTimeInRun->Fill(gammas.time[one]);
+            if (event.Pileup(gammas, one)) {
+                stats.Add(SortStats::kPileupRejected);
+                continue;
+            }
+            int crystal =
+                CrystalIndex(gammas.detector[one], gammas.crystal[one]);
+            fTotal->Fill(gammas.energy[one]);
+            fVsCrystal->Fill(crystal, gammas.energy[one]);
+            if (0 <= crystal && crystal < 64) {
+                fCrystal[crystal]->Fill(gammas.energy[one]);
+            }
+            if (1 <= gammas.detector[one] && gammas.detector[one] <= 16) {
+                fDetector[DetectorIndex(gammas.detector[one])]->Fill(
+                    gammas.energy[one]);
+            }
+            fChannel->Fill(gammas.channel[one], gammas.energy[one]);
+            fSummed->Fill(gammas.energy[one]);
+            fNoCT->Fill(event.noCTEnergy[one]);
+        }
+    }
+
+private:
+    TH1D *fTotal;
+    TH2D *fVsCrystal;
+    TH1D *fCrystal[64];
+    TH1F *fTimeInRun;
+    TH1D *fDetector[16];
+    TH2D *fChannel;
+    TH1D *fSummed;
+    TH1D *fNoCT;
+};
+
+// The addback of kMakeCalMatrices (6000 keV) and the CrossTalk selector
+// (7000 keV, with the addback multiplicity)
+class AddbackStage : public CalStage {
+public:
+    const char *Name() const override { return "addback"; }
+
+    void Book(CalOutputs &outputs, int run, int subRun) override {
+        TList *list = outputs.List(MatrixFileName(run, subRun));
+        fTotal = new TH1D("Addback_total", "#gamma addback for all detectors",
+                          6000, 0., 6000.);
+        list->Add(fTotal);
+        fVsDetector = new TH2D("Addback_vs_Detector",
+                               "#gamma addback for each detector", 16, 0, 16,
+                               6000, 0., 6000.);
+        list->Add(fVsDetector);
+        for (int i = 0; i < 16; ++i) {
+            fDetector[i] = new TH1D(Form("Addback_%.2d", i),
+                                    Form("Addback for detector %d", i), 6000,
+                                    0., 6000.);
+            list->Add(fDetector[i]);
+        }
+
+        TList *selector = outputs.List(SelectorFileName(run, subRun));
+        for (int det = 1; det <= 16; ++det) {
+            fSelectorDetector[det - 1] =
+                new TH1D(Form("aEdet%d", det),
+                         Form("Addback detector %d", det), 7000, 0, 7000);
+            selector->Add(fSelectorDetector[det - 1]);
+            fTwoFrags[det - 1] =
+                new TH1D(Form("aE2det%d", det),
+                         Form("Addback with 2 hits, detector %d", det), 7000,
+                         0, 7000);
+            selector->Add(fTwoFrags[det - 1]);
+        }
+        fMultiplicity = new TH1D("aMult", "addback multilpicity", 20, 0, 20);
+        selector->Add(fMultiplicity);
+        fSummed = new TH1D("aE", "Summed Addback", 7000, 0, 7000);
+        selector->Add(fSummed);
+    }
+
+    void Fill(const CalEvent &event, SortStats &stats) override {
+        const HitCache &addbacks = event.addbacks;
+        for (int one = 0; one < (int)addbacks.size(); ++one) {
+            if (event.Pileup(addbacks, one)) {
+                stats.Add(SortStats::kPileupRejected);
+                continue;
+            }
+            int detector = DetectorIndex(addbacks.detector[one]);
+            double energy = addbacks.energy[one];
+            fTotal->Fill(energy);
+            fVsDetector->Fill(detector, energy);
+            fSummed->Fill(energy);
+            fMultiplicity->Fill(event.addbackFrags[one]);
+            if (0 <= detector && detector < 16) {
+                fDetector[detector]->Fill(energy);
+                fSelectorDetector[detector]->Fill(energy);
+                if (event.addbackFrags[one] == 2) {
+                    fTwoFrags[detector]->Fill(energy);
+                }
+            }
+        }
+    }
+
+private:
+    TH1D *fTotal;
+    TH2D *fVsDetector;
+    TH1D *fDetector[16];
+    TH1D *fSelectorDetector[16];
+    TH1D *fTwoFrags[16];
+    TH1D *fMultiplicity;
+    TH1D *fSummed;
+};
+
+// The gamma-gamma matrix of the prompt pairs of crystals 180 degrees apart,
+// both orders, as kMakeCalMatrices fills it
+class SumStage : public CalStage {
+public:
+    const char *Name() const override { return "180 degree sum"; }
+
+    void Book(CalOutputs &outputs, int run, int subRun) override {
+        fMatrix = new TH2D("ggsummat", "#gamma-#gamma matrix 180 degrees", 6000,
+                           0., 6000., 6000, 0., 6000.);
+        outputs.List(MatrixFileName(run, subRun))->Add(fMatrix);
+    }
+
+    void Fill(const CalEvent &event, SortStats &stats) override {
+        const HitCache &gammas = event.gammas;
+        for (int one = 0; one < (int)gammas.size(); ++one) {
+            if (event.Pileup(gammas, one)) {
+                continue;
+            }
+            for (int two = 0; two < (int)gammas.size(); ++two) {
+                if (two == one) {
+                    continue;
+                }
+                stats.Add(SortStats::kPairsTested);
+                // the prompt window of kMakeCalMatrices, 0-350 ns
+                double timeDiff =
+                    std::fabs(gammas.time[two] - gammas.time[one]);
+                if (timeDiff >= 350.) {
+                    continue;
+                }
+                stats.Accept(0, SortStats::kGGPrompt);
+                if (event.grif->GetGriffinHit(one)->GetPosition().Angle(
+                        event.grif->GetGriffinHit(two)->GetPosition()) > 3.13) {
+                    fMatrix->Fill(gammas.energy[one], gammas.energy[two]);
+                }
+            }
+        }
+    }
+
+private:
+    TH2D *fMatrix;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef ChannelPool_h
+#define ChannelPool_h
+
+// Runs a job for every channel on a pool of threads.
+//
+// The peak fits of the 64 GRIFFIN channels do not depend on each other, so
+// they can run side by side. The threads take the next channel that is not
+// done yet until none are left, a channel with a slow fit holds up only its
+// own thread, and the whole takes about as long as the slowest channel (with
+// as many threads as channels):
+//
+//     std::vector<ChannelFit> fits(64);
+//     ChannelPool pool(nThreads);
+//     pool.Run(64, [&](int channel) { fits[channel] = FitChannel(channel); });
+//     ... use the fits in channel order ...
+//
+// The job must only touch the results of its own channel, anything shared has
+// to be protected by the caller. The time every channel took is kept, so the
+// slowest one can be reported.
+//
+// Fits in the jobs need two more things. SetUpFits(nThreads) is called once
+// before the first fit. Creating and deleting the peaks, functions and cuts of
+// a fit goes through the global lists of ROOT, which only one thread at a
+// time may do, so that is wrapped in RootLocked. The fits themselves run in
+// parallel:
+//
+//     TPeak *peak = RootLocked([&]() { return new TPeak(...); });
+//     peak->Fit(hist, "MQ");
+//     RootLocked([&]() { delete peak; });
+//
+// Drawing is not thread safe at all, so a TSpectrum::Search in a job needs the
+// "goff" option.
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Math/MinimizerOptions.h"
+#include "TF1.h"
+#include "TROOT.h"
+
+class ChannelPool {
+public:
+    explicit ChannelPool(int nThreads) : fThreads(nThreads) {}
+
+    // Returns when the job ran for all channels 0 ... nChannels - 1
+    void Run(int nChannels, const std::function<void(int)> &job) {
+        fTime.assign(nChannels, 0.);
+        std::atomic<int> next(0);
+        auto worker = [&]() {
+            for (int channel = next++; channel < nChannels;
+                 channel = next++) {
+                auto start = std::chrono::steady_clock::now();
+                job(channel);
+                std::chrono::duration<double> seconds =
+                    std::chrono::steady_clock::now() - start;
+                fTime[channel] = seconds.count();
+            }
+        };
+        if (fThreads <= 1) {
+            worker();
+            return;
+        }
+        std::vector<std::thread> workers;
+        for (int i = 0; i < fThreads && i < nChannels; ++i) {
+            workers.emplace_back(worker);
+        }
+        for (std::thread &thread : workers) {
+            thread.join();
+        }
+    }
+
+    // Time of one channel in the last Run, in seconds
+    double Time(int channel) const { return fTime[channel]; }
+
+    // The channel that took longest in the last Run
+    int Slowest() const {
+        int slowest = 0;
+        for (size_t i = 1; i < fTime.size(); ++i) {
+            if (fTime[i] > fTime[slowest]) {
+                slowest = i;
+            }
+        }
+        return slowest;
+    }
+
+    // Sum of the times of all channels, what a single thread would take
+    double TotalTime() const {
+        double total = 0.;
+        for (double time : fTime) {
+            total += time;
+        }
+        return total;
+    }
+
+private:
+    int fThreads;
+    std::vector<double> fTime;
+};
+
+// Sets up ROOT for fits on nThreads threads. TMinuit, the default minimizer,
+// is a single global object, so the fits use Minuit2, for every number of
+// threads so that the results don't depend on it. Functions in the global
+// list of ROOT replace the ones with the same name, so with several threads
+// the functions are not added to it.
+inline void SetUpFits(int nThreads) {
+    ROOT::Math::MinimizerOptions::SetDefaultMinimizer("Minuit2");
+    if (nThreads > 1) {
+        ROOT::EnableThreadSafety();
+        TF1::DefaultAddToGlobalList(false);
+    }
+}
+
+// Calls f while no other job creates or deletes ROOT objects, see above
+template <typename F> auto RootLocked(F f) -> decltype(f()) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    return f();
+}
+
+#endif
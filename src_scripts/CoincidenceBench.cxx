@@ -0,0 +1,148 @@
+// g++ CoincidenceBench.cxx -std=c++11 -O2 -o CoincidenceBench
+//
+// Compares the time-sorted coincidence search of CoincidenceWindow.h with the
+// brute-force double loops it replaced, for a range of event multiplicities.
+// The hits of each event are spread uniformly over an event window, and both
+// methods have to find the same prompt and time-random gamma-gamma pairs and
+// the same gamma-beta pairs. The multiplicity where the sweep starts to win is
+// kSweepMultiplicity, below it kLeanMatrices tests all pairs. No ROOT is
+// needed, so it can be run anywhere:
+//
+//     ./CoincidenceBench <optional: events per multiplicity> <event window [ns]>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "CoincidenceWindow.h"
+
+// same windows as kLeanMatrices, in ns
+const double ggTlow = 0.;
+const double ggThigh = 400.;
+const double ggBGlow = 1000.;
+const double ggBGhigh = 1750.;
+const double gbTlow = -400.;
+const double gbThigh = 400.;
+
+struct Result {
+    long prompt = 0;
+    long random = 0;
+    long gb = 0;
+    double sum = 0.; // sum of the prompt time differences, as a checksum
+};
+
+Result BruteForce(const std::vector<std::vector<double>> &gammas,
+                  const std::vector<std::vector<double>> &betas) {
+    Result r;
+    for (size_t e = 0; e < gammas.size(); ++e) {
+        const std::vector<double> &g = gammas[e];
+        for (size_t one = 0; one < g.size(); ++one) {
+            for (size_t two = one + 1; two < g.size(); ++two) {
+                double timeDiff = std::fabs(g[two] - g[one]);
+                if (ggTlow <= timeDiff && timeDiff < ggThigh) {
+                    ++r.prompt;
+                    r.sum += timeDiff;
+                }
+                if (ggBGlow <= timeDiff && timeDiff < ggBGhigh) {
+                    ++r.random;
+                }
+            }
+            for (double beta : betas[e]) {
+                double timeDiff = g[one] - beta;
+                if (gbTlow <= timeDiff && timeDiff <= gbThigh) {
+                    ++r.gb;
+                }
+            }
+        }
+    }
+    return r;
+}
+
+Result Sweep(const std::vector<std::vector<double>> &gammas,
+             const std::vector<std::vector<double>> &betas) {
+    Result r;
+    TimeOrder gammaOrder;
+    TimeOrder betaOrder;
+    for (size_t e = 0; e < gammas.size(); ++e) {
+        gammaOrder.Sort(gammas[e]);
+        betaOrder.Sort(betas[e]);
+        ForEachPair(gammaOrder, ggBGhigh, [&](int, int, double timeDiff) {
+            if (ggTlow <= timeDiff && timeDiff < ggThigh) {
+                ++r.prompt;
+                r.sum += timeDiff;
+            }
+            if (ggBGlow <= timeDiff && timeDiff < ggBGhigh) {
+                ++r.random;
+            }
+        });
+        ForEachCrossPair(gammaOrder, betaOrder, gbTlow, gbThigh,
+                         [&](int, int, double) { ++r.gb; });
+    }
+    return r;
+}
+
+template <typename F> double Time(F f, Result &r) {
+    auto start = std::chrono::steady_clock::now();
+    r = f();
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+int main(int argc, char **argv) {
+    long nEvents = 100000;
+    double eventWindow = 10000.;
+    if (argc > 1) {
+        nEvents = atol(argv[1]);
+    }
+    if (argc > 2) {
+        eventWindow = atof(argv[2]);
+    }
+
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> time(0., eventWindow);
+
+    printf("%ld events per multiplicity, hits spread over %.0f ns\n", nEvents,
+           eventWindow);
+    printf("%6s %12s %12s %10s %12s %12s\n", "mult", "loops [ns]",
+           "sweep [ns]", "speed-up", "prompt", "random");
+    int multiplicities[] = {2, 3, 4, 5, 6, 8, 16, 32, 64, 128};
+    for (int mult : multiplicities) {
+        // fewer events for the large multiplicities, the brute force loops
+        // would take forever otherwise
+        long events = std::max(1L, nEvents * 4 / (mult * mult) + 1);
+        std::vector<std::vector<double>> gammas(events);
+        std::vector<std::vector<double>> betas(events);
+        for (long e = 0; e < events; ++e) {
+            for (int i = 0; i < mult; ++i) {
+                gammas[e].push_back(time(rng));
+            }
+            for (int i = 0; i < std::max(1, mult / 4); ++i) {
+                betas[e].push_back(time(rng));
+            }
+        }
+
+        Result loops;
+        Result sweep;
+        double loopTime = Time([&]() { return BruteForce(gammas, betas); },
+                               loops);
+        double sweepTime = Time([&]() { return Sweep(gammas, betas); }, sweep);
+        if (loops.prompt != sweep.prompt || loops.random != sweep.random ||
+            loops.gb != sweep.gb ||
+            std::fabs(loops.sum - sweep.sum) > 1e-9 * loops.sum) {
+            printf("mismatch for multiplicity %d: prompt %ld/%ld, random "
+                   "%ld/%ld, gamma-beta %ld/%ld\n",
+                   mult, loops.prompt, sweep.prompt, loops.random, sweep.random,
+                   loops.gb, sweep.gb);
+            return 1;
+        }
+        printf("%6d %12.1f %12.1f %10.2f %12ld %12ld\n", mult,
+               1e9 * loopTime / events, 1e9 * sweepTime / events,
+               loopTime / sweepTime, loops.prompt, loops.random);
+    }
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+#ifndef CoincidenceWindow_h
+#define CoincidenceWindow_h
+
+// Coincidence search on time-sorted hits.
+//
+// Testing every pair of hits of an event against the time windows costs
+// n^2 per event, no matter how few pairs are actually close in time. Here the
+// hits of an event are sorted by time once (TimeOrder), and the pairs are
+// listed with a sweep that stops as soon as the time difference is past the
+// widest window, so the cost is n log n plus the number of pairs that are
+// actually used:
+//
+//     TimeOrder gammaOrder;
+//     gammaOrder.Sort(gammas.time);
+//     ForEachPair(gammaOrder, reach, [&](int one, int two, double timeDiff) {
+//         ...
+//     });
+//
+// The callbacks get the indices of the hits in the original (unsorted)
+// arrays, so all other per-hit arrays can be used with them. This header does
+// not depend on ROOT, see CoincidenceBench.cxx.
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Indices of the hits of one event, ordered by time
+class TimeOrder {
+public:
+    void Sort(const std::vector<double> &time) {
+        fIndex.resize(time.size());
+        fTime.resize(time.size());
+        // insertion sort, the multiplicities are small and the hits are
+        // mostly in order already
+        for (size_t i = 0; i < time.size(); ++i) {
+            size_t j = i;
+            for (; j > 0 && time[i] < fTime[j - 1]; --j) {
+                fTime[j] = fTime[j - 1];
+                fIndex[j] = fIndex[j - 1];
+            }
+            fTime[j] = time[i];
+            fIndex[j] = i;
+        }
+    }
+
+    size_t size() const { return fIndex.size(); }
+    bool empty() const { return fIndex.empty(); }
+    // Index in the original arrays of the i-th hit in time
+    int Index(size_t i) const { return fIndex[i]; }
+    double Time(size_t i) const { return fTime[i]; }
+
+private:
+    std::vector<int> fIndex;
+    std::vector<double> fTime;
+};
+
+// Calls f(one, two, timeDiff) once for every pair of hits with
+// timeDiff = |t(two) - t(one)| <= reach, the later hit is passed as two.
+template <typename F>
+void ForEachPair(const TimeOrder &hits, double reach, F f) {
+    for (size_t a = 0; a < hits.size(); ++a) {
+        for (size_t b = a + 1; b < hits.size(); ++b) {
+            double timeDiff = hits.Time(b) - hits.Time(a);
+            if (timeDiff > reach) {
+                break;
+            }
+            f(hits.Index(a), hits.Index(b), timeDiff);
+        }
+    }
+}
+
+// Calls f(a, b, timeDiff) for every hit a of first and b of second with
+// low <= timeDiff = t(a) - t(b) <= high.
+template <typename F>
+void ForEachCrossPair(const TimeOrder &first, const TimeOrder &second,
+                      double low, double high, F f) {
+    // the hits of second that are too early for the current hit of first are
+    // also too early for all later ones
+    size_t start = 0;
+    for (size_t a = 0; a < first.size(); ++a) {
+        double time = first.Time(a);
+        while (start < second.size() && time - second.Time(start) > high) {
+            ++start;
+        }
+        for (size_t b = start; b < second.size(); ++b) {
+            double timeDiff = time - second.Time(b);
+            if (timeDiff < low) {
+                break;
+            }
+            f(first.Index(a), second.Index(b), timeDiff);
+        }
+    }
+}
+
+// A pair of hits found by one of the searches above. Keeping the pairs of an
+// event in a list lets several sets of windows use them without searching
+// again.
+struct HitPair {
+    int one;
+    int two;
+    double timeDiff;
+};
+
+// The pairs of ForEachPair, in the same order
+inline void ListPairs(const TimeOrder &hits, double reach,
+                      std::vector<HitPair> &pairs) {
+    pairs.clear();
+    ForEachPair(hits, reach, [&](int one, int two, double timeDiff) {
+        pairs.push_back({one, two, timeDiff});
+    });
+}
+
+// The pairs of ForEachCrossPair, in the same order, one is the hit of first
+inline void ListCrossPairs(const TimeOrder &first, const TimeOrder &second,
+                           double low, double high,
+                           std::vector<HitPair> &pairs) {
+    pairs.clear();
+    ForEachCrossPair(first, second, low, high,
+                     [&](int one, int two, double timeDiff) {
+                         pairs.push_back({one, two, timeDiff});
+                     });
+}
+
+// Below this multiplicity sorting the hits costs more than the sweep saves,
+// and testing every pair is faster (see CoincidenceBench.cxx)
+const size_t kSweepMultiplicity = 6;
+
+// The same pairs as ListPairs, found by testing every pair of the unsorted
+// hits, for events with fewer than kSweepMultiplicity hits. The later hit is
+// two.
+inline void ListAllPairs(const std::vector<double> &time, double reach,
+                         std::vector<HitPair> &pairs) {
+    pairs.clear();
+    for (size_t a = 0; a < time.size(); ++a) {
+        for (size_t b = a + 1; b < time.size(); ++b) {
+            if (time[a] <= time[b]) {
+                if (time[b] - time[a] <= reach) {
+                    pairs.push_back({static_cast<int>(a), static_cast<int>(b),
+                                     time[b] - time[a]});
+                }
+            } else if (time[a] - time[b] <= reach) {
+                pairs.push_back({static_cast<int>(b), static_cast<int>(a),
+                                 time[a] - time[b]});
+            }
+        }
+    }
+}
+
+// The same pairs as ListCrossPairs, found by testing every pair of the
+// unsorted hits
+inline void ListAllCrossPairs(const std::vector<double> &first,
+                              const std::vector<double> &second, double low,
+                              double high, std::vector<HitPair> &pairs) {
+    pairs.clear();
+    for (size_t a = 0; a < first.size(); ++a) {
+        for (size_t b = 0; b < second.size(); ++b) {
+            double timeDiff = first[a] - second[b];
+            if (low <= timeDiff && timeDiff <= high) {
+                pairs.push_back(
+                    {static_cast<int>(a), static_cast<int>(b), timeDiff});
+            }
+        }
+    }
+}
+
+#endif
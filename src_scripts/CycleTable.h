@@ -0,0 +1,155 @@
+#ifndef CycleTable_h
+#define CycleTable_h
+
+// PPG cycle lookups without going through the TPPG for every hit.
+//
+// TPPG::GetTimeInCycle and GetCycleNumber search the map of PPG status words
+// on every call, and so does GetCycleTimeStamp of a hit. A CycleTable copies
+// the start of every cycle (the tape moves) out of the TPPG once, and finds
+// the cycle of a timestamp from the nominal cycle length, so a lookup costs
+// the same no matter how long the run is:
+//
+//     CycleTable cycles(ppg);
+//     ...
+//     hits.FillGriffin(grif, &cycles);   // cycleTime, cycleNumber and
+//                                        // cycleTimeStamp per hit
+//
+// When the table is built it is checked against the TPPG in up to a thousand
+// cycles spread over the run. If the two disagree, e.g. because the TPPG of
+// this GRSISort version counts the cycles differently, every lookup is passed
+// on to the TPPG, so the results are always the ones of the TPPG. Timestamps
+// before the first or after the last tape move are passed on as well. The
+// table needs a PPG, without one no table should be used at all.
+//
+// A table can be built from the status words up to a timestamp only, e.g. the
+// end of a subrun. It and the check against the TPPG then only depend on these
+// words, so the PPG of later subruns added to the TPPG doesn't change them.
+
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include "TPPG.h"
+
+class CycleTable {
+public:
+    CycleTable() = default;
+    explicit CycleTable(TPPG *ppg) { Build(ppg); }
+
+    // Takes the status words of the PPG up to and including the timestamp end
+    void Build(TPPG *ppg,
+               ULong64_t end = std::numeric_limits<ULong64_t>::max()) {
+        fPPG = ppg;
+        fStart.clear();
+        fCycleLength = 0;
+        fGood = false;
+        if (ppg == nullptr) {
+            return;
+        }
+        fCycleLength = ppg->GetCycleLength();
+        // Last() moves the iterator of the TPPG as well, so it is called
+        // before First()
+        TPPGData *last = ppg->Last();
+        for (TPPGData *data = ppg->First(); data != nullptr;
+             data = ppg->Next()) {
+            if (data->GetTimeStamp() > end) {
+                break;
+            }
+            if (data->GetNewPPG() == TPPG::kTapeMove) {
+                fStart.push_back(data->GetTimeStamp());
+            }
+            if (data == last) {
+                break;
+            }
+        }
+        if (fStart.size() < 2 || fCycleLength == 0) {
+            printf("Found %d PPG cycles, using the TPPG for the cycle times\n",
+                   (int)fStart.size());
+            return;
+        }
+        // the TPPG might not count the cycles from zero
+        fNumberOffset = ppg->GetCycleNumber(Middle(0));
+        fGood = true;
+        size_t step = fStart.size() / 1000 + 1;
+        for (size_t i = 0; i + 1 < fStart.size(); i += step) {
+            ULong64_t times[2] = {fStart[i] + 1, Middle(i)};
+            for (ULong64_t time : times) {
+                if (TimeInCycle(time) != ppg->GetTimeInCycle(time) ||
+                    CycleNumber(time) !=
+                        static_cast<Long64_t>(ppg->GetCycleNumber(time))) {
+                    printf("PPG cycle table does not match the TPPG, using "
+                           "the TPPG for the cycle times\n");
+                    fGood = false;
+                    return;
+                }
+            }
+        }
+    }
+
+    ULong64_t CycleLength() const { return fCycleLength; }
+
+    // Same as TPPG::GetTimeInCycle
+    ULong64_t TimeInCycle(ULong64_t timeStamp) const {
+        size_t cycle = Find(timeStamp);
+        if (cycle == kNone) {
+            return fPPG->GetTimeInCycle(timeStamp);
+        }
+        return timeStamp - fStart[cycle];
+    }
+
+    // Same as TPPG::GetCycleNumber
+    Long64_t CycleNumber(ULong64_t timeStamp) const {
+        size_t cycle = Find(timeStamp);
+        if (cycle == kNone) {
+            return fPPG->GetCycleNumber(timeStamp);
+        }
+        return fNumberOffset + static_cast<Long64_t>(cycle);
+    }
+
+    // The start of the cycle, same as GetCycleTimeStamp of a hit but with
+    // the TPPG of the table instead of the global one
+    ULong64_t CycleStart(ULong64_t timeStamp) const {
+        size_t cycle = Find(timeStamp);
+        if (cycle == kNone) {
+            return timeStamp - fPPG->GetTimeInCycle(timeStamp);
+        }
+        return fStart[cycle];
+    }
+
+private:
+    static const size_t kNone = static_cast<size_t>(-1);
+
+    ULong64_t Middle(size_t cycle) const {
+        return fStart[cycle] + (fStart[cycle + 1] - fStart[cycle]) / 2;
+    }
+
+    // The last cycle starting at or before the timestamp, kNone if the
+    // timestamp is not inside one of the complete cycles of the table
+    size_t Find(ULong64_t timeStamp) const {
+        if (!fGood || timeStamp < fStart.front() ||
+            timeStamp >= fStart.back()) {
+            return kNone;
+        }
+        // the cycle the nominal cycle length points to, the real cycle
+        // lengths differ by a few clock ticks at most
+        size_t cycle = (timeStamp - fStart.front()) / fCycleLength;
+        if (cycle > fStart.size() - 2) {
+            cycle = fStart.size() - 2;
+        }
+        while (cycle > 0 && fStart[cycle] > timeStamp) {
+            --cycle;
+        }
+        while (fStart[cycle + 1] <= timeStamp) {
+            ++cycle;
+        }
+        return cycle;
+    }
+
+    TPPG *fPPG = nullptr;
+    std::vector<ULong64_t> fStart;
+    ULong64_t fCycleLength = 0;
+    Long64_t fNumberOffset = 0;
+    bool fGood = false;
+};
+
+#endif
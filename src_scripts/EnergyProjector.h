@@ -0,0 +1,239 @@
+#ifndef EnergyProjector_h
+#define EnergyProjector_h
+
+// Fills the channel vs. energy matrix of the gain match and the residuals.
+//
+// TTree::Project("mat_en", "TGriffin.fGriffinLowGainHits.GetEnergy():...")
+// parses the formula, and calls GetEnergy() and GetChannel() through the
+// interpreter for every hit. EnergyProjector reads the GRIFFIN (or fragment)
+// branch into the objects and calls them directly, only reads the members it
+// needs (see ReadPlan.h), and with several threads splits the entries between
+// them, every thread with its own copy of the file and the matrix:
+//
+//     TH2D *mat_en = new TH2D("mat_en", "", 64, 0, 64, 5000, 0, 5000);
+//     EnergyProjector projector(EnergyProjector::kAnalysisTree);
+//     projector.SetMultiplicity(1, 1); // TGriffin.GetMultiplicity()==1
+//     projector.SetThreads(nThreads);
+//     projector.Project(tree, mat_en);
+//
+// The channel number is on the x-axis and the energy in keV on the y-axis. The
+// calibration has to be read (TChannel::ReadCalFromTree) before, and with
+// more than one thread ROOT::EnableThreadSafety() has to be called.
+//
+// ReadEnergyMatrix gives the matrix of kLinearGainMatch and
+// kResidualCalculator from either kind of input file, the calibration spectra
+// of kMakeCalMatrices (see CalHistCache.h) or a tree.
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TFile.h"
+#include "TH2.h"
+#include "TTree.h"
+
+#include "CalBundle.h"
+#include "CalHistCache.h"
+#include "ReadPlan.h"
+
+#ifndef __CINT__
+#include "TFragment.h"
+#include "TGriffin.h"
+#endif
+
+class EnergyProjector {
+public:
+    enum ELayout {
+        kAnalysisTree, // TGriffin branch, low gain hits
+        kFragmentTree  // TFragment branch, one fragment per entry
+    };
+
+    explicit EnergyProjector(ELayout layout) : fLayout(layout) {}
+
+    // Only events with min <= GRIFFIN multiplicity <= max are used, max < 0
+    // means no upper limit. A fragment tree has no events, every fragment is
+    // used.
+    void SetMultiplicity(int min, int max) {
+        fMinMultiplicity = min;
+        fMaxMultiplicity = max;
+    }
+    void SetThreads(int nThreads) { fThreads = std::max(nThreads, 1); }
+    // Size of the TTreeCache of every thread in bytes
+    void SetCacheSize(Long64_t bytes) { fCacheSize = bytes; }
+
+    // Fills hist from all entries of the tree, returns the number of hits
+    // filled or -1 if the branch is missing
+    long Project(TTree *tree, TH2 *hist) {
+        const char *branchName =
+            (fLayout == kFragmentTree) ? "TFragment" : "TGriffin";
+        if (tree->GetBranch(branchName) == nullptr) {
+            printf("Failed to find branch '%s' in tree '%s'!\n", branchName,
+                   tree->GetName());
+            return -1;
+        }
+        // the channel number of a fragment may be a member of its own
+        std::vector<std::string> members = ReadPlan::DefaultMembers();
+        members.push_back("fChannelNumber");
+        ReadPlan plan;
+        plan.SetCacheSize(fCacheSize);
+        plan.AddBranch(branchName, members);
+
+        Long64_t nEntries = tree->GetEntries();
+        int nThreads = fThreads;
+        if (nThreads > nEntries) {
+            nThreads = std::max(1LL, (long long)nEntries);
+        }
+        if (nThreads == 1) {
+            plan.Apply(tree, 0, nEntries, true);
+            long filled = ProjectEntries(tree, hist, 0, nEntries);
+            // the other scripts may read more branches of the tree
+            tree->SetBranchStatus("*", true);
+            return filled;
+        }
+
+        // Every thread opens the file on its own and fills its own matrix,
+        // the matrices are added up at the end
+        std::string fileName = tree->GetCurrentFile()->GetName();
+        std::string treeName = tree->GetName();
+        std::vector<TH2 *> shards(nThreads, nullptr);
+        std::vector<long> filled(nThreads, 0);
+        bool addDirectory = TH1::AddDirectoryStatus();
+        TH1::AddDirectory(false);
+        for (int i = 0; i < nThreads; ++i) {
+            shards[i] = static_cast<TH2 *>(hist->Clone());
+            shards[i]->Reset();
+        }
+        TH1::AddDirectory(addDirectory);
+
+        Long64_t chunk = nEntries / nThreads;
+        std::vector<std::thread> workers;
+        for (int i = 0; i < nThreads; ++i) {
+            Long64_t first = i * chunk;
+            Long64_t last = (i == nThreads - 1) ? nEntries : first + chunk;
+            workers.emplace_back([&, i, first, last]() {
+                TFile workerFile(fileName.c_str());
+                auto *workerTree =
+                    dynamic_cast<TTree *>(workerFile.Get(treeName.c_str()));
+                if (workerTree == nullptr) {
+                    printf("Thread %d failed to find tree '%s' in '%s'!\n", i,
+                           treeName.c_str(), fileName.c_str());
+                    filled[i] = -1;
+                    return;
+                }
+                plan.Apply(workerTree, first, last);
+                filled[i] = ProjectEntries(workerTree, shards[i], first, last);
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        long total = 0;
+        for (int i = 0; i < nThreads; ++i) {
+            if (filled[i] < 0) {
+                total = -1;
+            } else if (total >= 0) {
+                total += filled[i];
+            }
+            hist->Add(shards[i]);
+            delete shards[i];
+        }
+        return total;
+    }
+
+private:
+    // Fills the entries [firstEntry, lastEntry) of a tree owned by the
+    // calling thread
+    long ProjectEntries(TTree *tree, TH2 *hist, Long64_t firstEntry,
+                        Long64_t lastEntry) const {
+        long filled = 0;
+        if (fLayout == kFragmentTree) {
+            TFragment *frag = nullptr;
+            tree->SetBranchAddress("TFragment", &frag);
+            for (Long64_t entry = firstEntry; entry < lastEntry; ++entry) {
+                tree->GetEntry(entry);
+                hist->Fill(frag->GetChannelNumber(), frag->GetEnergy());
+                ++filled;
+            }
+            tree->ResetBranchAddresses();
+            delete frag;
+            return filled;
+        }
+
+        TGriffin *grif = nullptr;
+        tree->SetBranchAddress("TGriffin", &grif);
+        for (Long64_t entry = firstEntry; entry < lastEntry; ++entry) {
+            tree->GetEntry(entry);
+            grif->SetDefaultGainType(TGriffin::kLowGain);
+            int multiplicity = grif->GetMultiplicity();
+            if (multiplicity < fMinMultiplicity ||
+                (fMaxMultiplicity >= 0 && multiplicity > fMaxMultiplicity)) {
+                continue;
+            }
+            for (int i = 0; i < multiplicity; ++i) {
+                TGriffinHit *hit = grif->GetGriffinHit(i);
+                if (hit->GetChannel() == nullptr) {
+                    continue;
+                }
+                hist->Fill(hit->GetChannel()->GetNumber(), hit->GetEnergy());
+                ++filled;
+            }
+        }
+        tree->ResetBranchAddresses();
+        delete grif;
+        return filled;
+    }
+
+    ELayout fLayout;
+    int fMinMultiplicity = 0;
+    int fMaxMultiplicity = -1;
+    int fThreads = 1;
+    Long64_t fCacheSize = 100 * 1024 * 1024;
+};
+
+// The energy vs. channel matrix of the events with a single GRIFFIN hit, and
+// the calibration. A file made by kMakeCalMatrices (calhist<run>_<subrun>.root)
+// already has the matrix, otherwise it is filled from the tree of the given
+// layout. Returns nullptr if neither is found.
+inline TH2D *ReadEnergyMatrix(TFile *file, EnergyProjector::ELayout layout,
+                              int nThreads) {
+    if (CalHistCache::IsCache(file)) {
+        printf("Using the calibration spectra in '%s'\n", file->GetName());
+        CalHistCache *cache = CalHistCache::Read(file);
+        if (cache == nullptr) {
+            return nullptr;
+        }
+        TH2D *matrix = static_cast<TH2D *>(
+            cache->Energy(CalHistCache::kSingleHit)->Clone("mat_en"));
+        delete cache;
+        return matrix;
+    }
+
+    const char *treeName = (layout == EnergyProjector::kFragmentTree)
+                               ? "FragmentTree"
+                               : "AnalysisTree";
+    TTree *tree = nullptr;
+    file->GetObject(treeName, tree);
+    if (tree == nullptr) {
+        printf("Failed to find the %s in file '%s'.\n", treeName,
+               file->GetName());
+        return nullptr;
+    }
+    LoadCalibration(tree, nullptr, nullptr);
+
+    // Keep statistics at 1 keV/bin
+    TH2D *matrix = new TH2D("mat_en", "", 64, 0, 64, 5000, 0, 5000);
+    EnergyProjector projector(layout);
+    projector.SetMultiplicity(1, 1);
+    projector.SetThreads(nThreads);
+    if (projector.Project(tree, matrix) < 0) {
+        printf("Failed to fill the energy matrix!\n");
+        delete matrix;
+        return nullptr;
+    }
+    return matrix;
+}
+
+#endif
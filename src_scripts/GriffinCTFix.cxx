@@ -1,4 +1,10 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include "TFile.h"
 #include "TH2.h"
@@ -9,10 +15,15 @@
 #include "TObjString.h"
 #include "TObjArray.h"
 #include "TProfile.h"
+#include "TROOT.h"
 
 #include "TChannel.h"
 #include "TGriffin.h"
 
+#include "BandMatrix.h"
+#include "CalBundle.h"
+#include "ChannelPool.h"
+
 double CrossTalkFit(double* x, double* par)
 {
    // This function is the linear fit function, but uses the CT coefficients as parameters instead of slope and
@@ -27,7 +38,126 @@ double CrossTalkFit(double* x, double* par)
    return x[0] * slope + intercept;
 }
 
-double* CrossTalkFix(int det, double energy, TFile* in_file)
+// The addback line of one crystal pair, made by FitClover
+struct AddbackLine {
+   std::string   name;            // of the matrix
+   BandMatrix*   cmat  = nullptr; // the band around the sum energy
+   TGraphErrors* graph = nullptr; // mean y of every x bin of the band
+   TF1*          fit   = nullptr;
+   int           xind  = 0;
+   int           yind  = 0;
+};
+
+// The addback lines of one clover
+struct CloverFit {
+   std::vector<AddbackLine> lines;
+   std::string              log;
+};
+
+// The band of the addback line, energy +- 15 keV. This range seems to be working fairly well since no shift should
+// be larger than say 6 or 7 keV
+const double kHalfWidth = 15.;
+
+// Copies the band x + y = energy +- 15 keV of mat into cmat and makes the
+// addback line from it. Only the bins of the band are visited, and the mean
+// and its error of every x bin are summed up directly, the same way
+// TH1::GetMean(2) and TH1::GetMeanError(2) of the x bin would do it.
+TGraphErrors* AddbackLineGraph(const BandMatrix& mat, int band, BandMatrix* cmat, const TCutG& cut)
+{
+   // I make a graph out of the "addback line" because I don't like the way TProfile handles the empty bins
+   auto* fitGraph = new TGraphErrors;
+   fitGraph->SetNameTitle(Form("%s_graph", mat.GetName()), "Graph");
+
+   int xbins = mat.GetNbins();
+   for(int i = 1; i <= xbins; i++) {
+      double xc = mat.GetBinCenter(i);
+      // the bins of the band in this x bin, the cut decides which of them are in
+      int first;
+      int last;
+      mat.GetBandRange(band, i, first, last);
+      double sumw   = 0.;
+      double sumw2  = 0.;
+      double sumwy  = 0.;
+      double sumwy2 = 0.;
+      for(int j = first; j <= last; j++) {
+         double yc = mat.GetBinCenter(j);
+         if(cut.IsInside(xc, yc) == 0) {
+            continue;
+         }
+         double w = mat.GetBinContent(i, j);
+         if(w == 0.) {
+            continue;
+         }
+         cmat->SetBinContent(i, j, w);
+         sumw += w;
+         sumw2 += w * w;
+         sumwy += w * yc;
+         sumwy2 += w * yc * yc;
+      }
+      // This makes sure that there are at least 4 counts in the "y bin". I'd prefer this to be higher,
+      // but that requires more 60Co statistics. The reason I do this is because RMS and SD of the mean really only
+      // works
+      // for us if we have enough counts that the mean is actually a good representation of the true value. This is
+      // something
+      // TProfile does not do for us, and seems to skew the result a bit.
+      if(sumw > 6) {
+         double mean     = sumwy / sumw;
+         double variance = std::max(sumwy2 / sumw - mean * mean, 0.);
+         double neff     = sumw * sumw / sumw2;
+         fitGraph->SetPoint(fitGraph->GetN(), mat.GetBinCenter(i), mean);
+         fitGraph->SetPointError(fitGraph->GetN() - 1, mat.GetBinWidth(), std::sqrt(variance / neff));
+      }
+   }
+   return fitGraph;
+}
+
+// Fits the addback lines of the six crystal pairs of one clover. Nothing is
+// written and no channel is changed here, so the clovers can be fitted side
+// by side, see CrossTalkFix.
+void FitClover(const std::vector<BandMatrix*>& mats, double energy, bool quiet, CloverFit& result)
+{
+   double low_cut  = energy - kHalfWidth;
+   double high_cut = energy + kHalfWidth;
+
+   double xpts[5] = {low_cut, 0, 0, high_cut, low_cut};
+   double ypts[5] = {0, low_cut, high_cut, 0, 0};
+   TCutG* cut = RootLocked([&]() { return new TCutG(Form("cut_%s", mats[0]->GetName()), 5, xpts, ypts); });
+
+   std::ostringstream log;
+   for(auto mat : mats) {
+      log<<mat->GetName()<<std::endl;
+      int band = mat->FindBand(energy, kHalfWidth);
+      if(band < 0) {
+         log<<DRED<<mat->GetName()<<" has no band around "<<energy<<" keV, skipping it"<<RESET_COLOR<<std::endl;
+         continue;
+      }
+      AddbackLine line;
+      line.name  = mat->GetName();
+      line.cmat  = new BandMatrix(Form("%s_clone", mat->GetName()), mat->GetTitle(), mat->GetNbins(), mat->GetLow(),
+                                  mat->GetUp(), {energy}, kHalfWidth);
+      line.graph = AddbackLineGraph(*mat, band, line.cmat, *cut);
+
+      TString    name    = mat->GetName();
+      TObjArray* strings = name.Tokenize("_");
+      line.xind          = (dynamic_cast<TObjString*>(strings->At(strings->GetEntries() - 1)))->String().Atoi();
+      line.yind          = (dynamic_cast<TObjString*>(strings->At(strings->GetEntries() - 2)))->String().Atoi();
+      delete strings;
+
+      // This fits the TGraph
+      line.fit = RootLocked([&]() { return new TF1(Form("pxfit_%i_%i", line.yind, line.xind), CrossTalkFit, 6, 1167, 3); });
+      line.fit->SetParameter(0, 0.0001);
+      line.fit->SetParameter(1, 0.0001);
+      line.fit->SetParameter(2, energy);
+      line.fit->FixParameter(2, energy);
+      line.graph->Fit(line.fit, quiet ? "Q" : "");
+      result.lines.push_back(line);
+   }
+   result.log = log.str();
+
+   RootLocked([&]() { delete cut; });
+}
+
+double* CrossTalkFix(int det, double energy, CloverFit& clover)
 {
    // The outfile is implicit since it was the last file that was open.
    static double largest_correction = 0.0;
@@ -47,85 +177,18 @@ double* CrossTalkFix(int det, double energy, TFile* in_file)
    static int largest_crystal1 = -1;
    static int largest_crystal2 = -1;
 
-   std::string       namebase = Form("det_%d", det);
-   std::vector<TH2*> mats;
-   for(int i = 0; i < 4; i++) {
-      for(int j = i + 1; j < 4; j++) {
-         // Load all of the addback matrices in and put them into a vector of TH2*
-         std::string name = Form("%s_%d_%d", namebase.c_str(), i, j);
-         TH2*        m    = dynamic_cast<TH2*>(in_file->Get(name.c_str()));
-         if(m == nullptr) {
-            std::cout<<"can not find:  "<<name<<std::endl;
-            return nullptr;
-         }
-         mats.push_back(dynamic_cast<TH2*>(in_file->Get(name.c_str())));
-      }
-   }
-
-   double low_cut =
-      energy - 15; // This range seems to be working fairly well since no shift should be larger than say 6 or 7 keV
-   double high_cut = energy + 15;
-
-   double xpts[5] = {low_cut, 0, 0, high_cut, low_cut};
-   double ypts[5] = {0, low_cut, high_cut, 0, 0};
-   TCutG  cut("cut", 5, xpts, ypts);
-
    auto* d   = new double[16]; // matrix of coefficients
    auto* e_d = new double[16]; // matrix of errors
 
-   for(auto mat : mats) {
-      std::cout<<mat->GetName()<<std::endl;
-      int xbins = mat->GetNbinsX();
-      int ybins = mat->GetNbinsY();
-
-      TH2* cmat = dynamic_cast<TH2*>(mat->Clone(Form("%s_clone", mat->GetName())));
-      cmat->Reset();
-
-      // I make a graph out of the "addback line" because I don't like the way TProfile handles the empty bins
-      auto* fitGraph = new TGraphErrors;
-      fitGraph->SetNameTitle(Form("%s_graph", mat->GetName()), "Graph");
-
-      // This loop turns the addback plot and TCut into the TGraphErrors
-      for(int i = 1; i <= xbins; i++) {
-         bool inside_yet = false;
-         for(int j = 1; j <= ybins; j++) {
-            double xc = mat->GetXaxis()->GetBinCenter(i);
-            double yc = mat->GetYaxis()->GetBinCenter(j);
-            if(cut.IsInside(xc, yc) != 0) {
-               if(!inside_yet) {
-                  inside_yet = true;
-               }
-               cmat->Fill(xc, yc, mat->GetBinContent(i, j));
-            }
-         }
-         cmat->GetXaxis()->SetRange(i, i);
-         // This makes sure that there are at least 4 counts in the "y bin". I'd prefer this to be higher,
-         // but that requires more 60Co statistics. The reason I do this is because RMS and SD of the mean really only
-         // works
-         // for us if we have enough counts that the mean is actually a good representation of the true value. This is
-         // something
-         // TProfile does not do for us, and seems to skew the result a bit.
-         if(cmat->Integral() > 6) {
-            fitGraph->SetPoint(fitGraph->GetN(), cmat->GetYaxis()->GetBinCenter(i), cmat->GetMean(2));
-            fitGraph->SetPointError(fitGraph->GetN() - 1, cmat->GetXaxis()->GetBinWidth(i), cmat->GetMeanError(2));
-         }
-         cmat->GetXaxis()->UnZoom();
-      }
+   std::cout<<clover.log;
+   for(auto& line : clover.lines) {
+      // the dense matrix of the band only exists while it is written
+      TH2* cmat = line.cmat->MakeTH2();
+      TF1* fpx  = line.fit;
+      int  xind = line.xind;
+      int  yind = line.yind;
       cmat->Write();
-
-      TString    name    = mat->GetName();
-      TObjArray* strings = name.Tokenize("_");
-      int        xind    = (dynamic_cast<TObjString*>(strings->At(strings->GetEntries() - 1)))->String().Atoi();
-      int        yind    = (dynamic_cast<TObjString*>(strings->At(strings->GetEntries() - 2)))->String().Atoi();
-
-      // This fits the TGraph
-      auto* fpx = new TF1(Form("pxfit_%i_%i", yind, xind), CrossTalkFit, 6, 1167, 3);
-      fpx->SetParameter(0, 0.0001);
-      fpx->SetParameter(1, 0.0001);
-      fpx->SetParameter(2, energy);
-      fpx->FixParameter(2, energy);
-      fitGraph->Fit(fpx);
-      fitGraph->Write();
+      line.graph->Write();
       TProfile* px = cmat->ProfileX();
 
       px->Write();
@@ -138,12 +201,13 @@ double* CrossTalkFix(int det, double energy, TFile* in_file)
          residual_plot->SetBinError(i, px->GetBinError(i));
       }
       residual_plot->Write();
+      delete cmat;
+      delete line.cmat;
 
       std::cout<<"====================="<<std::endl;
-      std::cout<<mat->GetName()<<std::endl;
+      std::cout<<line.name<<std::endl;
       std::cout<<"d"<<xind<<yind<<" at zero   "<<(fpx->Eval(energy)) / energy<<std::endl;
       std::cout<<"====================="<<std::endl;
-
       // Fill the parameter matrix with the parameters from the fit.
       d[xind * 4 + yind]   = fpx->GetParameter(0);
       d[yind * 4 + xind]   = fpx->GetParameter(1);
@@ -203,27 +267,93 @@ double* CrossTalkFix(int det, double energy, TFile* in_file)
    return d;
 }
 
-void FixAll(TFile* in_file, TFile*)
+void FixAll(TFile* in_file, TFile*, int nThreads)
 {
    // This function only loops over 16 clvoers (always does) and uses the 1332 keV gamma ray in 60Co
    // We might want to make this coding a little "softer"
    double energies[2] = {1173.228, 1332.492};
+
+   // Load all of the addback matrices in and put them into a vector of band matrices per clover, the file is only
+   // read here. MakeCTMatrices writes band matrices, of the full matrices of older files only the band is kept.
+   std::vector<std::vector<BandMatrix*>> mats(16);
    for(int d = 1; d <= 16; d++) {
-      CrossTalkFix(d, energies[1], in_file);
+      std::string namebase = Form("det_%d", d);
+      for(int i = 0; i < 4; i++) {
+         for(int j = i + 1; j < 4; j++) {
+            std::string name = Form("%s_%d_%d", namebase.c_str(), i, j);
+            BandMatrix* m    = nullptr;
+            if(BandMatrix::IsBandMatrix(in_file, name.c_str())) {
+               m = BandMatrix::Read(in_file, name.c_str());
+            } else if(auto* full = dynamic_cast<TH2*>(in_file->Get(name.c_str()))) {
+               m = BandMatrix::FromTH2(full, {energies[1]}, kHalfWidth + 1.);
+               delete full;
+            }
+            if(m == nullptr) {
+               std::cout<<"can not find:  "<<name<<std::endl;
+               for(auto mat : mats[d - 1]) {
+                  delete mat;
+               }
+               mats[d - 1].clear();
+               break;
+            }
+            mats[d - 1].push_back(m);
+         }
+         if(mats[d - 1].empty()) {
+            break;
+         }
+      }
+   }
+
+   // The clovers are fitted side by side, then written one after the other
+   std::vector<CloverFit> clovers(16);
+   bool                   addDirectory = TH1::AddDirectoryStatus();
+   TH1::AddDirectory(false);
+   ChannelPool pool(nThreads);
+   pool.Run(16, [&](int c) {
+      if(!mats[c].empty()) {
+         FitClover(mats[c], energies[1], nThreads > 1, clovers[c]);
+      }
+   });
+   TH1::AddDirectory(addDirectory);
+   int slowest = pool.Slowest();
+   printf("Fits took %.2f s, the slowest clover %d took %.2f s\n", pool.TotalTime(), slowest + 1,
+          pool.Time(slowest));
+
+   for(int d = 1; d <= 16; d++) {
+      if(mats[d - 1].empty()) {
+         continue;
+      }
+      delete[] CrossTalkFix(d, energies[1], clovers[d - 1]);
+      for(auto mat : mats[d - 1]) {
+         delete mat;
+      }
    }
 }
 
 #ifndef __CINT__
 int main(int argc, char** argv)
 {
+   int nThreads = 1;
+   int nArgs    = 1;
+   for(int i = 1; i < argc; ++i) {
+      if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+         // clovers fitted at the same time
+         nThreads = atoi(argv[++i]);
+      } else {
+         argv[nArgs++] = argv[i];
+      }
+   }
+   argc = nArgs;
+
    // Do basic file checks
    if(argc != 3) {
-      printf("try again (usage: %s <matrix file> <cal file>\n", argv[0]);
+      printf("try again (usage: %s [-j <threads>] <matrix file> <cal file or calibration bundle>\n", argv[0]);
       return 0;
    }
+   SetUpFits(nThreads);
 
-   // We need a cal file to find the channels to write the corrections to
-   if(TChannel::ReadCalFile(argv[2]) < 0) {
+   // We need a cal file (or a calibration bundle) to find the channels to write the corrections to
+   if(!LoadCalibration(nullptr, argv[2], nullptr)) {
       std::cout<<"Aborting"<<std::endl;
       exit(1);
    }
@@ -241,7 +371,7 @@ int main(int argc, char** argv)
    // Create and output file.
    auto* out_file = new TFile(Form("ct_%s", in_file->GetName()), "RECREATE");
 
-   FixAll(in_file, out_file);
+   FixAll(in_file, out_file, nThreads);
 
    // This function writes a corrections cal_file which can be loaded in with your normal cal file.
    TChannel::WriteCTCorrections("ct_correction.cal");
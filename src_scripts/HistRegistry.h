@@ -0,0 +1,90 @@
+#ifndef HistRegistry_h
+#define HistRegistry_h
+
+// Histograms that are created by name and filled by number.
+//
+// Looking up the histogram of a hit by its name, as in
+// fH1[Form("gEdet%d", hit->GetDetector())], formats a string and searches a
+// map for every hit. A HistRegistry keeps the histograms in one array: every
+// histogram gets a handle (its index) when it is added, and the histograms of
+// one kind for all detectors, crystals or crystal pairs are added as a block
+// with consecutive handles, so the handle of a hit is the handle of the block
+// plus the index of its detector, crystal or pair:
+//
+//     HistRegistry hists;
+//     int gEdet = hists.AddBlock(16, [](int i) {
+//         return new TH1D(Form("gEdet%d", i + 1), "", 7000, 0, 7000);
+//     });
+//     ...
+//     hists.Get<TH1>(gEdet + DetectorIndex(detector))->Fill(energy);
+//
+// The names are only needed when the histograms are made and written, Handle
+// finds a histogram by its name for everything else. The registry does not own
+// the histograms. This header only needs TNamed and TList, so it can hold
+// other named objects, e.g. band matrices (see BandMatrix.h), too.
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "TList.h"
+#include "TNamed.h"
+
+// Index of a detector (1-16) within a block of 16
+inline int DetectorIndex(int detector) { return detector - 1; }
+// Index of a crystal (0-3) of a detector (1-16) within a block of 64
+inline int CrystalIndex(int detector, int crystal) {
+    return (detector - 1) * 4 + crystal;
+}
+// Index of the pair of crystals low < high (0-3) of a detector (1-16) within a
+// block of 96, in the order 0-1, 0-2, 0-3, 1-2, 1-3, 2-3
+inline int PairIndex(int detector, int low, int high) {
+    static const int first[3] = {0, 3, 5};
+    return (detector - 1) * 6 + first[low] + high - low - 1;
+}
+
+class HistRegistry {
+public:
+    // Adds a histogram, returns its handle
+    int Add(TNamed *hist) {
+        fHandles[hist->GetName()] = fHists.size();
+        fHists.push_back(hist);
+        return fHists.size() - 1;
+    }
+
+    // Adds the n histograms make(0) ... make(n - 1), returns the handle of the
+    // first, make(i) has the handle first + i
+    template <typename Make> int AddBlock(int n, Make make) {
+        int first = fHists.size();
+        for (int i = 0; i < n; ++i) {
+            Add(make(i));
+        }
+        return first;
+    }
+
+    // The histogram of a handle, H has to be its type or a base of it
+    template <typename H> H *Get(int handle) const {
+        return static_cast<H *>(fHists[handle]);
+    }
+
+    // The handle of the histogram with this name, -1 if there is none
+    int Handle(const std::string &name) const {
+        auto it = fHandles.find(name);
+        return (it != fHandles.end()) ? it->second : -1;
+    }
+
+    size_t size() const { return fHists.size(); }
+
+    // Adds all histograms to a list, in the order they were added
+    void AddTo(TList *list) const {
+        for (TNamed *hist : fHists) {
+            list->Add(hist);
+        }
+    }
+
+private:
+    std::vector<TNamed *> fHists;
+    std::map<std::string, int> fHandles;
+};
+
+#endif
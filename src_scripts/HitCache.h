@@ -0,0 +1,113 @@
+#ifndef HitCache_h
+#define HitCache_h
+
+// Per-event cache of the hits of one detector, one array per quantity.
+//
+// GetEnergy() of a GRIFFIN hit runs the energy calibration, the cross-talk
+// correction and the residual spline every time it is called, and the pair
+// loops of the sorting scripts ask for the same energies and times over and
+// over. A HitCache decodes every hit of an event once, right after
+// TTree::GetEntry, and the fill loops only read from the arrays:
+//
+//     HitCache gammas;
+//     ...
+//     tree->GetEntry(entry);
+//     gammas.FillGriffin(grif, cycles);
+//     for (size_t one = 0; one < gammas.size(); ++one) {
+//         gammaSingles->Fill(gammas.energy[one]);
+//     }
+//
+// Besides the hits of a TGriffin or TSceptar, a HitCache can also be filled
+// from a HitStore (see HitStore.h).
+//
+// The arrays keep their capacity from event to event, so after the first few
+// events no memory is allocated anymore.
+
+#include <vector>
+
+#include "CycleTable.h"
+
+#ifndef __CINT__
+#include "TGriffin.h"
+#include "TSceptar.h"
+#endif
+
+struct HitCache {
+    std::vector<double> energy; // keV, GetEnergy()
+    std::vector<double> charge; // GetCharge()
+    std::vector<double> time;   // ns, GetTime()
+    std::vector<Long64_t> timeStamp;
+    std::vector<int> channel; // GetArrayNumber()
+    std::vector<int> detector;
+    std::vector<int> crystal;
+    std::vector<int> kValue;
+    // TPPG::GetTimeInCycle, GetCycleNumber and GetCycleTimeStamp, from the
+    // CycleTable (see CycleTable.h), -1, -1 and 0 without a PPG
+    std::vector<double> cycleTime;
+    std::vector<Long64_t> cycleNumber;
+    std::vector<Long64_t> cycleTimeStamp;
+
+    size_t size() const { return energy.size(); }
+    bool empty() const { return energy.empty(); }
+
+    void Clear() {
+        energy.clear();
+        charge.clear();
+        time.clear();
+        timeStamp.clear();
+        channel.clear();
+        detector.clear();
+        crystal.clear();
+        kValue.clear();
+        cycleTime.clear();
+        cycleNumber.clear();
+        cycleTimeStamp.clear();
+    }
+
+    void Add(TGRSIDetectorHit *hit, const CycleTable *cycles) {
+        energy.push_back(hit->GetEnergy());
+        charge.push_back(hit->GetCharge());
+        time.push_back(hit->GetTime());
+        timeStamp.push_back(hit->GetTimeStamp());
+        channel.push_back(hit->GetArrayNumber());
+        detector.push_back(hit->GetDetector());
+        crystal.push_back(hit->GetCrystal());
+        kValue.push_back(hit->GetKValue());
+        if (cycles != nullptr) {
+            ULong64_t ts = static_cast<ULong64_t>(timeStamp.back());
+            cycleTime.push_back(cycles->TimeInCycle(ts));
+            cycleNumber.push_back(cycles->CycleNumber(ts));
+            cycleTimeStamp.push_back(cycles->CycleStart(ts));
+        } else {
+            cycleTime.push_back(-1.);
+            cycleNumber.push_back(-1);
+            cycleTimeStamp.push_back(0);
+        }
+    }
+
+    // The GRIFFIN singles of the current event
+    void FillGriffin(TGriffin *grif, const CycleTable *cycles = nullptr) {
+        Clear();
+        for (int i = 0; i < (int)grif->GetMultiplicity(); ++i) {
+            Add(grif->GetGriffinHit(i), cycles);
+        }
+    }
+
+    // The GRIFFIN addback hits of the current event, ResetAddback() has to be
+    // called on a new event before this
+    void FillAddback(TGriffin *grif, const CycleTable *cycles = nullptr) {
+        Clear();
+        for (int i = 0; i < (int)grif->GetAddbackMultiplicity(); ++i) {
+            Add(grif->GetAddbackHit(i), cycles);
+        }
+    }
+
+    void FillSceptar(TSceptar *scep, const CycleTable *cycles = nullptr) {
+        Clear();
+        for (int i = 0; i < (int)scep->GetMultiplicity(); ++i) {
+            Add(scep->GetSceptarHit(i), cycles);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,501 @@
+#ifndef HitStore_h
+#define HitStore_h
+
+// Compact columnar copy of the hits of an analysis tree.
+//
+// Reading the analysis tree means decompressing and deserializing the
+// TGriffin and TSceptar objects, and GetEnergy() runs the calibration for
+// every hit. When the same subrun is sorted over and over with different
+// windows and gates, that work is the same every time. kMakeHitStore does it
+// once and writes the decoded hits to a hit store file, which the sorting
+// scripts map into memory and read without any further copies or
+// deserialization.
+//
+// The energies are the calibrated energies at the time of the conversion (with
+// cross-talk correction and residuals, if they were used), so a new
+// calibration needs a new hit store. The raw charge is kept as well.
+//
+// A skim is a hit store of only the events that pass a selection (see
+// HitStoreSelection), e.g. the ones with two or more gammas for a gamma-gamma
+// sort. The selection is stored with the hits, so a sort can check that it
+// does not need any of the events that were left out.
+//
+// File layout, all numbers in host byte order and every section starting on
+// an 8 byte boundary:
+//
+//     HitStoreHeader
+//     HitStoreSelection          (version 2)
+//     event table:   int64 baseTimeStamp[nEvents]
+//                    double baseTime[nEvents]
+//                    int64 treeEntry[nEvents]    (version 2)
+//                    uint64 firstHit[kNHitStreams][nEvents + 1]
+//     per stream:    uint32 id[nHits]            packed, see HitStorePack()
+//                    uint32 timeStamp[nHits]     minus baseTimeStamp
+//                    float time[nHits]           ns, minus baseTime
+//                    float energy[nHits]         keV
+//                    float charge[nHits]
+//                    int64 cycleTimeStamp[nHits]
+//
+// The hits of event i in stream s are firstHit[s][i] to firstHit[s][i + 1].
+// Times are stored relative to the earliest hit of the event, which keeps them
+// exact to better than a ps for events shorter than 10 us. Energies are floats,
+// good to about 0.1 eV at 1 MeV.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "HitCache.h"
+
+enum HitStream { kGriffinHits = 0, kAddbackHits, kSceptarHits, kNHitStreams };
+
+struct HitStoreHeader {
+    char magic[8]; // "HITSTORE"
+    uint32_t version;
+    uint32_t nStreams;
+    uint64_t nEvents;
+    uint64_t nHits[kNHitStreams];
+};
+
+// The events a hit store keeps: all of them, or with any of the cuts set only
+// the ones that pass every cut that is set
+struct HitStoreSelection {
+    // at least this many GRIFFIN hits, 0 or 1 for no cut
+    uint32_t minGammas = 0;
+    // a SCEPTAR hit with gbLow <= t(gamma) - t(beta) <= gbHigh for a GRIFFIN
+    // hit, the same time difference as the gamma-beta windows of the sorts
+    uint32_t betaWindow = 0;
+    // a GRIFFIN hit with cycleLow <= time in cycle < cycleHigh, in the units
+    // of the cycle windows of kLeanMatrices (bgStart ...)
+    uint32_t cycleWindow = 0;
+    uint32_t reserved = 0;
+    double gbLow = 0.;
+    double gbHigh = 0.;
+    double cycleLow = 0.;
+    double cycleHigh = 0.;
+
+    bool Any() const { return minGammas > 1 || betaWindow || cycleWindow; }
+
+    bool Pass(const HitCache &gammas, const HitCache &betas) const {
+        if (gammas.size() < minGammas) {
+            return false;
+        }
+        if (betaWindow) {
+            bool found = false;
+            for (size_t g = 0; g < gammas.size() && !found; ++g) {
+                for (size_t b = 0; b < betas.size() && !found; ++b) {
+                    double timeDiff = gammas.time[g] - betas.time[b];
+                    found = (gbLow <= timeDiff && timeDiff <= gbHigh);
+                }
+            }
+            if (!found) {
+                return false;
+            }
+        }
+        if (cycleWindow) {
+            bool found = false;
+            for (size_t g = 0; g < gammas.size() && !found; ++g) {
+                found = (cycleLow <= gammas.cycleTime[g] &&
+                         gammas.cycleTime[g] < cycleHigh);
+            }
+            if (!found) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string Describe() const {
+        if (!Any()) {
+            return "all events";
+        }
+        std::string text;
+        char buffer[128];
+        if (minGammas > 1) {
+            snprintf(buffer, sizeof(buffer), "%u or more gammas", minGammas);
+            text += buffer;
+        }
+        if (betaWindow) {
+            snprintf(buffer, sizeof(buffer), "%sa beta in [%g, %g]",
+                     text.empty() ? "" : ", ", gbLow, gbHigh);
+            text += buffer;
+        }
+        if (cycleWindow) {
+            snprintf(buffer, sizeof(buffer), "%sa gamma in cycle [%g, %g)",
+                     text.empty() ? "" : ", ", cycleLow, cycleHigh);
+            text += buffer;
+        }
+        return text;
+    }
+};
+
+// The id word of a hit: channel + 1 (8 bits), detector (6 bits), crystal + 1
+// (3 bits) and k-value (15 bits). Returns false if one of them doesn't fit.
+inline bool HitStorePack(int channel, int detector, int crystal, int kValue,
+                         uint32_t &id) {
+    if (channel < -1 || channel > 254 || detector < 0 || detector > 63 ||
+        crystal < -1 || crystal > 6 || kValue < 0 || kValue > 32767) {
+        return false;
+    }
+    id = static_cast<uint32_t>(channel + 1) |
+         static_cast<uint32_t>(detector) << 8 |
+         static_cast<uint32_t>(crystal + 1) << 14 |
+         static_cast<uint32_t>(kValue) << 17;
+    return true;
+}
+
+class HitStoreWriter {
+public:
+    // Every column is written to a temporary file next to the output file and
+    // they are put together by Close(), so the hits never have to fit into
+    // memory
+    explicit HitStoreWriter(
+        const std::string &fileName,
+        const HitStoreSelection &selection = HitStoreSelection())
+        : fFileName(fileName), fSelection(selection) {
+        for (int i = 0; i < kNColumns; ++i) {
+            std::string name = fFileName + ".tmp" + std::to_string(i);
+            fColumns[i] = fopen(name.c_str(), "wb+");
+            if (fColumns[i] == nullptr) {
+                printf("Failed to open temporary file '%s'!\n", name.c_str());
+                fGood = false;
+            } else {
+                setvbuf(fColumns[i], nullptr, _IOFBF, 1 << 20);
+            }
+        }
+        for (int s = 0; s < kNHitStreams; ++s) {
+            fNHits[s] = 0;
+            if (fGood) {
+                Write(kFirstHit + s, fNHits[s]);
+            }
+        }
+    }
+    ~HitStoreWriter() {
+        for (int i = 0; i < kNColumns; ++i) {
+            if (fColumns[i] != nullptr) {
+                fclose(fColumns[i]);
+                remove((fFileName + ".tmp" + std::to_string(i)).c_str());
+            }
+        }
+    }
+
+    bool IsGood() const { return fGood; }
+    uint64_t GetEntries() const { return fNEvents; }
+
+    // Adds the next event, the hits of each stream are given in a HitCache.
+    // The tree entry defaults to the number of events added before, which is
+    // right unless events are skipped.
+    void AddEvent(const HitCache *hits[kNHitStreams], int64_t treeEntry = -1) {
+        if (!fGood) {
+            return;
+        }
+        int64_t baseTimeStamp = 0;
+        double baseTime = 0.;
+        bool first = true;
+        for (int s = 0; s < kNHitStreams; ++s) {
+            for (size_t i = 0; i < hits[s]->size(); ++i) {
+                if (first || hits[s]->timeStamp[i] < baseTimeStamp) {
+                    baseTimeStamp = hits[s]->timeStamp[i];
+                }
+                if (first || hits[s]->time[i] < baseTime) {
+                    baseTime = hits[s]->time[i];
+                }
+                first = false;
+            }
+        }
+        Write(kBaseTimeStamp, baseTimeStamp);
+        Write(kBaseTime, baseTime);
+        Write(kTreeEntry, (treeEntry < 0) ? static_cast<int64_t>(fNEvents)
+                                          : treeEntry);
+
+        for (int s = 0; s < kNHitStreams; ++s) {
+            const HitCache &h = *hits[s];
+            int column = kNEventColumns + s * kNHitColumns;
+            for (size_t i = 0; i < h.size(); ++i) {
+                uint32_t id;
+                if (!HitStorePack(h.channel[i], h.detector[i], h.crystal[i],
+                                  h.kValue[i], id)) {
+                    ++fBadHits;
+                    HitStorePack(0, 0, -1, 0, id);
+                }
+                int64_t deltaTimeStamp = h.timeStamp[i] - baseTimeStamp;
+                if (deltaTimeStamp > UINT32_MAX) {
+                    ++fBadHits;
+                    deltaTimeStamp = UINT32_MAX;
+                }
+                Write(column + kId, id);
+                Write(column + kTimeStamp,
+                      static_cast<uint32_t>(deltaTimeStamp));
+                Write(column + kTime, static_cast<float>(h.time[i] - baseTime));
+                Write(column + kEnergy, static_cast<float>(h.energy[i]));
+                Write(column + kCharge, static_cast<float>(h.charge[i]));
+                Write(column + kCycleTimeStamp,
+                      static_cast<int64_t>(h.cycleTimeStamp[i]));
+            }
+            fNHits[s] += h.size();
+            Write(kFirstHit + s, fNHits[s]);
+        }
+        ++fNEvents;
+    }
+
+    // Writes the file, returns false if that failed
+    bool Close() {
+        if (!fGood) {
+            return false;
+        }
+        if (fBadHits > 0) {
+            printf("%lu hits had ids or timestamps that don't fit into the "
+                   "hit store\n",
+                   static_cast<unsigned long>(fBadHits));
+        }
+        FILE *out = fopen(fFileName.c_str(), "wb");
+        if (out == nullptr) {
+            printf("Failed to open file '%s'!\n", fFileName.c_str());
+            return false;
+        }
+        HitStoreHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "HITSTORE", 8);
+        header.version = 2;
+        header.nStreams = kNHitStreams;
+        header.nEvents = fNEvents;
+        for (int s = 0; s < kNHitStreams; ++s) {
+            header.nHits[s] = fNHits[s];
+        }
+        // the columns are numbered in the order of the layout
+        bool good = fwrite(&header, sizeof(header), 1, out) == 1 && Pad(out);
+        good = good && fwrite(&fSelection, sizeof(fSelection), 1, out) == 1 &&
+               Pad(out);
+        good = good && CopyColumn(out, kBaseTimeStamp, fNEvents * 8);
+        good = good && CopyColumn(out, kBaseTime, fNEvents * 8);
+        good = good && CopyColumn(out, kTreeEntry, fNEvents * 8);
+        for (int s = 0; s < kNHitStreams; ++s) {
+            good = good && CopyColumn(out, kFirstHit + s, (fNEvents + 1) * 8);
+        }
+        for (int s = 0; s < kNHitStreams; ++s) {
+            for (int c = 0; c < kNHitColumns; ++c) {
+                int size = (c == kCycleTimeStamp) ? 8 : 4;
+                good = good && CopyColumn(out,
+                                          kNEventColumns + s * kNHitColumns + c,
+                                          fNHits[s] * size);
+            }
+        }
+        good = (fclose(out) == 0) && good;
+        if (!good) {
+            printf("Failed to write hit store '%s'!\n", fFileName.c_str());
+        }
+        return good;
+    }
+
+private:
+    enum {
+        kBaseTimeStamp,
+        kBaseTime,
+        kTreeEntry,
+        kFirstHit,
+        kNEventColumns = kFirstHit + kNHitStreams
+    };
+    enum { kId, kTimeStamp, kTime, kEnergy, kCharge, kCycleTimeStamp,
+           kNHitColumns };
+    static const int kNColumns = kNEventColumns + kNHitStreams * kNHitColumns;
+
+    template <typename T> void Write(int column, T value) {
+        if (fwrite(&value, sizeof(T), 1, fColumns[column]) != 1) {
+            fGood = false;
+        }
+    }
+
+    static bool Pad(FILE *out) {
+        static const char zeros[8] = {0};
+        long pos = ftell(out);
+        size_t pad = (8 - pos % 8) % 8;
+        return pad == 0 || fwrite(zeros, 1, pad, out) == pad;
+    }
+
+    bool CopyColumn(FILE *out, int column, uint64_t bytes) {
+        FILE *in = fColumns[column];
+        if (fflush(in) != 0 || fseek(in, 0, SEEK_SET) != 0) {
+            return false;
+        }
+        std::vector<char> buffer(1 << 20);
+        uint64_t copied = 0;
+        size_t n;
+        while ((n = fread(buffer.data(), 1, buffer.size(), in)) > 0) {
+            if (fwrite(buffer.data(), 1, n, out) != n) {
+                return false;
+            }
+            copied += n;
+        }
+        return copied == bytes && Pad(out);
+    }
+
+    std::string fFileName;
+    HitStoreSelection fSelection;
+    bool fGood = true;
+    uint64_t fNEvents = 0;
+    uint64_t fNHits[kNHitStreams];
+    uint64_t fBadHits = 0;
+    FILE *fColumns[kNColumns];
+};
+
+class HitStore {
+public:
+    HitStore() {}
+    ~HitStore() { Close(); }
+    HitStore(const HitStore &) = delete;
+    HitStore &operator=(const HitStore &) = delete;
+
+    // Maps the file into memory, returns false if it isn't a hit store
+    bool Open(const std::string &fileName) {
+        Close();
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            printf("Failed to open hit store '%s'!\n", fileName.c_str());
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 ||
+            info.st_size < static_cast<off_t>(sizeof(HitStoreHeader))) {
+            printf("'%s' is not a hit store!\n", fileName.c_str());
+            close(fd);
+            return false;
+        }
+        fSize = info.st_size;
+        void *data = mmap(nullptr, fSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            printf("Failed to map hit store '%s'!\n", fileName.c_str());
+            return false;
+        }
+        fData = static_cast<const char *>(data);
+        // the sorts run through the file from front to back
+        madvise(data, fSize, MADV_SEQUENTIAL);
+
+        const auto *header = reinterpret_cast<const HitStoreHeader *>(fData);
+        if (memcmp(header->magic, "HITSTORE", 8) != 0 ||
+            (header->version != 1 && header->version != 2) ||
+            header->nStreams != kNHitStreams) {
+            printf("'%s' is not a hit store (or of a different version)!\n",
+                   fileName.c_str());
+            Close();
+            return false;
+        }
+        fNEvents = header->nEvents;
+        size_t pos = (sizeof(HitStoreHeader) + 7) / 8 * 8;
+        // version 1 has all entries of the tree
+        fSelection = HitStoreSelection();
+        fTreeEntry = nullptr;
+        if (header->version >= 2) {
+            const HitStoreSelection *selection =
+                Section<HitStoreSelection>(pos, 1);
+            if (selection != nullptr) {
+                fSelection = *selection;
+            }
+        }
+        fBaseTimeStamp = Section<int64_t>(pos, fNEvents);
+        fBaseTime = Section<double>(pos, fNEvents);
+        if (header->version >= 2) {
+            fTreeEntry = Section<int64_t>(pos, fNEvents);
+        }
+        for (int s = 0; s < kNHitStreams; ++s) {
+            fFirstHit[s] = Section<uint64_t>(pos, fNEvents + 1);
+        }
+        for (int s = 0; s < kNHitStreams; ++s) {
+            uint64_t n = header->nHits[s];
+            fId[s] = Section<uint32_t>(pos, n);
+            fTimeStamp[s] = Section<uint32_t>(pos, n);
+            fTime[s] = Section<float>(pos, n);
+            fEnergy[s] = Section<float>(pos, n);
+            fCharge[s] = Section<float>(pos, n);
+            fCycleTimeStamp[s] = Section<int64_t>(pos, n);
+        }
+        if (pos > fSize) {
+            printf("Hit store '%s' is truncated!\n", fileName.c_str());
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+        if (fData != nullptr) {
+            munmap(const_cast<char *>(fData), fSize);
+            fData = nullptr;
+        }
+        fNEvents = 0;
+    }
+
+    bool IsOpen() const { return fData != nullptr; }
+    Long64_t GetEntries() const { return fNEvents; }
+    const HitStoreSelection &GetSelection() const { return fSelection; }
+    bool IsSkim() const { return fSelection.Any(); }
+    // The entry of the analysis tree an entry of the store was made from
+    Long64_t GetTreeEntry(Long64_t entry) const {
+        return (fTreeEntry != nullptr) ? fTreeEntry[entry] : entry;
+    }
+    size_t GetMultiplicity(Long64_t entry, HitStream stream) const {
+        return fFirstHit[stream][entry + 1] - fFirstHit[stream][entry];
+    }
+
+    // Unpacks the hits of one stream of an event, the cycle time and number
+    // are looked up from the timestamp if a cycle table is given
+    void Fill(Long64_t entry, HitStream stream, HitCache &hits,
+              const CycleTable *cycles = nullptr) const {
+        hits.Clear();
+        Long64_t baseTimeStamp = fBaseTimeStamp[entry];
+        double baseTime = fBaseTime[entry];
+        for (uint64_t i = fFirstHit[stream][entry];
+             i < fFirstHit[stream][entry + 1]; ++i) {
+            uint32_t id = fId[stream][i];
+            hits.energy.push_back(fEnergy[stream][i]);
+            hits.charge.push_back(fCharge[stream][i]);
+            hits.time.push_back(baseTime + fTime[stream][i]);
+            hits.timeStamp.push_back(baseTimeStamp + fTimeStamp[stream][i]);
+            hits.channel.push_back(static_cast<int>(id & 0xff) - 1);
+            hits.detector.push_back((id >> 8) & 0x3f);
+            hits.crystal.push_back(static_cast<int>((id >> 14) & 0x7) - 1);
+            hits.kValue.push_back(id >> 17);
+            if (cycles != nullptr) {
+                ULong64_t ts = static_cast<ULong64_t>(hits.timeStamp.back());
+                hits.cycleTime.push_back(cycles->TimeInCycle(ts));
+                hits.cycleNumber.push_back(cycles->CycleNumber(ts));
+            } else {
+                hits.cycleTime.push_back(-1.);
+                hits.cycleNumber.push_back(-1);
+            }
+            hits.cycleTimeStamp.push_back(fCycleTimeStamp[stream][i]);
+        }
+    }
+
+private:
+    // Pointer to n values at pos, and moves pos past them
+    template <typename T> const T *Section(size_t &pos, uint64_t n) const {
+        const T *data = reinterpret_cast<const T *>(fData + pos);
+        pos += (n * sizeof(T) + 7) / 8 * 8;
+        return pos <= fSize ? data : nullptr;
+    }
+
+    const char *fData = nullptr;
+    size_t fSize = 0;
+    Long64_t fNEvents = 0;
+    HitStoreSelection fSelection;
+    const int64_t *fTreeEntry = nullptr;
+    const int64_t *fBaseTimeStamp = nullptr;
+    const double *fBaseTime = nullptr;
+    const uint64_t *fFirstHit[kNHitStreams] = {};
+    const uint32_t *fId[kNHitStreams] = {};
+    const uint32_t *fTimeStamp[kNHitStreams] = {};
+    const float *fTime[kNHitStreams] = {};
+    const float *fEnergy[kNHitStreams] = {};
+    const float *fCharge[kNHitStreams] = {};
+    const int64_t *fCycleTimeStamp[kNHitStreams] = {};
+};
+
+#endif
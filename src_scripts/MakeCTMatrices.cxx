@@ -8,6 +8,8 @@
 //
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sys/stat.h>
@@ -35,8 +37,13 @@
 #include "TVirtualIndex.h"
 #include "TGRSIOptions.h"
 #include "THnSparse.h"
-#include "TSpline.h"
-#include "TMVA/TSpline1.h"
+
+#include "BandMatrix.h"
+#include "CalBundle.h"
+#include "HistRegistry.h"
+#include "HitCache.h"
+#include "ReadPlan.h"
+#include "ResidualTable.h"
 
 #ifndef __CINT__
 #include "TGriffin.h"
@@ -44,7 +51,13 @@
 #include "TGRSISelector.h"
 #endif
 
-std::vector<TMVA::TSpline1*> ResidualVec;
+ResidualTable Residuals;
+
+// The sum energies whose bands the matrices keep and the half width of the
+// bands. GriffinCTFix only uses 1332.492 +- 15 keV, other lines like 1173.228
+// are added with -s.
+std::vector<double> BandSums = {1332.492};
+double BandHalfWidth = 20.;
 
 // This function gets run if running interpretively
 // Not recommended for the analysis scripts
@@ -79,19 +92,26 @@ TList *LeanMatrices(TTree *tree, long maxEntries = 0, TStopwatch *w = NULL)
 
   TList *list = new TList;
 
-  TH2F *histos[96];
+  // Only the bands around the sum energies are kept (see BandMatrix.h), a
+  // full 2000x2000 matrix of every crystal pair would be ~1.5 GB
+  // in the order of PairIndex (see HistRegistry.h), 0-1, 0-2, 0-3, 1-2, 1-3, 2-3 for every detector
+  HistRegistry hists;
+	int pairs = hists.AddBlock(96, [&](int i) {
+		static const int low_crys[6] = {0, 0, 0, 1, 1, 2};
+		static const int high_crys[6] = {1, 2, 3, 2, 3, 3};
+		return new BandMatrix(Form("det_%d_%d_%d",i/6+1,low_crys[i%6],high_crys[i%6]),"",nofBins,low,high,BandSums,BandHalfWidth);
+	});
 
-	for(int det_num=0; det_num<16; det_num++){
-		histos[det_num*6]   = new TH2F(Form("det_%d_0_1",det_num+1),"",nofBins,low,high,nofBins,low,high);
-		histos[det_num*6+1] = new TH2F(Form("det_%d_0_2",det_num+1),"",nofBins,low,high,nofBins,low,high);
-		histos[det_num*6+2] = new TH2F(Form("det_%d_0_3",det_num+1),"",nofBins,low,high,nofBins,low,high);
-		histos[det_num*6+3] = new TH2F(Form("det_%d_1_2",det_num+1),"",nofBins,low,high,nofBins,low,high);
-		histos[det_num*6+4] = new TH2F(Form("det_%d_1_3",det_num+1),"",nofBins,low,high,nofBins,low,high);
-		histos[det_num*6+5] = new TH2F(Form("det_%d_2_3",det_num+1),"",nofBins,low,high,nofBins,low,high);
-	}
+	hists.AddTo(list);
+	printf("Keeping the bands of %d sum energies, %.1f MB for all matrices\n", (int)BandSums.size(), 96. * hists.Get<BandMatrix>(pairs)->GetMemoryUsage() / (1024. * 1024.));
 
-	for( int i=0; i<96; i++) { list->Add(histos[i]);}
 
+  if (maxEntries == 0 || maxEntries > tree->GetEntries()) { maxEntries = tree->GetEntries(); }
+
+  // Only the GRIFFIN hits are read, every other branch is switched off
+  ReadPlan plan;
+  plan.AddBranch("TGriffin");
+  plan.Apply(tree, 1, maxEntries, true);
 
   TGriffin *grif = 0;
   tree->SetBranchAddress("TGriffin", &grif); // We assume we always have a Griffin branch
@@ -100,21 +120,18 @@ TList *LeanMatrices(TTree *tree, long maxEntries = 0, TStopwatch *w = NULL)
 
   grif->ResetFlags();
 
-  if( ResidualVec.size() == 64 ) {
+  if (!Residuals.Empty()) {
       printf("Loading in energy residuals\n");
-      for (int k = 0; k < 64; k++) {
-          grif->LoadEnergyResidual(k+1, ResidualVec[k]);
-      }
   }
 
   // Indices of the two hits being compared
   int one;
   int two;
+  // the hits of the current event
+  HitCache gammas;
 
   std::cout << std::fixed << std::setprecision(1); // This just make outputs not look terrible
 
-  if (maxEntries == 0 || maxEntries > tree->GetEntries()) { maxEntries = tree->GetEntries(); }
-
 
 
 /*	// ****** Example from CrossTalk.C selector script
@@ -186,64 +203,57 @@ void CrossTalk::FillHistograms() {
 	{
 
 		tree->GetEntry(entry);
+		ApplyResiduals(Residuals, grif);
+
+		// decode every hit once, the loops below only use the cached values
+		gammas.FillGriffin(grif);
 
 		int det_mult[17] = {0};
 
 		// 1. distribute total multiplicity among each detector (1-16)
-		for( one = 0; one < grif->GetMultiplicity(); one++)
+		for( one = 0; one < (int)gammas.size(); one++)
 		{
-			++(det_mult[grif->GetGriffinHit(one)->GetDetector()]);
+			++(det_mult[gammas.detector[one]]);
 		}
 
 		// 2. first loop through hits in event (through entire multiplicity, across different detectors)
-		for (one = 0; one < grif->GetMultiplicity(); one++)
+		for (one = 0; one < (int)gammas.size(); one++)
 		{
 
 			// 3. reject pileup of current first hit index
-			if(grif->GetGriffinHit(one)->GetKValue() != 700) continue;
+			if( gammas.kValue[one] != 700 ) continue;
 
 			// 4. second loop through subsequent hits in event (only higher values of multiplicity [not symmetrized], across different detectors)
-			for( two = one+1; two < grif->GetMultiplicity(); two++)
+			for( two = one+1; two < (int)gammas.size(); two++)
 			{
 				// 5. reject pileup of current second hit index
-				if( grif->GetGriffinHit(two)->GetKValue() != 700 ) continue;
+				if( gammas.kValue[two] != 700 ) continue;
 
 				// 6. check if (1) current first indexed detector has mult = 2, (2) if both indices have same detector, and (3) prompt time difference (300)
 				// 8. exclude same-crystal hits
-				if( det_mult[grif->GetGriffinHit(one)->GetDetector()] !=2 ) continue;
-				if( grif->GetGriffinHit(one)->GetDetector() != grif->GetGriffinHit(two)->GetDetector() ) continue;
-				if( std::fabs( grif->GetGriffinHit(one)->GetTime() - grif->GetGriffinHit(two)->GetTime() ) > 300. ) continue;
-				if( grif->GetGriffinHit(one)->GetCrystal() == grif->GetGriffinHit(two)->GetCrystal() ) continue;
+				if( det_mult[gammas.detector[one]] !=2 ) continue;
+				if( gammas.detector[one] != gammas.detector[two] ) continue;
+				if( std::fabs( gammas.time[one] - gammas.time[two] ) > 300. ) continue;
+				if( gammas.crystal[one] == gammas.crystal[two] ) continue;
 
 				// 7. order the indices by crystal number (0-2 for "low" and 1-3 for "high")
-				TGriffinHit* low_crys_hit;
-				TGriffinHit* high_crys_hit;
+				int low_crys_hit = one;
+				int high_crys_hit = two;
 
-				if( grif->GetGriffinHit(one)->GetCrystal() < grif->GetGriffinHit(two)->GetCrystal() )
-				{
-					low_crys_hit = grif->GetGriffinHit(one);
-					high_crys_hit = grif->GetGriffinHit(two);
-				}
-				else
+				if( gammas.crystal[two] < gammas.crystal[one] )
 				{
-					low_crys_hit = grif->GetGriffinHit(two);
-					high_crys_hit = grif->GetGriffinHit(one);
+					low_crys_hit = two;
+					high_crys_hit = one;
 				}
 
-				// 9. fill histogram with crystal ordering
-				int hist_index = -1;
-
-				if( low_crys_hit->GetCrystal() == 0 && high_crys_hit->GetCrystal() == 1) { hist_index = 0; }
-				if( low_crys_hit->GetCrystal() == 0 && high_crys_hit->GetCrystal() == 2) { hist_index = 1; }
-				if( low_crys_hit->GetCrystal() == 0 && high_crys_hit->GetCrystal() == 3) { hist_index = 2; }
-				if( low_crys_hit->GetCrystal() == 1 && high_crys_hit->GetCrystal() == 2) { hist_index = 3; }
-				if( low_crys_hit->GetCrystal() == 1 && high_crys_hit->GetCrystal() == 3) { hist_index = 4; }
-				if( low_crys_hit->GetCrystal() == 2 && high_crys_hit->GetCrystal() == 3) { hist_index = 5; }
+				int low_crys = gammas.crystal[low_crys_hit];
+				int high_crys = gammas.crystal[high_crys_hit];
 
-				hist_index += ( 6*( grif->GetGriffinHit(one)->GetDetector()-1 ) );
+				// 9. fill histogram with crystal ordering
+				int hist_index = pairs + PairIndex(gammas.detector[one], low_crys, high_crys);
 
 				// Fill( low crystal, high crystal );
-				histos[hist_index]->Fill(low_crys_hit->GetEnergy(),high_crys_hit->GetEnergy());
+				hists.Get<BandMatrix>(hist_index)->Fill(gammas.energy[low_crys_hit],gammas.energy[high_crys_hit]);
 
 			}	// second gamma loop
 
@@ -263,8 +273,24 @@ void CrossTalk::FillHistograms() {
 // This function gets run if running in compiled mode
 #ifndef __CINT__
 int main(int argc, char **argv) {
+    int nArgs = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            // comma separated sum energies in keV
+            BandSums.clear();
+            for (char *sum = strtok(argv[++i], ","); sum != NULL; sum = strtok(NULL, ",")) {
+                BandSums.push_back(atof(sum));
+            }
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            BandHalfWidth = atof(argv[++i]);
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
     if ( argc != 3 && argc != 2) {
-        printf("try again (usage: %s <analysis tree file> <optional:residuals file>).\n", argv[0]);
+        printf("try again (usage: %s [-s <sum energies, default 1332.492, e.g. 1173.228,1332.492>] [-w <band half width>] <analysis tree file> <optional:residuals or calibration bundle file>).\n", argv[0]);
         return 0;
     }
 
@@ -285,32 +311,14 @@ int main(int argc, char **argv) {
     }
     printf("Sorting file:" DBLUE " %s" RESET_COLOR "\n", file->GetName());
 
-    TFile *pResFile = nullptr;
-    if ( argc > 2 ) // Check if the extra file is tacked on
-        pResFile = new TFile( argv[2], "READ");
-    if ( pResFile != nullptr )
-    {
-        pResFile->cd();
-        if (pResFile->cd("Energy_Residuals")) {
-            printf("Energy residuals found, loading...\n");
-            TGraph* TempGraph;
-            for (int k = 0 ; k < 64; k++) {
-                gDirectory->GetObject(Form("Graph;%d", k + 1), TempGraph);
-                ResidualVec.push_back( new TMVA::TSpline1("", TempGraph ) );
-            }
-        } else {
-            printf("No energy residuals found\n");
-        }
-        pResFile->Close();
-    }
-
-
     TTree *tree = (TTree *)file->Get("AnalysisTree");
-    TChannel::ReadCalFromTree(tree);
     if (tree == NULL) {
         printf("Failed to find analysis tree in file '%s'!\n", argv[1]);
         return 1;
     }
+    if (!LoadCalibration(tree, (argc > 2) ? argv[2] : nullptr, &Residuals)) {
+        return 1;
+    }
 
     TList *list; // We return a list because we fill a bunch of TH1's and shove them into this list.
 
@@ -0,0 +1,133 @@
+#ifndef ReadPlan_h
+#define ReadPlan_h
+
+// Works out which parts of the analysis tree a sort actually reads.
+//
+// The analysis tree has a branch for every detector system, and the detector
+// branches are split into one sub-branch per data member of the hits. A sort
+// usually needs a handful of those members, but TTree::GetEntry reads (and
+// decompresses) everything that is enabled. A ReadPlan lists the detector
+// branches and hit members a sort uses, disables every other branch of the
+// tree, and sets up the TTreeCache for the entry range the sort reads:
+//
+//     ReadPlan plan;
+//     plan.AddBranch("TGriffin");
+//     plan.AddBranch("TSceptar");
+//     plan.SetCacheSize(100 * 1024 * 1024);
+//     plan.Apply(tree, firstEntry, lastEntry); // before SetBranchAddress
+//
+// If none of the members can be found in a detector branch (e.g. an unsplit
+// branch or a GRSISort version with other member names), the whole branch is
+// read.
+
+#include <cstdio>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "TBranch.h"
+#include "TObjArray.h"
+#include "TTree.h"
+
+class ReadPlan {
+public:
+    // What GetEnergy(), GetTime(), GetDetector(), GetCrystal(), GetKValue()
+    // and addback need from a hit: the channel address (calibration, detector
+    // and crystal), charge and k-value (energy), timestamp and CFD (time).
+    static std::vector<std::string> DefaultMembers() {
+        return {"fAddress", "fCharge", "fKValue", "fTimeStamp",
+                "fCfd",     "fEnergy", "fBitFlags", "fBitflags"};
+    }
+
+    void AddBranch(const std::string &name,
+                   const std::vector<std::string> &members = DefaultMembers()) {
+        fBranches.push_back(name);
+        fMembers.push_back(std::set<std::string>(members.begin(), members.end()));
+    }
+
+    // Size of the TTreeCache in bytes, 0 switches the cache off
+    void SetCacheSize(Long64_t bytes) { fCacheSize = bytes; }
+    Long64_t GetCacheSize() const { return fCacheSize; }
+    // Number of entries the cache uses to learn which baskets to read
+    void SetLearnEntries(int entries) { fLearnEntries = entries; }
+
+    // Disables every branch not in the plan and sets up the cache for the
+    // entries [firstEntry, lastEntry). Has to be called before the branch
+    // addresses are set. Returns the number of compressed bytes that will be
+    // read for the whole tree.
+    Long64_t Apply(TTree *tree, Long64_t firstEntry, Long64_t lastEntry,
+                   bool verbose = false) const {
+        tree->SetBranchStatus("*", false);
+        Long64_t planned = 0;
+        for (size_t i = 0; i < fBranches.size(); ++i) {
+            TBranch *branch = tree->GetBranch(fBranches[i].c_str());
+            if (branch == nullptr) {
+                continue;
+            }
+            std::vector<TBranch *> leaves;
+            CollectLeaves(branch, leaves);
+            std::vector<TBranch *> selected;
+            for (TBranch *leaf : leaves) {
+                if (fMembers[i].count(MemberName(leaf->GetName())) > 0) {
+                    selected.push_back(leaf);
+                }
+            }
+            if (selected.empty()) {
+                // nothing we know about, read the whole branch
+                if (verbose && leaves.size() > 1) {
+                    printf("Found none of the needed members in branch '%s', "
+                           "reading all of it\n",
+                           fBranches[i].c_str());
+                }
+                selected = leaves;
+            }
+            for (TBranch *leaf : selected) {
+                // this also enables the branches holding the leaf, and the
+                // counter of the hit vector
+                tree->SetBranchStatus(leaf->GetName(), true);
+                planned += leaf->GetZipBytes();
+            }
+        }
+
+        if (fCacheSize > 0) {
+            tree->SetCacheSize(fCacheSize);
+            tree->SetCacheLearnEntries(fLearnEntries);
+            tree->SetCacheEntryRange(firstEntry, lastEntry);
+        } else {
+            tree->SetCacheSize(0);
+        }
+
+        if (verbose) {
+            printf("Reading %.1f of %.1f MB (compressed) of tree '%s'\n",
+                   planned / 1048576., tree->GetZipBytes() / 1048576.,
+                   tree->GetName());
+        }
+        return planned;
+    }
+
+private:
+    // All branches below branch that have no sub-branches themselves
+    static void CollectLeaves(TBranch *branch, std::vector<TBranch *> &leaves) {
+        TObjArray *subBranches = branch->GetListOfBranches();
+        if (subBranches == nullptr || subBranches->GetEntries() == 0) {
+            leaves.push_back(branch);
+            return;
+        }
+        for (int i = 0; i < subBranches->GetEntries(); ++i) {
+            CollectLeaves(static_cast<TBranch *>(subBranches->At(i)), leaves);
+        }
+    }
+
+    // "TGriffin.fGriffinLowGainHits.fCharge" -> "fCharge"
+    static std::string MemberName(const std::string &branchName) {
+        std::string name = branchName.substr(branchName.rfind('.') + 1);
+        return name.substr(0, name.find('['));
+    }
+
+    std::vector<std::string> fBranches;
+    std::vector<std::set<std::string>> fMembers;
+    Long64_t fCacheSize = 100 * 1024 * 1024;
+    int fLearnEntries = 100;
+};
+
+#endif
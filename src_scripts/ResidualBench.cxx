@@ -0,0 +1,138 @@
+// g++ ResidualBench.cxx -std=c++11 -O2 -o ResidualBench
+//
+// Compares the residual correction of ResidualTable.h with the spline
+// evaluation it replaced. The residual graphs look like the ones of
+// kResidualCalculator (a 152Eu source, two zero points above the last peak),
+// one per crystal, and the hits have random crystals and energies. The spline
+// is a copy of TMVA::TSpline1::Eval (binary search of the graph points and a
+// linear interpolation), so no ROOT is needed:
+//
+//     ./ResidualBench <optional: number of hits> <table step [keV]>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "ResidualTable.h"
+
+// the part of TGraph that ResidualTable::Build uses
+struct Graph {
+    std::vector<double> x;
+    std::vector<double> y;
+    int GetN() const { return (int)x.size(); }
+    const double *GetX() const { return x.data(); }
+    const double *GetY() const { return y.data(); }
+};
+
+// TMVA::TSpline1::Eval
+double SplineEval(const Graph &graph, double at) {
+    int n = graph.GetN();
+    int bin = (int)(std::upper_bound(graph.x.begin(), graph.x.end(), at) -
+                    graph.x.begin()) -
+              1;
+    if (bin < 0) {
+        bin = 0;
+    }
+    if (bin >= n) {
+        bin = n - 1;
+    }
+    int next = bin;
+    if ((at > graph.x[bin] && bin != n - 1) || bin == 0) {
+        ++next;
+    } else {
+        --next;
+    }
+    double dx = graph.x[bin] - graph.x[next];
+    double dy = graph.y[bin] - graph.y[next];
+    return graph.y[bin] + (at - graph.x[bin]) * dy / dx;
+}
+
+template <typename F> double Time(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+int main(int argc, char **argv) {
+    long nHits = 10000000;
+    double step = 0.1;
+    if (argc > 1) {
+        nHits = atol(argv[1]);
+    }
+    if (argc > 2) {
+        step = atof(argv[2]);
+    }
+
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> shift(-1.5, 1.5);
+    const double peaks[] = {121.8, 244.7, 344.3, 411.1, 778.9,
+                            867.4, 964.1, 1112.1, 1408.0};
+    std::vector<Graph> graphs(ResidualTable::kMaxChannel + 1);
+    ResidualTable table;
+    for (int channel = 1; channel <= ResidualTable::kMaxChannel; ++channel) {
+        Graph &graph = graphs[channel];
+        for (double peak : peaks) {
+            graph.x.push_back(peak + shift(rng));
+            graph.y.push_back(shift(rng));
+        }
+        graph.x.push_back(graph.x.back() + 10.);
+        graph.y.push_back(0.);
+        graph.x.push_back(graph.x.back() + 20.);
+        graph.y.push_back(0.);
+        table.Build(channel, graph, step);
+    }
+
+    std::uniform_int_distribution<int> crystal(1, ResidualTable::kMaxChannel);
+    std::uniform_real_distribution<double> energy(0., 3000.);
+    std::vector<int> channels(nHits);
+    std::vector<double> energies(nHits);
+    for (long i = 0; i < nHits; ++i) {
+        channels[i] = crystal(rng);
+        energies[i] = energy(rng);
+    }
+
+    std::vector<double> spline(energies);
+    std::vector<double> single(energies);
+    std::vector<double> batch(energies);
+    double splineTime = Time([&]() {
+        for (long i = 0; i < nHits; ++i) {
+            spline[i] -= SplineEval(graphs[channels[i]], spline[i]);
+        }
+    });
+    double singleTime = Time([&]() {
+        for (long i = 0; i < nHits; ++i) {
+            single[i] = table.Correct(channels[i], single[i]);
+        }
+    });
+    double batchTime =
+        Time([&]() { table.Correct(channels.data(), batch.data(), nHits); });
+
+    // the table is exact except within one step of the graph points, where
+    // the sampled function has a kink
+    double maxDiff = 0.;
+    for (long i = 0; i < nHits; ++i) {
+        maxDiff = std::max(maxDiff, std::fabs(batch[i] - spline[i]));
+        if (single[i] != batch[i]) {
+            printf("mismatch between single and batch correction at hit %ld\n",
+                   i);
+            return 1;
+        }
+    }
+
+    printf("%ld hits, table step %.3f keV, %.1f MB of tables\n", nHits, step,
+           1e-6 * sizeof(float) * table.Entries());
+    printf("%12s %12s %12s\n", "method", "[ns/hit]", "speed-up");
+    printf("%12s %12.2f %12.2f\n", "spline", 1e9 * splineTime / nHits, 1.);
+    printf("%12s %12.2f %12.2f\n", "table", 1e9 * singleTime / nHits,
+           splineTime / singleTime);
+    printf("%12s %12.2f %12.2f\n", "batch", 1e9 * batchTime / nHits,
+           splineTime / batchTime);
+    printf("largest difference to the spline: %g keV\n", maxDiff);
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+#ifndef ResidualTable_h
+#define ResidualTable_h
+
+// Energy residual correction from precomputed lookup tables.
+//
+// kResidualCalculator stores the residuals of every crystal as a TGraph, and
+// the scripts used to load them into TGriffin as TMVA::TSpline1, so every
+// GetEnergy() did a binary search of the graph points and an interpolation.
+// A ResidualTable samples the same piecewise linear function once, at fixed
+// steps (0.1 keV by default) over the range of the graph, so a correction is
+// an index computation and one interpolation between neighbouring entries:
+//
+//     ResidualTable residuals;
+//     residuals.Build(arrayNumber, *graph);   // once per crystal
+//     ...
+//     tree->GetEntry(entry);
+//     ApplyResiduals(residuals, grif);        // before the energies are used
+//
+// Like the spline, the table extrapolates its first and last interval outside
+// the range of the graph, and the corrected energy is E - residual(E). The
+// time saved is the binary search; the table entries of each hit depend on its
+// channel and energy, so the loads are not vectorized. This header does not
+// depend on ROOT, see ResidualBench.cxx.
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+class ResidualTable {
+public:
+    // channels are the GRIFFIN array numbers, 1 to 64
+    static const int kMaxChannel = 64;
+
+    ResidualTable() { Clear(); }
+
+    void Clear() {
+        // channel 0 is a table of zeros, used for all channels without one
+        fValues.assign(2, 0.f);
+        fLow.assign(kMaxChannel + 1, 0.);
+        fInvStep.assign(kMaxChannel + 1, 1.);
+        fOffset.assign(kMaxChannel + 1, 0);
+        fLast.assign(kMaxChannel + 1, 0);
+        fChannels = 0;
+    }
+
+    // Samples the residuals of a channel from a graph (anything with GetN(),
+    // GetX() and GetY() like a TGraph) with the points in increasing x. Returns
+    // false if the channel is out of range or the graph has too few points.
+    template <typename Graph>
+    bool Build(int channel, const Graph &graph, double step = 0.1) {
+        int n = graph.GetN();
+        if (channel < 1 || channel > kMaxChannel || n < 2 || step <= 0.) {
+            return false;
+        }
+        const double *x = graph.GetX();
+        const double *y = graph.GetY();
+        double low = x[0];
+        int nSteps = std::max(1, (int)std::ceil((x[n - 1] - low) / step));
+        if (fOffset[channel] == 0) {
+            ++fChannels;
+        }
+        // a rebuilt channel leaves its old entries unused, which is fine for
+        // the few times this happens
+        fOffset[channel] = (int)fValues.size();
+        fLow[channel] = low;
+        fInvStep[channel] = 1. / step;
+        fLast[channel] = nSteps - 1;
+        for (int i = 0; i <= nSteps; ++i) {
+            fValues.push_back((float)Interpolate(n, x, y, low + i * step));
+        }
+        return true;
+    }
+
+    // number of channels with a table
+    int Channels() const { return fChannels; }
+    bool Empty() const { return fChannels == 0; }
+    // number of table entries of all channels
+    size_t Entries() const { return fValues.size(); }
+
+    double Residual(int channel, double energy) const {
+        channel = (channel < 1 || channel > kMaxChannel) ? 0 : channel;
+        double pos = (energy - fLow[channel]) * fInvStep[channel];
+        // clamped before the conversion, so huge energies do not overflow
+        int bin = (int)std::min(std::max(pos, 0.), (double)fLast[channel]);
+        double frac = pos - bin;
+        const float *value = &fValues[fOffset[channel] + bin];
+        return value[0] + frac * (value[1] - value[0]);
+    }
+
+    double Correct(int channel, double energy) const {
+        return energy - Residual(channel, energy);
+    }
+
+    // Corrects the energies of n hits in place, one after the other
+    void Correct(const int *channel, double *energy, size_t n) const {
+        for (size_t i = 0; i < n; ++i) {
+            energy[i] -= Residual(channel[i], energy[i]);
+        }
+    }
+
+private:
+    // Linear interpolation between the graph points, extrapolating the first
+    // and last interval, the same as TMVA::TSpline1::Eval
+    static double Interpolate(int n, const double *x, const double *y,
+                              double at) {
+        int bin = (int)(std::upper_bound(x, x + n, at) - x) - 1;
+        bin = std::min(std::max(bin, 0), n - 2);
+        return y[bin] + (at - x[bin]) * (y[bin + 1] - y[bin]) /
+                            (x[bin + 1] - x[bin]);
+    }
+
+    std::vector<float> fValues;
+    std::vector<double> fLow;
+    std::vector<double> fInvStep;
+    std::vector<int> fOffset;
+    std::vector<int> fLast;
+    int fChannels;
+};
+
+// Applies the residuals to all GRIFFIN hits of the current event. The hits keep
+// the corrected energy, so the addback hits built from them afterwards are
+// corrected as well. The residuals must not also be loaded into the TGriffin
+// with LoadEnergyResidual.
+template <typename Griffin>
+void ApplyResiduals(const ResidualTable &residuals, Griffin *grif) {
+    if (residuals.Empty()) {
+        return;
+    }
+    for (int i = 0; i < (int)grif->GetMultiplicity(); ++i) {
+        auto *hit = grif->GetGriffinHit(i);
+        hit->SetEnergy(
+            residuals.Correct(hit->GetArrayNumber(), hit->GetEnergy()));
+    }
+}
+
+#endif
@@ -0,0 +1,346 @@
+// g++ SortBench.cxx -std=c++11 -O2 -o SortBench
+//
+// Runs the sort programs on a synthetic run from kMakeSyntheticRun and reports
+// how fast they are, so their performance can be followed without beam data.
+// Every program runs in its own process in the work directory, with its output
+// in <step>.log there, and is timed from the outside:
+//
+//     generate            kMakeSyntheticRun -n <events> -l co60+sn129 ...
+//     LeanMatrices        kLeanMatrices analysis00001_000.root
+//     LeanMatrices -j     kLeanMatrices -j <threads> ... (with -j only)
+//     MakeCalMatrices     kMakeCalMatrices analysis00001_000.root
+//     MakeCTMatrices      MakeCTMatrices analysis00001_000.root
+//     CalibrationSort     kCalibrationSort analysis00001_000.root (both above)
+//     ResidualCalculator  kResidualCalculator analysis00001_000.root
+//     ResidualCalculator -j  kResidualCalculator -j <threads> ...
+//     ResidualCalculator cache  kResidualCalculator calhist00001_000.root
+//     Recalibrate         kRecalibrate [-j <threads>] -r recal_residuals.root
+//                             calhist00001_000.root
+//     MakeCalBundle       kMakeCalBundle -o calibration00001.calb ...
+//     LeanMatrices bundle kLeanMatrices analysis00001_000.root
+//                             calibration00001.calb
+//     MakeHitStore skim   kMakeHitStore -m 2 analysis00001_000.root
+//     LeanMatrices gg     kLeanMatrices -p gg.plan analysis00001_000.root
+//     LeanMatrices skim   kLeanMatrices -p gg.plan -s skim00001_000.hits ...
+//     GriffinCTFix        GriffinCTFix [-j <threads>] CrossTalk_histos.root ...
+//
+// For every step the wall and CPU time, the events per second and ns per hit
+// (of all GRIFFIN and SCEPTAR hits of the run) and the peak resident memory
+// are printed, and with -a appended to a history file as tab separated
+// columns. No ROOT is needed for this program itself:
+//
+//     ./SortBench [-n <events>] [-m <gamma multiplicity>] [-j <threads>]
+//                 [-w <work directory>] [-k] [-a <history file>]
+//                 <directory of the compiled programs>
+//
+// With -k the synthetic run of an earlier benchmark in the work directory is
+// used again if there is one.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+const int kRunNumber = 1;
+
+struct Step {
+    std::string name;
+    std::string program;
+    std::vector<std::string> args;
+};
+
+struct Result {
+    bool ran = false;
+    int status = -1;
+    double wall = 0.;
+    double cpu = 0.;
+    long peakRSS = 0; // kB
+};
+
+// Runs a program in the work directory with its output in the log file
+Result Run(const std::string &binDir, const std::string &workDir,
+           const Step &step) {
+    Result result;
+    std::string path = binDir + "/" + step.program;
+    if (access(path.c_str(), X_OK) != 0) {
+        printf("Program '%s' not found, skipping %s\n", path.c_str(),
+               step.name.c_str());
+        return result;
+    }
+    std::string log = step.name;
+    for (char &c : log) {
+        if (c == ' ') {
+            c = '_';
+        }
+    }
+    log += ".log";
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("Failed to start %s: %s\n", step.name.c_str(), strerror(errno));
+        return result;
+    }
+    if (pid == 0) {
+        if (chdir(workDir.c_str()) != 0) {
+            _exit(127);
+        }
+        int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        std::vector<char *> argv;
+        argv.push_back(const_cast<char *>(path.c_str()));
+        for (const std::string &arg : step.args) {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(path.c_str(), argv.data());
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        printf("Failed to wait for %s: %s\n", step.name.c_str(),
+               strerror(errno));
+        return result;
+    }
+    auto stop = std::chrono::steady_clock::now();
+    result.ran = true;
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    result.wall = std::chrono::duration<double>(stop - start).count();
+    result.cpu = usage.ru_utime.tv_sec + 1e-6 * usage.ru_utime.tv_usec +
+                 usage.ru_stime.tv_sec + 1e-6 * usage.ru_stime.tv_usec;
+    // in kB on Linux
+    result.peakRSS = usage.ru_maxrss;
+    return result;
+}
+
+// Reads the event and hit counts kMakeSyntheticRun writes with the run
+bool ReadCounts(const std::string &fileName, long &events, long &hits) {
+    FILE *file = fopen(fileName.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    events = 0;
+    hits = 0;
+    char key[64];
+    long value;
+    while (fscanf(file, "%63s %ld", key, &value) == 2) {
+        if (strcmp(key, "events") == 0) {
+            events = value;
+        } else if (strcmp(key, "gammas") == 0 || strcmp(key, "betas") == 0) {
+            hits += value;
+        }
+    }
+    fclose(file);
+    return events > 0;
+}
+
+// Writes the plan of the gamma-gamma sorts, only the matrices a skim of the
+// events with two or more gammas has everything for
+bool WritePlan(const std::string &fileName) {
+    FILE *file = fopen(fileName.c_str(), "w");
+    if (file == nullptr) {
+        printf("Failed to open file '%s'!\n", fileName.c_str());
+        return false;
+    }
+    fprintf(file,
+            "LeanMatrices.Histograms: ggmatrix ggmatrixt aamatrix aamatrixt\n");
+    return fclose(file) == 0;
+}
+
+int main(int argc, char **argv) {
+    long nEvents = 1000000;
+    const char *multiplicity = "2";
+    int nThreads = 1;
+    std::string workDir = "bench";
+    bool keep = false;
+    const char *historyFile = nullptr;
+    int nArgs = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            nEvents = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            multiplicity = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            workDir = argv[++i];
+        } else if (strcmp(argv[i], "-k") == 0) {
+            keep = true;
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            historyFile = argv[++i];
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
+    if (argc != 2 || nEvents <= 0) {
+        printf("try again (usage: %s [-n <events>] [-m <gamma multiplicity>] "
+               "[-j <threads>] [-w <work directory>] [-k] "
+               "[-a <history file>] <directory of the compiled programs>).\n",
+               argv[0]);
+        return 0;
+    }
+    // the programs run in the work directory
+    char *binPath = realpath(argv[1], nullptr);
+    if (binPath == nullptr) {
+        printf("Failed to find directory '%s'!\n", argv[1]);
+        return 1;
+    }
+    std::string binDir = binPath;
+    free(binPath);
+    if (mkdir(workDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        printf("Failed to create work directory '%s'!\n", workDir.c_str());
+        return 1;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "analysis%05d_000.root", kRunNumber);
+    std::string input = name;
+    snprintf(name, sizeof(name), "synthetic%05d.cal", kRunNumber);
+    std::string calFile = name;
+    snprintf(name, sizeof(name), "calhist%05d_000.root", kRunNumber);
+    std::string calHist = name;
+    snprintf(name, sizeof(name), "calhist%05d_000.cal", kRunNumber);
+    std::string recalFile = name;
+    snprintf(name, sizeof(name), "calibration%05d.calb", kRunNumber);
+    std::string bundle = name;
+    snprintf(name, sizeof(name), "skim%05d_000.hits", kRunNumber);
+    std::string skim = name;
+    snprintf(name, sizeof(name), "synthetic%05d.txt", kRunNumber);
+    std::string countFile = workDir + "/" + name;
+
+    std::vector<Step> steps;
+    long events = 0;
+    long hits = 0;
+    if (!keep || !ReadCounts(countFile, events, hits)) {
+        steps.push_back({"generate",
+                         "kMakeSyntheticRun",
+                         {"-n", std::to_string(nEvents), "-m", multiplicity,
+                          "-r", std::to_string(kRunNumber), "-l",
+                          "co60+sn129", "."}});
+    }
+    steps.push_back({"LeanMatrices", "kLeanMatrices", {input}});
+    if (nThreads > 1) {
+        steps.push_back({"LeanMatrices -j",
+                         "kLeanMatrices",
+                         {"-j", std::to_string(nThreads), input}});
+    }
+    steps.push_back({"MakeCalMatrices", "kMakeCalMatrices", {input}});
+    steps.push_back({"MakeCTMatrices", "MakeCTMatrices", {input}});
+    // the two above and the CrossTalk selector in one pass
+    steps.push_back({"CalibrationSort", "kCalibrationSort", {input}});
+    steps.push_back({"ResidualCalculator", "kResidualCalculator", {input}});
+    if (nThreads > 1) {
+        steps.push_back({"ResidualCalculator -j",
+                         "kResidualCalculator",
+                         {"-j", std::to_string(nThreads), input}});
+    }
+    // from the spectra kMakeCalMatrices wrote, without reading the tree
+    steps.push_back(
+        {"ResidualCalculator cache", "kResidualCalculator", {calHist}});
+    // kResidualCalculator wrote residuals.root already
+    std::string recalResiduals = "recal_residuals.root";
+    steps.push_back({"Recalibrate",
+                     "kRecalibrate",
+                     {"-j", std::to_string(nThreads), "-r", recalResiduals,
+                      calHist}});
+    // the calibration of the tree with the gain match and residuals of
+    // kRecalibrate on top, and a sort with it
+    steps.push_back({"MakeCalBundle",
+                     "kMakeCalBundle",
+                     {"-o", bundle, input, recalFile, recalResiduals}});
+    steps.push_back({"LeanMatrices bundle", "kLeanMatrices", {input, bundle}});
+    // the gamma-gamma matrices from all entries and from a skim of the events
+    // with two or more gammas
+    std::string planFile = "gg.plan";
+    if (!WritePlan(workDir + "/" + planFile)) {
+        return 1;
+    }
+    steps.push_back({"MakeHitStore skim", "kMakeHitStore", {"-m", "2", input}});
+    steps.push_back(
+        {"LeanMatrices gg", "kLeanMatrices", {"-p", planFile, input}});
+    steps.push_back({"LeanMatrices skim",
+                     "kLeanMatrices",
+                     {"-p", planFile, "-s", skim, input}});
+    steps.push_back({"GriffinCTFix",
+                     "GriffinCTFix",
+                     {"-j", std::to_string(nThreads), "CrossTalk_histos.root",
+                      calFile}});
+
+    FILE *history = nullptr;
+    if (historyFile != nullptr) {
+        history = fopen(historyFile, "a");
+        if (history == nullptr) {
+            printf("Failed to open history file '%s'!\n", historyFile);
+            return 1;
+        }
+    }
+    char date[32];
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    std::vector<Result> results;
+    for (const Step &step : steps) {
+        printf("Running %s ...\n", step.name.c_str());
+        fflush(stdout);
+        results.push_back(Run(binDir, workDir, step));
+        if (step.name == "generate" &&
+            !ReadCounts(countFile, events, hits)) {
+            printf("The synthetic run was not written, see %s/generate.log\n",
+                   workDir.c_str());
+            return 1;
+        }
+    }
+
+    printf("\n%ld events, %ld hits\n", events, hits);
+    printf("%-24s %6s %10s %10s %12s %10s %12s\n", "step", "status",
+           "wall [s]", "cpu [s]", "events/s", "[ns/hit]", "peak RSS [MB]");
+    int failed = 0;
+    for (size_t i = 0; i < steps.size(); ++i) {
+        const Result &result = results[i];
+        if (!result.ran) {
+            printf("%-24s %6s\n", steps[i].name.c_str(), "-");
+            continue;
+        }
+        if (result.status != 0) {
+            ++failed;
+        }
+        double rate = (result.wall > 0.) ? events / result.wall : 0.;
+        double perHit = (hits > 0) ? 1e9 * result.wall / hits : 0.;
+        printf("%-24s %6d %10.2f %10.2f %12.0f %10.1f %12.1f\n",
+               steps[i].name.c_str(), result.status, result.wall, result.cpu,
+               rate, perHit, result.peakRSS / 1024.);
+        if (history != nullptr) {
+            fprintf(history, "%s\t%s\t%d\t%ld\t%ld\t%.3f\t%.3f\t%.0f\t%.2f\t"
+                             "%.1f\n",
+                    date, steps[i].name.c_str(), result.status, events, hits,
+                    result.wall, result.cpu, rate, perHit,
+                    result.peakRSS / 1024.);
+        }
+    }
+    if (history != nullptr) {
+        fclose(history);
+    }
+    if (failed > 0) {
+        printf("%d steps failed, see the logs in %s\n", failed,
+               workDir.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+#ifndef SortCache_h
+#define SortCache_h
+
+// Fingerprints for a cache of sorted subruns.
+//
+// A sort of a run does not have to sort a subrun again if neither the subrun
+// nor anything else the result depends on (calibration, residuals, windows)
+// changed since the last time. Fingerprint hashes all of these into one key,
+// and SortCache keeps the content hashes of the input files, so the big
+// analysis tree files are only read again when their size or modification
+// time changes:
+//
+//     SortCache cache("cache");
+//     Fingerprint key;
+//     key.Add(cache.ContentHash("runs_data/analysis04921_003.root"));
+//     key.AddFile("windows.plan");
+//     ... compare key.Hex() with the key stored with the cached result ...
+//
+// This header does not depend on ROOT.
+
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+// 64 bit FNV-1a of everything added, good enough to notice any change of the
+// input, but not meant to withstand deliberate collisions
+class Fingerprint {
+public:
+    void Add(const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            fHash = (fHash ^ bytes[i]) * 0x100000001b3ULL;
+        }
+    }
+    void Add(const std::string &text) {
+        Add(text.data(), text.size());
+        // so that "ab" + "c" differs from "a" + "bc"
+        Add(static_cast<uint64_t>(text.size()));
+    }
+    void Add(uint64_t value) { Add(&value, sizeof(value)); }
+    void Add(double value) { Add(&value, sizeof(value)); }
+
+    // Adds the contents of a file, false if it can not be read
+    bool AddFile(const std::string &path) {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        std::vector<char> buffer(1 << 20);
+        size_t size;
+        uint64_t total = 0;
+        while ((size = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+            Add(buffer.data(), size);
+            total += size;
+        }
+        bool good = (ferror(file) == 0);
+        fclose(file);
+        Add(total);
+        return good;
+    }
+
+    uint64_t Value() const { return fHash; }
+    std::string Hex() const {
+        char text[17];
+        snprintf(text, sizeof(text), "%016" PRIx64, fHash);
+        return text;
+    }
+
+private:
+    uint64_t fHash = 0xcbf29ce484222325ULL;
+};
+
+// A directory with the cached results of a sort, the sort program decides
+// what goes in there
+class SortCache {
+public:
+    explicit SortCache(const std::string &dir) : fDir(dir) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            printf("Failed to create cache directory '%s'!\n", dir.c_str());
+            return;
+        }
+        fGood = true;
+    }
+
+    bool IsGood() const { return fGood; }
+    std::string Path(const std::string &name) const {
+        return fDir + "/" + name;
+    }
+
+    // Hash of the contents of a file. The hash is remembered in the cache
+    // together with the size and modification time of the file, and only
+    // computed again if one of them changed. The memo is kept per full path,
+    // so files with the same name in different directories (e.g. the subruns
+    // of two data directories) don't share it. Returns 0 if the file can not
+    // be read.
+    uint64_t ContentHash(const std::string &path) {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) {
+            return 0;
+        }
+        uint64_t size = info.st_size;
+        uint64_t time = info.st_mtime;
+        std::string memo = Path(MemoName(path));
+        if (FILE *file = fopen(memo.c_str(), "r")) {
+            uint64_t memoSize;
+            uint64_t memoTime;
+            uint64_t hash;
+            int n = fscanf(file, "%" SCNu64 " %" SCNu64 " %" SCNx64, &memoSize,
+                           &memoTime, &hash);
+            fclose(file);
+            if (n == 3 && memoSize == size && memoTime == time) {
+                return hash;
+            }
+        }
+        Fingerprint content;
+        if (!content.AddFile(path)) {
+            return 0;
+        }
+        if (FILE *file = fopen(memo.c_str(), "w")) {
+            fprintf(file, "%" PRIu64 " %" PRIu64 " %s\n", size, time,
+                    content.Hex().c_str());
+            fclose(file);
+        }
+        return content.Value();
+    }
+
+private:
+    static std::string BaseName(const std::string &path) {
+        size_t slash = path.find_last_of('/');
+        return (slash == std::string::npos) ? path : path.substr(slash + 1);
+    }
+
+    // The name of the file stays readable, the hash of the absolute path
+    // tells the directories apart
+    static std::string MemoName(const std::string &path) {
+        char absolute[PATH_MAX];
+        Fingerprint fullPath;
+        if (realpath(path.c_str(), absolute) != nullptr) {
+            fullPath.Add(std::string(absolute));
+        } else {
+            fullPath.Add(path);
+        }
+        return BaseName(path) + "." + fullPath.Hex() + ".hash";
+    }
+
+    std::string fDir;
+    bool fGood = false;
+};
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef SortStats_h
+#define SortStats_h
+
+// Stage timers and counters of a sort.
+//
+// A slow sort can be slow because of reading (and decompressing) the tree,
+// because of the calibration, the coincidence search or the histogram fills.
+// SortStats adds up the time spent in each stage and counts the hits and
+// pairs, and writes it all as a JSON report at the end. The timers are a
+// steady clock read between two stages, cheap enough to stay on all the time:
+//
+//     SortStats stats;
+//     StageClock clock;
+//     for (...) {
+//         tree->GetEntry(entry);
+//         clock.Lap(stats, SortStats::kRead);
+//         ... calibrate ...
+//         clock.Lap(stats, SortStats::kCalibrate);
+//     }
+//     stats.WriteJSON("matrix04921_000.stats.json", "kLeanMatrices", ...);
+//
+// Every sorting thread keeps its own SortStats, and they are added together
+// at the end, so the stage times are summed over the threads. This header
+// does not depend on ROOT.
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class SortStats {
+public:
+    enum EStage {
+        kRead,        // GetEntry, reading and decompressing the baskets
+        kCalibrate,   // residuals and the calibrated hits
+        kCoincidence, // time order, pairs and beta tags
+        kFill,        // histogram fills
+        kBackground,  // time-random background subtraction
+        kWrite,       // output files
+        kNStages
+    };
+    enum ECounter {
+        kEntries,
+        kGammaHits,
+        kAddbackHits,
+        kBetaHits,
+        kPileupHits, // hits with a k-value other than the nominal one
+        kPileupRejected,
+        kPairsTested, // pairs within the reach of a time window
+        kNCounters
+    };
+    enum EWindow {
+        kGGPrompt,
+        kGGRandom,
+        kGBPrompt,
+        kGBRandom,
+        kAAPrompt,
+        kAARandom,
+        kABPrompt,
+        kABRandom,
+        kNWindows
+    };
+
+    // The pairs accepted by the windows are counted for each variant of the
+    // sort, the names are used in the report
+    void SetVariants(const std::vector<std::string> &names) {
+        fVariants = names;
+        fWindows.assign(names.size(), WindowCounts());
+        for (WindowCounts &counts : fWindows) {
+            counts.fill(0);
+        }
+    }
+
+    void Add(ECounter counter, long n = 1) { fCounters[counter] += n; }
+    void Accept(size_t variant, EWindow window) {
+        ++fWindows[variant][window];
+    }
+    void AddTime(EStage stage, double seconds) { fTime[stage] += seconds; }
+
+    long Counter(ECounter counter) const { return fCounters[counter]; }
+    double Time(EStage stage) const { return fTime[stage]; }
+
+    // Adds the stats of another thread, with the same variants (or none yet)
+    void Add(const SortStats &other) {
+        for (int i = 0; i < kNStages; ++i) {
+            fTime[i] += other.fTime[i];
+        }
+        for (int i = 0; i < kNCounters; ++i) {
+            fCounters[i] += other.fCounters[i];
+        }
+        if (fWindows.empty()) {
+            fVariants = other.fVariants;
+            fWindows = other.fWindows;
+            return;
+        }
+        for (size_t v = 0; v < fWindows.size() && v < other.fWindows.size();
+             ++v) {
+            for (int i = 0; i < kNWindows; ++i) {
+                fWindows[v][i] += other.fWindows[v][i];
+            }
+        }
+    }
+
+    // The stage that took longest
+    EStage Slowest() const {
+        int slowest = 0;
+        for (int i = 1; i < kNStages; ++i) {
+            if (fTime[i] > fTime[slowest]) {
+                slowest = i;
+            }
+        }
+        return (EStage)slowest;
+    }
+
+    void Print() const {
+        double total = 0.;
+        for (int i = 0; i < kNStages; ++i) {
+            total += fTime[i];
+        }
+        printf("%-12s %10s %8s\n", "stage", "time [s]", "share");
+        for (int i = 0; i < kNStages; ++i) {
+            printf("%-12s %10.2f %7.1f%%\n", StageName(i), fTime[i],
+                   (total > 0.) ? 100. * fTime[i] / total : 0.);
+        }
+        for (int i = 0; i < kNCounters; ++i) {
+            printf("%-16s %ld\n", CounterName(i), fCounters[i]);
+        }
+    }
+
+    // Writes the report, wallTime is the real time of the whole program.
+    // Returns false if the file can not be written.
+    bool WriteJSON(const std::string &fileName, const std::string &program,
+                   const std::string &input, int nThreads,
+                   double wallTime) const {
+        std::string tmpName = fileName + ".tmp";
+        FILE *file = fopen(tmpName.c_str(), "w");
+        if (file == nullptr) {
+            printf("Failed to open file '%s'!\n", tmpName.c_str());
+            return false;
+        }
+        double total = 0.;
+        for (int i = 0; i < kNStages; ++i) {
+            total += fTime[i];
+        }
+        fprintf(file, "{\n");
+        fprintf(file, "  \"program\": \"%s\",\n", Escape(program).c_str());
+        fprintf(file, "  \"input\": \"%s\",\n", Escape(input).c_str());
+        fprintf(file, "  \"threads\": %d,\n", nThreads);
+        fprintf(file, "  \"wallTime\": %.6f,\n", wallTime);
+        fprintf(file, "  \"slowestStage\": \"%s\",\n", StageName(Slowest()));
+        fprintf(file, "  \"stages\": {\n");
+        for (int i = 0; i < kNStages; ++i) {
+            fprintf(file,
+                    "    \"%s\": {\"seconds\": %.6f, \"share\": %.4f}%s\n",
+                    StageName(i), fTime[i],
+                    (total > 0.) ? fTime[i] / total : 0.,
+                    (i + 1 < kNStages) ? "," : "");
+        }
+        fprintf(file, "  },\n");
+        fprintf(file, "  \"counters\": {\n");
+        for (int i = 0; i < kNCounters; ++i) {
+            fprintf(file, "    \"%s\": %ld%s\n", CounterName(i), fCounters[i],
+                    (i + 1 < kNCounters) ? "," : "");
+        }
+        fprintf(file, "  },\n");
+        fprintf(file, "  \"pairsAccepted\": {\n");
+        for (size_t v = 0; v < fWindows.size(); ++v) {
+            fprintf(file, "    \"%s\": {",
+                    fVariants[v].empty() ? "default"
+                                         : Escape(fVariants[v]).c_str());
+            for (int i = 0; i < kNWindows; ++i) {
+                fprintf(file, "%s\"%s\": %ld", (i > 0) ? ", " : "",
+                        WindowName(i), fWindows[v][i]);
+            }
+            fprintf(file, "}%s\n", (v + 1 < fWindows.size()) ? "," : "");
+        }
+        fprintf(file, "  }\n");
+        fprintf(file, "}\n");
+        bool good = (ferror(file) == 0);
+        good &= (fclose(file) == 0);
+        if (!good || rename(tmpName.c_str(), fileName.c_str()) != 0) {
+            printf("Failed to write file '%s'!\n", fileName.c_str());
+            remove(tmpName.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static const char *StageName(int stage) {
+        static const char *names[kNStages] = {
+            "read", "calibrate", "coincidence", "fill", "background", "write"};
+        return names[stage];
+    }
+    static const char *CounterName(int counter) {
+        static const char *names[kNCounters] = {
+            "entries",    "gammaHits",      "addbackHits", "betaHits",
+            "pileupHits", "pileupRejected", "pairsTested"};
+        return names[counter];
+    }
+    static const char *WindowName(int window) {
+        static const char *names[kNWindows] = {
+            "ggPrompt", "ggRandom", "gbPrompt", "gbRandom",
+            "aaPrompt", "aaRandom", "abPrompt", "abRandom"};
+        return names[window];
+    }
+
+private:
+    typedef std::array<long, kNWindows> WindowCounts;
+
+    static std::string Escape(const std::string &text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    double fTime[kNStages] = {};
+    long fCounters[kNCounters] = {};
+    std::vector<std::string> fVariants;
+    std::vector<WindowCounts> fWindows;
+};
+
+// Splits the time of a thread into stages: every Lap adds the time since the
+// last one (or since the clock was started) to a stage
+class StageClock {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    StageClock() : fLast(Clock::now()) {}
+
+    void Start() { fLast = Clock::now(); }
+    void Lap(SortStats &stats, SortStats::EStage stage) {
+        Clock::time_point now = Clock::now();
+        std::chrono::duration<double> seconds = now - fLast;
+        stats.AddTime(stage, seconds.count());
+        fLast = now;
+    }
+
+private:
+    Clock::time_point fLast;
+};
+
+// The report goes next to the output file, with .root replaced by .stats.json
+inline std::string StatsFileName(const std::string &outName) {
+    std::string name = outName;
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".root") == 0) {
+        name.resize(name.size() - 5);
+    }
+    return name + ".stats.json";
+}
+
+#endif
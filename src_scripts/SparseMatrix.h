@@ -0,0 +1,514 @@
+#ifndef SparseMatrix_h
+#define SparseMatrix_h
+
+// Block-sparse 2D histogram used for the big coincidence matrices.
+//
+// A dense 10000x10000 TH2D is ~800 MB, but most of the bins of a gamma-gamma
+// matrix never get a count. SparseMatrix splits the bin grid into 64x64 tiles
+// and only allocates the tiles that are actually filled. It behaves like a
+// TH2 for filling, adding and scaling, and turns into a normal TH2D/TH2F only
+// when it is written or when a projection is asked for.
+//
+// The binning (including the under- and overflow bins) is the same as for a
+// TH2 with the same axis parameters, so the written matrix is a drop-in
+// replacement for the dense one. The bin contents of a 'D' matrix are kept as
+// doubles, those of an 'F' matrix as floats (exact counts up to 2^24 per
+// bin), like in the TH2 it is written as.
+//
+// As long as every fill has weight 1 the error of a bin is the square root
+// of its content. The first fill with another weight, Scale or Add with a
+// factor (e.g. a background subtraction) starts keeping the sum of the
+// squared weights in a double tile next to each content tile, like
+// TH1::Sumw2, and the written TH2 gets these errors.
+//
+// SymmetricMatrix is the folded version for gamma-gamma matrices: it only
+// stores the triangle binx <= biny and a single fill stands for both (x, y)
+// and (y, x), so each pair of gammas needs to be filled only once.
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "TDirectory.h"
+#include "TH1D.h"
+#include "TH2D.h"
+#include "TH2F.h"
+#include "TNamed.h"
+#include "TVectorD.h"
+#include "TVectorF.h"
+
+class SparseMatrix : public TNamed {
+public:
+    static const int kTileBits = 6;
+    static const int kTileSize = 1 << kTileBits; // 64x64 bins per tile
+
+    // type is the TH2 flavour this matrix is written out as, 'D' or 'F'
+    SparseMatrix(const char *name, const char *title, int nbinsx, double xlow,
+                 double xup, int nbinsy, double ylow, double yup,
+                 char type = 'D')
+        : TNamed(name, title), fNbinsX(nbinsx), fXlow(xlow), fXup(xup),
+          fNbinsY(nbinsy), fYlow(ylow), fYup(yup), fType(type) {
+        // +2 for the under- and overflow bins
+        fNTilesX = (fNbinsX + 2 + kTileSize - 1) / kTileSize;
+    }
+    // The copy has its own tiles, so the tile remembered for filling is not
+    // copied
+    SparseMatrix(const SparseMatrix &other)
+        : TNamed(other), fSymmetric(other.fSymmetric), fNbinsX(other.fNbinsX),
+          fXlow(other.fXlow), fXup(other.fXup), fNbinsY(other.fNbinsY),
+          fYlow(other.fYlow), fYup(other.fYup), fType(other.fType),
+          fNTilesX(other.fNTilesX), fSumw2(other.fSumw2),
+          fTiles(other.fTiles), fEntries(other.fEntries) {}
+    SparseMatrix &operator=(const SparseMatrix &) = delete;
+    ~SparseMatrix() override {}
+
+    int GetNbinsX() const { return fNbinsX; }
+    int GetNbinsY() const { return fNbinsY; }
+    double GetEntries() const { return fEntries; }
+    size_t GetNTiles() const { return fTiles.size(); }
+    // Whether the sums of the squared weights are kept
+    bool HasSumw2() const { return fSumw2; }
+    // Memory used by the bin contents (and their errors) in bytes
+    size_t GetMemoryUsage() const {
+        size_t bin = (fType == 'F') ? sizeof(Float_t) : sizeof(double);
+        if (fSumw2) {
+            bin += sizeof(double);
+        }
+        return fTiles.size() * kTileSize * kTileSize * bin;
+    }
+
+    // Same bin numbering as TAxis::FindBin, 0 is underflow, n+1 overflow
+    int FindBinX(double x) const { return FindBin(x, fNbinsX, fXlow, fXup); }
+    int FindBinY(double y) const { return FindBin(y, fNbinsY, fYlow, fYup); }
+
+    // For a symmetric matrix this fills both (x, y) and (y, x)
+    void Fill(double x, double y, double w = 1.) {
+        if (std::isnan(x) || std::isnan(y)) {
+            return;
+        }
+        AddBinContent(FindBinX(x), FindBinY(y), w);
+        fEntries += fSymmetric ? 2. : 1.;
+    }
+
+    // Adds w to the bin and, if they are kept, w^2 to its sum of squared
+    // weights
+    void AddBinContent(int binx, int biny, double w) {
+        if (fSymmetric && binx > biny) {
+            std::swap(binx, biny);
+        }
+        if (w != 1. && !fSumw2) {
+            Sumw2();
+        }
+        Tile &tile = GetTile(binx, biny);
+        int offset = TileOffset(binx, biny);
+        if (fType == 'F') {
+            tile.floats[offset] += w;
+        } else {
+            tile.doubles[offset] += w;
+        }
+        if (fSumw2) {
+            tile.sumw2[offset] += w * w;
+        }
+    }
+
+    // Starts keeping the sums of the squared weights. Up to now every fill
+    // had weight 1, so they are the contents themselves.
+    void Sumw2() {
+        if (fSumw2) {
+            return;
+        }
+        for (auto &tile : fTiles) {
+            tile.second.sumw2.resize(kTileSize * kTileSize);
+            for (int i = 0; i < kTileSize * kTileSize; ++i) {
+                tile.second.sumw2[i] = Content(tile.second, i);
+            }
+        }
+        fSumw2 = true;
+    }
+
+    // Content of the (unfolded) bin
+    double GetBinContent(int binx, int biny) const {
+        if (fSymmetric && binx > biny) {
+            std::swap(binx, biny);
+        }
+        auto it = fTiles.find(TileKey(binx, biny));
+        if (it == fTiles.end()) {
+            return 0.;
+        }
+        double content = Content(it->second, TileOffset(binx, biny));
+        // a fill on the diagonal ends up in the same bin twice
+        if (fSymmetric && binx == biny) {
+            content *= 2.;
+        }
+        return content;
+    }
+
+    // Error of the (unfolded) bin
+    double GetBinError(int binx, int biny) const {
+        if (fSymmetric && binx > biny) {
+            std::swap(binx, biny);
+        }
+        auto it = fTiles.find(TileKey(binx, biny));
+        if (it == fTiles.end()) {
+            return 0.;
+        }
+        double sumw2 = SumOfWeights2(it->second, TileOffset(binx, biny));
+        if (fSymmetric && binx == biny) {
+            sumw2 *= 2.;
+        }
+        return std::sqrt(sumw2);
+    }
+
+    // this += c*other, both matrices need the same binning
+    void Add(const SparseMatrix *other, double c = 1.) {
+        if ((c != 1. || other->fSumw2) && !fSumw2) {
+            Sumw2();
+        }
+        for (const auto &tile : other->fTiles) {
+            Tile &mine = fTiles[tile.first];
+            if (mine.Empty()) {
+                Allocate(mine);
+            }
+            for (int i = 0; i < kTileSize * kTileSize; ++i) {
+                AddContent(mine, i, c * other->Content(tile.second, i));
+            }
+            if (fSumw2) {
+                for (int i = 0; i < kTileSize * kTileSize; ++i) {
+                    mine.sumw2[i] +=
+                        c * c * other->SumOfWeights2(tile.second, i);
+                }
+            }
+        }
+        fEntries += other->fEntries;
+        fLastKey = -1;
+    }
+
+    void Scale(double c) {
+        if (c != 1. && !fSumw2) {
+            Sumw2();
+        }
+        for (auto &tile : fTiles) {
+            for (auto &bin : tile.second.floats) {
+                bin *= c;
+            }
+            for (auto &bin : tile.second.doubles) {
+                bin *= c;
+            }
+            for (auto &bin : tile.second.sumw2) {
+                bin *= c * c;
+            }
+        }
+    }
+
+    void Reset() {
+        fTiles.clear();
+        fSumw2 = false;
+        fEntries = 0.;
+        fLastKey = -1;
+    }
+
+    // Creates a dense TH2 with the contents of this matrix, the caller owns it
+    TH2 *MakeTH2(const char *name = nullptr) const {
+        if (name == nullptr) {
+            name = GetName();
+        }
+        TH2 *hist;
+        if (fType == 'F') {
+            hist = new TH2F(name, GetTitle(), fNbinsX, fXlow, fXup, fNbinsY,
+                            fYlow, fYup);
+        } else {
+            hist = new TH2D(name, GetTitle(), fNbinsX, fXlow, fXup, fNbinsY,
+                            fYlow, fYup);
+        }
+        hist->SetDirectory(nullptr);
+        if (fSumw2) {
+            hist->Sumw2();
+        }
+        bool sumw2 = fSumw2;
+        ForEachBin([hist, sumw2](int binx, int biny, double content,
+                                 double sumOfWeights2) {
+            int bin = hist->GetBin(binx, biny);
+            // a bin on the diagonal of a symmetric matrix comes twice
+            double error = hist->GetBinError(bin);
+            hist->AddBinContent(bin, content);
+            if (sumw2) {
+                hist->SetBinError(
+                    bin, std::sqrt(error * error + sumOfWeights2));
+            }
+        });
+        hist->ResetStats();
+        hist->SetEntries(fEntries);
+        return hist;
+    }
+
+    // Projection onto the x axis of the y bins [firstybin, lastybin]
+    TH1D *ProjectionX(const char *name, int firstybin = 0,
+                      int lastybin = -1) const {
+        if (lastybin < 0) {
+            lastybin = fNbinsY + 1;
+        }
+        auto *proj = new TH1D(name, GetTitle(), fNbinsX, fXlow, fXup);
+        proj->SetDirectory(nullptr);
+        if (fSumw2) {
+            proj->Sumw2();
+        }
+        bool sumw2 = fSumw2;
+        ForEachBin([=](int binx, int biny, double content,
+                       double sumOfWeights2) {
+            if (firstybin <= biny && biny <= lastybin) {
+                double error = proj->GetBinError(binx);
+                proj->AddBinContent(binx, content);
+                if (sumw2) {
+                    proj->SetBinError(
+                        binx, std::sqrt(error * error + sumOfWeights2));
+                }
+            }
+        });
+        proj->ResetStats();
+        return proj;
+    }
+
+    // Projection onto the y axis of the x bins [firstxbin, lastxbin]
+    TH1D *ProjectionY(const char *name, int firstxbin = 0,
+                      int lastxbin = -1) const {
+        if (lastxbin < 0) {
+            lastxbin = fNbinsX + 1;
+        }
+        auto *proj = new TH1D(name, GetTitle(), fNbinsY, fYlow, fYup);
+        proj->SetDirectory(nullptr);
+        if (fSumw2) {
+            proj->Sumw2();
+        }
+        bool sumw2 = fSumw2;
+        ForEachBin([=](int binx, int biny, double content,
+                       double sumOfWeights2) {
+            if (firstxbin <= binx && binx <= lastxbin) {
+                double error = proj->GetBinError(biny);
+                proj->AddBinContent(biny, content);
+                if (sumw2) {
+                    proj->SetBinError(
+                        biny, std::sqrt(error * error + sumOfWeights2));
+                }
+            }
+        });
+        proj->ResetStats();
+        return proj;
+    }
+
+    // Writes the tiles themselves instead of the dense TH2, as name_keys
+    // (the tile numbers and the number of entries), name_tiles and, if they
+    // are kept, name_sumw2, e.g. to keep partial results of a sort. AddTiles
+    // adds them back.
+    void WriteTiles(TDirectory *dir, const char *name) const {
+        TVectorD keys(fTiles.size() + 1);
+        int size = fTiles.size() * kTileSize * kTileSize;
+        TVectorD contents(std::max(1, size)); // never empty
+        TVectorD sumw2(fSumw2 ? std::max(1, size) : 1);
+        int i = 0;
+        for (const auto &tile : fTiles) {
+            keys[i] = tile.first;
+            int first = i * kTileSize * kTileSize;
+            for (int j = 0; j < kTileSize * kTileSize; ++j) {
+                contents[first + j] = Content(tile.second, j);
+            }
+            if (fSumw2) {
+                std::copy(tile.second.sumw2.begin(), tile.second.sumw2.end(),
+                          sumw2.GetMatrixArray() + first);
+            }
+            ++i;
+        }
+        keys[i] = fEntries;
+        dir->WriteTObject(&keys, Form("%s_keys", name));
+        dir->WriteTObject(&contents, Form("%s_tiles", name));
+        if (fSumw2) {
+            dir->WriteTObject(&sumw2, Form("%s_sumw2", name));
+        }
+    }
+
+    // Adds the tiles written by WriteTiles, which have to come from a matrix
+    // with the same binning. Returns false if they are not in the directory.
+    bool AddTiles(TDirectory *dir, const char *name) {
+        TVectorD *keys = nullptr;
+        TVectorD *contents = nullptr;
+        TVectorD *sumw2 = nullptr;
+        dir->GetObject(Form("%s_keys", name), keys);
+        dir->GetObject(Form("%s_tiles", name), contents);
+        dir->GetObject(Form("%s_sumw2", name), sumw2);
+        bool good = (keys != nullptr && contents != nullptr &&
+                     keys->GetNrows() >= 1 &&
+                     contents->GetNrows() >=
+                         (keys->GetNrows() - 1) * kTileSize * kTileSize &&
+                     (sumw2 == nullptr ||
+                      sumw2->GetNrows() >= contents->GetNrows()));
+        if (good) {
+            if (sumw2 != nullptr && !fSumw2) {
+                Sumw2();
+            }
+            int nTiles = keys->GetNrows() - 1;
+            for (int i = 0; i < nTiles; ++i) {
+                Tile &mine = fTiles[static_cast<int>((*keys)[i])];
+                if (mine.Empty()) {
+                    Allocate(mine);
+                }
+                int first = i * kTileSize * kTileSize;
+                for (int j = 0; j < kTileSize * kTileSize; ++j) {
+                    double content = (*contents)[first + j];
+                    AddContent(mine, j, content);
+                    if (fSumw2) {
+                        // without sums of squared weights every fill had
+                        // weight 1
+                        mine.sumw2[j] += (sumw2 != nullptr)
+                                             ? (*sumw2)[first + j]
+                                             : content;
+                    }
+                }
+            }
+            fEntries += (*keys)[nTiles];
+            fLastKey = -1;
+        }
+        delete keys;
+        delete contents;
+        delete sumw2;
+        return good;
+    }
+
+    // Writing the matrix writes the dense TH2, which only exists for the
+    // duration of this call
+    int Write(const char *name = nullptr, int option = 0,
+              int bufsize = 0) const override {
+        TH2 *hist = MakeTH2();
+        int nbytes = hist->Write(name, option, bufsize);
+        delete hist;
+        return nbytes;
+    }
+    int Write(const char *name = nullptr, int option = 0,
+              int bufsize = 0) override {
+        return const_cast<const SparseMatrix *>(this)->Write(name, option,
+                                                            bufsize);
+    }
+
+protected:
+    bool fSymmetric = false;
+
+private:
+    // The contents of a tile are in floats or doubles, depending on the type
+    // of the matrix, the sums of the squared weights only if they are kept
+    struct Tile {
+        std::vector<Float_t> floats;
+        std::vector<double> doubles;
+        std::vector<double> sumw2;
+
+        bool Empty() const { return floats.empty() && doubles.empty(); }
+    };
+
+    void Allocate(Tile &tile) const {
+        if (fType == 'F') {
+            tile.floats.assign(kTileSize * kTileSize, 0.);
+        } else {
+            tile.doubles.assign(kTileSize * kTileSize, 0.);
+        }
+        if (fSumw2) {
+            tile.sumw2.assign(kTileSize * kTileSize, 0.);
+        }
+    }
+    double Content(const Tile &tile, int i) const {
+        return (fType == 'F') ? tile.floats[i] : tile.doubles[i];
+    }
+    void AddContent(Tile &tile, int i, double w) const {
+        if (fType == 'F') {
+            tile.floats[i] += w;
+        } else {
+            tile.doubles[i] += w;
+        }
+    }
+    double SumOfWeights2(const Tile &tile, int i) const {
+        return fSumw2 ? tile.sumw2[i] : Content(tile, i);
+    }
+
+    // Calls f(binx, biny, content, sumw2) for every non-empty bin of the
+    // unfolded matrix. For a symmetric matrix a stored bin on the diagonal is
+    // visited twice, as it holds both (x, y) and (y, x).
+    template <typename F> void ForEachBin(F f) const {
+        for (const auto &tile : fTiles) {
+            int binx0 = (tile.first % fNTilesX) * kTileSize;
+            int biny0 = (tile.first / fNTilesX) * kTileSize;
+            for (int j = 0; j < kTileSize; ++j) {
+                for (int i = 0; i < kTileSize; ++i) {
+                    int bin = j * kTileSize + i;
+                    double content = Content(tile.second, bin);
+                    double sumw2 = SumOfWeights2(tile.second, bin);
+                    if (content == 0. && sumw2 == 0.) {
+                        continue;
+                    }
+                    f(binx0 + i, biny0 + j, content, sumw2);
+                    if (fSymmetric) {
+                        f(biny0 + j, binx0 + i, content, sumw2);
+                    }
+                }
+            }
+        }
+    }
+
+    static int FindBin(double x, int nbins, double low, double up) {
+        if (x < low) {
+            return 0;
+        }
+        if (!(x < up)) {
+            return nbins + 1;
+        }
+        return 1 + static_cast<int>(nbins * (x - low) / (up - low));
+    }
+
+    int TileKey(int binx, int biny) const {
+        return (biny >> kTileBits) * fNTilesX + (binx >> kTileBits);
+    }
+    static int TileOffset(int binx, int biny) {
+        return (biny & (kTileSize - 1)) * kTileSize + (binx & (kTileSize - 1));
+    }
+
+    Tile &GetTile(int binx, int biny) {
+        int key = TileKey(binx, biny);
+        // consecutive fills are often close in energy, so remember the last
+        // tile we used
+        if (key != fLastKey) {
+            Tile &tile = fTiles[key];
+            if (tile.Empty()) {
+                Allocate(tile);
+            }
+            fLastKey = key;
+            fLastTile = &tile;
+        }
+        return *fLastTile;
+    }
+
+    int fNbinsX;
+    double fXlow;
+    double fXup;
+    int fNbinsY;
+    double fYlow;
+    double fYup;
+    char fType;
+
+    int fNTilesX;
+    bool fSumw2 = false;
+    std::unordered_map<int, Tile> fTiles;
+    double fEntries = 0.;
+
+    int fLastKey = -1;
+    Tile *fLastTile = nullptr;
+};
+
+class SymmetricMatrix : public SparseMatrix {
+public:
+    // Both axes share the same binning
+    SymmetricMatrix(const char *name, const char *title, int nbins,
+                    double low, double up, char type = 'D')
+        : SparseMatrix(name, title, nbins, low, up, nbins, low, up, type) {
+        fSymmetric = true;
+    }
+};
+
+#endif
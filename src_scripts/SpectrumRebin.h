@@ -0,0 +1,82 @@
+#ifndef SpectrumRebin_h
+#define SpectrumRebin_h
+
+// Calibrated spectra from a charge spectrum, without the hits.
+//
+// A charge spectrum of a channel holds everything a new energy calibration
+// needs: every charge bin is mapped to energy through the calibration, and its
+// content is shared between the energy bins the mapped bin covers, in
+// proportion to the overlap (which is what the random number GRSISort adds to
+// the charge before calibrating does on average):
+//
+//     std::vector<double> charge(16384), energy(6000);
+//     ... fill charge ...
+//     RebinSpectrum(charge.data(), 16384, 0., 16384.,
+//                   Polynomial({offset, gain}), energy.data(), 6000, 0., 6000.);
+//
+// The mapping has to be monotonic over the charge range. This header does not
+// depend on ROOT.
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// energy = c[0] + c[1] * charge + c[2] * charge^2 + ..., as TChannel does it
+struct Polynomial {
+    Polynomial() {}
+    explicit Polynomial(const std::vector<double> &coefficients)
+        : c(coefficients) {}
+
+    double operator()(double x) const {
+        double y = 0.;
+        for (size_t i = c.size(); i > 0; --i) {
+            y = y * x + c[i - 1];
+        }
+        return y;
+    }
+
+    std::vector<double> c;
+};
+
+// Adds the source spectrum, mapped bin by bin, to the target spectrum.
+// Content mapped outside the target range is dropped.
+template <typename Map>
+void RebinSpectrum(const double *source, int nSource, double sourceLow,
+                   double sourceHigh, const Map &map, double *target,
+                   int nTarget, double targetLow, double targetHigh) {
+    double sourceWidth = (sourceHigh - sourceLow) / nSource;
+    double targetWidth = (targetHigh - targetLow) / nTarget;
+    // the edges are mapped once, every edge is shared by two bins
+    double low = map(sourceLow);
+    for (int i = 0; i < nSource; ++i) {
+        double high = map(sourceLow + (i + 1) * sourceWidth);
+        double content = source[i];
+        double a = std::min(low, high);
+        double b = std::max(low, high);
+        low = high;
+        if (content == 0. || b <= targetLow || a >= targetHigh) {
+            continue;
+        }
+        if (b - a <= 0.) {
+            int bin = (int)((a - targetLow) / targetWidth);
+            if (bin >= 0 && bin < nTarget) {
+                target[bin] += content;
+            }
+            continue;
+        }
+        double perUnit = content / (b - a);
+        int first = std::max(0, (int)std::floor((a - targetLow) / targetWidth));
+        int last = std::min(nTarget - 1,
+                            (int)std::floor((b - targetLow) / targetWidth));
+        for (int bin = first; bin <= last; ++bin) {
+            double binLow = targetLow + bin * targetWidth;
+            double overlap =
+                std::min(b, binLow + targetWidth) - std::max(a, binLow);
+            if (overlap > 0.) {
+                target[bin] += perUnit * overlap;
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef SyntheticEvents_h
+#define SyntheticEvents_h
+
+// Synthetic GRIFFIN and SCEPTAR events, so the sort programs can be run and
+// timed without experiment data.
+//
+// The events come from a source that is implanted during the beam on part of
+// every PPG cycle and decays with a half-life, on top of a constant room
+// background. A decay emits a Poisson distributed number of gammas from a list
+// of lines, each detected either with its full energy (possibly shared by two
+// crystals of a clover, so addback has something to add) or as a Compton
+// event, and is seen by a SCEPTAR paddle with some probability. The crystals
+// of a clover see a fraction of each other's energy (cross-talk), and every
+// channel has its own gain and a small nonlinearity, which kResidualCalculator
+// and GriffinCTFix should be able to find again:
+//
+//     SyntheticConfig config;
+//     ParseLines("co60+sn129", config.lines);
+//     SyntheticGenerator generator(config);
+//     SyntheticEvent event;
+//     for (long i = 0; i < config.events; ++i) {
+//         generator.Next(event);
+//         ... event.gammas, event.betas ...
+//     }
+//     ... generator.Cycles(generator.Time()) for the PPG ...
+//
+// The same configuration and seed always give the same events. This header
+// does not depend on ROOT, see kMakeSyntheticRun.cxx for the analysis trees.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+struct SyntheticLine {
+    double energy;    // keV
+    double intensity; // relative to the other lines
+};
+
+struct SyntheticConfig {
+    long events = 1000000;
+    unsigned long seed = 1;
+    std::vector<SyntheticLine> lines = {{1173.228, 1.}, {1332.492, 1.}};
+
+    // decays per second of a saturated source
+    double rate = 20000.;
+    // room background, relative to the saturated source
+    double background = 0.05;
+    // in s
+    double halfLife = 2.;
+
+    // mean number of gammas per decay
+    double gammaMultiplicity = 2.;
+    // probability of a SCEPTAR hit per decay
+    double betaFraction = 0.5;
+    // probability of a full energy gamma, the others are Compton events
+    double photopeak = 0.3;
+    // probability of a full energy gamma to be shared by two crystals
+    double scatter = 0.15;
+    // probability of a gamma to be not prompt with the rest of the event
+    double randomFraction = 0.05;
+
+    // mean fraction of the energy of a crystal seen by the other crystals of
+    // the clover, the pairs vary by +-50%
+    double crossTalk = 0.002;
+    // spread of the channel gains
+    double gainSpread = 0.05;
+    // largest deviation of the energies from a linear calibration, in keV
+    double nonlinearity = 1.;
+
+    // PPG cycle, in s from the tape move
+    double cycleLength = 15.;
+    double backgroundStart = 1.5;
+    double beamOnStart = 3.5;
+    double decayStart = 14.;
+
+    // in ns
+    double timeJitter = 5.;
+    double randomWindow = 2000.;
+};
+
+struct SyntheticGamma {
+    int detector;  // clover, 1 to 16
+    int crystal;   // 0 to 3
+    double energy; // keV, including cross-talk and nonlinearity
+    double time;   // ns
+};
+
+struct SyntheticBeta {
+    int paddle;    // 1 to 20
+    double energy; // keV
+    double time;   // ns
+};
+
+struct SyntheticEvent {
+    std::vector<SyntheticGamma> gammas;
+    std::vector<SyntheticBeta> betas;
+};
+
+// The parts of a PPG cycle, the writer maps them to the TPPG patterns
+enum ESyntheticCycle { kCycleTapeMove, kCycleBackground, kCycleBeamOn,
+                       kCycleDecay };
+
+struct SyntheticPPG {
+    double time; // ns
+    ESyntheticCycle newPattern;
+    ESyntheticCycle oldPattern;
+};
+
+// Reads a list of lines like "1173.2,1332.5:0.8", where the intensity after
+// the colon is optional, or one of the sources "co60" and "sn129" (the peaks
+// kResidualCalculator looks for). Several lists can be joined with '+'.
+// Returns false if the list can not be read.
+inline bool ParseLines(const std::string &text,
+                       std::vector<SyntheticLine> &lines) {
+    lines.clear();
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find('+', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string part = text.substr(start, end - start);
+        start = end + 1;
+        if (part == "co60") {
+            lines.push_back({1173.228, 1.});
+            lines.push_back({1332.492, 1.});
+            continue;
+        }
+        if (part == "sn129") {
+            const double peaks[] = {315.42, 511.0,   570.41,  645.2,
+                                    728.53, 769.31,  1008.53, 1054.3,
+                                    1864.89, 2118.26, 2546.61};
+            for (double peak : peaks) {
+                lines.push_back({peak, 0.5});
+            }
+            continue;
+        }
+        const char *pos = part.c_str();
+        while (*pos != '\0') {
+            char *next;
+            SyntheticLine line = {strtod(pos, &next), 1.};
+            if (next == pos || line.energy <= 0.) {
+                return false;
+            }
+            pos = next;
+            if (*pos == ':') {
+                line.intensity = strtod(pos + 1, &next);
+                if (next == pos + 1 || line.intensity <= 0.) {
+                    return false;
+                }
+                pos = next;
+            }
+            if (*pos == ',') {
+                ++pos;
+            } else if (*pos != '\0') {
+                return false;
+            }
+            lines.push_back(line);
+        }
+    }
+    return !lines.empty();
+}
+
+class SyntheticGenerator {
+public:
+    static const int kClovers = 16;
+    static const int kCrystals = 4;
+    static const int kPaddles = 20;
+    static const int kChannels = kClovers * kCrystals;
+
+    explicit SyntheticGenerator(const SyntheticConfig &config)
+        : fConfig(config), fRandom(config.seed) {
+        std::uniform_real_distribution<double> gain(1. - config.gainSpread,
+                                                    1. + config.gainSpread);
+        std::uniform_real_distribution<double> offset(-2., 2.);
+        for (int channel = 0; channel < kChannels; ++channel) {
+            fGain[channel] = 0.5 * gain(fRandom);
+            fOffset[channel] = offset(fRandom);
+        }
+        std::uniform_real_distribution<double> pair(0.5, 1.5);
+        for (int clover = 0; clover < kClovers; ++clover) {
+            for (int i = 0; i < kCrystals; ++i) {
+                for (int j = 0; j < kCrystals; ++j) {
+                    fCrossTalk[clover][i][j] =
+                        (i == j) ? 0. : config.crossTalk * pair(fRandom);
+                }
+            }
+        }
+        double total = 0.;
+        for (const SyntheticLine &line : config.lines) {
+            total += line.intensity;
+            fLineSum.push_back(total);
+        }
+        fDecayConstant = std::log(2.) / (config.halfLife * 1e9);
+    }
+
+    const SyntheticConfig &Config() const { return fConfig; }
+
+    // Time of the last event, in ns since the first tape move
+    double Time() const { return fTime; }
+    long Gammas() const { return fGammas; }
+    long Betas() const { return fBetas; }
+
+    // Linear calibration of a channel (array number - 1, 0 to 63), the
+    // energy is offset + gain * charge
+    double Gain(int channel) const { return fGain[channel]; }
+    double Offset(int channel) const { return fOffset[channel]; }
+    double Charge(int channel, double energy) const {
+        return (energy - fOffset[channel]) / fGain[channel];
+    }
+
+    // Pairs of crystals, the energy of crystal i gets ct(i, j) times the
+    // energy of crystal j of the same clover added
+    double CrossTalk(int detector, int i, int j) const {
+        return fCrossTalk[detector - 1][i][j];
+    }
+
+    void Next(SyntheticEvent &event) {
+        event.gammas.clear();
+        event.betas.clear();
+        while (event.gammas.empty() && event.betas.empty()) {
+            NextDecay(event);
+        }
+        fGammas += event.gammas.size();
+        fBetas += event.betas.size();
+    }
+
+    // The PPG status changes from the first tape move up to a time in ns,
+    // starting every cycle with a tape move
+    std::vector<SyntheticPPG> Cycles(double until) const {
+        const double parts[] = {0., fConfig.backgroundStart,
+                                fConfig.beamOnStart, fConfig.decayStart};
+        std::vector<SyntheticPPG> cycles;
+        ESyntheticCycle last = kCycleDecay;
+        for (long cycle = 0;; ++cycle) {
+            for (int part = kCycleTapeMove; part <= kCycleDecay; ++part) {
+                double time = (cycle * fConfig.cycleLength + parts[part]) * 1e9;
+                if (time > until) {
+                    return cycles;
+                }
+                cycles.push_back({time, (ESyntheticCycle)part, last});
+                last = (ESyntheticCycle)part;
+            }
+        }
+    }
+
+private:
+    // Activity of the implanted source relative to a saturated one
+    double Activity(double time) const {
+        double cycleLength = fConfig.cycleLength * 1e9;
+        double inCycle = std::fmod(time, cycleLength);
+        double on = fConfig.beamOnStart * 1e9;
+        double off = fConfig.decayStart * 1e9;
+        if (inCycle < on) {
+            return 0.;
+        }
+        if (inCycle < off) {
+            return 1. - std::exp(-fDecayConstant * (inCycle - on));
+        }
+        return (1. - std::exp(-fDecayConstant * (off - on))) *
+               std::exp(-fDecayConstant * (inCycle - off));
+    }
+
+    void NextDecay(SyntheticEvent &event) {
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        double activity = Activity(fTime);
+        double rate = fConfig.rate * (fConfig.background + activity) * 1e-9;
+        fTime += std::exponential_distribution<double>(rate)(fRandom);
+        bool decay =
+            uniform(fRandom) * (fConfig.background + activity) < activity;
+
+        std::poisson_distribution<int> multiplicity(fConfig.gammaMultiplicity);
+        int nGammas = multiplicity(fRandom);
+        for (int i = 0; i < nGammas && !fLineSum.empty(); ++i) {
+            AddGamma(event, decay);
+        }
+        if (decay && uniform(fRandom) < fConfig.betaFraction) {
+            std::uniform_int_distribution<int> paddle(1, kPaddles);
+            std::exponential_distribution<double> energy(1. / 800.);
+            event.betas.push_back({paddle(fRandom), energy(fRandom), Jitter()});
+        }
+        Merge(event.gammas);
+        AddCrossTalk(event.gammas);
+        for (SyntheticGamma &gamma : event.gammas) {
+            gamma.energy += Nonlinearity(gamma.energy);
+            gamma.energy += Resolution(gamma.energy);
+        }
+    }
+
+    void AddGamma(SyntheticEvent &event, bool decay) {
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        double pick = uniform(fRandom) * fLineSum.back();
+        size_t line =
+            std::upper_bound(fLineSum.begin(), fLineSum.end(), pick) -
+            fLineSum.begin();
+        double energy =
+            fConfig.lines[std::min(line, fLineSum.size() - 1)].energy;
+        // the room background only shows up as Compton events
+        if (!decay || uniform(fRandom) >= fConfig.photopeak) {
+            energy *= uniform(fRandom);
+        }
+        double time = (uniform(fRandom) < fConfig.randomFraction)
+                          ? fTime + fConfig.randomWindow *
+                                        (2. * uniform(fRandom) - 1.)
+                          : Jitter();
+        std::uniform_int_distribution<int> detector(1, kClovers);
+        std::uniform_int_distribution<int> crystal(0, kCrystals - 1);
+        SyntheticGamma gamma = {detector(fRandom), crystal(fRandom), energy,
+                                time};
+        if (decay && uniform(fRandom) < fConfig.scatter) {
+            // scattered into a second crystal of the same clover
+            std::uniform_int_distribution<int> other(1, kCrystals - 1);
+            double fraction = 0.1 + 0.8 * uniform(fRandom);
+            SyntheticGamma second = gamma;
+            second.crystal = (gamma.crystal + other(fRandom)) % kCrystals;
+            second.energy = (1. - fraction) * energy;
+            gamma.energy = fraction * energy;
+            event.gammas.push_back(second);
+        }
+        event.gammas.push_back(gamma);
+    }
+
+    double Jitter() {
+        return fTime +
+               std::normal_distribution<double>(0., fConfig.timeJitter)(
+                   fRandom);
+    }
+
+    // Gammas in the same crystal are one hit with the sum of the energies
+    static void Merge(std::vector<SyntheticGamma> &gammas) {
+        for (size_t i = 0; i < gammas.size(); ++i) {
+            for (size_t j = i + 1; j < gammas.size();) {
+                if (gammas[j].detector == gammas[i].detector &&
+                    gammas[j].crystal == gammas[i].crystal) {
+                    gammas[i].energy += gammas[j].energy;
+                    gammas[i].time = std::min(gammas[i].time, gammas[j].time);
+                    gammas.erase(gammas.begin() + j);
+                } else {
+                    ++j;
+                }
+            }
+        }
+    }
+
+    void AddCrossTalk(std::vector<SyntheticGamma> &gammas) const {
+        std::vector<double> energy(gammas.size());
+        for (size_t i = 0; i < gammas.size(); ++i) {
+            energy[i] = gammas[i].energy;
+        }
+        for (size_t i = 0; i < gammas.size(); ++i) {
+            for (size_t j = 0; j < gammas.size(); ++j) {
+                if (i != j && gammas[i].detector == gammas[j].detector) {
+                    gammas[i].energy +=
+                        CrossTalk(gammas[i].detector, gammas[i].crystal,
+                                  gammas[j].crystal) *
+                        energy[j];
+                }
+            }
+        }
+    }
+
+    // a smooth bump that is zero at 0 and 3000 keV
+    double Nonlinearity(double energy) const {
+        double x = std::min(std::max(energy / 3000., 0.), 1.);
+        return 4. * fConfig.nonlinearity * x * (1. - x);
+    }
+
+    // HPGe resolution, 1.9 keV FWHM at 1332 keV
+    double Resolution(double energy) {
+        double sigma = std::sqrt(0.25 + 4.6e-4 * std::max(energy, 0.));
+        return std::normal_distribution<double>(0., sigma)(fRandom);
+    }
+
+    SyntheticConfig fConfig;
+    std::mt19937_64 fRandom;
+    std::vector<double> fLineSum;
+    double fGain[kChannels];
+    double fOffset[kChannels];
+    double fCrossTalk[kClovers][kCrystals][kCrystals];
+    double fDecayConstant;
+    double fTime = 0.;
+    long fGammas = 0;
+    long fBetas = 0;
+};
+
+#endif
@@ -0,0 +1,220 @@
+// g++ kCalibrationSort.cxx -std=c++0x -I$GRSISYS/include -L$GRSISYS/libraries
+// -lAnalysisTreeBuilder -lGriffin -lSceptar -lDescant -lPaces -lGRSIDetector
+// -lTGRSIFit -lTigress -lSharc -lCSM -lTriFoil -lTGRSIint -lGRSILoop
+// -lMidasFormat -lGRSIRootIO -lDataParser -lGRSIFormat -lMidasFormat
+// -lXMLParser -lXMLIO -lProof -lGuiHtml `grsi-config --cflags --libs`
+// `root-config --cflags --libs`  -lTreePlayer -lGROOT -lX11 -lXpm -lSpectrum
+//
+// The calibration sort of a 60Co run in one pass over the analysis tree. It
+// writes what MakeCTMatrices, kMakeCalMatrices and the CrossTalk selector
+// write, each of which reads the whole tree on its own:
+//
+//     CrossTalk_histos.root       crystal pair matrices for GriffinCTFix
+//     matrix<run>_<subrun>.root   singles, addback and the 180 degree matrix
+//     calhist<run>_<subrun>.root  the spectra of kLinearGainMatch and
+//                                 kResidualCalculator (see CalHistCache.h)
+//     CrosstalkBands<run>_<subrun>.root  the spectra of the CrossTalk
+//                                 selector, with band matrices of the crystal
+//                                 pairs instead of its full ones
+//
+// Every event is decoded once and handed to the stages in CalStages.h.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Globals.h"
+#include "TFile.h"
+#include "TGRSIOptions.h"
+#include "TGRSIRunInfo.h"
+#include "TStopwatch.h"
+#include "TTree.h"
+
+#include "CalBundle.h"
+#include "CalHistCache.h"
+#include "CalStages.h"
+#include "HitCache.h"
+#include "ReadPlan.h"
+#include "ResidualTable.h"
+#include "SortStats.h"
+
+#ifndef __CINT__
+#include "TGriffin.h"
+#endif
+
+ResidualTable Residuals;
+
+// Runs every stage on the entries [1, maxEntries) of the tree, and fills the
+// calibration spectra of the cache
+void CalibrationSort(TTree *tree, const std::vector<CalStage *> &stages,
+                     CalHistCache &cache, long maxEntries, TStopwatch &w,
+                     SortStats &stats) {
+    if (maxEntries == 0 || maxEntries > tree->GetEntries()) {
+        maxEntries = tree->GetEntries();
+    }
+
+    // Only the GRIFFIN hits are read, every other branch is switched off
+    ReadPlan plan;
+    plan.AddBranch("TGriffin");
+    plan.Apply(tree, 1, maxEntries, true);
+
+    TGriffin *grif = 0;
+    tree->SetBranchAddress("TGriffin", &grif);
+    // the singles and addback are cross-talk corrected, the crystal pair
+    // matrices use the energies without the correction
+    TGRSIOptions::AnalysisOptions()->SetCorrectCrossTalk(true);
+    if (!Residuals.Empty()) {
+        printf("Loading in energy residuals\n");
+    }
+
+    CalEvent event;
+    event.residuals = &Residuals;
+    stats.SetVariants({""});
+    StageClock clock;
+    // I'm starting at entry 1 because of the weird high stamp of 4
+    for (long entry = 1; entry < maxEntries; ++entry) {
+        clock.Start();
+        tree->GetEntry(entry);
+        clock.Lap(stats, SortStats::kRead);
+
+        // the cache keeps the spectra without the residuals, see CalHistCache
+        cache.Fill(grif);
+        ApplyResiduals(Residuals, grif);
+        event.Fill(grif);
+        clock.Lap(stats, SortStats::kCalibrate);
+        stats.Add(SortStats::kEntries);
+        stats.Add(SortStats::kGammaHits, event.gammas.size());
+        stats.Add(SortStats::kAddbackHits, event.addbacks.size());
+
+        for (CalStage *stage : stages) {
+            stage->Fill(event, stats);
+        }
+        clock.Lap(stats, SortStats::kFill);
+        if ((entry % 10000) == 0) {
+            printf("Completed %ld of %ld \r", entry, maxEntries);
+        }
+    }
+    tree->ResetBranchAddresses();
+
+    std::cout << "creating histograms done after " << w.RealTime()
+              << " seconds" << std::endl;
+    w.Continue();
+}
+
+// This function gets run if running in compiled mode
+#ifndef __CINT__
+int main(int argc, char **argv) {
+    // The sum energies whose bands the crystal pair matrices keep, only the
+    // one GriffinCTFix uses unless -s adds others, see MakeCTMatrices
+    std::vector<double> bandSums = {1332.492};
+    double bandHalfWidth = 20.;
+    int nArgs = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            bandSums.clear();
+            for (char *sum = strtok(argv[++i], ","); sum != NULL;
+                 sum = strtok(NULL, ",")) {
+                bandSums.push_back(atof(sum));
+            }
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            bandHalfWidth = atof(argv[++i]);
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
+    if (argc != 4 && argc != 3 && argc != 2) {
+        printf("try again (usage: %s [-s <sum energies>] [-w <band half "
+               "width>] <analysis tree file> <optional: residuals or "
+               "calibration bundle file> <optional: max entries>).\n",
+               argv[0]);
+        return 0;
+    }
+
+    // We use a stopwatch so that we can watch progress
+    TStopwatch w;
+    w.Start();
+
+    TFile *file = new TFile(argv[1]);
+    if (!file->IsOpen()) {
+        printf("Failed to open file '%s'!\n", argv[1]);
+        return 1;
+    }
+    printf("Sorting file:" DBLUE " %s" RESET_COLOR "\n", file->GetName());
+
+    TGRSIRunInfo *runInfo = (TGRSIRunInfo *)file->Get("TGRSIRunInfo");
+    if (runInfo == NULL) {
+        printf("Failed to find run information in file '%s'!\n", argv[1]);
+        return 1;
+    }
+    TGRSIRunInfo::Get()->SetRunInfo(runInfo);
+    int runnumber = runInfo->RunNumber();
+    int subrunnumber = runInfo->SubRunNumber();
+
+    TTree *tree = (TTree *)file->Get("AnalysisTree");
+    if (tree == NULL) {
+        printf("Failed to find analysis tree in file '%s'!\n", argv[1]);
+        return 1;
+    }
+    if (!LoadCalibration(tree, (argc > 2) ? argv[2] : nullptr, &Residuals)) {
+        return 1;
+    }
+
+    // the histograms belong to the lists of the outputs, not to the input
+    // file
+    TH1::AddDirectory(false);
+    CalHistCache cache;
+    std::vector<CalStage *> stages = {
+        new CTPairStage(bandSums, bandHalfWidth), new SinglesStage,
+        new AddbackStage, new SumStage};
+    CalOutputs outputs;
+    for (CalStage *stage : stages) {
+        stage->Book(outputs, runnumber, subrunnumber);
+    }
+
+    std::cout << argv[0] << ": starting Analysis after " << w.RealTime()
+              << " seconds" << std::endl;
+    w.Continue();
+    std::cout << std::fixed << std::setprecision(1);
+
+    SortStats stats;
+    long maxEntries = 0;
+    if (argc > 3) {
+        maxEntries = atol(argv[3]);
+        std::cout << "Limiting processing of analysis tree to " << maxEntries
+                  << " entries!" << std::endl;
+    }
+    CalibrationSort(tree, stages, cache, maxEntries, w, stats);
+
+    StageClock clock;
+    outputs.Write();
+    std::string cacheName =
+        Form("calhist%05d_%03d.root", runnumber, subrunnumber);
+    printf("Writing calibration spectra to: " DYELLOW "%s" RESET_COLOR "\n",
+           cacheName.c_str());
+    cache.Write(cacheName.c_str());
+    clock.Lap(stats, SortStats::kWrite);
+
+    stats.Print();
+    stats.WriteJSON(
+        StatsFileName(Form("calsort%05d_%03d.root", runnumber, subrunnumber)),
+        "kCalibrationSort", argv[1], 1, w.RealTime());
+    w.Continue();
+
+    for (CalStage *stage : stages) {
+        delete stage;
+    }
+
+    std::cout << argv[0] << " done after " << w.RealTime() << " seconds"
+              << std::endl
+              << std::endl;
+
+    return 0;
+}
+
+#endif
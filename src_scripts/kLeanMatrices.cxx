@@ -7,33 +7,58 @@
 // -lProof -lGuiHtml `grsi-config --cflags
 // --libs` `root-config --cflags --libs`  -lTreePlayer -lGROOT -lX11 -lXpm
 // -lSpectrum
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
 #include <sys/stat.h>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "Globals.h"
 #include "TCanvas.h"
 #include "TChain.h"
+#include "TEnv.h"
 #include "TF1.h"
 #include "TFile.h"
 #include "TGRSIRunInfo.h"
 #include "TGRSISortInfo.h"
 #include "TH1F.h"
 #include "TH2F.h"
+#include "TChannel.h"
 #include "TH3F.h"
+#include "TKey.h"
 #include "TList.h"
 #include "TMath.h"
 #include "TPPG.h"
 #include "TROOT.h"
 #include "TStopwatch.h"
+#include "TSystem.h"
 #include "TTree.h"
 #include "TTreeIndex.h"
 #include "TVectorD.h"
 #include "TVirtualIndex.h"
-#include "TMVA/TSpline1.h"
+
+#include "CalBundle.h"
+#include "CoincidenceWindow.h"
+#include "CycleTable.h"
+#include "HitCache.h"
+#include "HitStore.h"
+#include "ReadPlan.h"
+#include "ResidualTable.h"
+#include "SortCache.h"
+#include "SortStats.h"
+#include "SparseMatrix.h"
 
 #ifndef __CINT__
 #include "TGriffin.h"
@@ -58,7 +83,10 @@
 //
 /////////////////////////////////////////////////////////////////////////////////////////
 
-std::vector<TMVA::TSpline1*> ResidualVec;
+ResidualTable Residuals;
+
+// k-value of a GRIF-16 hit without pileup
+const int kNominalKValue = 700;
 
 // This function gets run if running interpretively
 // Not recommended for the analysis scripts
@@ -70,6 +98,7 @@ void LeanMatrices() {
     }
     // coinc window = 0-20, bg window 40-60, 6000 bins from 0. to 6000. (default
     // is 4000)
+    LoadCalibration(AnalysisTree, nullptr, &Residuals);
     TList *list = LeanMatrices(AnalysisTree, TPPG, TGRSIRunInfo, 0.);
 
     TFile *outfile = new TFile("output.root", "recreate");
@@ -77,16 +106,8 @@ void LeanMatrices() {
 }
 #endif
 
-TList *LeanMatrices(TTree *tree, TPPG *ppg, TGRSIRunInfo *runInfo,
-                    long maxEntries = 0, TStopwatch *w = nullptr) {
-    if (runInfo == nullptr) {
-        return nullptr;
-    }
-
-    TGRSIOptions::AnalysisOptions()->SetCorrectCrossTalk(true);
-
-    ///////////////////////////////////// SETUP
-    //////////////////////////////////////////
+// Sorting parameters, these are shared (read only) by all sorting threads
+struct LeanParameters {
     // Histogram paramaters
     Double_t low = 0;
     Double_t high = 10000;
@@ -102,16 +123,11 @@ TList *LeanMatrices(TTree *tree, TPPG *ppg, TGRSIRunInfo *runInfo,
     Double_t ggBGhigh = 1750.;
     Double_t gbBGlow = -1600.;
     Double_t gbBGhigh = 0.;
-    Double_t ggBGScale = (ggThigh - ggTlow) / (ggBGhigh - ggBGlow);
-    Double_t gbBGScale = (gbThigh - gbTlow) / (gbBGhigh - gbBGlow);
 
     Double_t betaThres = 0.;
 
     // this is in ms
     Double_t cycleLength = 15000;
-    if (ppg != nullptr) {
-        cycleLength = ppg->GetCycleLength() / 1e5;
-    }
 
     Double_t bgStart = 1.5e8;
     Double_t bgEnd = 3.5e8;
@@ -119,854 +135,2426 @@ TList *LeanMatrices(TTree *tree, TPPG *ppg, TGRSIRunInfo *runInfo,
     Double_t onEnd = 14.0e8;
     Double_t offStart = 14.5e8;
     Double_t offEnd = 15.5e8;
+};
 
-    if (w == nullptr) {
-        w = new TStopwatch;
-        w->Start();
+// The histograms a variant is sorted into
+struct HistogramSelection {
+    bool all = true;
+    std::set<std::string> names;
+
+    bool Wants(const std::string &name) const {
+        return all || names.count(name) > 0;
     }
-    auto *list = new TList;
+};
 
-    // const size_t MEM_SIZE = (size_t)1024*(size_t)1024*(size_t)1024*(size_t)8;
-    // // 8 GB
+// One set of sorting parameters and the histograms filled with it. The
+// histograms of all but the first variant get "_<name>" added to their names.
+struct LeanVariant {
+    std::string name;
+    LeanParameters par;
+    HistogramSelection selection;
+};
 
-    // We create some spectra and then add it to the list
-    // hit patterns
-    auto *bIdVsgId =
-        new TH2D("bIdVsgId", "Sceptar Id vs Griffin Id", 20, 1, 21, 64, 1, 65);
-    list->Add(bIdVsgId);
+// Reads the parameters starting with prefix from the plan file, the ones that
+// are not in the file keep their value from par
+LeanParameters ReadParameters(const TEnv &env, const std::string &prefix,
+                              LeanParameters par) {
+    auto read = [&](const char *key, Double_t &value) {
+        value = env.GetValue((prefix + key).c_str(), value);
+    };
+    read("low", par.low);
+    read("high", par.high);
+    read("nofBins", par.nofBins);
+    read("ggTlow", par.ggTlow);
+    read("ggThigh", par.ggThigh);
+    read("gbTlow", par.gbTlow);
+    read("gbThigh", par.gbThigh);
+    read("ggBGlow", par.ggBGlow);
+    read("ggBGhigh", par.ggBGhigh);
+    read("gbBGlow", par.gbBGlow);
+    read("gbBGhigh", par.gbBGhigh);
+    read("betaThres", par.betaThres);
+    read("cycleLength", par.cycleLength);
+    read("bgStart", par.bgStart);
+    read("bgEnd", par.bgEnd);
+    read("onStart", par.onStart);
+    read("onEnd", par.onEnd);
+    read("offStart", par.offStart);
+    read("offEnd", par.offEnd);
+    return par;
+}
 
-    // gamma single spectra
-    auto *gammaSingles = new TH1D("gammaSingles", "#gamma singles;energy[keV]",
-                                  nofBins, low, high);
-    list->Add(gammaSingles);
-    auto *gammaSinglesB = new TH1D("gammaSinglesB", "#beta #gamma;energy[keV]",
-                                   nofBins, low, high);
-    list->Add(gammaSinglesB);
-    auto *gammaSinglesBm =
-        new TH1D("gammaSinglesBm",
-                 "#beta #gamma (multiple counting of #beta's);energy[keV]",
-                 nofBins, low, high);
-    list->Add(gammaSinglesBm);
-    auto *gammaSinglesBt =
-        new TH1D("gammaSinglesBt", "#beta #gamma t-rand-corr; energy[keV]",
-                 nofBins, low, high);
-    list->Add(gammaSinglesBt);
-    auto *ggTimeDiff =
-        new TH1D("ggTimeDiff", "#gamma-#gamma time difference", 3000, 0, 3000);
-    list->Add(ggTimeDiff);
-    auto *gbTimeDiff = new TH1D("gbTimeDiff", "#gamma-#beta time difference",
-                                2000, -1000, 1000);
-    list->Add(gbTimeDiff);
-    auto *bbTimeDiff =
-        new TH2D("bbTimeDiff", "#beta energy vs. #beta-#beta time difference",
-                 2000, -1000, 1000, 1000, 0., 2e6);
-    list->Add(bbTimeDiff);
-    auto *gTimeDiff = new TH2D("gTimeDiff", "channel vs. time difference", 2000,
-                               0, 2000, 65, 1., 65.);
-    list->Add(gTimeDiff);
-    auto *gtimestamp =
-        new TH1F("gtimestamp", "#gamma time stamp", 10000, 0, 1000);
-    list->Add(gtimestamp);
-    auto *btimestamp =
-        new TH1F("btimestamp", "#beta time stamp", 10000, 0, 1000);
-    list->Add(btimestamp);
-    auto *gbEnergyvsgTime =
-        new TH2F("gbEnergyvsgTime", "#gamma #beta coincident: #gamma timestamp "
-                                    "vs. #gamma energy; Time [s]; Energy [keV]",
-                 1000, 0, 1000, nofBins, low, high);
-    list->Add(gbEnergyvsgTime);
-    auto *gbEnergyvsbTime =
-        new TH2F("gbEnergyvsbTime", "#gamma #beta coincident: #beta timestamp "
-                                    "vs. #gamma energy; Time [s]; Energy [keV]",
-                 1000, 0, 1000, nofBins, low, high);
-    list->Add(gbEnergyvsbTime);
-    auto *ggmatrix = new TH2D("ggmatrix", "#gamma-#gamma matrix", nofBins, low,
-                              high, nofBins, low, high);
-    list->Add(ggmatrix);
-    auto *ggmatrixt = new TH2D("ggmatrixt", "#gamma-#gamma matrix t-corr",
-                               nofBins, low, high, nofBins, low, high);
-    list->Add(ggmatrixt);
-    auto *gammaSinglesB_hp =
-        new TH2F("gammaSinglesB_hp", "#gamma-#beta vs. SC channel", nofBins,
-                 low, high, 20, 1, 21);
-    list->Add(gammaSinglesB_hp);
-    auto *ggbmatrix = new TH2F("ggbmatrix", "#gamma-#gamma-#beta matrix",
-                               nofBins, low, high, nofBins, low, high);
-    list->Add(ggbmatrix);
-    auto *ggbmatrixt =
-        new TH2F("ggbmatrixt", "#gamma-#gamma-#beta matrix t-corr", nofBins,
-                 low, high, nofBins, low, high);
-    list->Add(ggbmatrixt);
-    auto *grifscep_hp = new TH2F(
-        "grifscep_hp", "Sceptar vs Griffin hit pattern", 64, 0, 64, 20, 0, 20);
-    list->Add(grifscep_hp);
-    auto *gbTimevsg =
-        new TH2F("gbTimevsg", "#gamma energy vs. #gamma-#beta timing", 300,
-                 -150, 150, nofBins, low, high);
-    list->Add(gbTimevsg);
-    auto *ggbmatrixOn =
-        new TH2D("ggbmatrixOn", "#gamma-#gamma-#beta matrix, beam on window",
-                 nofBins, low, high, nofBins, low, high);
-    list->Add(ggbmatrixOn);
-    auto *ggbmatrixBg =
-        new TH2F("ggbmatrixBg", "#gamma-#gamma-#beta matrix, background window",
-                 nofBins, low, high, nofBins, low, high);
-    list->Add(ggbmatrixBg);
-    auto *ggbmatrixOff =
-        new TH2F("ggbmatrixOff", "#gamma-#gamma-#beta matrix, beam off window",
-                 nofBins, low, high, nofBins, low, high);
-    list->Add(ggbmatrixOff);
+// Reads a list of histogram names, "all" selects every histogram and "none"
+// none of them. Returns selection if the key is not in the plan file.
+HistogramSelection ReadSelection(const TEnv &env, const std::string &key,
+                                 HistogramSelection selection) {
+    if (!env.Defined(key.c_str())) {
+        return selection;
+    }
+    selection.all = false;
+    selection.names.clear();
+    std::string value = env.GetValue(key.c_str(), "");
+    std::replace(value.begin(), value.end(), ',', ' ');
+    std::istringstream names(value);
+    std::string name;
+    while (names >> name) {
+        if (name == "all") {
+            selection.all = true;
+        } else if (name != "none") {
+            selection.names.insert(name);
+        }
+    }
+    // the time-random corrected histograms are made from the prompt ones
+    const char *needs[][2] = {{"ggmatrixt", "ggmatrix"},
+                              {"ggbmatrixt", "ggbmatrix"},
+                              {"gammaSinglesBt", "gammaSinglesB"},
+                              {"aamatrixt", "aamatrix"},
+                              {"aabmatrixt", "aabmatrix"},
+                              {"gammaAddbackBt", "gammaAddbackB"}};
+    for (auto &need : needs) {
+        if (selection.names.count(need[0]) > 0) {
+            selection.names.insert(need[1]);
+        }
+    }
+    return selection;
+}
+
+// Reads the variants from a plan file (TEnv format), e.g.
+//
+//     LeanMatrices.Histograms:     ggmatrix ggmatrixt ggbmatrix ggbmatrixt
+//     LeanMatrices.ggThigh:        400
+//     LeanMatrices.Variants:       narrow wide
+//     LeanMatrices.narrow.ggThigh: 200
+//     LeanMatrices.wide.ggThigh:   600
+//
+// The first variant uses the "LeanMatrices.<parameter>" entries, every
+// variant in LeanMatrices.Variants starts from those and changes the entries
+// set for it. Without a plan file all histograms are sorted with the default
+// parameters.
+bool LoadLeanPlan(const char *fileName, std::vector<LeanVariant> &variants) {
+    variants.assign(1, LeanVariant());
+    if (fileName == nullptr) {
+        return true;
+    }
+    TEnv env;
+    if (env.ReadFile(fileName, kEnvLocal) != 0) {
+        printf("Failed to read plan file '%s'!\n", fileName);
+        return false;
+    }
+    std::string prefix = "LeanMatrices.";
+    LeanVariant &first = variants[0];
+    first.par = ReadParameters(env, prefix, first.par);
+    first.selection =
+        ReadSelection(env, prefix + "Histograms", first.selection);
+
+    std::string value = env.GetValue((prefix + "Variants").c_str(), "");
+    std::replace(value.begin(), value.end(), ',', ' ');
+    std::istringstream names(value);
+    std::string name;
+    while (names >> name) {
+        for (const LeanVariant &variant : variants) {
+            if (variant.name == name) {
+                printf("Variant '%s' is listed twice in plan file '%s'!\n",
+                       name.c_str(), fileName);
+                return false;
+            }
+        }
+        LeanVariant variant;
+        variant.name = name;
+        variant.par = ReadParameters(env, prefix + name + ".", first.par);
+        variant.selection = ReadSelection(
+            env, prefix + name + ".Histograms", first.selection);
+        variants.push_back(variant);
+    }
+    return true;
+}
+
+// All histograms filled by the sort. When sorting with several threads each
+// thread fills its own set, and the sets are added together at the end.
+// Histograms that were not asked for in the plan are nullptr.
+struct LeanHistograms {
+    TList *list = nullptr;
+    // the names of all histograms the sort knows, whether they are filled or
+    // not
+    std::set<std::string> known;
 
+    TH2D *bIdVsgId = nullptr;
+    TH1D *gammaSingles = nullptr;
+    TH1D *gammaSinglesB = nullptr;
+    TH1D *gammaSinglesBm = nullptr;
+    TH1D *gammaSinglesBt = nullptr;
+    TH1D *ggTimeDiff = nullptr;
+    TH1D *gbTimeDiff = nullptr;
+    TH2D *bbTimeDiff = nullptr;
+    TH2D *gTimeDiff = nullptr;
+    TH1F *gtimestamp = nullptr;
+    TH1F *btimestamp = nullptr;
+    TH2F *gbEnergyvsgTime = nullptr;
+    TH2F *gbEnergyvsbTime = nullptr;
+    SymmetricMatrix *ggmatrix = nullptr;
+    SymmetricMatrix *ggmatrixt = nullptr;
+    TH2F *gammaSinglesB_hp = nullptr;
+    SparseMatrix *ggbmatrix = nullptr;
+    SparseMatrix *ggbmatrixt = nullptr;
+    TH2F *grifscep_hp = nullptr;
+    TH2F *gbTimevsg = nullptr;
+    SparseMatrix *ggbmatrixOn = nullptr;
+    SparseMatrix *ggbmatrixBg = nullptr;
+    SparseMatrix *ggbmatrixOff = nullptr;
+    TH1D *gammaAddback = nullptr;
+    TH1D *gammaAddbackB = nullptr;
+    TH1D *gammaAddbackBm = nullptr;
+    TH1D *gammaAddbackBt = nullptr;
+    TH1D *aaTimeDiff = nullptr;
+    TH1D *abTimeDiff = nullptr;
+    TH2F *abEnergyvsgTime = nullptr;
+    TH2F *abEnergyvsbTime = nullptr;
+    SymmetricMatrix *aamatrix = nullptr;
+    SymmetricMatrix *aamatrixt = nullptr;
+    TH2F *gammaAddbackB_hp = nullptr;
+    SparseMatrix *aabmatrix = nullptr;
+    SparseMatrix *aabmatrixt = nullptr;
+    TH2F *abTimevsg = nullptr;
+    TH2F *abTimevsgf = nullptr;
+    TH2F *abTimevsgl = nullptr;
+    SparseMatrix *aabmatrixOn = nullptr;
+    SparseMatrix *aabmatrixBg = nullptr;
+    SparseMatrix *aabmatrixOff = nullptr;
     TH2F *gammaSinglesCyc = nullptr;
     TH2F *gammaSinglesBCyc = nullptr;
     TH2F *gammaSinglesBmCyc = nullptr;
     TH2F *betaSinglesCyc = nullptr;
-    if (ppg != nullptr) {
-        gammaSinglesCyc =
-            new TH2F("gammaSinglesCyc", "Cycle time vs. #gamma energy",
-                     cycleLength / 10., 0., cycleLength, nofBins, low, high);
-        list->Add(gammaSinglesCyc);
-        gammaSinglesBCyc = new TH2F(
-            "gammaSinglesBCyc", "Cycle time vs. #beta coinc #gamma energy",
-            cycleLength / 10., 0., cycleLength, nofBins, low, high);
-        list->Add(gammaSinglesBCyc);
-        gammaSinglesBmCyc = new TH2F(
-            "gammaSinglesBmCyc", "Cycle time vs. #beta coinc #gamma energy "
-                                 "(multiple counting of #beta's)",
-            cycleLength / 10., 0., cycleLength, nofBins, low, high);
-        list->Add(gammaSinglesBmCyc);
-        betaSinglesCyc = new TH2F(
-            "betaSinglesCyc", "Cycle number vs. cycle time for #beta's",
-            cycleLength / 10., 0., cycleLength, 1000, 0, 1000);
-        list->Add(betaSinglesCyc);
+    TH2F *gammaAddbackCyc = nullptr;
+    TH2F *gammaAddbackBCyc = nullptr;
+    TH2F *gammaAddbackBmCyc = nullptr;
+};
+
+// Timestamps of the first and last hit of each channel within a range of
+// entries, used to stitch gTimeDiff together across the thread boundaries.
+struct ChannelTimes {
+    std::vector<double> first;
+    std::vector<long> last;
+
+    ChannelTimes() : first(65, -1.), last(65, 0) {}
+};
+
+// Creates the histogram if the selection asks for it and adds it to the list
+template <typename T, typename... Args>
+void Book(LeanHistograms &h, const HistogramSelection &sel,
+          const std::string &suffix, T *&hist, const char *name,
+          Args... args) {
+    h.known.insert(name);
+    hist = nullptr;
+    if (sel.Wants(name)) {
+        hist = new T((name + suffix).c_str(), args...);
+        h.list->Add(hist);
+    }
+}
+
+LeanHistograms CreateHistograms(const LeanParameters &par,
+                                const HistogramSelection &sel,
+                                const std::string &suffix, TPPG *ppg) {
+    LeanHistograms h;
+    h.list = new TList;
+
+    // We create some spectra and then add it to the list
+    // hit patterns
+    Book(h, sel, suffix, h.bIdVsgId, "bIdVsgId", "Sceptar Id vs Griffin Id", 20,
+         1, 21, 64, 1, 65);
+
+    // gamma single spectra
+    Book(h, sel, suffix, h.gammaSingles, "gammaSingles",
+         "#gamma singles;energy[keV]", par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.gammaSinglesB, "gammaSinglesB",
+         "#beta #gamma;energy[keV]", par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.gammaSinglesBm, "gammaSinglesBm",
+         "#beta #gamma (multiple counting of #beta's);energy[keV]", par.nofBins,
+         par.low, par.high);
+    Book(h, sel, suffix, h.gammaSinglesBt, "gammaSinglesBt",
+         "#beta #gamma t-rand-corr; energy[keV]", par.nofBins, par.low,
+         par.high);
+    Book(h, sel, suffix, h.ggTimeDiff, "ggTimeDiff",
+         "#gamma-#gamma time difference", 3000, 0, 3000);
+    Book(h, sel, suffix, h.gbTimeDiff, "gbTimeDiff",
+         "#gamma-#beta time difference", 2000, -1000, 1000);
+    Book(h, sel, suffix, h.bbTimeDiff, "bbTimeDiff",
+         "#beta energy vs. #beta-#beta time difference", 2000, -1000, 1000,
+         1000, 0., 2e6);
+    Book(h, sel, suffix, h.gTimeDiff, "gTimeDiff",
+         "channel vs. time difference", 2000, 0, 2000, 65, 1., 65.);
+    Book(h, sel, suffix, h.gtimestamp, "gtimestamp", "#gamma time stamp", 10000,
+         0, 1000);
+    Book(h, sel, suffix, h.btimestamp, "btimestamp", "#beta time stamp", 10000,
+         0, 1000);
+    Book(h, sel, suffix, h.gbEnergyvsgTime, "gbEnergyvsgTime",
+         "#gamma #beta coincident: #gamma timestamp vs. #gamma energy; Time "
+         "[s]; Energy [keV]", 1000, 0, 1000, par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.gbEnergyvsbTime, "gbEnergyvsbTime",
+         "#gamma #beta coincident: #beta timestamp vs. #gamma energy; Time "
+         "[s]; Energy [keV]", 1000, 0, 1000, par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.ggmatrix, "ggmatrix", "#gamma-#gamma matrix",
+         par.nofBins, par.low, par.high, 'D');
+    Book(h, sel, suffix, h.ggmatrixt, "ggmatrixt",
+         "#gamma-#gamma matrix t-corr", par.nofBins, par.low, par.high, 'D');
+    Book(h, sel, suffix, h.gammaSinglesB_hp, "gammaSinglesB_hp",
+         "#gamma-#beta vs. SC channel", par.nofBins, par.low, par.high, 20, 1,
+         21);
+    Book(h, sel, suffix, h.ggbmatrix, "ggbmatrix", "#gamma-#gamma-#beta matrix",
+         par.nofBins, par.low, par.high, par.nofBins, par.low, par.high, 'F');
+    Book(h, sel, suffix, h.ggbmatrixt, "ggbmatrixt",
+         "#gamma-#gamma-#beta matrix t-corr", par.nofBins, par.low, par.high,
+         par.nofBins, par.low, par.high, 'F');
+    Book(h, sel, suffix, h.grifscep_hp, "grifscep_hp",
+         "Sceptar vs Griffin hit pattern", 64, 0, 64, 20, 0, 20);
+    Book(h, sel, suffix, h.gbTimevsg, "gbTimevsg",
+         "#gamma energy vs. #gamma-#beta timing", 300, -150, 150, par.nofBins,
+         par.low, par.high);
+    Book(h, sel, suffix, h.ggbmatrixOn, "ggbmatrixOn",
+         "#gamma-#gamma-#beta matrix, beam on window", par.nofBins, par.low,
+         par.high, par.nofBins, par.low, par.high, 'D');
+    Book(h, sel, suffix, h.ggbmatrixBg, "ggbmatrixBg",
+         "#gamma-#gamma-#beta matrix, background window", par.nofBins, par.low,
+         par.high, par.nofBins, par.low, par.high, 'F');
+    Book(h, sel, suffix, h.ggbmatrixOff, "ggbmatrixOff",
+         "#gamma-#gamma-#beta matrix, beam off window", par.nofBins, par.low,
+         par.high, par.nofBins, par.low, par.high, 'F');
+
+    // the gamma cycle spectra need a PPG, without one they are not created
+    HistogramSelection cycleSel = sel;
+    if (ppg == nullptr) {
+        cycleSel.all = false;
+        cycleSel.names.clear();
     }
+    Book(h, cycleSel, suffix, h.gammaSinglesCyc, "gammaSinglesCyc",
+         "Cycle time vs. #gamma energy", par.cycleLength / 10., 0.,
+         par.cycleLength, par.nofBins, par.low, par.high);
+    Book(h, cycleSel, suffix, h.gammaSinglesBCyc, "gammaSinglesBCyc",
+         "Cycle time vs. #beta coinc #gamma energy", par.cycleLength / 10.,
+         0., par.cycleLength, par.nofBins, par.low, par.high);
+    Book(h, cycleSel, suffix, h.gammaSinglesBmCyc, "gammaSinglesBmCyc",
+         "Cycle time vs. #beta coinc #gamma energy (multiple counting of "
+         "#beta's)", par.cycleLength / 10., 0., par.cycleLength, par.nofBins,
+         par.low, par.high);
+    Book(h, cycleSel, suffix, h.betaSinglesCyc, "betaSinglesCyc",
+         "Cycle number vs. cycle time for #beta's", par.cycleLength / 10.,
+         0., par.cycleLength, 1000, 0, 1000);
     // addback spectra
-    auto *gammaAddback = new TH1D("gammaAddback", "#gamma singles;energy[keV]",
-                                  nofBins, low, high);
-    list->Add(gammaAddback);
-    auto *gammaAddbackB = new TH1D("gammaAddbackB", "#beta #gamma;energy[keV]",
-                                   nofBins, low, high);
-    list->Add(gammaAddbackB);
-    auto *gammaAddbackBm =
-        new TH1D("gammaAddbackBm",
-                 "#beta #gamma (multiple counting of #beta's);energy[keV]",
-                 nofBins, low, high);
-    list->Add(gammaAddbackBm);
-    auto *gammaAddbackBt =
-        new TH1D("gammaAddbackBt", "#beta #gamma t-rand-corr; energy[keV]",
-                 nofBins, low, high);
-    list->Add(gammaAddbackBt);
-    auto *aaTimeDiff =
-        new TH1D("aaTimeDiff", "#gamma-#gamma time difference", 300, 0, 300);
-    list->Add(aaTimeDiff);
-    auto *abTimeDiff = new TH1D("abTimeDiff", "#gamma-#beta time difference",
-                                2000, -1000, 1000);
-    list->Add(abTimeDiff);
-    auto *abEnergyvsgTime =
-        new TH2F("abEnergyvsgTime", "#gamma #beta coincident: #gamma timestamp "
-                                    "vs. #gamma energy; Time [s]; Energy [keV]",
-                 1000, 0, 1000, nofBins, low, high);
-    list->Add(abEnergyvsgTime);
-    auto *abEnergyvsbTime =
-        new TH2F("abEnergyvsbTime", "#gamma #beta coincident: #beta timestamp "
-                                    "vs. #gamma energy; Time [s]; Energy [keV]",
-                 1000, 0, 1000, nofBins, low, high);
-    list->Add(abEnergyvsbTime);
-    auto *aamatrix = new TH2D("aamatrix", "#gamma-#gamma matrix", nofBins, low,
-                              high, nofBins, low, high);
-    list->Add(aamatrix);
-    auto *aamatrixt = new TH2D("aamatrixt", "#gamma-#gamma matrix t-corr",
-                               nofBins, low, high, nofBins, low, high);
-    list->Add(aamatrixt);
-    auto *gammaAddbackB_hp =
-        new TH2F("gammaAddbackB_hp", "#gamma-#beta vs. SC channel", nofBins,
-                 low, high, 20, 1, 21);
-    list->Add(gammaAddbackB_hp);
-    auto *aabmatrix = new TH2F("aabmatrix", "#gamma-#gamma-#beta matrix",
-                               nofBins, low, high, nofBins, low, high);
-    list->Add(aabmatrix);
-    auto *aabmatrixt =
-        new TH2F("aabmatrixt", "#gamma-#gamma-#beta matrix t-corr", nofBins,
-                 low, high, nofBins, low, high);
-    list->Add(aabmatrixt);
-    auto *abTimevsg =
-        new TH2F("abTimevsg", "#gamma energy vs. #gamma-#beta timing", 300,
-                 -150, 150, nofBins, low, high);
-    list->Add(abTimevsg);
-    auto *abTimevsgf =
-        new TH2F("abTimevsgf",
-                 "#gamma energy vs. #gamma-#beta timing (first #beta only)",
-                 300, -150, 150, nofBins, low, high);
-    list->Add(abTimevsgf);
-    auto *abTimevsgl = new TH2F(
-        "abTimevsgl", "#gamma energy vs. #gamma-#beta timing (last #beta only)",
-        300, -150, 150, nofBins, low, high);
-    list->Add(abTimevsgl);
-    auto *aabmatrixOn =
-        new TH2D("aabmatrixOn", "#gamma-#gamma-#beta matrix, beam on window",
-                 nofBins, low, high, nofBins, low, high);
-    list->Add(aabmatrixOn);
-    auto *aabmatrixBg =
-        new TH2F("aabmatrixBg", "#gamma-#gamma-#beta matrix, background window",
-                 nofBins, low, high, nofBins, low, high);
-    list->Add(aabmatrixBg);
-    auto *aabmatrixOff =
-        new TH2F("aabmatrixOff", "#gamma-#gamma-#beta matrix, beam off window",
-                 nofBins, low, high, nofBins, low, high);
-    list->Add(aabmatrixOff);
-
-    TH2F *gammaAddbackCyc;
-    TH2F *gammaAddbackBCyc;
-    TH2F *gammaAddbackBmCyc;
-    gammaAddbackCyc =
-        new TH2F("gammaAddbackCyc", "Cycle time vs. #gamma energy",
-                 cycleLength / 10., 0., cycleLength, nofBins, low, high);
-    list->Add(gammaAddbackCyc);
-    gammaAddbackBCyc =
-        new TH2F("gammaAddbackBCyc", "Cycle time vs. #beta coinc #gamma energy",
-                 cycleLength / 10., 0., cycleLength, nofBins, low, high);
-    list->Add(gammaAddbackBCyc);
-    gammaAddbackBmCyc =
-        new TH2F("gammaAddbackBmCyc", "Cycle time vs. #beta coinc #gamma "
-                                      "energy (multiple counting of #beta's)",
-                 cycleLength / 10., 0., cycleLength, nofBins, low, high);
-    list->Add(gammaAddbackBmCyc);
-    list->Sort(); // Sorts the list alphabetically
+    Book(h, sel, suffix, h.gammaAddback, "gammaAddback",
+         "#gamma singles;energy[keV]", par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.gammaAddbackB, "gammaAddbackB",
+         "#beta #gamma;energy[keV]", par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.gammaAddbackBm, "gammaAddbackBm",
+         "#beta #gamma (multiple counting of #beta's);energy[keV]", par.nofBins,
+         par.low, par.high);
+    Book(h, sel, suffix, h.gammaAddbackBt, "gammaAddbackBt",
+         "#beta #gamma t-rand-corr; energy[keV]", par.nofBins, par.low,
+         par.high);
+    Book(h, sel, suffix, h.aaTimeDiff, "aaTimeDiff",
+         "#gamma-#gamma time difference", 300, 0, 300);
+    Book(h, sel, suffix, h.abTimeDiff, "abTimeDiff",
+         "#gamma-#beta time difference", 2000, -1000, 1000);
+    Book(h, sel, suffix, h.abEnergyvsgTime, "abEnergyvsgTime",
+         "#gamma #beta coincident: #gamma timestamp vs. #gamma energy; Time "
+         "[s]; Energy [keV]", 1000, 0, 1000, par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.abEnergyvsbTime, "abEnergyvsbTime",
+         "#gamma #beta coincident: #beta timestamp vs. #gamma energy; Time "
+         "[s]; Energy [keV]", 1000, 0, 1000, par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.aamatrix, "aamatrix", "#gamma-#gamma matrix",
+         par.nofBins, par.low, par.high, 'D');
+    Book(h, sel, suffix, h.aamatrixt, "aamatrixt",
+         "#gamma-#gamma matrix t-corr", par.nofBins, par.low, par.high, 'D');
+    Book(h, sel, suffix, h.gammaAddbackB_hp, "gammaAddbackB_hp",
+         "#gamma-#beta vs. SC channel", par.nofBins, par.low, par.high, 20, 1,
+         21);
+    Book(h, sel, suffix, h.aabmatrix, "aabmatrix", "#gamma-#gamma-#beta matrix",
+         par.nofBins, par.low, par.high, par.nofBins, par.low, par.high, 'F');
+    Book(h, sel, suffix, h.aabmatrixt, "aabmatrixt",
+         "#gamma-#gamma-#beta matrix t-corr", par.nofBins, par.low, par.high,
+         par.nofBins, par.low, par.high, 'F');
+    Book(h, sel, suffix, h.abTimevsg, "abTimevsg",
+         "#gamma energy vs. #gamma-#beta timing", 300, -150, 150, par.nofBins,
+         par.low, par.high);
+    Book(h, sel, suffix, h.abTimevsgf, "abTimevsgf",
+         "#gamma energy vs. #gamma-#beta timing (first #beta only)", 300, -150,
+         150, par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.abTimevsgl, "abTimevsgl",
+         "#gamma energy vs. #gamma-#beta timing (last #beta only)", 300, -150,
+         150, par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.aabmatrixOn, "aabmatrixOn",
+         "#gamma-#gamma-#beta matrix, beam on window", par.nofBins, par.low,
+         par.high, par.nofBins, par.low, par.high, 'D');
+    Book(h, sel, suffix, h.aabmatrixBg, "aabmatrixBg",
+         "#gamma-#gamma-#beta matrix, background window", par.nofBins, par.low,
+         par.high, par.nofBins, par.low, par.high, 'F');
+    Book(h, sel, suffix, h.aabmatrixOff, "aabmatrixOff",
+         "#gamma-#gamma-#beta matrix, beam off window", par.nofBins, par.low,
+         par.high, par.nofBins, par.low, par.high, 'F');
+
+    Book(h, sel, suffix, h.gammaAddbackCyc, "gammaAddbackCyc",
+         "Cycle time vs. #gamma energy", par.cycleLength / 10., 0.,
+         par.cycleLength, par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.gammaAddbackBCyc, "gammaAddbackBCyc",
+         "Cycle time vs. #beta coinc #gamma energy", par.cycleLength / 10., 0.,
+         par.cycleLength, par.nofBins, par.low, par.high);
+    Book(h, sel, suffix, h.gammaAddbackBmCyc, "gammaAddbackBmCyc",
+         "Cycle time vs. #beta coinc #gamma energy (multiple counting of "
+         "#beta's)", par.cycleLength / 10., 0., par.cycleLength, par.nofBins,
+         par.low, par.high);
+    h.list->Sort(); // Sorts the list alphabetically
+
+    return h;
+}
+
+// Adds the status words of the PPG up to the end of a subrun to its cache key.
+// The cycle times of the subrun only depend on these (see CycleTable.h), so
+// the words of the subruns written later don't change the key.
+void AddPPG(Fingerprint &key, TPPG *ppg, ULong64_t end) {
+    if (ppg == nullptr) {
+        key.Add(static_cast<uint64_t>(0));
+        return;
+    }
+    key.Add(static_cast<uint64_t>(ppg->GetCycleLength()));
+    // Last() moves the iterator of the TPPG as well, so it is called before
+    // First()
+    TPPGData *last = ppg->Last();
+    for (TPPGData *data = ppg->First(); data != nullptr; data = ppg->Next()) {
+        if (data->GetTimeStamp() > end) {
+            break;
+        }
+        key.Add(static_cast<uint64_t>(data->GetTimeStamp()));
+        key.Add(static_cast<uint64_t>(data->GetOldPPG()));
+        key.Add(static_cast<uint64_t>(data->GetNewPPG()));
+        if (data == last) {
+            break;
+        }
+    }
+}
+
+// Adds the energy and cross-talk coefficients of every channel to the cache
+// key, in the order of the addresses
+void AddCalibration(Fingerprint &key) {
+    std::map<unsigned int, TChannel *> channels;
+    for (auto &entry : *TChannel::GetChannelMap()) {
+        channels[entry.second->GetAddress()] = entry.second;
+    }
+    key.Add(static_cast<uint64_t>(channels.size()));
+    for (auto &entry : channels) {
+        key.Add(static_cast<uint64_t>(entry.first));
+        std::vector<Float_t> eng = entry.second->GetENGCoeff();
+        key.Add(static_cast<uint64_t>(eng.size()));
+        for (Float_t c : eng) {
+            key.Add(static_cast<double>(c));
+        }
+        std::vector<double> ct = entry.second->GetCTCoeff();
+        key.Add(static_cast<uint64_t>(ct.size()));
+        for (double c : ct) {
+            key.Add(c);
+        }
+    }
+}
+
+// Returns the matrix of the PPG cycle window the time falls into, or nullptr
+// if it is outside of all windows
+SparseMatrix *CycleMatrix(const LeanParameters &par, double timeInCycle,
+                          SparseMatrix *bg, SparseMatrix *on,
+                          SparseMatrix *off) {
+    if (timeInCycle > par.bgStart && timeInCycle < par.bgEnd) {
+        return bg;
+    }
+    if (timeInCycle > par.onStart && timeInCycle < par.onEnd) {
+        return on;
+    }
+    if (timeInCycle > par.offStart && timeInCycle < par.offEnd) {
+        return off;
+    }
+    return nullptr;
+}
+
+// The hits of one event and what is worked out from them once for all variants
+struct EventHits {
+    HitCache gammas;
+    HitCache addbacks;
+    HitCache betas;
+    TimeOrder gammaOrder;
+    TimeOrder addbackOrder;
+    TimeOrder betaOrder;
+    // the pairs within the reach of any variant, for the gamma-beta and
+    // addback-beta pairs the beta is two
+    std::vector<HitPair> ggPairs;
+    std::vector<HitPair> bbPairs;
+    std::vector<HitPair> gbPairs;
+    std::vector<HitPair> aaPairs;
+    std::vector<HitPair> abPairs;
+    // number of betas in coincidence with each gamma (or addback) hit, one
+    // array for each beta tag
+    std::vector<std::vector<int>> gammaTags;
+    std::vector<std::vector<int>> addbackTags;
+    // channel and time since the previous hit in that channel
+    std::vector<std::pair<int, double>> channelDiffs;
+};
+
+// Pairs of hits outside of all time windows are never visited. The time
+// difference spectra need every pair, including the ones that end up in the
+// overflow bins, so with one of them there is no limit.
+struct CoincidenceReach {
+    double gg;
+    double gbLow;
+    double gbHigh;
+    double bb;
+};
+
+CoincidenceReach GetReach(const LeanParameters &par,
+                          const LeanHistograms &h) {
+    CoincidenceReach reach;
+    reach.gg = std::max(par.ggThigh, par.ggBGhigh);
+    reach.gbLow = std::min(par.gbTlow, par.gbBGlow);
+    reach.gbHigh = std::max(par.gbThigh, par.gbBGhigh);
+    reach.bb = 0.;
+    const double all = std::numeric_limits<double>::infinity();
+    if (h.ggTimeDiff != nullptr || h.aaTimeDiff != nullptr) {
+        reach.gg = all;
+    }
+    if (h.gbTimeDiff != nullptr || h.gbTimevsg != nullptr ||
+        h.abTimeDiff != nullptr || h.abTimevsg != nullptr ||
+        h.abTimevsgf != nullptr || h.abTimevsgl != nullptr) {
+        reach.gbLow = -all;
+        reach.gbHigh = all;
+    }
+    if (h.bbTimeDiff != nullptr) {
+        reach.bb = all;
+    }
+    return reach;
+}
+
+// The parts of the event processing the histograms of a variant need
+struct LeanNeeds {
+    bool addbacks = false; // addback hits at all
+    bool betas = false;    // SCEPTAR hits at all
+    bool channelTimes = false;
+    bool gammaPairs = false;
+    bool betaPairs = false;
+    bool gammaBetaPairs = false;
+    bool addbackPairs = false;
+    bool addbackBetaPairs = false;
+    // the number of betas in coincidence with each gamma (addback)
+    bool gammaTag = false;
+    bool addbackTag = false;
+
+    void Add(const LeanNeeds &other) {
+        addbacks |= other.addbacks;
+        betas |= other.betas;
+        channelTimes |= other.channelTimes;
+        gammaPairs |= other.gammaPairs;
+        betaPairs |= other.betaPairs;
+        gammaBetaPairs |= other.gammaBetaPairs;
+        addbackPairs |= other.addbackPairs;
+        addbackBetaPairs |= other.addbackBetaPairs;
+        gammaTag |= other.gammaTag;
+        addbackTag |= other.addbackTag;
+    }
+};
+
+LeanNeeds GetNeeds(const LeanHistograms &h) {
+    LeanNeeds needs;
+    bool ggb = h.ggbmatrix || h.ggbmatrixt || h.ggbmatrixOn ||
+               h.ggbmatrixBg || h.ggbmatrixOff;
+    needs.gammaTag = ggb || h.gammaSinglesB || h.gammaSinglesBCyc;
+    needs.gammaPairs = ggb || h.ggTimeDiff || h.ggmatrix || h.ggmatrixt;
+    needs.gammaBetaPairs =
+        needs.gammaTag || h.gbTimeDiff || h.gbTimevsg || h.gbEnergyvsbTime ||
+        h.gammaSinglesBmCyc || h.gbEnergyvsgTime || h.gammaSinglesBm ||
+        h.bIdVsgId || h.gammaSinglesB_hp || h.grifscep_hp ||
+        h.gammaSinglesBt;
+    needs.betaPairs = (h.bbTimeDiff != nullptr);
+    needs.channelTimes = (h.gTimeDiff != nullptr);
+
+    bool aab = h.aabmatrix || h.aabmatrixt || h.aabmatrixOn ||
+               h.aabmatrixBg || h.aabmatrixOff;
+    needs.addbackTag = aab || h.gammaAddbackB || h.gammaAddbackBCyc;
+    needs.addbackPairs = aab || h.aaTimeDiff || h.aamatrix || h.aamatrixt;
+    needs.addbackBetaPairs =
+        needs.addbackTag || h.abTimeDiff || h.abTimevsg || h.abTimevsgf ||
+        h.abTimevsgl || h.abEnergyvsbTime || h.gammaAddbackBmCyc ||
+        h.abEnergyvsgTime || h.gammaAddbackBm || h.gammaAddbackB_hp ||
+        h.gammaAddbackBt;
+
+    needs.addbacks = needs.addbackPairs || needs.addbackBetaPairs ||
+                     h.gammaAddback || h.gammaAddbackCyc;
+    needs.betas = needs.gammaBetaPairs || needs.addbackBetaPairs ||
+                  needs.betaPairs || h.btimestamp || h.betaSinglesCyc;
+    return needs;
+}
+
+// A beta tag counts the betas above threshold inside the prompt gamma-beta
+// window. Variants with the same window and threshold share their tag.
+struct BetaTag {
+    double low;
+    double high;
+    double threshold;
+};
+
+// What has to be done for each event, worked out from the histograms of all
+// variants. Only what at least one variant needs is done, and the pairs are
+// searched once, with the widest reach of all variants.
+struct LeanStages {
+    LeanNeeds all;
+    CoincidenceReach reach;
+    std::vector<BetaTag> tags;
+    std::vector<bool> gammaTag; // the tag is counted for the gammas
+    std::vector<bool> addbackTag;
+    // for each variant
+    std::vector<LeanNeeds> needs;
+    std::vector<CoincidenceReach> reaches;
+    std::vector<int> tag; // index in tags, or -1
+};
+
+LeanStages GetStages(const std::vector<LeanVariant> &variants,
+                     const std::vector<LeanHistograms> &hists) {
+    LeanStages stages;
+    for (size_t v = 0; v < variants.size(); ++v) {
+        const LeanParameters &par = variants[v].par;
+        LeanNeeds needs = GetNeeds(hists[v]);
+        CoincidenceReach reach = GetReach(par, hists[v]);
+        if (v == 0) {
+            stages.reach = reach;
+        } else {
+            stages.reach.gg = std::max(stages.reach.gg, reach.gg);
+            stages.reach.gbLow = std::min(stages.reach.gbLow, reach.gbLow);
+            stages.reach.gbHigh = std::max(stages.reach.gbHigh, reach.gbHigh);
+            stages.reach.bb = std::max(stages.reach.bb, reach.bb);
+        }
+        int tag = -1;
+        if (needs.gammaTag || needs.addbackTag) {
+            for (size_t t = 0; t < stages.tags.size(); ++t) {
+                if (stages.tags[t].low == par.gbTlow &&
+                    stages.tags[t].high == par.gbThigh &&
+                    stages.tags[t].threshold == par.betaThres) {
+                    tag = t;
+                }
+            }
+            if (tag < 0) {
+                tag = stages.tags.size();
+                stages.tags.push_back({par.gbTlow, par.gbThigh, par.betaThres});
+                stages.gammaTag.push_back(false);
+                stages.addbackTag.push_back(false);
+            }
+            if (needs.gammaTag) {
+                stages.gammaTag[tag] = true;
+            }
+            if (needs.addbackTag) {
+                stages.addbackTag[tag] = true;
+            }
+        }
+        stages.all.Add(needs);
+        stages.needs.push_back(needs);
+        stages.reaches.push_back(reach);
+        stages.tag.push_back(tag);
+    }
+    return stages;
+}
+
+// Counts for every hit of the pairs (one) the betas (two) inside the tag
+void CountBetas(const BetaTag &tag, size_t nHits,
+                const std::vector<HitPair> &pairs, const HitCache &betas,
+                std::vector<int> &nBeta) {
+    nBeta.assign(nHits, 0);
+    for (const HitPair &pair : pairs) {
+        if (betas.energy[pair.two] >= tag.threshold &&
+            tag.low <= pair.timeDiff && pair.timeDiff <= tag.high) {
+            ++nBeta[pair.one];
+        }
+    }
+}
+
+// Histograms the plan did not ask for are nullptr and are skipped
+template <typename H, typename... Args> void FillIf(H *hist, Args... args) {
+    if (hist != nullptr) {
+        hist->Fill(args...);
+    }
+}
+
+// Fills the gamma-gamma-beta matrices with the pairs of gammas (or addbacks).
+// Each pair is visited once, but the matrices are filled like the loop over
+// the betas and both orderings of the gammas did: (E1, E2) once for every
+// beta in coincidence with the first gamma, in the cycle window of the first
+// gamma, and (E2, E1) for the betas of the second one. So these matrices are
+// not symmetric.
+void FillBetaPairs(const LeanParameters &par, const CoincidenceReach &reach,
+                   const CycleTable *cycles, const HitCache &hits,
+                   const std::vector<HitPair> &pairs,
+                   const std::vector<int> &nBeta, SparseMatrix *prompt,
+                   SparseMatrix *random, SparseMatrix *bg, SparseMatrix *on,
+                   SparseMatrix *off) {
+    for (const HitPair &pair : pairs) {
+        double timeDiff = pair.timeDiff;
+        if (timeDiff > reach.gg || nBeta[pair.one] + nBeta[pair.two] == 0) {
+            continue;
+        }
+        bool isPrompt = (par.ggTlow <= timeDiff && timeDiff < par.ggThigh);
+        bool isRandom = (par.ggBGlow <= timeDiff && timeDiff < par.ggBGhigh);
+        int orders[2][2] = {{pair.one, pair.two}, {pair.two, pair.one}};
+        for (const auto &order : orders) {
+            int one = order[0];
+            double e1 = hits.energy[one];
+            double e2 = hits.energy[order[1]];
+            SparseMatrix *cycleMatrix = nullptr;
+            if (isPrompt && cycles != nullptr) {
+                cycleMatrix =
+                    CycleMatrix(par, hits.cycleTime[one], bg, on, off);
+            }
+            for (int b = 0; b < nBeta[one]; ++b) {
+                if (isPrompt) {
+                    FillIf(prompt, e1, e2);
+                    FillIf(cycleMatrix, e1, e2);
+                }
+                if (isRandom) {
+                    // If they are not close enough in time, fill the
+                    // gamma-gamma-beta time-random matrix.
+                    FillIf(random, e1, e2);
+                }
+            }
+        }
+    }
+}
+
+// Fills the histograms of variant v with the hits and pairs of one event
+void FillVariant(const LeanParameters &par, const LeanStages &stages,
+                 size_t v, const CycleTable *cycles, LeanHistograms &h,
+                 const EventHits &ev, SortStats &stats) {
+    const HitCache &gammas = ev.gammas;
+    const HitCache &addbacks = ev.addbacks;
+    const HitCache &betas = ev.betas;
+    const LeanNeeds &needs = stages.needs[v];
+    const CoincidenceReach &reach = stages.reaches[v];
+    const std::vector<int> *nBeta = nullptr;
+
+    // loop over the gammas in the event packet
+    for (int one = 0; one < (int)gammas.size(); ++one) {
+        // We want to put every gamma ray in this event into the singles
+        FillIf(h.gammaSingles, gammas.energy[one]);
+        FillIf(h.gtimestamp, gammas.time[one] / 100000000.);
+        if (cycles != nullptr && h.gammaSinglesCyc != nullptr) {
+            Long_t time = static_cast<Long_t>(gammas.time[one]) %
+                          cycles->CycleLength();
+            // gammaSinglesCyc->Fill((time - ppg->GetLastStatusTime(time,
+            // TPPG::kTapeMove))/1e5,
+            // grif->GetGriffinHit(one)->GetEnergy());
+            h.gammaSinglesCyc->Fill(time / 1e5, gammas.energy[one]);
+        }
+    }
+    if (needs.channelTimes) {
+        for (const auto &diff : ev.channelDiffs) {
+            h.gTimeDiff->Fill(diff.second, diff.first);
+        }
+    }
+    // Now the pairs of gammas that are close enough in time. The matrices
+    // are symmetric, so every pair only has to be filled once
+    if (needs.gammaPairs) {
+        for (const HitPair &pair : ev.ggPairs) {
+            int one = pair.one;
+            int two = pair.two;
+            double timeDiff = pair.timeDiff;
+            // once for (one, two) and once for (two, one)
+            FillIf(h.ggTimeDiff, timeDiff);
+            FillIf(h.ggTimeDiff, timeDiff);
+            if (timeDiff > reach.gg) {
+                continue;
+            }
+            if (par.ggTlow <= timeDiff && timeDiff < par.ggThigh) {
+                // If they are close enough in time, fill the gamma-gamma
+                // matrix, this fills both (E1, E2) and (E2, E1)
+                FillIf(h.ggmatrix, gammas.energy[one], gammas.energy[two]);
+                stats.Accept(v, SortStats::kGGPrompt);
+            }
+            if (par.ggBGlow <= timeDiff && timeDiff < par.ggBGhigh) {
+                // If they are not close enough in time, fill the
+                // time-random gamma-gamma matrix
+                FillIf(h.ggmatrixt, gammas.energy[one], gammas.energy[two]);
+                stats.Accept(v, SortStats::kGGRandom);
+            }
+        }
+    }
+
+    // Now we make beta gamma coincident matrices
+    if (!betas.empty()) {
+        bool plotted_flag = false;
+        for (int b = 0; b < (int)betas.size(); ++b) {
+            if (betas.energy[b] < par.betaThres) {
+                continue;
+            }
+            FillIf(h.btimestamp, betas.time[b] / 1e8);
+            if ((cycles != nullptr) && h.betaSinglesCyc != nullptr &&
+                !plotted_flag) { // Fill on first hit only.
+                h.betaSinglesCyc->Fill(betas.cycleTime[b] / 1e5,
+                                       betas.cycleNumber[b]);
+                //  betaSinglesCyc->Fill((((ULong64_t)(scep->GetHit(b)->GetTime()))%(ppg->GetCycleLength()))/1e5,(scep->GetHit(b)->GetTime())/(ppg->GetCycleLength()));
+                plotted_flag = true;
+            }
+        }
+        // every beta above threshold against every other beta, b2 is the
+        // later one of the pair
+        if (needs.betaPairs) {
+            for (const HitPair &pair : ev.bbPairs) {
+                int b = pair.one;
+                int b2 = pair.two;
+                if (betas.energy[b] >= par.betaThres) {
+                    h.bbTimeDiff->Fill(-pair.timeDiff, betas.energy[b]);
+                }
+                if (betas.energy[b2] >= par.betaThres) {
+                    h.bbTimeDiff->Fill(pair.timeDiff, betas.energy[b2]);
+                }
+            }
+        }
+        // Be careful about time ordering!!!! betas and gammas are
+        // not symmetric out of the DAQ, timeDiff is t(gamma) - t(beta)
+        if (needs.gammaBetaPairs) {
+            for (const HitPair &pair : ev.gbPairs) {
+                int one = pair.one;
+                int b = pair.two;
+                double timeDiff = pair.timeDiff;
+                if (betas.energy[b] < par.betaThres) {
+                    continue;
+                }
+                // Fill the time diffrence spectra
+                FillIf(h.gbTimeDiff, timeDiff);
+                FillIf(h.gbTimevsg, timeDiff, gammas.energy[one]);
+                if (timeDiff < reach.gbLow || timeDiff > reach.gbHigh) {
+                    continue;
+                }
+                if (par.gbTlow <= timeDiff && timeDiff <= par.gbThigh) {
+                    stats.Accept(v, SortStats::kGBPrompt);
+                    FillIf(h.gbEnergyvsbTime, betas.time[b],
+                           gammas.energy[one]);
+                    if (cycles != nullptr && h.gammaSinglesBmCyc != nullptr) {
+                        ULong64_t time =
+                            static_cast<ULong64_t>(gammas.time[one]) %
+                            cycles->CycleLength();
+                        h.gammaSinglesBmCyc->Fill(time / 1e5,
+                                                  gammas.energy[one]);
+                    }
+                    // Plots a gamma energy spectrum in coincidence with a
+                    // beta
+                    FillIf(h.gbEnergyvsgTime, gammas.time[one] / 1e8,
+                           gammas.energy[one]);
+                    FillIf(h.gammaSinglesBm, gammas.energy[one]);
+                    FillIf(h.bIdVsgId, betas.detector[b], gammas.channel[one]);
+                    FillIf(h.gammaSinglesB_hp, gammas.energy[one],
+                           betas.detector[b]);
+                    FillIf(h.grifscep_hp, gammas.channel[one],
+                           betas.detector[b]);
+                }
+                if (par.gbBGlow <= timeDiff && timeDiff <= par.gbBGhigh) {
+                    FillIf(h.gammaSinglesBt, gammas.energy[one]);
+                    stats.Accept(v, SortStats::kGBRandom);
+                }
+            }
+        }
+        if (needs.gammaTag) {
+            nBeta = &ev.gammaTags[stages.tag[v]];
+        }
+    }
+    if (nBeta != nullptr) {
+        // the singles are only filled once for every gamma with a beta, we
+        // don't want to bin twice just because we have two betas
+        for (int one = 0; one < (int)gammas.size(); ++one) {
+            if ((*nBeta)[one] == 0) {
+                continue;
+            }
+            FillIf(h.gammaSinglesB, gammas.energy[one]);
+            if (cycles != nullptr) {
+                // gammaSinglesBCyc->Fill(ppg->GetTimeInCycle((ULong64_t)(grif->GetHit(one)->GetTimeStamp()))/1e5,
+                // grif->GetGriffinHit(one)->GetEnergy());
+                FillIf(h.gammaSinglesBCyc, gammas.cycleTimeStamp[one] / 1e5,
+                       gammas.energy[one]);
+            }
+        }
+        FillBetaPairs(par, reach, cycles, gammas, ev.ggPairs, *nBeta,
+                      h.ggbmatrix, h.ggbmatrixt, h.ggbmatrixBg, h.ggbmatrixOn,
+                      h.ggbmatrixOff);
+    }
+
+    // loop over the addbacks in the event packet
+    for (int one = 0; one < (int)addbacks.size(); ++one) {
+        // We want to put every gamma ray in this event into the singles
+        FillIf(h.gammaAddback, addbacks.energy[one]);
+        if (cycles != nullptr && h.gammaAddbackCyc != nullptr) {
+            Long_t time = static_cast<Long_t>(addbacks.time[one]) %
+                          cycles->CycleLength();
+            h.gammaAddbackCyc->Fill(time / 1e5, addbacks.energy[one]);
+        }
+    }
+    // We now want to loop over the pairs of addbacks in this packet
+    if (needs.addbackPairs) {
+        for (const HitPair &pair : ev.aaPairs) {
+            int one = pair.one;
+            int two = pair.two;
+            double timeDiff = pair.timeDiff;
+            // once for (one, two) and once for (two, one)
+            // VINZENZ I THINK THIS IS BREAKING THIS FOR SOME REASON.
+            FillIf(h.aaTimeDiff, timeDiff);
+            FillIf(h.aaTimeDiff, timeDiff);
+            if (timeDiff > reach.gg) {
+                continue;
+            }
+            if (par.ggTlow <= timeDiff && timeDiff < par.ggThigh) {
+                // If they are close enough in time, fill the gamma-gamma
+                // matrix, this fills both (E1, E2) and (E2, E1)
+                FillIf(h.aamatrix, addbacks.energy[one], addbacks.energy[two]);
+                stats.Accept(v, SortStats::kAAPrompt);
+            }
+            if (par.ggBGlow <= timeDiff && timeDiff < par.ggBGhigh) {
+                // If they are not close enough in time, fill the
+                // time-random gamma-gamma matrix
+                FillIf(h.aamatrixt, addbacks.energy[one],
+                       addbacks.energy[two]);
+                stats.Accept(v, SortStats::kAARandom);
+            }
+        }
+    }
+
+    // Now we make beta gamma coincident matrices
+    nBeta = nullptr;
+    if (!betas.empty()) {
+        // Be careful about time ordering!!!! betas and gammas are
+        // not symmetric out of the DAQ, timeDiff is t(gamma) - t(beta)
+        if (needs.addbackBetaPairs) {
+            for (const HitPair &pair : ev.abPairs) {
+                int one = pair.one;
+                int b = pair.two;
+                double timeDiff = pair.timeDiff;
+                if (betas.energy[b] < par.betaThres) {
+                    continue;
+                }
+                // Fill the time diffrence spectra
+                FillIf(h.abTimeDiff, timeDiff);
+                FillIf(h.abTimevsg, timeDiff, addbacks.energy[one]);
+                if (b == 0) {
+                    FillIf(h.abTimevsgf, timeDiff, addbacks.energy[one]);
+                }
+                if (b == (int)betas.size() - 1) {
+                    FillIf(h.abTimevsgl, timeDiff, addbacks.energy[one]);
+                }
+                if (timeDiff < reach.gbLow || timeDiff > reach.gbHigh) {
+                    continue;
+                }
+                if (par.gbTlow <= timeDiff && timeDiff <= par.gbThigh) {
+                    stats.Accept(v, SortStats::kABPrompt);
+                    FillIf(h.abEnergyvsbTime, betas.time[b],
+                           addbacks.energy[one]);
+                    if (cycles != nullptr && h.gammaAddbackBmCyc != nullptr) {
+                        ULong64_t time =
+                            static_cast<ULong64_t>(addbacks.time[one]) %
+                            cycles->CycleLength();
+                        h.gammaAddbackBmCyc->Fill(time / 1e5,
+                                                  addbacks.energy[one]);
+                    }
+                    // Plots a gamma energy spectrum in coincidence with
+                    // a beta
+                    FillIf(h.abEnergyvsgTime, addbacks.time[one] / 1e8,
+                           addbacks.energy[one]);
+                    FillIf(h.gammaAddbackBm, addbacks.energy[one]);
+                    FillIf(h.gammaAddbackB_hp, addbacks.energy[one],
+                           betas.detector[b]);
+                }
+                if (par.gbBGlow <= timeDiff && timeDiff <= par.gbBGhigh) {
+                    FillIf(h.gammaAddbackBt, addbacks.energy[one]);
+                    stats.Accept(v, SortStats::kABRandom);
+                }
+            }
+        }
+        if (needs.addbackTag) {
+            nBeta = &ev.addbackTags[stages.tag[v]];
+        }
+    }
+    if (nBeta != nullptr) {
+        // the singles are only filled once for every addback with a beta
+        for (int one = 0; one < (int)addbacks.size(); ++one) {
+            if ((*nBeta)[one] == 0) {
+                continue;
+            }
+            FillIf(h.gammaAddbackB, addbacks.energy[one]);
+            if (cycles != nullptr) {
+                FillIf(h.gammaAddbackBCyc, addbacks.cycleTime[one] / 1e5,
+                       addbacks.energy[one]);
+            }
+        }
+        FillBetaPairs(par, reach, cycles, addbacks, ev.aaPairs, *nBeta,
+                      h.aabmatrix, h.aabmatrixt, h.aabmatrixBg, h.aabmatrixOn,
+                      h.aabmatrixOff);
+    }
+}
+
+// Fills the histograms of all variants with the hits of one event. Sorting the
+// hits in time, listing the pairs and counting the betas of each gamma is done
+// once here, the variants only apply their windows to the results. The time
+// is split between the coincidence search and the fills.
+void FillEvent(const std::vector<LeanVariant> &variants,
+               const LeanStages &stages, const CycleTable *cycles,
+               std::vector<LeanHistograms> &hists, EventHits &ev,
+               ChannelTimes &times, SortStats &stats, StageClock &clock) {
+    const LeanNeeds &needs = stages.all;
+    const CoincidenceReach &reach = stages.reach;
+    const HitCache &gammas = ev.gammas;
+
+    if (needs.channelTimes) {
+        ev.channelDiffs.clear();
+        for (int one = 0; one < (int)gammas.size(); ++one) {
+            int channel = gammas.channel[one];
+            if (channel < 0 || channel >= (int)times.last.size()) {
+                continue;
+            }
+            if (times.last[channel] > 0) {
+                ev.channelDiffs.push_back(std::make_pair(
+                    channel, gammas.time[one] - times.last[channel]));
+            } else if (times.first[channel] < 0) {
+                // first hit of this channel in our entry range, the
+                // difference to the previous range is filled after merging
+                times.first[channel] = gammas.time[one];
+            }
+            times.last[channel] = gammas.time[one];
+        }
+    }
+
+    // small events are faster with the plain loops over all pairs, the hits
+    // are only sorted for the sweep
+    const HitCache &addbacks = ev.addbacks;
+    const HitCache &betas = ev.betas;
+    bool sweepGammas = gammas.size() >= kSweepMultiplicity;
+    bool sweepAddbacks = addbacks.size() >= kSweepMultiplicity;
+    bool sweepBetas = betas.size() >= kSweepMultiplicity;
+    if (sweepGammas && (needs.gammaPairs || needs.gammaBetaPairs)) {
+        ev.gammaOrder.Sort(gammas.time);
+    }
+    long tested = 0;
+    if (needs.gammaPairs) {
+        if (sweepGammas) {
+            ListPairs(ev.gammaOrder, reach.gg, ev.ggPairs);
+        } else {
+            ListAllPairs(gammas.time, reach.gg, ev.ggPairs);
+        }
+        tested += ev.ggPairs.size();
+    }
+    if (sweepAddbacks && (needs.addbackPairs || needs.addbackBetaPairs)) {
+        ev.addbackOrder.Sort(addbacks.time);
+    }
+    if (needs.addbackPairs) {
+        if (sweepAddbacks) {
+            ListPairs(ev.addbackOrder, reach.gg, ev.aaPairs);
+        } else {
+            ListAllPairs(addbacks.time, reach.gg, ev.aaPairs);
+        }
+        tested += ev.aaPairs.size();
+    }
+    if (!betas.empty()) {
+        // the sweep over gammas and betas needs both of them sorted
+        if (sweepBetas && !sweepGammas && needs.gammaBetaPairs) {
+            ev.gammaOrder.Sort(gammas.time);
+        }
+        if (sweepBetas && !sweepAddbacks && needs.addbackBetaPairs) {
+            ev.addbackOrder.Sort(addbacks.time);
+        }
+        bool sortBetas = sweepBetas || (sweepGammas && needs.gammaBetaPairs) ||
+                         (sweepAddbacks && needs.addbackBetaPairs);
+        if (sortBetas) {
+            ev.betaOrder.Sort(betas.time);
+        }
+        if (needs.betaPairs) {
+            if (sweepBetas) {
+                ListPairs(ev.betaOrder, reach.bb, ev.bbPairs);
+            } else {
+                ListAllPairs(betas.time, reach.bb, ev.bbPairs);
+            }
+            tested += ev.bbPairs.size();
+        }
+        if (needs.gammaBetaPairs) {
+            if (sweepGammas || sweepBetas) {
+                ListCrossPairs(ev.gammaOrder, ev.betaOrder, reach.gbLow,
+                               reach.gbHigh, ev.gbPairs);
+            } else {
+                ListAllCrossPairs(gammas.time, betas.time, reach.gbLow,
+                                  reach.gbHigh, ev.gbPairs);
+            }
+            tested += ev.gbPairs.size();
+        }
+        if (needs.addbackBetaPairs) {
+            if (sweepAddbacks || sweepBetas) {
+                ListCrossPairs(ev.addbackOrder, ev.betaOrder, reach.gbLow,
+                               reach.gbHigh, ev.abPairs);
+            } else {
+                ListAllCrossPairs(addbacks.time, betas.time, reach.gbLow,
+                                  reach.gbHigh, ev.abPairs);
+            }
+            tested += ev.abPairs.size();
+        }
+        ev.gammaTags.resize(stages.tags.size());
+        ev.addbackTags.resize(stages.tags.size());
+        for (size_t t = 0; t < stages.tags.size(); ++t) {
+            if (stages.gammaTag[t]) {
+                CountBetas(stages.tags[t], gammas.size(), ev.gbPairs, ev.betas,
+                           ev.gammaTags[t]);
+            }
+            if (stages.addbackTag[t]) {
+                CountBetas(stages.tags[t], ev.addbacks.size(), ev.abPairs,
+                           ev.betas, ev.addbackTags[t]);
+            }
+        }
+    }
+
+    stats.Add(SortStats::kPairsTested, tested);
+    clock.Lap(stats, SortStats::kCoincidence);
+
+    for (size_t v = 0; v < variants.size(); ++v) {
+        FillVariant(variants[v].par, stages, v, cycles, hists[v], ev, stats);
+    }
+    clock.Lap(stats, SortStats::kFill);
+}
+
+// Counts the hits of one event
+void CountHits(const EventHits &ev, SortStats &stats) {
+    stats.Add(SortStats::kEntries);
+    stats.Add(SortStats::kGammaHits, ev.gammas.size());
+    stats.Add(SortStats::kAddbackHits, ev.addbacks.size());
+    stats.Add(SortStats::kBetaHits, ev.betas.size());
+    // the sort keeps them, kMakeCalMatrices rejects them
+    long pileup = 0;
+    for (int kValue : ev.gammas.kValue) {
+        pileup += (kValue != kNominalKValue);
+    }
+    stats.Add(SortStats::kPileupHits, pileup);
+}
+
+// Sorts the entries [firstEntry, lastEntry) of the tree into the histograms.
+// The tree has to be owned by the calling thread, as the TGriffin and TSceptar
+// branch buffers are set up here.
+void SortEntries(TTree *tree, const CycleTable *cycles,
+                 const std::vector<LeanVariant> &variants,
+                 const LeanStages &stages, std::vector<LeanHistograms> &hists,
+                 long firstEntry, long lastEntry, ChannelTimes &times,
+                 std::atomic<long> *progress, long maxEntries,
+                 SortStats &stats) {
+    // set up branches
+    // Each branch can hold multiple hits
+    // ie TGriffin grif holds 3 gamma rays on a triples event
+    TGriffin *grif = nullptr;
+    TSceptar *scep = nullptr;
+    tree->SetBranchAddress("TGriffin",
+                           &grif); // We assume we always have a Griffin
+
+    bool gotSceptar;
+    if (!stages.all.betas || tree->FindBranch("TSceptar") == nullptr) {
+        // We check to see if we have a Scepter branch in the analysis tree,
+        // and if any of the histograms needs it
+        gotSceptar = false;
+    } else {
+        tree->SetBranchAddress("TSceptar", &scep);
+        gotSceptar = true;
+    }
+
+    EventHits ev;
+    StageClock clock;
+
+    long entry;
+    for (entry = firstEntry; entry < lastEntry; ++entry) {
+        clock.Start();
+        tree->GetEntry(entry);
+        clock.Lap(stats, SortStats::kRead);
+        /*
+              if(runInfo->SubRunNumber() > 21) {
+                //in run 04921 we got a wrap-around of the timestamp within
+           subrun 22
+                //so from subrun 22 on we add 2^42 to each timestamp that is
+           less than 2^41
+                ULong_t thres = 0x1;
+                thres = thres<<41;
+                for(one = 0; one < (int) grif->GetMultiplicity(); ++one) {
+                  if(grif->GetGriffinHit(one)->GetTimeStamp() < thres) {
+                    grif->GetGriffinHit(one)->SetTimeStamp(grif->GetGriffinHit(one)->GetTimeStamp()
+           + 2*thres);
+                  }
+                }
+                for(one = 0; one < (int) scep->GetMultiplicity(); ++one) {
+                  if(scep->GetSceptarHit(one)->GetTimeStamp() < thres) {
+                    scep->GetSceptarHit(one)->SetTimeStamp(scep->GetSceptarHit(one)->GetTimeStamp()
+           + 2*thres);
+                  }
+                }
+              }
+        */
+        grif->ResetAddback();
+        grif->SetDefaultGainType(TGriffin::kLowGain);
+        ApplyResiduals(Residuals, grif);
+        // decode every hit once, the histograms are filled from the cache
+        ev.gammas.FillGriffin(grif, cycles);
+        if (stages.all.addbacks) {
+            ev.addbacks.FillAddback(grif, cycles);
+        }
+        if (gotSceptar) {
+            ev.betas.FillSceptar(scep, cycles);
+        }
+        clock.Lap(stats, SortStats::kCalibrate);
+        CountHits(ev, stats);
+        FillEvent(variants, stages, cycles, hists, ev, times, stats, clock);
+
+        if ((entry % 10000) == 0) {
+            long done = progress->fetch_add(10000) + 10000;
+            printf("Completed %ld of %ld \r", done, maxEntries);
+            fflush(stdout);
+        }
+    }
+}
+
+// Same as SortEntries, but the hits are read from a hit store
+void SortStoreEntries(const HitStore *store, const CycleTable *cycles,
+                      const std::vector<LeanVariant> &variants,
+                      const LeanStages &stages,
+                      std::vector<LeanHistograms> &hists, long firstEntry,
+                      long lastEntry, ChannelTimes &times,
+                      std::atomic<long> *progress, long maxEntries,
+                      SortStats &stats) {
+    EventHits ev;
+    StageClock clock;
+
+    // the hits of the store are calibrated already, so it is all reading
+    for (long entry = firstEntry; entry < lastEntry; ++entry) {
+        clock.Start();
+        store->Fill(entry, kGriffinHits, ev.gammas, cycles);
+        if (stages.all.addbacks) {
+            store->Fill(entry, kAddbackHits, ev.addbacks, cycles);
+        }
+        if (stages.all.betas) {
+            store->Fill(entry, kSceptarHits, ev.betas, cycles);
+        }
+        clock.Lap(stats, SortStats::kRead);
+        CountHits(ev, stats);
+        FillEvent(variants, stages, cycles, hists, ev, times, stats, clock);
+
+        if ((entry % 10000) == 0) {
+            long done = progress->fetch_add(10000) + 10000;
+            printf("Completed %ld of %ld \r", done, maxEntries);
+            fflush(stdout);
+        }
+    }
+}
+
+// One set of histograms for every variant
+std::vector<LeanHistograms>
+CreateHistograms(const std::vector<LeanVariant> &variants, TPPG *ppg) {
+    std::vector<LeanHistograms> hists;
+    for (const LeanVariant &variant : variants) {
+        std::string suffix = variant.name.empty() ? "" : "_" + variant.name;
+        hists.push_back(
+            CreateHistograms(variant.par, variant.selection, suffix, ppg));
+    }
+    return hists;
+}
+
+// Stats that count the accepted pairs of every variant
+SortStats CreateStats(const std::vector<LeanVariant> &variants) {
+    std::vector<std::string> names;
+    for (const LeanVariant &variant : variants) {
+        names.push_back(variant.name);
+    }
+    SortStats stats;
+    stats.SetVariants(names);
+    return stats;
+}
+
+// Reads the plan file and creates the first set of histograms. Returns false
+// if the plan file can not be read.
+bool SetUpSort(const char *planFile, TPPG *ppg,
+               std::vector<LeanVariant> &variants,
+               std::vector<LeanHistograms> &hists, LeanStages &stages) {
+    // The windows and histograms of every variant come from the plan file
+    if (!LoadLeanPlan(planFile, variants)) {
+        return false;
+    }
+
     if (ppg != nullptr) {
-        list->Add(ppg);
+        for (LeanVariant &variant : variants) {
+            variant.par.cycleLength = ppg->GetCycleLength() / 1e5;
+        }
     }
 
-    list->Add(runInfo);
+    hists = CreateHistograms(variants, ppg);
+    for (const LeanVariant &variant : variants) {
+        for (const std::string &name : variant.selection.names) {
+            if (hists[0].known.count(name) == 0) {
+                printf("Unknown histogram '%s' in plan file '%s'!\n",
+                       name.c_str(), planFile);
+            }
+        }
+    }
+    stages = GetStages(variants, hists);
+    if (variants.size() > 1) {
+        printf("Sorting %d variants of the windows in one pass\n",
+               (int)variants.size());
+    }
+    return true;
+}
+
+// A skim (see HitStore.h) only has the events that pass its selection. A
+// histogram can be sorted from it if it gets nothing from the other events:
+// the coincidence histograms need two gammas, the beta gated ones a beta
+// within the gamma-beta reach of their variant and the cycle window matrices
+// a gamma in one of the windows. Returns false, and says which histogram
+// would miss events, if the plan asks for anything else.
+bool SkimCompatible(const HitStoreSelection &sel,
+                    const std::vector<LeanVariant> &variants,
+                    const std::vector<LeanHistograms> &hists,
+                    const LeanStages &stages) {
+    for (size_t v = 0; v < hists.size(); ++v) {
+        const LeanHistograms &h = hists[v];
+        const LeanParameters &par = variants[v].par;
+        const CoincidenceReach &reach = stages.reaches[v];
+        std::set<const TObject *> pairs = {
+            h.ggTimeDiff,  h.ggmatrix,    h.ggmatrixt,    h.ggbmatrix,
+            h.ggbmatrixt,  h.ggbmatrixOn, h.ggbmatrixBg,  h.ggbmatrixOff,
+            h.aaTimeDiff,  h.aamatrix,    h.aamatrixt,    h.aabmatrix,
+            h.aabmatrixt,  h.aabmatrixOn, h.aabmatrixBg,  h.aabmatrixOff};
+        std::set<const TObject *> betas = {
+            h.bIdVsgId,         h.gammaSinglesB,     h.gammaSinglesBm,
+            h.gammaSinglesBt,   h.gbTimeDiff,        h.gbEnergyvsgTime,
+            h.gbEnergyvsbTime,  h.gammaSinglesB_hp,  h.ggbmatrix,
+            h.ggbmatrixt,       h.grifscep_hp,       h.gbTimevsg,
+            h.ggbmatrixOn,      h.ggbmatrixBg,       h.ggbmatrixOff,
+            h.gammaSinglesBCyc, h.gammaSinglesBmCyc, h.gammaAddbackB,
+            h.gammaAddbackBm,   h.gammaAddbackBt,    h.abTimeDiff,
+            h.abEnergyvsgTime,  h.abEnergyvsbTime,   h.gammaAddbackB_hp,
+            h.aabmatrix,        h.aabmatrixt,        h.abTimevsg,
+            h.abTimevsgf,       h.abTimevsgl,        h.aabmatrixOn,
+            h.aabmatrixBg,      h.aabmatrixOff,      h.gammaAddbackBCyc,
+            h.gammaAddbackBmCyc};
+        std::set<const TObject *> cycleWindows = {
+            h.ggbmatrixOn, h.ggbmatrixBg, h.ggbmatrixOff,
+            h.aabmatrixOn, h.aabmatrixBg, h.aabmatrixOff};
+        // the addback-beta pairs have the same reach
+        bool betaInside =
+            sel.gbLow <= reach.gbLow && reach.gbHigh <= sel.gbHigh;
+        double cycleLow = std::min({par.bgStart, par.onStart, par.offStart});
+        double cycleHigh = std::max({par.bgEnd, par.onEnd, par.offEnd});
+        bool cycleInside =
+            sel.cycleLow <= cycleLow && cycleHigh <= sel.cycleHigh;
+        for (int k = 0; k < h.list->GetSize(); ++k) {
+            const TObject *obj = h.list->At(k);
+            bool keeps =
+                (sel.minGammas <= 1 ||
+                 (sel.minGammas == 2 && pairs.count(obj) > 0)) &&
+                (!sel.betaWindow || (betaInside && betas.count(obj) > 0)) &&
+                (!sel.cycleWindow ||
+                 (cycleInside && cycleWindows.count(obj) > 0));
+            if (!keeps) {
+                printf("Histogram '%s' needs events that are not in the skim "
+                       "(it has %s)!\n",
+                       obj->GetName(), sel.Describe().c_str());
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
+// Adds other to hists. All sets are created in the same order, so we can add
+// them up entry by entry.
+void AddHistograms(std::vector<LeanHistograms> &hists,
+                   const std::vector<LeanHistograms> &other) {
+    for (size_t v = 0; v < hists.size(); ++v) {
+        TList *list = hists[v].list;
+        TList *shard = other[v].list;
+        for (int k = 0; k < list->GetSize(); ++k) {
+            TObject *obj = list->At(k);
+            if (auto *hist = dynamic_cast<TH1 *>(obj)) {
+                hist->Add(static_cast<TH1 *>(shard->At(k)));
+            } else if (auto *mat = dynamic_cast<SparseMatrix *>(obj)) {
+                mat->Add(static_cast<SparseMatrix *>(shard->At(k)));
+            }
+        }
+    }
+}
+
+void ResetHistograms(std::vector<LeanHistograms> &hists) {
+    for (LeanHistograms &h : hists) {
+        TIter next(h.list);
+        while (TObject *obj = next()) {
+            if (auto *hist = dynamic_cast<TH1 *>(obj)) {
+                hist->Reset();
+            } else if (auto *mat = dynamic_cast<SparseMatrix *>(obj)) {
+                mat->Reset();
+            }
+        }
+    }
+}
+
+void DeleteHistograms(std::vector<LeanHistograms> &hists) {
+    for (LeanHistograms &h : hists) {
+        h.list->Delete();
+        delete h.list;
+        h.list = nullptr;
+    }
+}
+
+// Fills the channel time differences that crossed a boundary between the
+// ranges of entries, the ranges have to be in the order of the data
+void FillBoundaryTimes(const std::vector<ChannelTimes> &times,
+                       std::vector<LeanHistograms> &hists) {
+    std::vector<long> lastTimeStamp(65, 0);
+    for (const ChannelTimes &range : times) {
+        for (size_t chan = 0; chan < lastTimeStamp.size(); ++chan) {
+            if (range.first[chan] >= 0. && lastTimeStamp[chan] > 0) {
+                for (LeanHistograms &h : hists) {
+                    FillIf(h.gTimeDiff,
+                           range.first[chan] - lastTimeStamp[chan], chan);
+                }
+            }
+            if (range.last[chan] > 0) {
+                lastTimeStamp[chan] = range.last[chan];
+            }
+        }
+    }
+}
+
+// A time-random background histogram and the prompt one it is subtracted
+// from
+struct BackgroundPair {
+    TObject *random;
+    const TObject *prompt;
+    double scale;
+};
+
+std::vector<BackgroundPair> GetBackgroundPairs(const LeanParameters &par,
+                                               const LeanHistograms &h) {
+    Double_t ggBGScale =
+        (par.ggThigh - par.ggTlow) / (par.ggBGhigh - par.ggBGlow);
+    Double_t gbBGScale =
+        (par.gbThigh - par.gbTlow) / (par.gbBGhigh - par.gbBGlow);
+    std::vector<BackgroundPair> pairs;
+    // a background histogram always comes with its prompt one
+    auto add = [&pairs](TObject *random, const TObject *prompt,
+                        double scale) {
+        if (random != nullptr) {
+            pairs.push_back({random, prompt, scale});
+        }
+    };
+    add(h.ggmatrixt, h.ggmatrix, ggBGScale);
+    add(h.ggbmatrixt, h.ggbmatrix, ggBGScale);
+    add(h.gammaSinglesBt, h.gammaSinglesB, gbBGScale);
+    add(h.aamatrixt, h.aamatrix, ggBGScale);
+    add(h.aabmatrixt, h.aabmatrix, ggBGScale);
+    add(h.gammaAddbackBt, h.gammaAddbackB, gbBGScale);
+    return pairs;
+}
+
+// random = prompt - scale * random
+void SubtractBackground(TObject *random, const TObject *prompt,
+                        double scale) {
+    if (auto *mat = dynamic_cast<SparseMatrix *>(random)) {
+        mat->Scale(-scale);
+        mat->Add(static_cast<const SparseMatrix *>(prompt));
+    } else if (auto *hist = dynamic_cast<TH1 *>(random)) {
+        hist->Scale(-scale);
+        hist->Add(static_cast<const TH1 *>(prompt));
+    }
+}
+
+// Subtracts the time-random background and puts the histograms of all
+// variants into one list, sorted by name. The lists of the sets are deleted.
+TList *CollectHistograms(const std::vector<LeanVariant> &variants,
+                         std::vector<LeanHistograms> &hists) {
+    TList *list = new TList;
+    for (size_t v = 0; v < variants.size(); ++v) {
+        LeanHistograms &h = hists[v];
+        for (const BackgroundPair &pair :
+             GetBackgroundPairs(variants[v].par, h)) {
+            SubtractBackground(pair.random, pair.prompt, pair.scale);
+        }
+
+        TIter next(h.list);
+        while (TObject *obj = next()) {
+            list->Add(obj);
+        }
+        delete h.list;
+        h.list = nullptr;
+    }
+    list->Sort(); // Sorts the list alphabetically
+    return list;
+}
+
+void PrintMatrixMemory(TList *list) {
+    size_t matrixMemory = 0;
+    TIter next(list);
+    while (TObject *obj = next()) {
+        if (auto *mat = dynamic_cast<SparseMatrix *>(obj)) {
+            matrixMemory += mat->GetMemoryUsage();
+        }
+    }
+    printf("Coincidence matrices use %.1f MB\n", matrixMemory / 1048576.);
+}
+
+TList *LeanMatrices(TTree *tree, TPPG *ppg, TGRSIRunInfo *runInfo,
+                    long maxEntries = 0, TStopwatch *w = nullptr,
+                    int nThreads = 1, Long64_t cacheSize = 100 * 1048576,
+                    const HitStore *store = nullptr,
+                    const char *planFile = nullptr,
+                    SortStats *report = nullptr) {
+    if (runInfo == nullptr) {
+        return nullptr;
+    }
+
+    TGRSIOptions::AnalysisOptions()->SetCorrectCrossTalk(true);
+
+    ///////////////////////////////////// SETUP
+    //////////////////////////////////////////
+    std::vector<LeanVariant> variants;
+    std::vector<LeanHistograms> hists;
+    LeanStages stages;
+    if (!SetUpSort(planFile, ppg, variants, hists, stages)) {
+        return nullptr;
+    }
+    if (store != nullptr && store->IsSkim() &&
+        !SkimCompatible(store->GetSelection(), variants, hists, stages)) {
+        return nullptr;
+    }
+
+    if (w == nullptr) {
+        w = new TStopwatch;
+        w->Start();
+    }
+
+    // The cycle of every hit is looked up once, when the event is read, and
+    // without searching the TPPG
+    CycleTable cycleTable(ppg);
+    const CycleTable *cycles = (ppg != nullptr) ? &cycleTable : nullptr;
     if (ppg != nullptr) {
         TGRSIDetectorHit::SetPPGPtr(ppg);
     }
 
-    ///////////////////////////////////// PROCESSING
-    ////////////////////////////////////////
+    ///////////////////////////////////// PROCESSING
+    ////////////////////////////////////////
+
+    // The calibration is global, so the caller has to load it (see
+    // LoadCalibration) before any of the sorting threads start
+    if (!Residuals.Empty()) {
+        printf("Loading in energy residuals\n");
+    }
+
+    std::cout << std::fixed
+              << std::setprecision(
+                     1); // This just make outputs not look terrible
+    long nEntries =
+        (store != nullptr) ? store->GetEntries() : tree->GetEntries();
+    if (maxEntries == 0 || maxEntries > nEntries) {
+        maxEntries = nEntries;
+    }
+
+    // I'm starting at entry 1 because of the weird high stamp of 4.
+    long firstEntry = 1;
+    if (nThreads < 1) {
+        nThreads = 1;
+    }
+    if (nThreads > maxEntries - firstEntry) {
+        nThreads = std::max(1L, maxEntries - firstEntry);
+    }
+
+    // We only read the members of the GRIFFIN and SCEPTAR hits the sort
+    // uses, every other branch of the tree is switched off
+    ReadPlan plan;
+    plan.AddBranch("TGriffin");
+    if (stages.all.betas) {
+        plan.AddBranch("TSceptar");
+    }
+    plan.SetCacheSize(cacheSize);
+    if (store == nullptr) {
+        plan.Apply(tree, firstEntry, maxEntries, true);
+    } else {
+        printf("Reading the hits from the hit store\n");
+    }
+
+    std::atomic<long> progress(0);
+    std::vector<ChannelTimes> times(nThreads);
+    std::vector<SortStats> stats(nThreads, CreateStats(variants));
+
+    if (nThreads == 1 && store != nullptr) {
+        SortStoreEntries(store, cycles, variants, stages, hists, firstEntry,
+                         maxEntries, times[0], &progress, maxEntries,
+                         stats[0]);
+    } else if (nThreads == 1) {
+        SortEntries(tree, cycles, variants, stages, hists, firstEntry,
+                    maxEntries, times[0], &progress, maxEntries, stats[0]);
+    } else {
+        // Every thread opens the file on its own (or reads its part of the
+        // hit store) and fills its own set of histograms, the first set is
+        // the one we return. The threads open files and create histograms,
+        // so ROOT has to be thread safe, whoever calls this.
+        ROOT::EnableThreadSafety();
+        printf("Sorting with %d threads\n", nThreads);
+        std::string fileName = tree->GetCurrentFile()->GetName();
+        std::string treeName = tree->GetName();
+
+        std::vector<std::vector<LeanHistograms>> shards(nThreads);
+        shards[0] = hists;
+        TH1::AddDirectory(false);
+        for (int i = 1; i < nThreads; ++i) {
+            shards[i] = CreateHistograms(variants, ppg);
+        }
+        TH1::AddDirectory(true);
+
+        long chunk = (maxEntries - firstEntry) / nThreads;
+        std::vector<std::thread> workers;
+        for (int i = 0; i < nThreads; ++i) {
+            long first = firstEntry + i * chunk;
+            long last = (i == nThreads - 1) ? maxEntries : first + chunk;
+            workers.emplace_back([&, i, first, last]() {
+                if (store != nullptr) {
+                    SortStoreEntries(store, cycles, variants, stages, shards[i],
+                                     first, last, times[i], &progress,
+                                     maxEntries, stats[i]);
+                    return;
+                }
+                TFile workerFile(fileName.c_str());
+                auto *workerTree =
+                    dynamic_cast<TTree *>(workerFile.Get(treeName.c_str()));
+                if (workerTree == nullptr) {
+                    printf("Thread %d failed to find tree '%s' in '%s'!\n", i,
+                           treeName.c_str(), fileName.c_str());
+                    return;
+                }
+                plan.Apply(workerTree, first, last);
+                SortEntries(workerTree, cycles, variants, stages, shards[i],
+                            first, last, times[i], &progress, maxEntries,
+                            stats[i]);
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        for (int i = 1; i < nThreads; ++i) {
+            AddHistograms(hists, shards[i]);
+            DeleteHistograms(shards[i]);
+        }
+        FillBoundaryTimes(times, hists);
+    }
+
+    StageClock clock;
+    TList *list = CollectHistograms(variants, hists);
+    clock.Lap(stats[0], SortStats::kBackground);
+    if (report != nullptr) {
+        for (const SortStats &threadStats : stats) {
+            report->Add(threadStats);
+        }
+    }
+
+    if (ppg != nullptr) {
+        list->Add(ppg);
+    }
+
+    list->Add(runInfo);
+
+    auto *t = new TVectorD(2);
+    (*t)[0] = runInfo->RunStart();
+    (*t)[1] = runInfo->RunStop();
+
+    list->Add(t);
+
+    PrintMatrixMemory(list);
+
+    std::cout << "creating histograms done after " << w->RealTime()
+              << " seconds" << std::endl;
+    w->Continue();
+    return list;
+}
 
-    // set up branches
-    // Each branch can hold multiple hits
-    // ie TGriffin grif holds 3 gamma rays on a triples event
-    TGriffin *grif = nullptr;
-    TSceptar *scep = nullptr;
-    tree->SetBranchAddress("TGriffin",
-                           &grif); // We assume we always have a Griffin
-    TGRSIOptions::AnalysisOptions()->SetCorrectCrossTalk(true); // Correct for cross talk
+// One subrun of a run sorted by LeanRunMatrices
+struct LeanSubrun {
+    std::string fileName;
+    int subrun = 0;
+    long entries = 0;
+    // the last PPG status word of this and the earlier subruns, the cycle
+    // times of this subrun are found from the words up to it
+    ULong64_t ppgEnd = 0;
+    // where the histograms of this subrun are cached and with which key,
+    // empty without a cache
+    std::string cacheFile;
+    std::string cacheKey;
+};
 
-    printf("Loading in energy residuals\n");
-    if( ResidualVec.size() > 0 ) {
-        for (int k = 0; k < 64; k++) {
-            grif->LoadEnergyResidual(k+1, ResidualVec[k]);
+// Keeps the histograms of a sorted subrun (before the background subtraction)
+// in a cache file, with the matrices as tiles. The file is written under a
+// temporary name first, so an interrupted sort never leaves a broken file.
+void WriteCachedSubrun(const LeanSubrun &subrun,
+                       const std::vector<LeanHistograms> &hists,
+                       const ChannelTimes &times) {
+    std::string tmpName = subrun.cacheFile + ".tmp";
+    TFile file(tmpName.c_str(), "recreate");
+    if (!file.IsOpen()) {
+        printf("Failed to write cache file '%s'!\n", tmpName.c_str());
+        return;
+    }
+    TNamed key("LeanCacheKey", subrun.cacheKey.c_str());
+    file.WriteTObject(&key);
+    for (const LeanHistograms &h : hists) {
+        TIter next(h.list);
+        while (TObject *obj = next()) {
+            if (auto *mat = dynamic_cast<SparseMatrix *>(obj)) {
+                mat->WriteTiles(&file, mat->GetName());
+            } else {
+                file.WriteTObject(obj);
+            }
         }
     }
+    TVectorD first(times.first.size());
+    TVectorD last(times.last.size());
+    for (size_t chan = 0; chan < times.first.size(); ++chan) {
+        first[chan] = times.first[chan];
+        last[chan] = times.last[chan];
+    }
+    file.WriteTObject(&first, "ChannelTimesFirst");
+    file.WriteTObject(&last, "ChannelTimesLast");
+    file.Close();
+    gSystem->Rename(tmpName.c_str(), subrun.cacheFile.c_str());
+}
 
-    bool gotSceptar;
-    if (tree->FindBranch("TSceptar") == nullptr) { // We check to see if we have
-                                                   // a Scepter branch in the
-                                                   // analysis tree
-        gotSceptar = false;
-    } else {
-        tree->SetBranchAddress("TSceptar", &scep);
-        gotSceptar = true;
+// Adds the cached histograms of a subrun to hists, which have to be empty.
+// Returns false if there is no cached result with the key of the subrun, or
+// if it is incomplete, hists are left in an undefined state then.
+bool ReadCachedSubrun(const LeanSubrun &subrun,
+                      std::vector<LeanHistograms> &hists,
+                      ChannelTimes &times) {
+    // AccessPathName is true if the file does not exist
+    if (gSystem->AccessPathName(subrun.cacheFile.c_str())) {
+        return false;
     }
+    TFile file(subrun.cacheFile.c_str(), "read");
+    auto *key = dynamic_cast<TNamed *>(file.Get("LeanCacheKey"));
+    if (!file.IsOpen() || key == nullptr ||
+        subrun.cacheKey != key->GetTitle()) {
+        return false;
+    }
+    for (LeanHistograms &h : hists) {
+        TIter next(h.list);
+        while (TObject *obj = next()) {
+            if (auto *mat = dynamic_cast<SparseMatrix *>(obj)) {
+                if (!mat->AddTiles(&file, mat->GetName())) {
+                    return false;
+                }
+                continue;
+            }
+            auto *cached = dynamic_cast<TH1 *>(file.Get(obj->GetName()));
+            if (cached == nullptr) {
+                return false;
+            }
+            static_cast<TH1 *>(obj)->Add(cached);
+            delete cached;
+        }
+    }
+    TVectorD *first = nullptr;
+    TVectorD *last = nullptr;
+    file.GetObject("ChannelTimesFirst", first);
+    file.GetObject("ChannelTimesLast", last);
+    bool good = (first != nullptr && last != nullptr &&
+                 first->GetNrows() == (int)times.first.size() &&
+                 last->GetNrows() == (int)times.last.size());
+    for (size_t chan = 0; good && chan < times.first.size(); ++chan) {
+        times.first[chan] = (*first)[chan];
+        times.last[chan] = static_cast<long>((*last)[chan]);
+    }
+    delete first;
+    delete last;
+    return good;
+}
 
-    // tree->LoadBaskets(MEM_SIZE);
+// Sorts all subruns of a run into one set of histograms. Up to nThreads
+// subruns are sorted at the same time, each into the set of histograms of its
+// thread, and every set is added to the total as soon as its subrun is done
+// and then reused for the next subrun. So the memory needed is nThreads + 1
+// sets, no matter how many subruns there are. With breakdown a copy of every
+// 1D histogram is kept for each subrun, named <histogram>_sub<subrun>. Subruns
+// with a cache file are only sorted if the cache file does not have their
+// key, and the cache file is written after they are sorted. The subruns have
+// to be in order, ppg has to cover all of them (see SortRun).
+TList *LeanRunMatrices(const std::vector<LeanSubrun> &subruns, TPPG *ppg,
+                       TGRSIRunInfo *runInfo, long maxEntries = 0,
+                       TStopwatch *w = nullptr, int nThreads = 1,
+                       Long64_t cacheSize = 100 * 1048576,
+                       const char *planFile = nullptr,
+                       bool breakdown = false, SortStats *report = nullptr) {
+    if (runInfo == nullptr || subruns.empty()) {
+        return nullptr;
+    }
 
-    // long entries = tree->GetEntries();
-    // long entries = 1e6;
-    // These are the indices of the two hits being compared
-    int one;
-    int two;
+    TGRSIOptions::AnalysisOptions()->SetCorrectCrossTalk(true);
 
-    auto *t = new TVectorD(2);
-    (*t)[0] = runInfo->RunStart();
-    (*t)[1] = runInfo->RunStop();
+    // None of the histograms belong to one of the files, they would be
+    // deleted with it
+    TH1::AddDirectory(false);
+    std::vector<LeanVariant> variants;
+    std::vector<LeanHistograms> hists;
+    LeanStages stages;
+    if (!SetUpSort(planFile, ppg, variants, hists, stages)) {
+        TH1::AddDirectory(true);
+        return nullptr;
+    }
 
-    list->Add(t);
+    if (w == nullptr) {
+        w = new TStopwatch;
+        w->Start();
+    }
 
-    // store the last timestamp of each channel
-    std::vector<long> lastTimeStamp(65, 0);
+    // The TPPG of the whole run, so the hits of every subrun find their cycle.
+    // The table of a subrun only has the status words up to its end, so it is
+    // the same no matter how many subruns follow (see SortRun). The tables
+    // are built before the threads start, the TPPG can't be searched by
+    // several threads.
+    std::vector<CycleTable> cycleTables(subruns.size());
+    if (ppg != nullptr) {
+        for (size_t s = 0; s < subruns.size(); ++s) {
+            cycleTables[s].Build(ppg, subruns[s].ppgEnd);
+        }
+        TGRSIDetectorHit::SetPPGPtr(ppg);
+    }
+    if (!Residuals.Empty()) {
+        printf("Loading in energy residuals\n");
+    }
 
     std::cout << std::fixed
               << std::setprecision(
                      1); // This just make outputs not look terrible
-    // size_t angIndex;
-    if (maxEntries == 0 || maxEntries > tree->GetEntries()) {
-        maxEntries = tree->GetEntries();
-    }
-    // maxEntries = 1e5;
-    int entry;
-    for (entry = 1; entry < maxEntries;
-         ++entry) { // Only loop over the set number of entries
-        // I'm starting at entry 1 because of the weird high stamp of 4.
-        tree->GetEntry(entry);
-        if (entry == 1) {
-            TChannel::ReadCalFromTree(tree);
-        }
-        /*
-              if(runInfo->SubRunNumber() > 21) {
-                //in run 04921 we got a wrap-around of the timestamp within
-           subrun 22
-                //so from subrun 22 on we add 2^42 to each timestamp that is
-           less than 2^41
-                ULong_t thres = 0x1;
-                thres = thres<<41;
-                for(one = 0; one < (int) grif->GetMultiplicity(); ++one) {
-                  if(grif->GetGriffinHit(one)->GetTimeStamp() < thres) {
-                    grif->GetGriffinHit(one)->SetTimeStamp(grif->GetGriffinHit(one)->GetTimeStamp()
-           + 2*thres);
-                  }
-                }
-                for(one = 0; one < (int) scep->GetMultiplicity(); ++one) {
-                  if(scep->GetSceptarHit(one)->GetTimeStamp() < thres) {
-                    scep->GetSceptarHit(one)->SetTimeStamp(scep->GetSceptarHit(one)->GetTimeStamp()
-           + 2*thres);
-                  }
-                }
-              }
-        */
-        grif->ResetAddback();
-        grif->SetDefaultGainType(TGriffin::kLowGain);
 
-        // loop over the gammas in the event packet
-        // grif is the variable which points to the current TGriffin
-        for (one = 0; one < (int)grif->GetMultiplicity(); ++one) {
-            // We want to put every gamma ray in this event into the singles
-            gammaSingles->Fill(grif->GetGriffinHit(one)->GetEnergy());
-            gtimestamp->Fill(grif->GetGriffinHit(one)->GetTime() / 100000000.);
-            Long_t time = static_cast<Long_t>(grif->GetHit(one)->GetTime());
-            if (ppg != nullptr) {
-                time = time % ppg->GetCycleLength();
-                // gammaSinglesCyc->Fill((time - ppg->GetLastStatusTime(time,
-                // TPPG::kTapeMove))/1e5,
-                // grif->GetGriffinHit(one)->GetEnergy());
-                gammaSinglesCyc->Fill(time / 1e5,
-                                      grif->GetGriffinHit(one)->GetEnergy());
-            }
-            if (grif->GetGriffinHit(one)->GetArrayNumber() <
-                lastTimeStamp.size()) {
-                if (lastTimeStamp.at(
-                        grif->GetGriffinHit(one)->GetArrayNumber()) > 0) {
-                    gTimeDiff->Fill(
-                        grif->GetHit(one)->GetTime() -
-                            lastTimeStamp.at(
-                                grif->GetGriffinHit(one)->GetArrayNumber()),
-                        grif->GetGriffinHit(one)->GetArrayNumber());
-                }
-                lastTimeStamp.at(grif->GetGriffinHit(one)->GetArrayNumber()) =
-                    grif->GetHit(one)->GetTime();
-            }
-            // We now want to loop over any other gammas in this packet
-            for (two = 0; two < (int)grif->GetMultiplicity(); ++two) {
-                if (two == one) { // If we are looking at the same gamma we
-                                  // don't want to call it a coincidence
-                    continue;
-                }
-                // Check to see if the two gammas are close enough in time
-                ggTimeDiff->Fill(
-                    TMath::Abs(grif->GetGriffinHit(two)->GetTime() -
-                               grif->GetGriffinHit(one)->GetTime()));
-                if (ggTlow <= TMath::Abs(grif->GetGriffinHit(two)->GetTime() -
-                                         grif->GetGriffinHit(one)->GetTime()) &&
-                    TMath::Abs(grif->GetGriffinHit(two)->GetTime() -
-                               grif->GetGriffinHit(one)->GetTime()) < ggThigh) {
-                    // If they are close enough in time, fill the gamma-gamma
-                    // matrix. This will be symmetric because we are
-                    // doing a double loop over gammas
-                    ggmatrix->Fill(grif->GetGriffinHit(one)->GetEnergy(),
-                                   grif->GetGriffinHit(two)->GetEnergy());
-                }
-                if (ggBGlow <=
-                        TMath::Abs(grif->GetGriffinHit(two)->GetTime() -
-                                   grif->GetGriffinHit(one)->GetTime()) &&
-                    TMath::Abs(grif->GetGriffinHit(two)->GetTime() -
-                               grif->GetGriffinHit(one)->GetTime()) <
-                        ggBGhigh) {
-                    // If they are not close enough in time, fill the
-                    // time-random gamma-gamma matrix. This will be symmetric
-                    // because we are doing a double loop over gammas
-                    ggmatrixt->Fill(grif->GetGriffinHit(one)->GetEnergy(),
-                                    grif->GetGriffinHit(two)->GetEnergy());
-                }
-            }
+    // I'm starting at entry 1 of every subrun because of the weird high
+    // stamp of 4.
+    long firstEntry = 1;
+    std::vector<long> lastEntry(subruns.size());
+    long totalEntries = 0;
+    for (size_t s = 0; s < subruns.size(); ++s) {
+        lastEntry[s] = subruns[s].entries;
+        if (maxEntries > 0 && maxEntries < lastEntry[s]) {
+            lastEntry[s] = maxEntries;
         }
+        totalEntries += std::max(0L, lastEntry[s] - firstEntry);
+    }
+    if (nThreads < 1) {
+        nThreads = 1;
+    }
+    if (nThreads > (int)subruns.size()) {
+        nThreads = (int)subruns.size();
+    }
+    printf("Sorting %d subruns with %d threads\n", (int)subruns.size(),
+           nThreads);
+    if (nThreads > 1) {
+        ROOT::EnableThreadSafety();
+    }
 
-        // Now we make beta gamma coincident matrices
-        if (gotSceptar && scep->GetMultiplicity() > 0) {
-            bool plotted_flag = false;
-            // We do an outside loop on gammas so that we can break on the betas
-            // if we see a beta in coincidence (we don't
-            // want to bin twice just because we have two betas)
-            for (int b = 0; b < scep->GetMultiplicity(); ++b) {
-                if (scep->GetHit(b)->GetEnergy() < betaThres) {
-                    continue;
-                }
-                btimestamp->Fill(scep->GetHit(b)->GetTime() / 1e8);
-                if ((ppg != nullptr) &&
-                    !plotted_flag) { // Fill on first hit only.
-                    betaSinglesCyc->Fill(
-                        ((ppg->GetTimeInCycle(
-                             scep->GetHit(b)->GetTimeStamp())) /
-                         1e5),
-                        ppg->GetCycleNumber(static_cast<ULong64_t>(
-                            scep->GetHit(b)->GetTimeStamp())));
-                    //  betaSinglesCyc->Fill((((ULong64_t)(scep->GetHit(b)->GetTime()))%(ppg->GetCycleLength()))/1e5,(scep->GetHit(b)->GetTime())/(ppg->GetCycleLength()));
-                    plotted_flag = true;
-                }
-                for (int b2 = 0; b2 < scep->GetMultiplicity(); ++b2) {
-                    if (b == b2) {
-                        continue;
+    ReadPlan plan;
+    plan.AddBranch("TGriffin");
+    if (stages.all.betas) {
+        plan.AddBranch("TSceptar");
+    }
+    plan.SetCacheSize(cacheSize);
+
+    std::vector<std::vector<LeanHistograms>> shards(nThreads);
+    for (int i = 0; i < nThreads; ++i) {
+        shards[i] = CreateHistograms(variants, ppg);
+    }
+    std::vector<SortStats> stats(nThreads, CreateStats(variants));
+
+    std::atomic<long> progress(0);
+    std::atomic<size_t> nextSubrun(0);
+    std::vector<ChannelTimes> times(subruns.size());
+    std::vector<TH1 *> subrunHists;
+    std::mutex totalMutex;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nThreads; ++i) {
+        workers.emplace_back([&, i]() {
+            for (size_t s = nextSubrun++; s < subruns.size();
+                 s = nextSubrun++) {
+                const LeanSubrun &subrun = subruns[s];
+                bool cached = false;
+                StageClock clock;
+                if (!subrun.cacheFile.empty()) {
+                    cached = ReadCachedSubrun(subrun, shards[i], times[s]);
+                    clock.Lap(stats[i], SortStats::kRead);
+                    if (cached) {
+                        printf("Subrun %d taken from the cache\n",
+                               subrun.subrun);
+                        progress += lastEntry[s] - firstEntry;
+                    } else {
+                        ResetHistograms(shards[i]);
+                        times[s] = ChannelTimes();
                     }
-                    bbTimeDiff->Fill(scep->GetHit(b)->GetTime() -
-                                         scep->GetHit(b2)->GetTime(),
-                                     scep->GetHit(b)->GetEnergy());
                 }
-            }
-            for (one = 0; one < (int)grif->GetMultiplicity(); ++one) {
-                bool found = false;
-                for (int b = 0; b < scep->GetMultiplicity(); ++b) {
-                    if (scep->GetHit(b)->GetEnergy() < betaThres) {
+                if (!cached) {
+                    TFile workerFile(subrun.fileName.c_str());
+                    auto *workerTree = dynamic_cast<TTree *>(
+                        workerFile.Get("AnalysisTree"));
+                    if (workerTree == nullptr) {
+                        printf("Thread %d failed to find the analysis tree "
+                               "in '%s'!\n",
+                               i, subrun.fileName.c_str());
                         continue;
                     }
-                    // Be careful about time ordering!!!! betas and gammas are
-                    // not symmetric out of the DAQ
-                    // Fill the time diffrence spectra
-                    gbTimeDiff->Fill(grif->GetHit(one)->GetTime() -
-                                     scep->GetHit(b)->GetTime());
-                    gbTimevsg->Fill(grif->GetHit(one)->GetTime() -
-                                        scep->GetHit(b)->GetTime(),
-                                    grif->GetHit(one)->GetEnergy());
-                    if ((gbTlow <= grif->GetHit(one)->GetTime() -
-                                       scep->GetHit(b)->GetTime()) &&
-                        (grif->GetHit(one)->GetTime() -
-                             scep->GetHit(b)->GetTime() <=
-                         gbThigh)) {
-                        gbEnergyvsbTime->Fill(scep->GetHit(b)->GetTime(),
-                                              grif->GetHit(one)->GetEnergy());
+                    plan.Apply(workerTree, firstEntry, lastEntry[s]);
+                    const CycleTable *cycles =
+                        (ppg != nullptr) ? &cycleTables[s] : nullptr;
+                    SortEntries(workerTree, cycles, variants, stages,
+                                shards[i], firstEntry, lastEntry[s], times[s],
+                                &progress, totalEntries, stats[i]);
+                    if (!subrun.cacheFile.empty()) {
+                        clock.Start();
+                        WriteCachedSubrun(subrun, shards[i], times[s]);
+                        clock.Lap(stats[i], SortStats::kWrite);
                     }
-                    if ((gbTlow <= grif->GetHit(one)->GetTime() -
-                                       scep->GetHit(b)->GetTime()) &&
-                        (grif->GetHit(one)->GetTime() -
-                             scep->GetHit(b)->GetTime() <=
-                         gbThigh)) {
-                        ULong64_t time = static_cast<ULong64_t>(
-                            grif->GetHit(one)->GetTime());
-                        if (ppg != nullptr) {
-                            time = time % ppg->GetCycleLength();
-                            gammaSinglesBmCyc->Fill(
-                                time / 1e5,
-                                grif->GetGriffinHit(one)->GetEnergy());
-                        }
-                        // Plots a gamma energy spectrum in coincidence with a
-                        // beta
-                        gbEnergyvsgTime->Fill(
-                            grif->GetGriffinHit(one)->GetTime() / 1e8,
-                            grif->GetGriffinHit(one)->GetEnergy());
-                        gammaSinglesBm->Fill(
-                            grif->GetGriffinHit(one)->GetEnergy());
-                        bIdVsgId->Fill(
-                            scep->GetSceptarHit(b)->GetDetector(),
-                            grif->GetGriffinHit(one)->GetArrayNumber());
-                        if (!found) {
-                            gammaSinglesB->Fill(
-                                grif->GetGriffinHit(one)->GetEnergy());
-                            if (ppg != nullptr) {
-                                // gammaSinglesBCyc->Fill(ppg->GetTimeInCycle((ULong64_t)(grif->GetHit(one)->GetTimeStamp()))/1e5,
-                                // grif->GetGriffinHit(one)->GetEnergy());
-                                gammaSinglesBCyc->Fill(
-                                    grif->GetHit(one)->GetCycleTimeStamp() /
-                                        1e5,
-                                    grif->GetGriffinHit(one)->GetEnergy());
-                                // std::cout<<grif->GetHit(one)->GetCycleTimeStamp()<<"
-                                // =>
-                                // "<<grif->GetHit(one)->GetCycleTimeStamp()/1e5<<"
-                                // = bin
-                                // "<<gammaSinglesBCyc->GetXaxis()->FindBin(grif->GetHit(one)->GetCycleTimeStamp()/1e5)<<std::endl;
-                            }
-                        }
-                        gammaSinglesB_hp->Fill(
-                            grif->GetGriffinHit(one)->GetEnergy(),
-                            scep->GetSceptarHit(b)->GetDetector());
-                        grifscep_hp->Fill(
-                            grif->GetGriffinHit(one)->GetArrayNumber(),
-                            scep->GetSceptarHit(b)->GetDetector());
-                        // gammaSinglesBCyc->Fill((time -
-                        // ppg->GetLastStatusTime(time, TPPG::kTapeMove))/1e5,
-                        // grif->GetGriffinHit(one)->GetEnergy());
-                        // Now we want to loop over gamma rays if they are in
-                        // coincidence.
-                        if (grif->GetMultiplicity() > 1) {
-                            for (two = 0; two < (int)grif->GetMultiplicity();
-                                 ++two) {
-                                if (two == one) { // If we are looking at the
-                                                  // same gamma we don't want to
-                                                  // call it a coincidence
-                                    continue;
-                                }
-
-                                if (ggTlow <=
-                                        TMath::Abs(grif->GetGriffinHit(two)
-                                                       ->GetTime() -
-                                                   grif->GetGriffinHit(one)
-                                                       ->GetTime()) &&
-                                    TMath::Abs(
-                                        grif->GetGriffinHit(two)->GetTime() -
-                                        grif->GetGriffinHit(one)->GetTime()) <
-                                        ggThigh) {
-                                    // If they are close enough in time, fill
-                                    // the gamma-gamma-beta matrix. This will be
-                                    // symmetric
-                                    // because we are doing a double loop over
-                                    // gammas
-                                    ggbmatrix->Fill(
-                                        grif->GetGriffinHit(one)->GetEnergy(),
-                                        grif->GetGriffinHit(two)->GetEnergy());
-                                    if ((ppg != nullptr) &&
-                                        ppg->GetTimeInCycle(
-                                            grif->GetGriffinHit(one)
-                                                ->GetTimeStamp()) > bgStart &&
-                                        ppg->GetTimeInCycle(
-                                            grif->GetGriffinHit(one)
-                                                ->GetTimeStamp()) < bgEnd) {
-                                        ggbmatrixBg->Fill(
-                                            grif->GetGriffinHit(one)
-                                                ->GetEnergy(),
-                                            grif->GetGriffinHit(two)
-                                                ->GetEnergy());
-                                    } else if ((ppg != nullptr) &&
-                                               ppg->GetTimeInCycle(
-                                                   grif->GetGriffinHit(one)
-                                                       ->GetTimeStamp()) >
-                                                   onStart &&
-                                               ppg->GetTimeInCycle(
-                                                   grif->GetGriffinHit(one)
-                                                       ->GetTimeStamp()) <
-                                                   onEnd) {
-                                        ggbmatrixOn->Fill(
-                                            grif->GetGriffinHit(one)
-                                                ->GetEnergy(),
-                                            grif->GetGriffinHit(two)
-                                                ->GetEnergy());
-                                    } else if ((ppg != nullptr) &&
-                                               ppg->GetTimeInCycle(
-                                                   grif->GetGriffinHit(one)
-                                                       ->GetTimeStamp()) >
-                                                   offStart &&
-                                               ppg->GetTimeInCycle(
-                                                   grif->GetGriffinHit(one)
-                                                       ->GetTimeStamp()) <
-                                                   offEnd) {
-                                        ggbmatrixOff->Fill(
-                                            grif->GetGriffinHit(one)
-                                                ->GetEnergy(),
-                                            grif->GetGriffinHit(two)
-                                                ->GetEnergy());
-                                    }
-                                }
-                                if (ggBGlow <=
-                                        TMath::Abs(grif->GetGriffinHit(two)
-                                                       ->GetTime() -
-                                                   grif->GetGriffinHit(one)
-                                                       ->GetTime()) &&
-                                    TMath::Abs(
-                                        grif->GetGriffinHit(two)->GetTime() -
-                                        grif->GetGriffinHit(one)->GetTime()) <
-                                        ggBGhigh) {
-                                    // If they are not close enough in time,
-                                    // fill the gamma-gamma-beta time-random
-                                    // matrix. This
-                                    // will be symmetric because we are doing a
-                                    // double loop over gammas
-                                    ggbmatrixt->Fill(
-                                        grif->GetGriffinHit(one)->GetEnergy(),
-                                        grif->GetGriffinHit(two)->GetEnergy());
-                                }
+                }
+
+                std::lock_guard<std::mutex> lock(totalMutex);
+                AddHistograms(hists, shards[i]);
+                if (breakdown) {
+                    for (LeanHistograms &h : shards[i]) {
+                        TIter next(h.list);
+                        while (TObject *obj = next()) {
+                            auto *hist = dynamic_cast<TH1 *>(obj);
+                            if (hist == nullptr || hist->GetDimension() != 1) {
+                                continue;
                             }
+                            subrunHists.push_back(static_cast<TH1 *>(
+                                hist->Clone(Form("%s_sub%03d", hist->GetName(),
+                                                 subrun.subrun))));
+                            subrunHists.back()->SetTitle(
+                                Form("%s, subrun %d", hist->GetTitle(),
+                                     subrun.subrun));
                         }
-                        found = true;
-                    }
-                    if ((gbBGlow <= grif->GetHit(one)->GetTime() -
-                                        scep->GetHit(b)->GetTime()) &&
-                        (grif->GetHit(one)->GetTime() -
-                             scep->GetHit(b)->GetTime() <=
-                         gbBGhigh)) {
-                        gammaSinglesBt->Fill(grif->GetHit(one)->GetEnergy());
                     }
                 }
+                ResetHistograms(shards[i]);
             }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    for (int i = 0; i < nThreads; ++i) {
+        DeleteHistograms(shards[i]);
+    }
+    FillBoundaryTimes(times, hists);
+
+    StageClock clock;
+    TList *list = CollectHistograms(variants, hists);
+    clock.Lap(stats[0], SortStats::kBackground);
+    if (report != nullptr) {
+        for (const SortStats &threadStats : stats) {
+            report->Add(threadStats);
         }
+    }
+    for (TH1 *hist : subrunHists) {
+        list->Add(hist);
+    }
+    list->Sort();
+    TH1::AddDirectory(true);
 
-        // loop over the addbacks in the event packet
-        // grif is the variable which points to the current TGriffin
-        for (one = 0; one < (int)grif->GetAddbackMultiplicity(); ++one) {
-            // We want to put every gamma ray in this event into the singles
-            gammaAddback->Fill(grif->GetAddbackHit(one)->GetEnergy());
-            Long_t time =
-                static_cast<Long_t>(grif->GetAddbackHit(one)->GetTime());
-            if (ppg != nullptr) {
-                time = time % ppg->GetCycleLength();
-                // gammaSinglesCyc->Fill((time - ppg->GetLastStatusTime(time,
-                // TPPG::kTapeMove))/1e5,
-                // grif->GetGriffinHit(one)->GetEnergy());
-                gammaAddbackCyc->Fill(time / 1e5,
-                                      grif->GetAddbackHit(one)->GetEnergy());
-                // We now want to loop over any other gammas in this packet
+    if (ppg != nullptr) {
+        list->Add(ppg);
+    }
+
+    list->Add(runInfo);
+
+    PrintMatrixMemory(list);
+
+    std::cout << "creating histograms done after " << w->RealTime()
+              << " seconds" << std::endl;
+    w->Continue();
+    return list;
+}
+
+// Sorts every subrun of a run found in dataDir (analysis<run>_<subrun>.root)
+// into matrix<run>.root. With a cache directory the histograms of every
+// subrun are kept there, and only the subruns that are new or changed, or
+// all of them if the plan, residuals or calibration changed, are sorted.
+int SortRun(const char *dataDir, int runNumber, long maxEntries,
+            TStopwatch &w, int nThreads, Long64_t cacheSize,
+            const char *planFile, bool breakdown,
+            const char *residualsFile = nullptr,
+            const char *cacheDir = nullptr) {
+    std::vector<LeanSubrun> subruns;
+    void *dir = gSystem->OpenDirectory(dataDir);
+    if (dir == nullptr) {
+        printf("Failed to open directory '%s'!\n", dataDir);
+        return 1;
+    }
+    while (const char *entry = gSystem->GetDirEntry(dir)) {
+        int run;
+        int subrun;
+        if (sscanf(entry, "analysis%d_%d.root", &run, &subrun) != 2 ||
+            run != runNumber ||
+            strcmp(entry, Form("analysis%05d_%03d.root", run, subrun)) != 0) {
+            continue;
+        }
+        LeanSubrun sub;
+        sub.fileName = Form("%s/%s", dataDir, entry);
+        sub.subrun = subrun;
+        subruns.push_back(sub);
+    }
+    gSystem->FreeDirectory(dir);
+    if (subruns.empty()) {
+        printf("Found no subruns of run %d in '%s'!\n", runNumber, dataDir);
+        return 1;
+    }
+    std::sort(subruns.begin(), subruns.end(),
+              [](const LeanSubrun &a, const LeanSubrun &b) {
+                  return a.subrun < b.subrun;
+              });
+
+    // The calibration and run info come from the first subrun, the TPPGs of
+    // all subruns are put together, so the cycles crossing a subrun boundary
+    // are complete
+    TPPG *runPPG = nullptr;
+    TGRSIRunInfo *runInfo = nullptr;
+    auto *sortinfolist = new TGRSISortList;
+    double runStart = 0.;
+    double runStop = 0.;
+    ULong64_t ppgEnd = 0;
+    for (LeanSubrun &subrun : subruns) {
+        TFile file(subrun.fileName.c_str());
+        auto *tree = dynamic_cast<TTree *>(file.Get("AnalysisTree"));
+        auto *info = dynamic_cast<TGRSIRunInfo *>(file.Get("TGRSIRunInfo"));
+        if (!file.IsOpen() || tree == nullptr || info == nullptr) {
+            printf("Failed to find analysis tree or run information in file "
+                   "'%s'!\n",
+                   subrun.fileName.c_str());
+            return 1;
+        }
+        printf("Sorting file:" DBLUE " %s" RESET_COLOR "\n",
+               subrun.fileName.c_str());
+        subrun.entries = tree->GetEntries();
+        if (runInfo == nullptr) {
+            runInfo = static_cast<TGRSIRunInfo *>(info->Clone());
+            runStart = info->RunStart();
+            if (!LoadCalibration(tree, residualsFile, &Residuals)) {
+                return 1;
             }
-            for (two = 0; two < (int)grif->GetAddbackMultiplicity(); ++two) {
-                if (two == one) { // If we are looking at the same gamma we
-                                  // don't want to call it a coincidence
-                    continue;
-                }
-                // Check to see if the two gammas are close enough in time
-                // VINZENZ I THINK THIS IS BREAKING THIS FOR SOME REASON.
-                aaTimeDiff->Fill(
-                    TMath::Abs(grif->GetAddbackHit(two)->GetTime() -
-                               grif->GetAddbackHit(one)->GetTime()));
-                if (ggTlow <= TMath::Abs(grif->GetAddbackHit(two)->GetTime() -
-                                         grif->GetAddbackHit(one)->GetTime()) &&
-                    TMath::Abs(grif->GetAddbackHit(two)->GetTime() -
-                               grif->GetAddbackHit(one)->GetTime()) < ggThigh) {
-                    // If they are close enough in time, fill the gamma-gamma
-                    // matrix. This will be symmetric because we are
-                    // doing a double loop over gammas
-                    aamatrix->Fill(grif->GetAddbackHit(one)->GetEnergy(),
-                                   grif->GetAddbackHit(two)->GetEnergy());
-                }
-                if (ggBGlow <=
-                        TMath::Abs(grif->GetAddbackHit(two)->GetTime() -
-                                   grif->GetAddbackHit(one)->GetTime()) &&
-                    TMath::Abs(grif->GetAddbackHit(two)->GetTime() -
-                               grif->GetAddbackHit(one)->GetTime()) <
-                        ggBGhigh) {
-                    // If they are not close enough in time, fill the
-                    // time-random gamma-gamma matrix. This will be symmetric
-                    // because we are doing a double loop over gammas
-                    aamatrixt->Fill(grif->GetAddbackHit(one)->GetEnergy(),
-                                    grif->GetAddbackHit(two)->GetEnergy());
-                }
+        }
+        runStop = std::max(runStop, info->RunStop());
+        sortinfolist->AddSortInfo(new TGRSISortInfo(info));
+
+        auto *ppg = dynamic_cast<TPPG *>(file.Get("TPPG"));
+        if (ppg == nullptr || ppg->MapIsEmpty()) {
+            printf("No PPG information in file '%s'!\n",
+                   subrun.fileName.c_str());
+        } else {
+            ppgEnd = std::max(ppgEnd, ppg->Last()->GetTimeStamp());
+            if (runPPG == nullptr) {
+                runPPG = static_cast<TPPG *>(ppg->Clone());
+            } else {
+                runPPG->Add(ppg);
             }
         }
+        subrun.ppgEnd = ppgEnd;
+    }
 
-        // Now we make beta gamma coincident matrices
-        if (gotSceptar && scep->GetMultiplicity() > 0) {
-            // We do an outside loop on gammas so that we can break on the betas
-            // if we see a beta in coincidence (we don't
-            // want to bin twice just because we have two betas)
-            for (one = 0; one < (int)grif->GetAddbackMultiplicity(); ++one) {
-                bool found = false;
-                for (int b = 0; b < scep->GetMultiplicity(); ++b) {
-                    if (scep->GetHit(b)->GetEnergy() < betaThres) {
-                        continue;
-                    }
-                    // Be careful about time ordering!!!! betas and gammas are
-                    // not symmetric out of the DAQ
-                    // Fill the time diffrence spectra
-                    abTimeDiff->Fill(grif->GetAddbackHit(one)->GetTime() -
-                                     scep->GetHit(b)->GetTime());
-                    abTimevsg->Fill(grif->GetAddbackHit(one)->GetTime() -
-                                        scep->GetHit(b)->GetTime(),
-                                    grif->GetAddbackHit(one)->GetEnergy());
-                    if (b == 0) {
-                        abTimevsgf->Fill(grif->GetAddbackHit(one)->GetTime() -
-                                             scep->GetHit(b)->GetTime(),
-                                         grif->GetAddbackHit(one)->GetEnergy());
-                    }
-                    if (b == scep->GetMultiplicity() - 1) {
-                        abTimevsgl->Fill(grif->GetAddbackHit(one)->GetTime() -
-                                             scep->GetHit(b)->GetTime(),
-                                         grif->GetAddbackHit(one)->GetEnergy());
-                    }
-                    if ((gbTlow <= grif->GetAddbackHit(one)->GetTime() -
-                                       scep->GetHit(b)->GetTime()) &&
-                        (grif->GetAddbackHit(one)->GetTime() -
-                             scep->GetHit(b)->GetTime() <=
-                         gbThigh)) {
-                        abEnergyvsbTime->Fill(
-                            scep->GetHit(b)->GetTime(),
-                            grif->GetAddbackHit(one)->GetEnergy());
-                    }
-                    if ((gbTlow <= grif->GetAddbackHit(one)->GetTime() -
-                                       scep->GetHit(b)->GetTime()) &&
-                        (grif->GetAddbackHit(one)->GetTime() -
-                             scep->GetHit(b)->GetTime() <=
-                         gbThigh)) {
-                        ULong64_t time = static_cast<ULong64_t>(
-                            grif->GetAddbackHit(one)->GetTime());
-                        if (ppg != nullptr) {
-                            time = time % ppg->GetCycleLength();
-                            gammaAddbackBmCyc->Fill(
-                                time / 1e5,
-                                grif->GetAddbackHit(one)->GetEnergy());
-                            // Plots a gamma energy spectrum in coincidence with
-                            // a beta
-                        }
-                        abEnergyvsgTime->Fill(
-                            grif->GetAddbackHit(one)->GetTime() / 1e8,
-                            grif->GetAddbackHit(one)->GetEnergy());
-                        gammaAddbackBm->Fill(
-                            grif->GetAddbackHit(one)->GetEnergy());
-                        if (!found) {
-                            gammaAddbackB->Fill(
-                                grif->GetAddbackHit(one)->GetEnergy());
-                            if (ppg != nullptr) {
-                                gammaAddbackBCyc->Fill(
-                                    ppg->GetTimeInCycle(static_cast<ULong64_t>(
-                                        grif->GetAddbackHit(one)
-                                            ->GetTimeStamp())) /
-                                        1e5,
-                                    grif->GetAddbackHit(one)->GetEnergy());
-                            }
-                        }
-                        gammaAddbackB_hp->Fill(
-                            grif->GetAddbackHit(one)->GetEnergy(),
-                            scep->GetSceptarHit(b)->GetDetector());
-                        // Now we want to loop over gamma rays if they are in
-                        // coincidence.
-                        if (grif->GetAddbackMultiplicity() > 1) {
-                            for (two = 0;
-                                 two < (int)grif->GetAddbackMultiplicity();
-                                 ++two) {
-                                if (two == one) { // If we are looking at the
-                                                  // same gamma we don't want to
-                                                  // call it a coincidence
-                                    continue;
-                                }
-
-                                if (ggTlow <=
-                                        TMath::Abs(grif->GetAddbackHit(two)
-                                                       ->GetTime() -
-                                                   grif->GetAddbackHit(one)
-                                                       ->GetTime()) &&
-                                    TMath::Abs(
-                                        grif->GetAddbackHit(two)->GetTime() -
-                                        grif->GetAddbackHit(one)->GetTime()) <
-                                        ggThigh) {
-                                    // If they are close enough in time, fill
-                                    // the gamma-gamma-beta matrix. This will be
-                                    // symmetric
-                                    // because we are doing a double loop over
-                                    // gammas
-                                    aabmatrix->Fill(
-                                        grif->GetAddbackHit(one)->GetEnergy(),
-                                        grif->GetAddbackHit(two)->GetEnergy());
-                                    if ((ppg != nullptr) &&
-                                        ppg->GetTimeInCycle(
-                                            grif->GetAddbackHit(one)
-                                                ->GetTimeStamp()) > bgStart &&
-                                        ppg->GetTimeInCycle(
-                                            grif->GetAddbackHit(one)
-                                                ->GetTimeStamp()) < bgEnd) {
-                                        aabmatrixBg->Fill(
-                                            grif->GetAddbackHit(one)
-                                                ->GetEnergy(),
-                                            grif->GetAddbackHit(two)
-                                                ->GetEnergy());
-                                    } else if ((ppg != nullptr) &&
-                                               ppg->GetTimeInCycle(
-                                                   grif->GetAddbackHit(one)
-                                                       ->GetTimeStamp()) >
-                                                   onStart &&
-                                               ppg->GetTimeInCycle(
-                                                   grif->GetAddbackHit(one)
-                                                       ->GetTimeStamp()) <
-                                                   onEnd) {
-                                        aabmatrixOn->Fill(
-                                            grif->GetAddbackHit(one)
-                                                ->GetEnergy(),
-                                            grif->GetAddbackHit(two)
-                                                ->GetEnergy());
-                                    } else if ((ppg != nullptr) &&
-                                               ppg->GetTimeInCycle(
-                                                   grif->GetAddbackHit(one)
-                                                       ->GetTimeStamp()) >
-                                                   offStart &&
-                                               ppg->GetTimeInCycle(
-                                                   grif->GetAddbackHit(one)
-                                                       ->GetTimeStamp()) <
-                                                   offEnd) {
-                                        aabmatrixOff->Fill(
-                                            grif->GetAddbackHit(one)
-                                                ->GetEnergy(),
-                                            grif->GetAddbackHit(two)
-                                                ->GetEnergy());
-                                    }
-                                }
-                                if (ggBGlow <=
-                                        TMath::Abs(grif->GetAddbackHit(two)
-                                                       ->GetTime() -
-                                                   grif->GetAddbackHit(one)
-                                                       ->GetTime()) &&
-                                    TMath::Abs(
-                                        grif->GetAddbackHit(two)->GetTime() -
-                                        grif->GetAddbackHit(one)->GetTime()) <
-                                        ggBGhigh) {
-                                    // If they are not close enough in time,
-                                    // fill the gamma-gamma-beta time-random
-                                    // matrix. This
-                                    // will be symmetric because we are doing a
-                                    // double loop over gammas
-                                    aabmatrixt->Fill(
-                                        grif->GetAddbackHit(one)->GetEnergy(),
-                                        grif->GetAddbackHit(two)->GetEnergy());
-                                }
-                            }
-                        }
-                        found = true;
-                    }
-                    if ((gbBGlow <= grif->GetAddbackHit(one)->GetTime() -
-                                        scep->GetHit(b)->GetTime()) &&
-                        (grif->GetAddbackHit(one)->GetTime() -
-                             scep->GetHit(b)->GetTime() <=
-                         gbBGhigh)) {
-                        gammaAddbackBt->Fill(
-                            grif->GetAddbackHit(one)->GetEnergy());
-                    }
-                }
+    if (cacheDir != nullptr) {
+        SortCache cache(cacheDir);
+        if (!cache.IsGood()) {
+            return 1;
+        }
+        // Everything besides the subrun itself that goes into the histograms:
+        // the calibration (the coefficients of the first subrun with the
+        // residuals or bundle on top), the plan, the number of entries and the
+        // PPG up to the end of the subrun
+        Fingerprint config;
+        config.Add(std::string("kLeanMatrices cache 4"));
+        AddCalibration(config);
+        config.Add((residualsFile != nullptr)
+                       ? cache.ContentHash(residualsFile)
+                       : static_cast<uint64_t>(0));
+        config.Add((planFile != nullptr) ? cache.ContentHash(planFile)
+                                         : static_cast<uint64_t>(0));
+        config.Add(static_cast<uint64_t>(maxEntries));
+        for (LeanSubrun &subrun : subruns) {
+            Fingerprint key = config;
+            AddPPG(key, runPPG, subrun.ppgEnd);
+            key.Add(cache.ContentHash(subrun.fileName));
+            subrun.cacheKey = key.Hex();
+            subrun.cacheFile = cache.Path(
+                Form("lean%05d_%03d.root", runNumber, subrun.subrun));
+        }
+    }
+
+    std::cout << "starting Analysis after " << w.RealTime() << " seconds"
+              << std::endl;
+    w.Continue();
+    SortStats stats;
+    TList *list =
+        LeanRunMatrices(subruns, runPPG, runInfo, maxEntries, &w, nThreads,
+                        cacheSize, planFile, breakdown, &stats);
+    if (list == nullptr) {
+        std::cout << "LeanRunMatrices returned TList* nullptr!\n" << std::endl;
+        return 1;
+    }
+    auto *t = new TVectorD(2);
+    (*t)[0] = runStart;
+    (*t)[1] = runStop;
+    list->Add(t);
+
+    StageClock clock;
+    TFile outfile(Form("matrix%05d.root", runNumber), "recreate");
+    printf("Writing to File: " DYELLOW "%s" RESET_COLOR "\n",
+           outfile.GetName());
+    list->Write();
+    sortinfolist->Write("TGRSISortList", TObject::kSingleKey);
+    outfile.Close();
+    clock.Lap(stats, SortStats::kWrite);
+
+    stats.Print();
+    stats.WriteJSON(StatsFileName(outfile.GetName()), "kLeanMatrices",
+                    dataDir, nThreads, w.RealTime());
+    w.Continue();
+
+    return 0;
+}
+
+// Writes the current state of the histograms to fileName, with the
+// time-random background subtracted from copies, so the sort can go on. The
+// file is written under a temporary name and renamed, so whoever looks at it
+// never sees half a snapshot.
+void WriteSnapshot(const std::string &fileName,
+                   const std::vector<LeanVariant> &variants,
+                   const std::vector<LeanHistograms> &hists, TPPG *ppg,
+                   TGRSIRunInfo *runInfo) {
+    std::string tmpName = fileName + ".tmp";
+    TFile file(tmpName.c_str(), "recreate");
+    if (!file.IsOpen()) {
+        printf("Failed to write snapshot '%s'!\n", tmpName.c_str());
+        return;
+    }
+    for (size_t v = 0; v < variants.size(); ++v) {
+        std::vector<BackgroundPair> pairs =
+            GetBackgroundPairs(variants[v].par, hists[v]);
+        TIter next(hists[v].list);
+        while (TObject *obj = next()) {
+            auto pair = std::find_if(
+                pairs.begin(), pairs.end(),
+                [obj](const BackgroundPair &p) { return p.random == obj; });
+            if (pair == pairs.end()) {
+                obj->Write();
+                continue;
+            }
+            TObject *copy;
+            if (auto *mat = dynamic_cast<SparseMatrix *>(obj)) {
+                copy = new SparseMatrix(*mat);
+            } else {
+                copy = obj->Clone();
             }
+            SubtractBackground(copy, pair->prompt, pair->scale);
+            copy->Write();
+            delete copy;
         }
-        if ((entry % 10000) == 0) {
-            printf("Completed %d of %ld \r", entry, maxEntries);
+    }
+    if (ppg != nullptr) {
+        ppg->Write();
+    }
+    if (runInfo != nullptr) {
+        runInfo->Write();
+        TVectorD t(2);
+        t[0] = runInfo->RunStart();
+        t[1] = runInfo->RunStop();
+        t.Write();
+    }
+    file.Close();
+    gSystem->Rename(tmpName.c_str(), fileName.c_str());
+}
+
+// Follows an analysis tree file that is still being written, and the files
+// of the following subruns (analysis<run>_<subrun>.root in the same
+// directory) once they show up. Every look at the file only sorts the
+// entries that are new since the last one, the histograms are kept in
+// between. A subrun is taken to be complete once the file of the next one
+// exists. Every interval seconds a snapshot of the histograms is written to
+// matrix<run>.root. Stops after idleTimeout seconds without new entries, or
+// never if it is 0.
+int FollowRun(const char *fileName, int interval, int idleTimeout,
+              const char *planFile, Long64_t cacheSize, TStopwatch &w,
+              const char *calFile = nullptr) {
+    // None of the histograms belong to one of the files, they would be
+    // deleted with it
+    TH1::AddDirectory(false);
+
+    std::string current = fileName;
+    std::string dir = ".";
+    std::string base = current;
+    size_t slash = current.find_last_of('/');
+    if (slash != std::string::npos) {
+        dir = current.substr(0, slash);
+        base = current.substr(slash + 1);
+    }
+    int runNumber = -1;
+    int subrun = -1;
+    bool sequence =
+        (sscanf(base.c_str(), "analysis%d_%d.root", &runNumber, &subrun) == 2);
+
+    auto *file = new TFile(current.c_str());
+    TTree *tree = nullptr;
+    TGRSIRunInfo *runInfo = nullptr;
+    if (file->IsOpen()) {
+        tree = dynamic_cast<TTree *>(file->Get("AnalysisTree"));
+        runInfo = dynamic_cast<TGRSIRunInfo *>(file->Get("TGRSIRunInfo"));
+    }
+    if (tree == nullptr) {
+        printf("Failed to find analysis tree in file '%s'!\n", fileName);
+        return 1;
+    }
+    if (runInfo != nullptr) {
+        runNumber = runInfo->RunNumber();
+    }
+    if (runNumber < 0) {
+        printf("Failed to find the run number of file '%s'!\n", fileName);
+        return 1;
+    }
+    printf("Following file:" DBLUE " %s" RESET_COLOR "\n", fileName);
+
+    // The PPG is usually only written at the end of a subrun, the cycle
+    // histograms are only made if there already is one
+    TPPG *ppg = nullptr;
+    short ppgCycle = -1;
+    CycleTable cycleTable;
+    const CycleTable *cycles = nullptr;
+    auto updatePPG = [&]() {
+        TKey *key = file->GetKey("TPPG");
+        if (key == nullptr || key->GetCycle() == ppgCycle) {
+            return;
         }
+        ppgCycle = key->GetCycle();
+        TObject *obj = key->ReadObj();
+        auto *newPPG = dynamic_cast<TPPG *>(obj);
+        if (newPPG == nullptr || newPPG->MapIsEmpty()) {
+            delete obj;
+            return;
+        }
+        // the old PPG is only deleted once the hits point to the new one
+        TPPG *oldPPG = ppg;
+        ppg = newPPG;
+        cycleTable.Build(ppg);
+        cycles = &cycleTable;
+        TGRSIDetectorHit::SetPPGPtr(ppg);
+        delete oldPPG;
+    };
+    updatePPG();
+    if (ppg == nullptr) {
+        printf("No PPG yet, the cycle histograms are not made\n");
+    }
+
+    TGRSIOptions::AnalysisOptions()->SetCorrectCrossTalk(true);
+    std::vector<LeanVariant> variants;
+    std::vector<LeanHistograms> hists;
+    LeanStages stages;
+    if (!SetUpSort(planFile, ppg, variants, hists, stages)) {
+        return 1;
+    }
+    if (!LoadCalibration(tree, calFile, &Residuals)) {
+        return 1;
+    }
+    if (!Residuals.Empty()) {
+        printf("Loading in energy residuals\n");
     }
-    ggmatrixt->Scale(-ggBGScale);
-    ggmatrixt->Add(ggmatrix);
 
-    ggbmatrixt->Scale(-ggBGScale);
-    ggbmatrixt->Add(ggbmatrix);
+    ReadPlan plan;
+    plan.AddBranch("TGriffin");
+    if (stages.all.betas) {
+        plan.AddBranch("TSceptar");
+    }
+    plan.SetCacheSize(cacheSize);
 
-    gammaSinglesBt->Scale(-gbBGScale);
-    gammaSinglesBt->Add(gammaSinglesB);
+    std::string outName = Form("matrix%05d.root", runNumber);
+    // the subruns follow each other, so the channel times just go on
+    ChannelTimes times;
+    SortStats stats = CreateStats(variants);
+    StageClock clock;
+    // I'm starting at entry 1 because of the weird high stamp of 4.
+    long done = 1;
+    long total = 0;
+    auto sortNew = [&]() {
+        long nEntries = tree->GetEntries();
+        if (nEntries <= done) {
+            return false;
+        }
+        std::atomic<long> progress(done);
+        plan.Apply(tree, done, nEntries);
+        SortEntries(tree, cycles, variants, stages, hists, done, nEntries,
+                    times, &progress, nEntries, stats);
+        total += nEntries - done;
+        done = nEntries;
+        return true;
+    };
 
-    aamatrixt->Scale(-ggBGScale);
-    aamatrixt->Add(aamatrix);
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point lastSnapshot = Clock::now();
+    Clock::time_point lastNew = lastSnapshot;
+    while (true) {
+        // a subrun file only has a tree after its first auto-save
+        if (tree == nullptr) {
+            file->ReadKeys();
+            tree = dynamic_cast<TTree *>(file->Get("AnalysisTree"));
+        } else {
+            tree->Refresh();
+        }
+        if (tree != nullptr && sortNew()) {
+            lastNew = Clock::now();
+        }
+        file->ReadKeys();
+        updatePPG();
 
-    aabmatrixt->Scale(-ggBGScale);
-    aabmatrixt->Add(aabmatrix);
+        std::string next;
+        if (sequence) {
+            next = Form("%s/analysis%05d_%03d.root", dir.c_str(), runNumber,
+                        subrun + 1);
+        }
+        if (tree != nullptr && !next.empty() &&
+            !gSystem->AccessPathName(next.c_str())) {
+            // one last look at the subrun, then on to the next one
+            tree->Refresh();
+            sortNew();
+            printf("Subrun %d done after %ld entries, following" DBLUE
+                   " %s" RESET_COLOR "\n",
+                   subrun, done, next.c_str());
+            file->Close();
+            delete file;
+            file = new TFile(next.c_str());
+            tree = nullptr;
+            ppgCycle = -1;
+            ++subrun;
+            done = 1;
+            continue;
+        }
 
-    gammaAddbackBt->Scale(-gbBGScale);
-    gammaAddbackBt->Add(gammaAddbackB);
+        Clock::time_point now = Clock::now();
+        bool idle = (idleTimeout > 0 &&
+                     now - lastNew >= std::chrono::seconds(idleTimeout));
+        if (idle || now - lastSnapshot >= std::chrono::seconds(interval)) {
+            // the background subtraction of the copies is part of it
+            clock.Start();
+            WriteSnapshot(outName, variants, hists, ppg, runInfo);
+            clock.Lap(stats, SortStats::kWrite);
+            lastSnapshot = now;
+            printf("Wrote snapshot " DYELLOW "%s" RESET_COLOR
+                   " after %ld entries and %.0f seconds\n",
+                   outName.c_str(), total, w.RealTime());
+            w.Continue();
+        }
+        if (idle) {
+            break;
+        }
+        gSystem->Sleep(1000);
+    }
 
-    std::cout << "creating histograms done after " << w->RealTime()
-              << " seconds" << std::endl;
-    w->Continue();
-    return list;
+    stats.Print();
+    stats.WriteJSON(StatsFileName(outName), "kLeanMatrices", fileName, 1,
+                    w.RealTime());
+    w.Continue();
+
+    TGRSIDetectorHit::SetPPGPtr(nullptr);
+    delete ppg;
+
+    return 0;
 }
 
 // This function gets run if running in compiled mode
 #ifndef __CINT__
 int main(int argc, char **argv) {
+    // Pull the options out of the argument list, whatever is left over are
+    // the positional arguments
+    int nThreads = 1;
+    Long64_t cacheSize = 100 * 1048576;
+    const char *storeName = nullptr;
+    const char *planFile = nullptr;
+    int runNumber = -1;
+    bool breakdown = false;
+    const char *cacheDir = nullptr;
+    int snapshotInterval = 0;
+    int idleTimeout = 0;
+    int nArgs = 0;
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            // tree cache size in MB
+            cacheSize = atol(argv[++i]) * 1048576;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            // hit store (or skim) made by kMakeHitStore from the analysis
+            // tree file
+            storeName = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            // windows and histograms to sort, see LoadLeanPlan
+            planFile = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            // sort all subruns of a run, the first argument is the directory
+            // with the analysis tree files
+            runNumber = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            // keep the 1D histograms of every subrun of a run
+            breakdown = true;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            // cache of the sorted subruns of a run, see SortRun
+            cacheDir = argv[++i];
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            // follow a file that is still being written, with a snapshot
+            // every so many seconds
+            snapshotInterval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            // stop following after so many seconds without new entries
+            idleTimeout = atoi(argv[++i]);
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
     if (argc != 4 && argc != 3 && argc != 2) {
-        printf("try again (usage: %s <analysis tree file> <optional: output "
-               "file> <max entries>).\n",
+        printf("try again (usage: %s [-j <threads>] [-c <cache size in MB>] "
+               "[-s <hit store>] [-p <plan file>] [-r <run number> [-b] "
+               "[-i <cache directory>]] [-f <snapshot interval in s> "
+               "[-t <idle timeout in s>]] "
+               "<analysis tree file, or with -r the directory of the "
+               "subruns> <optional: residuals or calibration bundle file> "
+               "<max entries>).\n",
                argv[0]);
         return 0;
     }
+    if (runNumber >= 0 && storeName != nullptr) {
+        printf("A hit store can only be used for a single file!\n");
+        return 1;
+    }
+    if (snapshotInterval > 0 && (runNumber >= 0 || storeName != nullptr)) {
+        printf("Following a file can not be combined with -r or -s!\n");
+        return 1;
+    }
+    if (runNumber < 0 && cacheDir != nullptr) {
+        printf("The cache can only be used for a whole run (-r)!\n");
+        return 1;
+    }
+    if (nThreads > 1) {
+        ROOT::EnableThreadSafety();
+    }
 
     // We use a stopwatch so that we can watch progress
     TStopwatch w;
     w.Start();
 
+    if (snapshotInterval > 0) {
+        return FollowRun(argv[1], snapshotInterval, idleTimeout, planFile,
+                         cacheSize, w, (argc > 2) ? argv[2] : nullptr);
+    }
+    if (runNumber >= 0) {
+        long entries = 0;
+        if (argc > 3) {
+            entries = atol(argv[3]);
+            std::cout << "Limiting processing of every subrun to " << entries
+                      << " entries!" << std::endl;
+        }
+        int result = SortRun(argv[1], runNumber, entries, w, nThreads,
+                             cacheSize, planFile, breakdown,
+                             (argc > 2) ? argv[2] : nullptr, cacheDir);
+        std::cout << argv[0] << " done after " << w.RealTime() << " seconds"
+                  << std::endl
+                  << std::endl;
+        return result;
+    }
+
     auto *file = new TFile(argv[1]);
 
     if (file == nullptr) {
@@ -990,25 +2578,6 @@ int main(int argc, char **argv) {
         myPPG = nullptr;
     }
 
-    TFile *pResFile = nullptr;
-    if ( argc > 2 ) // Check if the extra file is tacked on
-        pResFile = new TFile( argv[2], "READ");
-    if ( pResFile != nullptr )
-    {
-        pResFile->cd();
-        if (pResFile->cd("Energy_Residuals")) {
-            printf("Energy residuals found, loading...\n");
-            TGraph* TempGraph;
-            for (int k = 0 ; k < 64; k++) {
-                gDirectory->GetObject(Form("Graph;%d", k + 1), TempGraph);
-                ResidualVec.push_back( new TMVA::TSpline1("", TempGraph) );
-            }
-        } else {
-            printf("No energy residuals found\n");
-        }
-        pResFile->Close();
-    }
-
     // Get run info from File
     TGRSIRunInfo *runInfo =
         dynamic_cast<TGRSIRunInfo *>(file->Get("TGRSIRunInfo"));
@@ -1018,26 +2587,58 @@ int main(int argc, char **argv) {
     }
 
     TTree *tree = dynamic_cast<TTree *>(file->Get("AnalysisTree"));
-    TChannel::ReadCalFromTree(tree);
     if (tree == nullptr) {
         printf("Failed to find analysis tree in file '%s'!\n", argv[1]);
         return 1;
     }
+    // the calibration of the tree, and the residuals file or calibration
+    // bundle on top if there is one
+    if (!LoadCalibration(tree, (argc > 2) ? argv[2] : nullptr, &Residuals)) {
+        return 1;
+    }
     // Get the TGRSIRunInfo from the analysis Tree.
 
+    // The run info, PPG and calibration still come from the analysis tree
+    // file, but the hits are read from the hit store
+    HitStore store;
+    if (storeName != nullptr) {
+        if (!store.Open(storeName)) {
+            return 1;
+        }
+        if (store.IsSkim()) {
+            printf("Hit store '%s' is a skim of %lld of the %lld entries, "
+                   "with %s\n",
+                   storeName, store.GetEntries(), tree->GetEntries(),
+                   store.GetSelection().Describe().c_str());
+        } else if (store.GetEntries() != tree->GetEntries()) {
+            printf("Hit store '%s' has %lld entries, but the analysis tree "
+                   "has %lld!\n",
+                   storeName, store.GetEntries(), tree->GetEntries());
+            return 1;
+        }
+        if (!Residuals.Empty()) {
+            printf("The energies of the hit store already are calibrated, "
+                   "the residuals are not used\n");
+        }
+    }
+    HitStore *pStore = store.IsOpen() ? &store : nullptr;
+
     TList *list; // We return a list because we fill a bunch of TH1's and shove
                  // them into this list.
+    SortStats stats;
 
     std::cout << argv[0] << ": starting Analysis after " << w.RealTime()
               << " seconds" << std::endl;
     w.Continue();
     if (argc < 4) {
-        list = LeanMatrices(tree, myPPG, runInfo, 0, &w);
+        list = LeanMatrices(tree, myPPG, runInfo, 0, &w, nThreads,
+                            cacheSize, pStore, planFile, &stats);
     } else {
         int entries = atoi(argv[3]);
         std::cout << "Limiting processing of analysis tree to " << entries
                   << " entries!" << std::endl;
-        list = LeanMatrices(tree, myPPG, runInfo, entries, &w);
+        list = LeanMatrices(tree, myPPG, runInfo, entries, &w, nThreads,
+                            cacheSize, pStore, planFile, &stats);
     }
     if (list == nullptr) {
         std::cout << "LeanMatrices returned TList* nullptr!\n" << std::endl;
@@ -1052,6 +2653,7 @@ int main(int argc, char **argv) {
     }
     int runnumber = runInfo->RunNumber();
     int subrunnumber = runInfo->SubRunNumber();
+    StageClock clock;
     outfile = new TFile(
         Form("matrix%05d_%03d.root", runnumber, subrunnumber), "recreate");
 
@@ -1068,6 +2670,12 @@ int main(int argc, char **argv) {
     }
 
     outfile->Close();
+    clock.Lap(stats, SortStats::kWrite);
+
+    stats.Print();
+    stats.WriteJSON(StatsFileName(outfile->GetName()), "kLeanMatrices",
+                    argv[1], nThreads, w.RealTime());
+    w.Continue();
 
     std::cout << argv[0] << " done after " << w.RealTime() << " seconds"
               << std::endl
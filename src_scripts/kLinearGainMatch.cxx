@@ -44,6 +44,12 @@
 #include "TStyle.h"
 #include "TTree.h"
 
+#include "CalBundle.h"
+#include "CalHistCache.h"
+#include "CalPeaks.h"
+#include "ChannelPool.h"
+#include "EnergyProjector.h"
+
 #ifndef __CINT__
 #include "TGriffin.h"
 #include "TSceptar.h"
@@ -55,15 +61,53 @@
 // Otherwise gIsCalibration = 0
 const bool gIsCalibration = 0;
 
-// Input the two peaks for fitting
-//  {peak, fit window}
-const double_t gCalPeaks[2][2] = { {315.42, 20}, {1864.89, 20} };
+// The two peaks for fitting, gCalPeaks of CalPeaks.h
+
+const int gNChannels = 64;
+
+// Fits both peaks of one channel, h_en is only used by this thread
+void FitChannel(TH1D *h_en, double_t *MeasuredPeaks) {
+    for ( int k = 0; k < 2 ; k++ ) {
+        TSpectrum s;
+        h_en->GetXaxis()->SetRangeUser(
+                gCalPeaks[k][0] - gCalPeaks[k][1],
+                gCalPeaks[k][0] + gCalPeaks[k][1] );
+        s.Search(h_en, 2, "goff", 0.25);
+        double_t SpecPeak = s.GetPositionX()[0];
+        h_en->GetXaxis()->UnZoom();
+
+        TPeak* TempP = RootLocked([&]() {
+            return new TPeak(SpecPeak, SpecPeak - gCalPeaks[k][1],
+                    SpecPeak + gCalPeaks[k][1] );
+        });
+
+        TempP->Fit(h_en,"MQ");
+        MeasuredPeaks[k] = TempP->GetCentroid();
+        RootLocked([&]() { delete TempP; });
+    }
+}
 
 int main(int argc, char *argv[]) {
+    int nThreads = 1;
+    int nArgs = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            // channels fitted at the same time
+            nThreads = atoi(argv[++i]);
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
     if (argc < 2) {
-        printf("Usage is: %s <fragment or analysis tree file> ).\n", argv[0]);
+        printf("Usage is: %s [-j <threads>] "
+               "<fragment or analysis tree file, or calibration spectra of "
+               "kMakeCalMatrices> ).\n",
+               argv[0]);
         exit(EXIT_FAILURE);
     }
+    SetUpFits(nThreads);
 
     TFile *pFile = new TFile(argv[1]);
 
@@ -72,60 +116,40 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    TTree *pTree = nullptr;
-    if( gIsCalibration )
-        pTree = static_cast<TTree*>( pFile->Get("FragmentTree") );
-    else
-        pTree = static_cast<TTree*>( pFile->Get("AnalysisTree") );
-
-    if (!pTree) {
-        printf("Failed to find TTree\n");
+    TChannel* pChannel = nullptr;
+    EnergyProjector::ELayout layout = gIsCalibration
+                                          ? EnergyProjector::kFragmentTree
+                                          : EnergyProjector::kAnalysisTree;
+    TH2D *mat_en = ReadEnergyMatrix(pFile, layout, nThreads);
+    if (mat_en == nullptr) {
         exit(EXIT_FAILURE);
     }
 
-    double_t MeasuredPeaks[2];
-    
-    TChannel* pChannel = nullptr;
-    TChannel::ReadCalFromTree(pTree);
-
-    // Keep statistics at 1 keV/bin
-    TH2D *mat_en = new TH2D("mat_en", "", 64, 0, 64, 5000, 0, 5000);
-
-    if (gIsCalibration)
-        pTree->Project("mat_en",
-                        "TFragment.GetEnergy():TFragment.GetChannelNumber()",
-                        "TGriffin.GetMultiplicity()==1");
-	else
-        pTree->Project("mat_en", "TGriffin.fGriffinLowGainHits.GetEnergy():"
-                                  "TGriffin.fGriffinLowGainHits.GetChannel().fNumber",
-                                  "TGriffin.GetMultiplicity()==1"); // for cal files
-    for (int i = 0; i < 64 ; i++ ) {
+    // Project the histograms for all channels, then fit them side by side
+    std::vector<TH1D *> Hists(gNChannels);
+    for (int i = 0; i < gNChannels ; i++ ) {
+        Hists[i] = mat_en->ProjectionY(Form("h_%.2i", i), i + 1, i + 1);
+    }
+    std::vector<double_t> MeasuredPeaks(2 * gNChannels);
+    ChannelPool Pool(nThreads);
+    Pool.Run(gNChannels, [&](int i) {
+        FitChannel(Hists[i], &MeasuredPeaks[2 * i]);
+    });
+    int Slowest = Pool.Slowest();
+    printf("Fits took %.2f s, the slowest channel %d took %.2f s\n",
+           Pool.TotalTime(), Slowest, Pool.Time(Slowest));
+
+    // The new coefficients go into the channels one after the other
+    for (int i = 0; i < gNChannels ; i++ ) {
         pChannel = TChannel::GetChannelByNumber(i);
-        TH1D *h_en = mat_en->ProjectionY(Form("h_%.2i", i), i + 1, i + 1);
-
-        for ( int k = 0; k < 2 ; k++ ) {
-            TSpectrum s;
-            h_en->GetXaxis()->SetRangeUser( 
-                    gCalPeaks[k][0] - gCalPeaks[k][1],
-                    gCalPeaks[k][0] + gCalPeaks[k][1] );
-            s.Search(h_en, 2, "", 0.25);
-            double_t SpecPeak = s.GetPositionX()[0];
-            h_en->GetXaxis()->UnZoom();
-
-            TPeak* TempP = new TPeak(SpecPeak, SpecPeak - gCalPeaks[k][1],
-                    SpecPeak + gCalPeaks[k][1] );
-
-            TempP->Fit(h_en,"MQ");
-            MeasuredPeaks[k] = TempP->GetCentroid();
-            delete TempP;
-        }
 
         double_t oldSlope = pChannel->GetENGCoeff()[1];
         double_t oldOffset = pChannel->GetENGCoeff()[0];
         double_t ChargePeaks[2];
 
         for ( int k = 0; k < 2 ; k++ ) {
-            ChargePeaks[k] = ( MeasuredPeaks[k] - oldOffset ) / oldSlope;
+            ChargePeaks[k] =
+                ( MeasuredPeaks[2 * i + k] - oldOffset ) / oldSlope;
         }
 
         double_t newSlope = (gCalPeaks[1][0] - gCalPeaks[0][0])
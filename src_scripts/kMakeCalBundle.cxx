@@ -0,0 +1,106 @@
+// g++ kMakeCalBundle.cxx -std=c++0x -I$GRSISYS/include -L$GRSISYS/libraries
+// -lAnalysisTreeBuilder -lGriffin -lSceptar -lDescant -lPaces -lGRSIDetector
+// -lTGRSIFit -lTigress -lSharc -lCSM -lTriFoil -lTGRSIint -lGRSILoop
+// -lMidasFormat -lGRSIRootIO -lDataParser -lGRSIFormat -lMidasFormat
+// -lXMLParser -lXMLIO -lProof -lGuiHtml `grsi-config --cflags --libs`
+// `root-config --cflags --libs`  -lTreePlayer -lGROOT -lX11 -lXpm -lSpectrum
+
+// Puts the calibration of a run together into a calibration bundle (see
+// CalBundle.h), which every sorting script takes instead of a residuals file.
+// The sources are read in the order they are given, later ones override the
+// earlier ones:
+//
+//     analysis or fragment tree file  the calibration stored with the tree
+//     residuals file (.root)          the residuals of kResidualCalculator
+//     calibration file (e.g. .cal)    gain match or ct_correction.cal
+//     calibration bundle              all of it
+//
+// e.g. kMakeCalBundle -o run12345.calb analysis12345_000.root
+//      gainmatch.cal ct_correction.cal residuals.root
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Globals.h"
+#include "TFile.h"
+#include "TTree.h"
+
+#include "CalBundle.h"
+#include "ResidualTable.h"
+
+#ifndef __CINT__
+int main(int argc, char **argv) {
+    std::string bundleName = "calibration.calb";
+    std::vector<const char *> sources;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            bundleName = argv[++i];
+        } else {
+            sources.push_back(argv[i]);
+        }
+    }
+    if (sources.empty()) {
+        printf("try again (usage: %s [-o <bundle file>] <tree, residuals, "
+               "calibration or bundle files>).\n",
+               argv[0]);
+        return 0;
+    }
+
+    CalBundleContents contents;
+    for (const char *source : sources) {
+        printf("Reading calibration from:" DBLUE " %s" RESET_COLOR "\n",
+               source);
+        // a tree file gives the calibration stored with its tree
+        TTree *tree = nullptr;
+        std::string name(source);
+        if (name.size() > 5 &&
+            name.compare(name.size() - 5, 5, ".root") == 0) {
+            TFile file(source, "READ");
+            if (!file.IsOpen()) {
+                printf("Failed to open file '%s'!\n", source);
+                return 1;
+            }
+            file.GetObject("AnalysisTree", tree);
+            if (tree == nullptr) {
+                file.GetObject("FragmentTree", tree);
+            }
+            if (tree != nullptr) {
+                LoadCalibration(tree, nullptr, nullptr);
+                continue;
+            }
+        }
+        if (!LoadCalibration(nullptr, source, nullptr, &contents)) {
+            return 1;
+        }
+    }
+    AddChannels(contents);
+
+    printf("Writing calibration of %lu channels and residuals of %lu "
+           "crystals to: " DYELLOW "%s" RESET_COLOR "\n",
+           static_cast<unsigned long>(contents.channels.size()),
+           static_cast<unsigned long>(contents.residuals.size()),
+           bundleName.c_str());
+    if (!contents.Write(bundleName)) {
+        return 1;
+    }
+
+    // what a sort pays for its calibration
+    auto start = std::chrono::steady_clock::now();
+    CalBundle bundle;
+    ResidualTable residuals;
+    if (!bundle.Open(bundleName)) {
+        return 1;
+    }
+    ApplyToChannels(bundle);
+    bundle.BuildResiduals(residuals);
+    double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    printf("The bundle loads in %.2f ms\n", ms);
+
+    return 0;
+}
+#endif
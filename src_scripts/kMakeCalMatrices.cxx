@@ -33,8 +33,14 @@
 #include "TVirtualIndex.h"
 #include "TGRSIOptions.h"
 #include "THnSparse.h"
-#include "TSpline.h"
-#include "TMVA/TSpline1.h"
+
+#include "CalBundle.h"
+#include "CalHistCache.h"
+#include "HistRegistry.h"
+#include "HitCache.h"
+#include "ReadPlan.h"
+#include "ResidualTable.h"
+#include "SortStats.h"
 
 #ifndef __CINT__
 #include "TGriffin.h"
@@ -42,7 +48,7 @@
 #include "TGRSISelector.h"
 #endif
 
-std::vector<TSpline*> ResidualVec;
+ResidualTable Residuals;
 
 // This function gets run if running interpretively
 // Not recommended for the analysis scripts
@@ -62,7 +68,8 @@ void LeanMatrices() {
 #endif
 
 TList *LeanMatrices(TTree *tree, TPPG *ppg, TGRSIRunInfo *runInfo,
-                    long maxEntries = 0, TStopwatch *w = NULL) {
+                    long maxEntries = 0, TStopwatch *w = NULL,
+                    SortStats *stats = NULL, CalHistCache *cache = NULL) {
     if (runInfo == NULL) {
         return NULL;
     }
@@ -112,163 +119,169 @@ TList *LeanMatrices(TTree *tree, TPPG *ppg, TGRSIRunInfo *runInfo,
         new TH2D("Addback_vs_Detector", "#gamma addback for each detector", 16,
                  0, 16, nofBins, low, high);
     list->Add(Addback_vs_Detector);
-    TH1D *Singles[64];
-    TH1D *Addback[16];
+    // the singles of every crystal and the addback of every detector are
+    // filled through their handles (see HistRegistry.h)
+    HistRegistry hists;
 
     TH2D *ggsummat = new TH2D("ggsummat","#gamma-#gamma matrix 180 degrees",nofBins, low, high,nofBins, low, high); list->Add(ggsummat);
 
 
-    for (int i = 0; i < 64; i++) {
-        char name[128];
-
-        sprintf(name, "Singles_%.2d", i);
-
-        Singles[i] = new TH1D(name, Form("Singles for crystal %d", i), nofBins,
-                              low, high);
-        list->Add(Singles[i]);
-    }
-    for (int i = 0; i < 16; i++) {
-        char name[128];
-
-        sprintf(name, "Addback_%.2d", i);
-
-        Addback[i] = new TH1D(name, Form("Addback for detector %d", i), nofBins,
-                              low, high);
-        list->Add(Addback[i]);
-    }
+    int Singles = hists.AddBlock(64, [&](int i) {
+        return new TH1D(Form("Singles_%.2d", i),
+                        Form("Singles for crystal %d", i), nofBins, low, high);
+    });
+    int Addback = hists.AddBlock(16, [&](int i) {
+        return new TH1D(Form("Addback_%.2d", i),
+                        Form("Addback for detector %d", i), nofBins, low, high);
+    });
+    hists.AddTo(list);
 
     // Check what the times are
     TH1F *timeinrun = new TH1F(
         "timeinrun", "Time within run for #gamma singles", 1000, 0., 6.0e12);
     list->Add(timeinrun);
 
+    if (maxEntries == 0 || maxEntries > tree->GetEntries()) {
+        maxEntries = tree->GetEntries();
+    }
+
+    // Only the GRIFFIN hits are read, every other branch is switched off
+    ReadPlan plan;
+    plan.AddBranch("TGriffin");
+    plan.Apply(tree, 1, maxEntries, true);
+
     TGriffin *grif = 0;
     tree->SetBranchAddress("TGriffin",
                            &grif); // We assume we always have a Griffin branch
             TGRSIOptions::AnalysisOptions()->SetCorrectCrossTalk(true);
         //TGRSIOptions::AnalysisOptions()->IsCorrectingCrossTalk();
     //grif->ResetFlags();
-    if( ResidualVec.size() == 64 ) {
+    if (!Residuals.Empty()) {
         printf("Loading in energy residuals\n");
-        for (int k = 0; k < 64; k++) {
-            grif->LoadEnergyResidual(k+1, ResidualVec[k]);
-        }
     }
 
     // Indices of the two hits being compared
     int one;
     int two;
+    // the hits of the current event
+    HitCache gammas;
+    HitCache addbacks;
+    SortStats localStats;
+    if (stats == NULL) {
+        stats = &localStats;
+    }
+    stats->SetVariants({""});
+    StageClock clock;
 
     std::cout << std::fixed
               << std::setprecision(
                      1); // This just make outputs not look terrible
 
-    if (maxEntries == 0 || maxEntries > tree->GetEntries()) {
-        maxEntries = tree->GetEntries();
-    }
-
     int entry;
     // Only loop over the set number of entries
     // I'm starting at entry 1 because of the weird high stamp of 4
     for (entry = 1; entry < maxEntries; ++entry) {
 
+        clock.Start();
         tree->GetEntry(entry);
+        clock.Lap(*stats, SortStats::kRead);
 
         grif->ResetAddback();
+        // the cache keeps the spectra without the residuals, see CalHistCache
+        if (cache != NULL) {
+            cache->Fill(grif);
+        }
+        ApplyResiduals(Residuals, grif);
+        // decode every hit once, the loops below only use the cached values
+        gammas.FillGriffin(grif);
+        addbacks.FillAddback(grif);
+        clock.Lap(*stats, SortStats::kCalibrate);
+        stats->Add(SortStats::kEntries);
+        stats->Add(SortStats::kGammaHits, gammas.size());
+        stats->Add(SortStats::kAddbackHits, addbacks.size());
 
         // loop over the gammas in the event packet
-        for (one = 0; one < (int)grif->GetMultiplicity(); ++one) {
-                
-            timeinrun->Fill(grif->GetHit(one)->GetTime());
-                if(grif->GetGriffinHit(one)->GetKValue() != 700) continue;
-            int crystal = grif->GetGriffinHit(one)->GetCrystal() +
-                          (grif->GetGriffinHit(one)->GetDetector() - 1) * 4;
+        for (one = 0; one < (int)gammas.size(); ++one) {
+
+            timeinrun->Fill(gammas.time[one]);
+            if (gammas.kValue[one] != 700) {
+                stats->Add(SortStats::kPileupRejected);
+                continue;
+            }
+            int crystal =
+                CrystalIndex(gammas.detector[one], gammas.crystal[one]);
 
             // We want to put every gamma ray in this event into the singles
-            Singles_total->Fill(grif->GetGriffinHit(one)->GetEnergy());
-            Singles_vs_Crystal->Fill(crystal,
-                                     grif->GetGriffinHit(one)->GetEnergy());
-
-            for (int i = 0; i < 64; i++) {
-
-                if (crystal == i)
-                    Singles[i]->Fill(grif->GetGriffinHit(one)->GetEnergy());
-
-            } // crystal loop
-
-                     // We now want to loop over any other gammas in this
-               //packet
-                     for(two = 0; two < (int) grif->GetMultiplicity(); ++two) {
-                        if(two == one) continue; //If we are looking at the same
-               //gamma we don't want to call it a coincidence
-
-                        //ggTimeDiff->Fill(TMath::Abs(grif->GetGriffinHit(two)->GetTime()-grif->GetGriffinHit(one)->GetTime()));
-
-                        if(ggTlow <=
-               TMath::Abs(grif->GetGriffinHit(two)->GetTime()-grif->GetGriffinHit(one)->GetTime())
-               &&
-               TMath::Abs(grif->GetGriffinHit(two)->GetTime()-grif->GetGriffinHit(one)->GetTime())
-               < ggThigh) {
-                           //If they are close enough in time, fill the
-               //gamma-gamma matrix. This will be symmetric because we are doing a
-               //double loop over gammas
-               
-               if(grif->GetGriffinHit(one)->GetPosition()               //180 sum coincidence
-                             .Angle(grif->GetGriffinHit(two)->GetPosition()) 
-                           > 3.13)
-               
-                           ggsummat->Fill(grif->GetGriffinHit(one)->GetEnergy(),
-               grif->GetGriffinHit(two)->GetEnergy());
-
-                        } // gg prompt coincidences
-
-                //        if(ggBGlow <=
-              // TMath::Abs(grif->GetGriffinHit(two)->GetTime()-grif->GetGriffinHit(one)->GetTime())
-             //  &&
-             //  TMath::Abs(grif->GetGriffinHit(two)->GetTime()-grif->GetGriffinHit(one)->GetTime())
-             //  < ggBGhigh) {
-                           //If they are not close enough in time, fill the
-               //time-random gamma-gamma matrix. This will be symmetric because we
-               //are doing a double loop over gammas
-                        } // gg time random coincidences
-
-                     } // gg second gamma loop
-            
-
-         // g first gamma loop
+            Singles_total->Fill(gammas.energy[one]);
+            Singles_vs_Crystal->Fill(crystal, gammas.energy[one]);
 
-        // loop over the addbacks in the event packet
-        for (one = 0; one < (int)grif->GetAddbackMultiplicity(); ++one) {
+            if (0 <= crystal && crystal < 64) {
+                hists.Get<TH1>(Singles + crystal)->Fill(gammas.energy[one]);
+            }
 
-            int detector = grif->GetAddbackHit(one)->GetDetector() - 1;
-                if(grif->GetAddbackHit(one)->GetKValue() != 700) continue;
-            // We want to put every gamma ray in this event into the singles
-            Addback_total->Fill(grif->GetAddbackHit(one)->GetEnergy());
-            Addback_vs_Detector->Fill(detector,
-                                      grif->GetAddbackHit(one)->GetEnergy());
+            // We now want to loop over any other gammas in this packet
+            for (two = 0; two < (int)gammas.size(); ++two) {
+                if (two == one) continue; // If we are looking at the same
+                // gamma we don't want to call it a coincidence
 
-            for (int i = 0; i < 16; i++) {
+                // ggTimeDiff->Fill(TMath::Abs(gammas.time[two]-gammas.time[one]));
 
-                if (detector == i)
-                    Addback[i]->Fill(grif->GetAddbackHit(one)->GetEnergy());
+                double timeDiff =
+                    TMath::Abs(gammas.time[two] - gammas.time[one]);
+                stats->Add(SortStats::kPairsTested);
+                if (ggTlow <= timeDiff && timeDiff < ggThigh) {
+                    stats->Accept(0, SortStats::kGGPrompt);
+                    // If they are close enough in time, fill the gamma-gamma
+                    // matrix. This will be symmetric because we are doing a
+                    // double loop over gammas
 
-            } // detectorloop
+                    // 180 sum coincidence, the positions are only needed for
+                    // the prompt pairs so they are not cached
+                    if (grif->GetGriffinHit(one)->GetPosition().Angle(
+                            grif->GetGriffinHit(two)->GetPosition()) > 3.13)
+                        ggsummat->Fill(gammas.energy[one], gammas.energy[two]);
 
-            // We now want to loop over any other gammas in this packet
-            /*         for(two = 0; two < (int) grif->GetAddbackMultiplicity();
-               ++two) {
-                                                    if(two == one) continue;
-               //If we are looking at the same gamma we don't want to call it a
-               coincidence
+                } // gg prompt coincidences
+
+                // if(ggBGlow <= timeDiff && timeDiff < ggBGhigh) {
+                // If they are not close enough in time, fill the
+                // time-random gamma-gamma matrix. This will be symmetric
+                // because we are doing a double loop over gammas
+                // } // gg time random coincidences
+
+            } // gg second gamma loop
+
+        } // g first gamma loop
+
+        // loop over the addbacks in the event packet
+        for (one = 0; one < (int)addbacks.size(); ++one) {
+
+            int detector = DetectorIndex(addbacks.detector[one]);
+            if (addbacks.kValue[one] != 700) {
+                stats->Add(SortStats::kPileupRejected);
+                continue;
+            }
+            // We want to put every gamma ray in this event into the singles
+            Addback_total->Fill(addbacks.energy[one]);
+            Addback_vs_Detector->Fill(detector, addbacks.energy[one]);
 
+            if (0 <= detector && detector < 16) {
+                hists.Get<TH1>(Addback + detector)->Fill(addbacks.energy[one]);
+            }
+
+            // We now want to loop over any other gammas in this packet
+            /*         for(two = 0; two < (int) addbacks.size(); ++two) {
+                        if(two == one) continue;
+                        //If we are looking at the same gamma we don't want to
+                        //call it a coincidence
 
                         //VINZENZ I THINK THIS IS BREAKING THIS FOR SOME REASON.
-                        aaTimeDiff->Fill(TMath::Abs(grif->GetAddbackHit(two)->GetTime()-grif->GetAddbackHit(one)->GetTime()));
+                        aaTimeDiff->Fill(TMath::Abs(addbacks.time[two]-addbacks.time[one]));
 
                      } // aa multiplicity loop
             */
         } // a loop
-
+        clock.Lap(*stats, SortStats::kFill);
         if ((entry % 10000) == 0) {
             printf("Completed %d of %ld \r", entry, maxEntries);
         }
@@ -285,8 +298,8 @@ TList *LeanMatrices(TTree *tree, TPPG *ppg, TGRSIRunInfo *runInfo,
 #ifndef __CINT__
 int main(int argc, char **argv) {
     if (argc != 4 && argc != 3 && argc != 2) {
-        printf("try again (usage: %s <analysis tree file> <optional: output "
-               "file> <max entries>).\n",
+        printf("try again (usage: %s <analysis tree file> <optional: "
+               "residuals or calibration bundle file> <max entries>).\n",
                argv[0]);
         return 0;
     }
@@ -315,25 +328,6 @@ int main(int argc, char **argv) {
             return 1;
            }*/
 
-    TFile *pResFile = nullptr;
-    if ( argc > 2 ) // Check if the extra file is tacked on
-        pResFile = new TFile( argv[2], "READ");
-    if ( pResFile != nullptr )
-    {
-        pResFile->cd();
-        if (pResFile->cd("Energy_Residuals")) {
-            printf("Energy residuals found, loading...\n");
-            TGraph* TempGraph;
-            for (int k = 0 ; k < 64; k++) {
-                gDirectory->GetObject(Form("Graph;%d", k + 1), TempGraph);
-                ResidualVec.push_back( new TMVA::TSpline1("", TempGraph ) );
-            }
-        } else {
-            printf("No energy residuals found\n");
-        }
-        pResFile->Close();
-    }
-
     // Get run info from File
     TGRSIRunInfo *runInfo = (TGRSIRunInfo *)file->Get("TGRSIRunInfo");
     TGRSIRunInfo::Get()->SetRunInfo(runInfo);
@@ -343,11 +337,13 @@ int main(int argc, char **argv) {
     }
 
     TTree *tree = (TTree *)file->Get("AnalysisTree");
-    TChannel::ReadCalFromTree(tree);
     if (tree == NULL) {
         printf("Failed to find analysis tree in file '%s'!\n", argv[1]);
         return 1;
     }
+    if (!LoadCalibration(tree, (argc > 2) ? argv[2] : nullptr, &Residuals)) {
+        return 1;
+    }
 
     // Get the TGRSIRunInfo from the analysis Tree.
 
@@ -381,28 +377,45 @@ int main(int argc, char **argv) {
         outfile = new TFile(argv[2], "recreate");
     }
 */
+    SortStats stats;
+    // the channel spectra for kLinearGainMatch and kResidualCalculator
+    CalHistCache cache;
     std::cout << argv[0] << ": starting Analysis after " << w.RealTime()
               << " seconds" << std::endl;
     w.Continue();
     if (argc < 4) {
-        list = LeanMatrices(tree, myPPG, runInfo, 0, &w);
+        list = LeanMatrices(tree, myPPG, runInfo, 0, &w, &stats, &cache);
     } else {
         int entries = atoi(argv[3]);
         std::cout << "Limiting processing of analysis tree to " << entries
                   << " entries!" << std::endl;
-        list = LeanMatrices(tree, myPPG, runInfo, entries, &w);
+        list = LeanMatrices(tree, myPPG, runInfo, entries, &w, &stats,
+                            &cache);
     }
     if (list == NULL) {
         std::cout << "LeanMatrices returned TList* NULL!\n" << std::endl;
         return 1;
     }
 
+    StageClock clock;
     printf("Writing to File: " DYELLOW "%s" RESET_COLOR "\n",
            outfile->GetName());
     list->Write();
 
     outfile->Close();
 
+    std::string cacheName =
+        Form("calhist%05d_%03d.root", runnumber, subrunnumber);
+    printf("Writing calibration spectra to: " DYELLOW "%s" RESET_COLOR "\n",
+           cacheName.c_str());
+    cache.Write(cacheName.c_str());
+    clock.Lap(stats, SortStats::kWrite);
+
+    stats.Print();
+    stats.WriteJSON(StatsFileName(outfile->GetName()), "kMakeCalMatrices",
+                    argv[1], 1, w.RealTime());
+    w.Continue();
+
     std::cout << argv[0] << " done after " << w.RealTime() << " seconds"
               << std::endl
               << std::endl;
@@ -0,0 +1,219 @@
+// g++ kMakeHitStore.cxx -std=c++0x -I$GRSISYS/include -L$GRSISYS/libraries
+// -lAnalysisTreeBuilder -lGriffin -lSceptar -lDescant -lPaces -lGRSIDetector
+// -lTGRSIFit -lTigress -lSharc -lCSM -lTriFoil -lTGRSIint -lGRSILoop
+// -lMidasFormat -lGRSIRootIO -lDataParser -lGRSIFormat -lMidasFormat
+// -lXMLParser -lXMLIO -lProof -lGuiHtml `grsi-config --cflags --libs`
+// `root-config --cflags --libs`  -lTreePlayer -lGROOT -lX11 -lXpm -lSpectrum
+
+// Converts the GRIFFIN, addback and SCEPTAR hits of an analysis tree into a
+// hit store (see HitStore.h), which kLeanMatrices can sort with -s instead of
+// reading the analysis tree again. The hits are calibrated the same way
+// kLeanMatrices does it, with cross-talk correction and optionally residuals
+// or a calibration bundle (see CalBundle.h).
+//
+// With a selection only the events that pass it are written, a skim that
+// gamma-gamma or gamma-gamma-beta sorts read instead of all entries:
+//
+//     -m <n>            at least n GRIFFIN hits
+//     -b <low,high>     a SCEPTAR hit with low <= t(gamma) - t(beta) <= high
+//     -y <low,high>     a GRIFFIN hit in this part of the PPG cycle
+//
+// The selection is stored in the skim, and kLeanMatrices refuses to sort
+// histograms from it that would miss any of the left out events.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Globals.h"
+#include "TFile.h"
+#include "TGRSIOptions.h"
+#include "TGRSIRunInfo.h"
+#include "TPPG.h"
+#include "TStopwatch.h"
+#include "TTree.h"
+
+#include "CalBundle.h"
+#include "CycleTable.h"
+#include "HitCache.h"
+#include "HitStore.h"
+#include "ReadPlan.h"
+#include "ResidualTable.h"
+
+#ifndef __CINT__
+#include "TGriffin.h"
+#include "TSceptar.h"
+#endif
+
+ResidualTable Residuals;
+
+#ifndef __CINT__
+// Reads "<low>,<high>", returns false if that is not what it is
+bool ReadRange(const char *text, double &low, double &high) {
+    return sscanf(text, "%lf,%lf", &low, &high) == 2 && low < high;
+}
+
+int main(int argc, char **argv) {
+    HitStoreSelection selection;
+    int nArgs = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            selection.minGammas = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            selection.betaWindow = 1;
+            if (!ReadRange(argv[++i], selection.gbLow, selection.gbHigh)) {
+                printf("Bad gamma-beta window '%s'!\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-y") == 0 && i + 1 < argc) {
+            selection.cycleWindow = 1;
+            if (!ReadRange(argv[++i], selection.cycleLow,
+                           selection.cycleHigh)) {
+                printf("Bad cycle window '%s'!\n", argv[i]);
+                return 1;
+            }
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
+    if (argc != 4 && argc != 3 && argc != 2) {
+        printf("try again (usage: %s [-m <min gammas>] [-b <gb low,high>] "
+               "[-y <cycle low,high>] <analysis tree file> <optional: "
+               "residuals or calibration bundle file> <optional: hit store "
+               "file>).\n",
+               argv[0]);
+        return 0;
+    }
+
+    TStopwatch w;
+    w.Start();
+
+    auto *file = new TFile(argv[1]);
+    if (!file->IsOpen()) {
+        printf("Failed to open file '%s'!\n", argv[1]);
+        return 1;
+    }
+    printf("Converting file:" DBLUE " %s" RESET_COLOR "\n", file->GetName());
+
+    // The PPG is needed for the cycle timestamps of the hits
+    TPPG *ppg = dynamic_cast<TPPG *>(file->Get("TPPG"));
+    if (ppg != nullptr && ppg->MapIsEmpty()) {
+        ppg = nullptr;
+    }
+    CycleTable cycleTable(ppg);
+    const CycleTable *cycles = (ppg != nullptr) ? &cycleTable : nullptr;
+    if (ppg != nullptr) {
+        TGRSIDetectorHit::SetPPGPtr(ppg);
+    } else if (selection.cycleWindow) {
+        printf("A cycle window needs the PPG, but there is none in file "
+               "'%s'!\n",
+               argv[1]);
+        return 1;
+    }
+
+    TGRSIRunInfo *runInfo =
+        dynamic_cast<TGRSIRunInfo *>(file->Get("TGRSIRunInfo"));
+    if (runInfo == nullptr) {
+        printf("Failed to find run information in file '%s'!\n", argv[1]);
+        return 1;
+    }
+    TTree *tree = dynamic_cast<TTree *>(file->Get("AnalysisTree"));
+    if (tree == nullptr) {
+        printf("Failed to find analysis tree in file '%s'!\n", argv[1]);
+        return 1;
+    }
+    if (!LoadCalibration(tree, (argc > 2) ? argv[2] : nullptr, &Residuals)) {
+        return 1;
+    }
+    TGRSIOptions::AnalysisOptions()->SetCorrectCrossTalk(true);
+
+    std::string storeName;
+    if (argc > 3) {
+        storeName = argv[3];
+    } else {
+        storeName = Form(selection.Any() ? "skim%05d_%03d.hits"
+                                         : "hits%05d_%03d.hits",
+                         runInfo->RunNumber(), runInfo->SubRunNumber());
+    }
+
+    ReadPlan plan;
+    plan.AddBranch("TGriffin");
+    plan.AddBranch("TSceptar");
+    if (selection.betaWindow && tree->FindBranch("TSceptar") == nullptr) {
+        printf("A gamma-beta window needs SCEPTAR, but there is none in "
+               "file '%s'!\n",
+               argv[1]);
+        return 1;
+    }
+    plan.Apply(tree, 0, tree->GetEntries(), true);
+
+    TGriffin *grif = nullptr;
+    TSceptar *scep = nullptr;
+    tree->SetBranchAddress("TGriffin", &grif);
+    bool gotSceptar = (tree->FindBranch("TSceptar") != nullptr);
+    if (gotSceptar) {
+        tree->SetBranchAddress("TSceptar", &scep);
+    }
+
+    printf("Keeping %s\n", selection.Describe().c_str());
+    HitStoreWriter writer(storeName, selection);
+    if (!writer.IsGood()) {
+        return 1;
+    }
+    HitCache gammas;
+    HitCache addbacks;
+    HitCache betas;
+    const HitCache *hits[kNHitStreams];
+    hits[kGriffinHits] = &gammas;
+    hits[kAddbackHits] = &addbacks;
+    hits[kSceptarHits] = &betas;
+
+    // without a selection every entry is converted, so the entry numbers
+    // stay the same
+    long nEntries = tree->GetEntries();
+    for (long entry = 0; entry < nEntries; ++entry) {
+        tree->GetEntry(entry);
+        grif->ResetAddback();
+        grif->SetDefaultGainType(TGriffin::kLowGain);
+        ApplyResiduals(Residuals, grif);
+        gammas.FillGriffin(grif, cycles);
+        addbacks.FillAddback(grif, cycles);
+        if (gotSceptar) {
+            betas.FillSceptar(scep, cycles);
+        }
+        // the sorts skip entry 0 (see kLeanMatrices), so a skim keeps it to
+        // skip the same event
+        if (entry == 0 || selection.Pass(gammas, betas)) {
+            writer.AddEvent(hits, entry);
+        }
+
+        if ((entry % 10000) == 0) {
+            printf("Completed %ld of %ld \r", entry, nEntries);
+            fflush(stdout);
+        }
+    }
+
+    printf("Writing to File: " DYELLOW "%s" RESET_COLOR "\n",
+           storeName.c_str());
+    uint64_t kept = writer.GetEntries();
+    if (!writer.Close()) {
+        return 1;
+    }
+    if (selection.Any()) {
+        printf("Kept %lu of %ld entries (%.1f%%)\n",
+               static_cast<unsigned long>(kept), nEntries,
+               (nEntries > 0) ? 100. * kept / nEntries : 0.);
+    }
+
+    std::cout << argv[0] << " done after " << w.RealTime() << " seconds"
+              << std::endl
+              << std::endl;
+
+    return 0;
+}
+#endif
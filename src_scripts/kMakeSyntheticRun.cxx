@@ -0,0 +1,280 @@
+// g++ kMakeSyntheticRun.cxx -std=c++0x -I$GRSISYS/include -L$GRSISYS/libraries
+// -lAnalysisTreeBuilder -lGriffin -lSceptar -lDescant -lPaces -lGRSIDetector
+// -lTGRSIFit -lTigress -lSharc -lCSM -lTriFoil -lTGRSIint -lGRSILoop
+// -lMidasFormat -lGRSIRootIO -lDataParser -lGRSIFormat -lMidasFormat
+// -lXMLParser -lXMLIO -lProof -lGuiHtml `grsi-config --cflags --libs`
+// `root-config --cflags --libs`  -lTreePlayer -lGROOT -lX11 -lXpm -lSpectrum
+
+// Writes a run of synthetic GRIFFIN and SCEPTAR events (see SyntheticEvents.h)
+// as analysis tree files analysis<run>_<subrun>.root, with the calibration,
+// PPG and run information of a real run, so the sort programs can be run and
+// benchmarked without beam data (see SortBench.cxx). The calibration is also
+// written as a cal file for GriffinCTFix, and the number of events and hits as
+// synthetic<run>.txt.
+//
+// The hits are built from fragments the way GRSISort builds them from the
+// MIDAS data, so the analysis trees have the layout of the GRSISort version
+// this is compiled with. The charge of a fragment is the integral over kValue
+// samples, and the time is the timestamp (10 ns) plus the CFD of a GRIF-16.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Globals.h"
+#include "TChannel.h"
+#include "TFile.h"
+#include "TFragment.h"
+#include "TGRSIRunInfo.h"
+#include "TPPG.h"
+#include "TStopwatch.h"
+#include "TTree.h"
+
+#include "SyntheticEvents.h"
+
+#ifndef __CINT__
+#include "TGriffin.h"
+#include "TSceptar.h"
+#endif
+
+const int kKValue = 700;
+
+// GRIFFIN channels are numbered by array number - 1, the SCEPTAR channels
+// follow them
+TChannel *MakeChannel(const char *name, unsigned int address, int number,
+                      double offset, double gain) {
+    auto *chan = new TChannel(name);
+    chan->SetAddress(address);
+    chan->SetNumber(number);
+    chan->SetDigitizerType("GRF16");
+    chan->AddENGCoefficient(offset);
+    chan->AddENGCoefficient(gain);
+    TChannel::AddChannel(chan);
+    return chan;
+}
+
+decltype(TPPG::kTapeMove) Pattern(ESyntheticCycle part) {
+    switch (part) {
+    case kCycleTapeMove:
+        return TPPG::kTapeMove;
+    case kCycleBackground:
+        return TPPG::kBackground;
+    case kCycleBeamOn:
+        return TPPG::kBeamOn;
+    default:
+        return TPPG::kDecay;
+    }
+}
+
+std::shared_ptr<TFragment> MakeFragment(unsigned int address, double charge,
+                                        double time) {
+    auto frag = std::make_shared<TFragment>();
+    Long64_t timeStamp = (Long64_t)(time / 10.);
+    frag->SetAddress(address);
+    frag->SetTimeStamp(timeStamp);
+    // the CFD of a GRIF-16 replaces the lowest 18 bits of the timestamp, in
+    // units of 1/1.6 ns
+    frag->SetCfd((int)((time - (timeStamp & ~0x3ffffLL) * 10.) * 1.6));
+    frag->SetKValue(kKValue);
+    frag->SetCharge((int)(std::max(charge, 0.) * kKValue));
+    return frag;
+}
+
+// Writes one subrun, with the events that follow the ones of the subruns
+// before it
+bool WriteSubrun(const char *fileName, SyntheticGenerator &generator,
+                 long nEvents, int runNumber, int subrun,
+                 TChannel **griffinChannels, TChannel **sceptarChannels) {
+    double start = generator.Time();
+    auto *file = new TFile(fileName, "recreate");
+    if (!file->IsOpen()) {
+        printf("Failed to open file '%s'!\n", fileName);
+        return false;
+    }
+
+    auto *tree = new TTree("AnalysisTree", "AnalysisTree");
+    TGriffin *grif = new TGriffin;
+    TSceptar *scep = new TSceptar;
+    tree->Branch("TGriffin", &grif);
+    tree->Branch("TSceptar", &scep);
+
+    SyntheticEvent event;
+    for (long i = 0; i < nEvents; ++i) {
+        generator.Next(event);
+        grif->Clear();
+        scep->Clear();
+        for (const SyntheticGamma &gamma : event.gammas) {
+            int channel = (gamma.detector - 1) * SyntheticGenerator::kCrystals +
+                          gamma.crystal;
+            TChannel *chan = griffinChannels[channel];
+            grif->AddFragment(
+                MakeFragment(chan->GetAddress(),
+                             generator.Charge(channel, gamma.energy),
+                             gamma.time),
+                chan);
+        }
+        for (const SyntheticBeta &beta : event.betas) {
+            TChannel *chan = sceptarChannels[beta.paddle - 1];
+            scep->AddFragment(
+                MakeFragment(chan->GetAddress(), beta.energy, beta.time), chan);
+        }
+        tree->Fill();
+
+        if ((i % 10000) == 0) {
+            printf("Subrun %d: completed %ld of %ld \r", subrun, i, nEvents);
+            fflush(stdout);
+        }
+    }
+    printf("Subrun %d: completed %ld of %ld \n", subrun, nEvents, nEvents);
+    double stop = generator.Time();
+
+    // the PPG of a subrun has the status changes during the subrun, the first
+    // one starts at the first tape move
+    TPPG ppg;
+    for (const SyntheticPPG &change : generator.Cycles(stop)) {
+        if (change.time < start && subrun > 0) {
+            continue;
+        }
+        ULong64_t timeStamp = (ULong64_t)(change.time / 10.);
+        auto *data = new TPPGData;
+        data->SetLowTimeStamp(timeStamp & 0x0fffffff);
+        data->SetHighTimeStamp(timeStamp >> 28);
+        data->SetNewPPG(Pattern(change.newPattern));
+        data->SetOldPPG(Pattern(change.oldPattern));
+        ppg.AddData(data);
+    }
+
+    TGRSIRunInfo *runInfo = TGRSIRunInfo::Get();
+    runInfo->SetRunNumber(runNumber);
+    runInfo->SetSubRunNumber(subrun);
+    runInfo->SetRunStart(start * 1e-9);
+    runInfo->SetRunStop(stop * 1e-9);
+
+    file->cd();
+    tree->Write();
+    ppg.Write("TPPG");
+    runInfo->Write("TGRSIRunInfo");
+    TChannel::WriteToRoot(file);
+    file->Close();
+    delete file;
+    return true;
+}
+
+#ifndef __CINT__
+int main(int argc, char **argv) {
+    SyntheticConfig config;
+    int runNumber = 1;
+    int nSubruns = 1;
+    int nArgs = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            config.events = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runNumber = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            nSubruns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            if (!ParseLines(argv[++i], config.lines)) {
+                printf("Failed to read the lines '%s'!\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            config.gammaMultiplicity = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            config.betaFraction = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            config.crossTalk = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            config.rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            // keeps the parts of the cycle in proportion
+            double scale = atof(argv[++i]) / config.cycleLength;
+            config.cycleLength *= scale;
+            config.backgroundStart *= scale;
+            config.beamOnStart *= scale;
+            config.decayStart *= scale;
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            config.seed = strtoul(argv[++i], nullptr, 10);
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
+    if (argc != 2 || config.events <= 0 || nSubruns <= 0 ||
+        config.cycleLength <= 0. || config.rate <= 0.) {
+        printf("try again (usage: %s [-n <events>] [-r <run number>] "
+               "[-s <subruns>] [-l <lines, e.g. co60+sn129 or "
+               "1173.2,1332.5:0.8>] [-m <gamma multiplicity>] "
+               "[-b <betas per decay>] [-x <cross-talk>] [-R <decays/s>] "
+               "[-c <cycle length in s>] [-S <seed>] <output directory>).\n",
+               argv[0]);
+        return 0;
+    }
+
+    TStopwatch w;
+    w.Start();
+
+    SyntheticGenerator generator(config);
+    TChannel *griffinChannels[SyntheticGenerator::kChannels];
+    TChannel *sceptarChannels[SyntheticGenerator::kPaddles];
+    for (int channel = 0; channel < SyntheticGenerator::kChannels; ++channel) {
+        int detector = channel / SyntheticGenerator::kCrystals + 1;
+        int crystal = channel % SyntheticGenerator::kCrystals;
+        griffinChannels[channel] = MakeChannel(
+            Form("GRG%02d%sN00A", detector,
+                 TGriffin::GetColorFromNumber(crystal)),
+            channel, channel, generator.Offset(channel),
+            generator.Gain(channel));
+    }
+    for (int paddle = 0; paddle < SyntheticGenerator::kPaddles; ++paddle) {
+        sceptarChannels[paddle] =
+            MakeChannel(Form("SEP%02dXN00X", paddle + 1), 0x1000 + paddle,
+                        SyntheticGenerator::kChannels + paddle, 0., 1.);
+    }
+
+    for (int subrun = 0; subrun < nSubruns; ++subrun) {
+        long first = config.events * subrun / nSubruns;
+        long last = config.events * (subrun + 1) / nSubruns;
+        std::string fileName = std::string(argv[1]) + "/" +
+                               Form("analysis%05d_%03d.root", runNumber,
+                                    subrun);
+        if (!WriteSubrun(fileName.c_str(), generator, last - first,
+                         runNumber, subrun, griffinChannels,
+                         sceptarChannels)) {
+            return 1;
+        }
+        printf("Wrote file: " DYELLOW "%s" RESET_COLOR "\n",
+               fileName.c_str());
+    }
+
+    std::string calName =
+        std::string(argv[1]) + "/" + Form("synthetic%05d.cal", runNumber);
+    TChannel::WriteCalFile(calName);
+
+    // the event and hit counts for SortBench
+    std::string infoName =
+        std::string(argv[1]) + "/" + Form("synthetic%05d.txt", runNumber);
+    FILE *info = fopen(infoName.c_str(), "w");
+    if (info == nullptr) {
+        printf("Failed to open file '%s'!\n", infoName.c_str());
+        return 1;
+    }
+    fprintf(info, "events %ld\ngammas %ld\nbetas %ld\nsubruns %d\n",
+            config.events, generator.Gammas(), generator.Betas(), nSubruns);
+    fclose(info);
+
+    printf("%ld events with %ld gamma and %ld beta hits over %.1f s\n",
+           config.events, generator.Gammas(), generator.Betas(),
+           generator.Time() * 1e-9);
+    std::cout << argv[0] << " done after " << w.RealTime() << " seconds"
+              << std::endl
+              << std::endl;
+
+    return 0;
+}
+#endif
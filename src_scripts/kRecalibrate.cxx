@@ -0,0 +1,396 @@
+// g++ kRecalibrate.cxx -std=c++0x -I$GRSISYS/include -L$GRSISYS/libraries
+// -lAnalysisTreeBuilder -lGriffin -lSceptar -lDescant -lPaces -lGRSIDetector
+// -lTGRSIFit -lTigress -lSharc -lCSM -lTriFoil -lTGRSIint -lGRSILoop
+// -lMidasFormat -lGRSIRootIO -lDataParser -lGRSIFormat -lMidasFormat
+// -lXMLParser -lXMLIO -lProof -lGuiHtml `grsi-config --cflags --libs`
+// `root-config --cflags --libs`  -lTreePlayer -lGROOT -lX11 -lXpm -lSpectrum
+
+// Linear gain match and residuals of all GRIFFIN channels from the charge
+// spectra of a calibration run (calhist<run>_<subrun>.root of
+// kMakeCalMatrices), without going back to the tree.
+//
+// Every channel keeps its charge spectrum in memory. A calibration is tried by
+// mapping the charge spectrum to energy (see SpectrumRebin.h) and fitting the
+// peaks, the calibration is corrected by what the fits found, and this is
+// repeated until the centroids stay within the tolerance of the literature
+// values:
+//
+//     1. linear: the two peaks of kLinearGainMatch set the offset and gain
+//     2. residuals: the peaks of kResidualCalculator set the residual at
+//        each peak, with the linear calibration of step 1
+//
+// Only the result is written, the coefficients as a cal file and the residuals
+// in the layout of kResidualCalculator (residuals.root unless -r names another
+// file; an existing residuals.root is not overwritten):
+//
+//     kRecalibrate [-j <threads>] [-t <tolerance in keV>]
+//                  [-i <max iterations>] [-o <cal file>]
+//                  [-r <residuals file>] calhist04921_000.root
+//
+// A channel whose gain match peaks are not found fails. It keeps the
+// calibration it started with and gets no residuals, and the failed channels
+// are listed at the end.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdarg.h>
+#include <string>
+#include <vector>
+
+#include "Globals.h"
+#include "TChannel.h"
+#include "TF1.h"
+#include "TFile.h"
+#include "TGraph.h"
+#include "TH1D.h"
+#include "TList.h"
+#include "TPeak.h"
+#include "TROOT.h"
+#include "TSpectrum.h"
+#include "TStopwatch.h"
+#include "TSystem.h"
+
+#include "CalHistCache.h"
+#include "CalPeaks.h"
+#include "ChannelPool.h"
+#include "SpectrumRebin.h"
+
+const int gNChannels = CalHistCache::kChannels;
+
+// Linear calibration followed by the residual correction, E - residual(E)
+// with the residual interpolated linearly between its points (and the first
+// and last interval extrapolated), the same as ResidualTable.h
+struct CalibrationMap {
+    double operator()(double charge) const {
+        double energy = linear(charge);
+        if (x.size() < 2) {
+            return energy;
+        }
+        int n = x.size();
+        int bin = (int)(std::upper_bound(x.begin(), x.end(), energy) -
+                        x.begin()) - 1;
+        bin = std::min(std::max(bin, 0), n - 2);
+        return energy - (y[bin] + (energy - x[bin]) * (y[bin + 1] - y[bin]) /
+                                      (x[bin + 1] - x[bin]));
+    }
+
+    Polynomial linear;
+    // residual points, increasing in x
+    std::vector<double> x;
+    std::vector<double> y;
+};
+
+// The calibration of one channel and how it got there. The channels are
+// calibrated side by side, so the printout is collected and printed in
+// channel order when all are done.
+struct ChannelCalibration {
+    CalibrationMap map;
+    int linearIterations = 0;
+    int residualIterations = 0;
+    double deviation = 0.; // largest |centroid - peak| of the last fits
+    bool converged = false;
+    bool failed = false; // the gain match peaks were not found
+    std::string log;
+};
+
+void AddToLog(std::string &log, const char *format, ...) {
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    log += text;
+}
+
+// Fits the strongest peak within window of energy, false if there is none.
+// The threshold of the peak search is relative to the strongest peak.
+bool FitPeak(TH1D *hist, double energy, double window, double threshold,
+             double &centroid) {
+    TSpectrum s;
+    hist->GetXaxis()->SetRangeUser(energy - window, energy + window);
+    int nFound = s.Search(hist, 2, "goff", threshold);
+    hist->GetXaxis()->UnZoom();
+    if (nFound < 1 || s.GetPositionX()[0] < 1) {
+        return false;
+    }
+    double found = s.GetPositionX()[0];
+
+    TPeak *peak = RootLocked(
+        [&]() { return new TPeak(found, found - window, found + window); });
+    peak->Fit(hist, "MQ");
+    centroid = peak->GetCentroid();
+    RootLocked([&]() { delete peak; });
+    return std::isfinite(centroid);
+}
+
+// Maps the charge spectrum into the histogram with the current calibration
+void Apply(const std::vector<double> &charge, const CalibrationMap &map,
+           std::vector<double> &energy, TH1D *hist) {
+    std::fill(energy.begin(), energy.end(), 0.);
+    RebinSpectrum(charge.data(), CalHistCache::kChargeBins, 0.,
+                  CalHistCache::kChargeHigh, map, energy.data(),
+                  CalHistCache::kEnergyBins, 0., CalHistCache::kEnergyHigh);
+    for (int bin = 0; bin < CalHistCache::kEnergyBins; ++bin) {
+        hist->SetBinContent(bin + 1, energy[bin]);
+    }
+}
+
+void CalibrateChannel(int channel, const std::vector<double> &charge,
+                      double tolerance, int maxIterations,
+                      ChannelCalibration &cal) {
+    std::vector<double> energy(CalHistCache::kEnergyBins);
+    TH1D hist(Form("h_%.2i", channel), "", CalHistCache::kEnergyBins, 0.,
+              CalHistCache::kEnergyHigh);
+
+    // 1. offset and gain from the two peaks, the residuals are not used yet
+    std::vector<double> &c = cal.map.linear.c;
+    if (c.size() < 2) {
+        c.resize(2, 0.);
+        c[1] = 1.;
+    }
+    c.resize(2);
+    bool linearDone = false;
+    bool linearFound = true;
+    while (!linearDone && cal.linearIterations < maxIterations) {
+        ++cal.linearIterations;
+        Apply(charge, cal.map, energy, &hist);
+        double centroid[2];
+        double chargePeak[2];
+        bool found = true;
+        for (int k = 0; k < 2 && found; ++k) {
+            found = FitPeak(&hist, gCalPeaks[k][0], gCalPeaks[k][1], 0.25,
+                            centroid[k]);
+            chargePeak[k] = (centroid[k] - c[0]) / c[1];
+        }
+        if (!found) {
+            AddToLog(cal.log, "Could not find the gain match peaks, the "
+                              "channel FAILED!\n");
+            linearFound = false;
+            cal.failed = true;
+            break;
+        }
+        cal.deviation = std::max(std::fabs(centroid[0] - gCalPeaks[0][0]),
+                                 std::fabs(centroid[1] - gCalPeaks[1][0]));
+        linearDone = (cal.deviation < tolerance);
+        if (!linearDone) {
+            c[1] = (gCalPeaks[1][0] - gCalPeaks[0][0]) /
+                   (chargePeak[1] - chargePeak[0]);
+            c[0] = gCalPeaks[0][0] - c[1] * chargePeak[0];
+        }
+    }
+    if (cal.failed) {
+        return;
+    }
+    AddToLog(cal.log, "linear: offset %g, gain %g after %d iterations\n", c[0],
+             c[1], cal.linearIterations);
+
+    // 2. residuals at the peaks that are found with the linear calibration.
+    // The points stay where the peaks are without residuals, and every
+    // iteration adds what is still off to their residual.
+    std::vector<int> peaks;
+    if (linearFound) {
+        Apply(charge, cal.map, energy, &hist);
+        for (int k = 0; k < gNResPeaks; ++k) {
+            double centroid;
+            if (!FitPeak(&hist, gResPeaks[k][0], gResPeaks[k][1], 0.15,
+                         centroid)) {
+                AddToLog(cal.log, "Could not find peak %g, skipping\n",
+                         gResPeaks[k][0]);
+                continue;
+            }
+            peaks.push_back(k);
+            cal.map.x.push_back(centroid);
+            cal.map.y.push_back(centroid - gResPeaks[k][0]);
+        }
+    }
+    if (!peaks.empty()) {
+        // boundary conditions to prevent too much extrapolation
+        cal.map.x.push_back(cal.map.x.back() + 10.);
+        cal.map.y.push_back(0.);
+        cal.map.x.push_back(cal.map.x.back() + 20.);
+        cal.map.y.push_back(0.);
+    }
+    while (!peaks.empty() && !cal.converged &&
+           cal.residualIterations < maxIterations) {
+        ++cal.residualIterations;
+        Apply(charge, cal.map, energy, &hist);
+        cal.deviation = 0.;
+        for (size_t p = 0; p < peaks.size(); ++p) {
+            const double *peak = gResPeaks[peaks[p]];
+            double centroid;
+            if (!FitPeak(&hist, peak[0], peak[1], 0.15, centroid)) {
+                continue;
+            }
+            double off = centroid - peak[0];
+            cal.map.y[p] += off;
+            cal.deviation = std::max(cal.deviation, std::fabs(off));
+        }
+        cal.converged = (cal.deviation < tolerance);
+    }
+    AddToLog(cal.log,
+             "residuals: %d peaks, largest deviation %g keV after %d "
+             "iterations%s\n",
+             (int)peaks.size(), cal.deviation, cal.residualIterations,
+             cal.converged ? "" : " (not converged)");
+}
+
+#ifndef __CINT__
+int main(int argc, char **argv) {
+    int nThreads = 1;
+    double tolerance = 0.05;
+    int maxIterations = 10;
+    std::string calName;
+    std::string resName;
+    int nArgs = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            maxIterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            calName = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            resName = argv[++i];
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
+    if (argc != 2 || tolerance <= 0. || maxIterations < 1) {
+        printf("try again (usage: %s [-j <threads>] [-t <tolerance in keV>] "
+               "[-i <max iterations>] [-o <cal file>] [-r <residuals file>] "
+               "<calibration spectra of kMakeCalMatrices>).\n",
+               argv[0]);
+        return 0;
+    }
+    if (calName.empty()) {
+        calName = argv[1];
+        if (calName.size() > 5 &&
+            calName.compare(calName.size() - 5, 5, ".root") == 0) {
+            calName.resize(calName.size() - 5);
+        }
+        calName += ".cal";
+    }
+    // the residuals of kResidualCalculator are only replaced on request
+    if (resName.empty()) {
+        resName = "residuals.root";
+        if (!gSystem->AccessPathName(resName.c_str())) {
+            printf("'%s' exists already, name the residuals file with -r to "
+                   "replace it.\n",
+                   resName.c_str());
+            return 1;
+        }
+    }
+    SetUpFits(nThreads);
+
+    // the histograms of the fits belong to their thread, not to a file
+    TH1::AddDirectory(false);
+
+    TStopwatch w;
+    w.Start();
+
+    TFile *file = new TFile(argv[1]);
+    if (!file->IsOpen()) {
+        printf("Failed to open file '%s'!\n", argv[1]);
+        return 1;
+    }
+    CalHistCache *cache = CalHistCache::Read(file);
+    if (cache == nullptr) {
+        printf("Failed to find calibration spectra in file '%s'!\n", argv[1]);
+        return 1;
+    }
+
+    // the charge spectra and the calibration to start from
+    std::vector<std::vector<double>> charge(gNChannels);
+    std::vector<ChannelCalibration> cals(gNChannels);
+    TH2D *chargeMatrix = cache->Charge(CalHistCache::kSingleHit);
+    for (int channel = 0; channel < gNChannels; ++channel) {
+        charge[channel].resize(CalHistCache::kChargeBins);
+        for (int bin = 0; bin < CalHistCache::kChargeBins; ++bin) {
+            charge[channel][bin] =
+                chargeMatrix->GetBinContent(channel + 1, bin + 1);
+        }
+        TChannel *chan = TChannel::GetChannelByNumber(channel);
+        if (chan != nullptr) {
+            for (Float_t c : chan->GetENGCoeff()) {
+                cals[channel].map.linear.c.push_back(c);
+            }
+        }
+    }
+    delete cache;
+    std::cout << argv[0] << ": read the spectra after " << w.RealTime()
+              << " seconds" << std::endl;
+    w.Continue();
+
+    printf("Calibrating %d channels with %d threads\n", gNChannels, nThreads);
+    ChannelPool pool(nThreads);
+    pool.Run(gNChannels, [&](int channel) {
+        CalibrateChannel(channel, charge[channel], tolerance, maxIterations,
+                         cals[channel]);
+    });
+
+    int nConverged = 0;
+    std::vector<int> failed;
+    TList *graphs = new TList;
+    for (int channel = 0; channel < gNChannels; ++channel) {
+        const ChannelCalibration &cal = cals[channel];
+        printf("Channel %d:\n%s", channel, cal.log.c_str());
+        if (cal.converged) {
+            ++nConverged;
+        }
+        if (cal.failed) {
+            failed.push_back(channel);
+        }
+        TChannel *chan = TChannel::GetChannelByNumber(channel);
+        if (chan != nullptr && !cal.failed) {
+            chan->DestroyENGCal();
+            chan->AddENGCoefficient(static_cast<Float_t>(cal.map.linear.c[0]));
+            chan->AddENGCoefficient(static_cast<Float_t>(cal.map.linear.c[1]));
+        }
+        // the residuals are the deviation from the linear calibration
+        auto *graph = new TGraph(cal.map.x.size(), cal.map.x.data(),
+                                 cal.map.y.data());
+        graph->SetTitle("");
+        graphs->Add(graph);
+    }
+    int slowest = pool.Slowest();
+    printf("%d of %d channels converged, the slowest channel %d took %.2f s\n",
+           nConverged, gNChannels, slowest, pool.Time(slowest));
+    if (!failed.empty()) {
+        printf(DRED "%d channels FAILED, they keep their old calibration:",
+               (int)failed.size());
+        for (int channel : failed) {
+            printf(" %d", channel);
+        }
+        printf(RESET_COLOR "\n");
+    }
+
+    printf("Writing calibration to: " DYELLOW "%s" RESET_COLOR "\n",
+           calName.c_str());
+    TChannel::WriteCalFile(calName);
+
+    // the same layout kResidualCalculator writes, Graph;1 to Graph;64
+    printf("Writing residuals to: " DYELLOW "%s" RESET_COLOR "\n",
+           resName.c_str());
+    TFile *resFile = new TFile(resName.c_str(), "recreate");
+    if (!resFile->IsOpen()) {
+        printf("Failed to open file '%s'!\n", resName.c_str());
+        return 1;
+    }
+    TDirectory *dir = resFile->mkdir("Energy_Residuals");
+    dir->cd();
+    graphs->Write();
+    resFile->Close();
+
+    std::cout << argv[0] << " done after " << w.RealTime() << " seconds"
+              << std::endl
+              << std::endl;
+    return 0;
+}
+#endif
@@ -7,42 +7,21 @@
  * gain matched.
  *
  * This script takes in an analsys tree from the provided root file,
- * measures the amount the peaks specified (in gPeaks) from the measured data.
+ * measures the amount the peaks specified (in gResPeaks of CalPeaks.h) from
+ * the measured data.
  *
  * The resulting TGraphs are stored in a directory "Energy_Residuals" in the
  * provided root file.
  *
  */
 
-/* 
- * Example loading script. Put at the begining of your other analysis scripts
- * such as LeanMatricies.cxx, after the TGriffin address has been loaded.
- *
- * Change pGriff to the TGriffin address pointer variable.
+/*
+ * The sorting scripts load the residuals with LoadCalibration (see
+ * CalBundle.h), either from residuals.root or from a calibration bundle that
+ * kMakeCalBundle made from it, given as another argument to the script, ie
  *
- * Note that the TGraphs are stored from 1->64, but they are loaded in through
- * LoadEnergyResidual from 0->63.
-
-    if( gResidualFile->cd("Energy_Residuals") ) {
-        printf("Energy residual calibration data found. Loading...\n");
-
-        TGraph* TempResidual;
-        for( int i = 1 ; i <= 64 ; i++ ) {
-            gDirectory->GetObject(Form("Graph;%d",i), TempResidual);
-            pGriff->LoadEnergyResidual( i-1, TempResidual);
-        }
-        gFile->cd(); // Return to the top directory
-        printf("Done.\n");
-    }
-
-    Any scripts that use the above code will need to open the resiual file residuals.root.
-    This can be done as another argument to the script, ie
-    LeanMatricies <rootfile> residuals.root
-
-    The file can be accessed by looking at argv[2] in this instance. Thus to load
-    the residual file we could just:
-    TFile *gResidualFile = TFile(argv[2], READ);
-*/
+ *     kLeanMatrices <rootfile> residuals.root
+ */
 
 #include <algorithm>
 #include <cmath>
@@ -51,6 +30,7 @@
 #include <iomanip>
 #include <iostream>
 #include <math.h> // round, floor, ceil, trunc
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -83,6 +63,12 @@
 #include "TStyle.h"
 #include "TTree.h"
 
+#include "CalBundle.h"
+#include "CalHistCache.h"
+#include "CalPeaks.h"
+#include "ChannelPool.h"
+#include "EnergyProjector.h"
+
 #ifndef __CINT__
 #include "TGriffin.h"
 #include "TSceptar.h"
@@ -93,55 +79,115 @@
 // 0 for analysis tree
 const bool gIsFragmentFile = 0;
 
-// Input calibration peaks for finding nonlinearities
-/*
-const std::vector<double_t> gPeaks = {121.7817, 244.6974, 964.057,
-                                      1085.837, 1112.076};
-
-const std::vector<double_t> gWidths = {16, 20, 20, 13, 13};
-*/
-
-// Key peaks for 129Sn
-const std::vector<double_t> gPeaks = {
-    315.42,
-    511.0,
-    570.41,
-    645.2,
-    728.53,
-    769.31,
-//    907.34, // Double Peak
-    1008.53,
-    1054.3,
-//    1222.51,
-//    1781.54,
-    1864.89,
-    2118.26,
-    2546.61};
-
-const std::vector<double_t> gWidths = {
-    20,
-    20,
-    20,
-    20,
-    20,
-    20,
-//    20,
-    20,
-    15,
-//    20,
-//    20,
-    20,
-    20,
-    20};
+// The calibration peaks for finding nonlinearities are gResPeaks of
+// CalPeaks.h
 
 // Used for displaying individual peak fitting information
 const bool gPrintFlag = true;
 
+const int gNChannels = 64;
+
+// The residuals of one channel, and what was printed while fitting it. The
+// channels are fitted side by side, so the printout is collected and printed
+// in channel order when all are done.
+struct ChannelResiduals {
+    std::vector<double_t> EngDiff;
+    std::vector<double_t> EngDiffErr;
+    std::vector<double_t> EngX;
+    std::string Log;
+};
+
+void AddToLog(std::string &log, const char *format, ...) {
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    log += text;
+}
+
+// Fits all the peaks of one channel, h_en is only used by this thread
+void FitChannel(TH1D *h_en, ChannelResiduals &res) {
+    int nPeaks = gNResPeaks;
+
+    // Fit all the peaks in our calibration and collect their centroids
+    for (int k = 0; k < nPeaks; k++) {
+        double_t CalPeak, DataPeak, CalWidth;
+        double_t DataPeakErr;
+        CalPeak = gResPeaks[k][0];
+        CalWidth = gResPeaks[k][1];
+
+        // We use TSpectrum::Search() to grab all the peaks. Output is
+        // ordered from the most intense peak to the least.
+        if (gPrintFlag)
+            AddToLog(res.Log, "Fitting peak %g .", gResPeaks[k][0]);
+        TSpectrum s;
+        h_en->GetXaxis()->SetRangeUser(CalPeak - CalWidth,
+                                       CalPeak + CalWidth);
+        s.Search(h_en, 2, "goff", 0.15); // Hist, Sigma, Opt, Threshold
+        DataPeak = s.GetPositionX()[0]; // Grab most intense peak
+
+        if ( DataPeak < 1 ) { // Errors commonly fall under this condition
+            AddToLog(res.Log, "Could not find Peak, Skipping.\n");
+            continue;
+        }
+
+        if (gPrintFlag)
+            AddToLog(res.Log, "Roughly at %g ", DataPeak);
+        h_en->GetXaxis()->UnZoom();
+
+        // Fit the peak
+        TPeak *CurPeak = RootLocked([&]() {
+            return new TPeak(DataPeak, DataPeak - CalWidth,
+                             DataPeak + CalWidth);
+        });
+        CurPeak->Fit(h_en, "MQ+"); // Quiet Flag
+        DataPeak = CurPeak->GetCentroid();
+        DataPeakErr = CurPeak->GetCentroidErr();
+
+        // Report the peak
+        if (gPrintFlag)
+            AddToLog(res.Log, "... found at %g, ", DataPeak);
+        // We compute the quantanty that will be subtracted by the data
+        res.EngDiff.push_back( DataPeak - CalPeak );
+        res.EngDiffErr.push_back(DataPeakErr);
+        if (gPrintFlag)
+            AddToLog(res.Log, " difference of %g\n", res.EngDiff.back());
+        res.EngX.push_back(DataPeak);
+
+        // Loop Cleanup
+        RootLocked([&]() { delete CurPeak; });
+    }
+
+    // Boundary conditions to prevent too much exterpolation
+    res.EngX.push_back(res.EngX.back() + 10);
+    res.EngDiffErr.push_back(0.0);
+    res.EngDiff.push_back(0.0);
+    res.EngX.push_back(res.EngX.back() + 20);
+    res.EngDiffErr.push_back(0.0);
+    res.EngDiff.push_back(0.0);
+}
+
 int main(int argc, char *argv[]) {
+    int nThreads = 1;
+    int nArgs = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            // channels fitted at the same time
+            nThreads = atoi(argv[++i]);
+        } else {
+            argv[nArgs++] = argv[i];
+        }
+    }
+    argc = nArgs;
+
     if (argc != 2) {
-        printf("Usage: %s <fragment or analysis tree file>.\n", argv[0]);
+        printf("Usage: %s [-j <threads>] <fragment or analysis tree file, or "
+               "calibration spectra of kMakeCalMatrices>.\n",
+               argv[0]);
         exit(EXIT_FAILURE);
     }
+    SetUpFits(nThreads);
 
     TFile *pFile = new TFile(argv[1], "update");
 
@@ -150,130 +196,50 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if( gPeaks.size() != gWidths.size() ) {
-        printf("Number of peaks and widths are different!\n");
-        exit(EXIT_FAILURE);
-    }
-
-    TTree *pTree = nullptr;
-
-    if (gIsFragmentFile)
-        pTree = (TTree *)pFile->Get("FragmentTree");
-    else
-        pTree = (TTree *)pFile->Get("AnalysisTree");
-
-    TChannel::ReadCalFromTree(pTree);
-
-    if (pTree == nullptr) {
-        printf("Failed to find fragment or analysis tree in file '%s'.\n",
-               argv[1]);
+    EnergyProjector::ELayout layout = gIsFragmentFile
+                                          ? EnergyProjector::kFragmentTree
+                                          : EnergyProjector::kAnalysisTree;
+    TH2D *mat_en = ReadEnergyMatrix(pFile, layout, nThreads);
+    if (mat_en == nullptr) {
         exit(EXIT_FAILURE);
     }
 
-    // Setup TGriffin
-    TGriffin *pGriff = nullptr;
-    pTree->SetBranchAddress("TGriffin", &pGriff);
-
-    //TChannel *pChannel = nullptr;
-    //TChannel::ReadCalFromTree(pTree);
-
-    printf("Generating empty matrix");
-    // Load energy matrix
-    TH2D *mat_en = new TH2D("mat_en", "", 64, 0, 64, 5000, 0, 5000);
-
-    printf("Filling energy matrix");
-    // Load in Energy data
-    if (gIsFragmentFile)
-        pTree->Project("mat_en", "TFragment.GetEnergy():"
-                                 "TFragment.GetChannelNumber()",
-                                 "TGriffin.GetMultiplicity()==1");
-    else
-        pTree->Project("mat_en",
-                       "TGriffin.fGriffinLowGainHits.GetEnergy():"
-                       "TGriffin.fGriffinLowGainHits.GetChannel().fNumber",
-                       "TGriffin.GetMultiplicity()==1");
-
     // Make a list that will store all the energy differences
     TList* LNonlinearitiesGraphs = new TList();
     TList* LNonlinearitiesGraphsErr = new TList();
 
-    int nPeaks = gPeaks.size();
-
-    for (int i = 0; i < 64; i++) {
-        printf("Starting new channel %d:\n", i);
+    // Project the histograms for all channels, then fit them side by side
+    std::vector<TH1D *> Hists(gNChannels);
+    for (int i = 0; i < gNChannels; i++) {
+        Hists[i] = mat_en->ProjectionY(Form("h_%.2i", i), i + 1, i + 1);
+    }
 
-        // Project the project the histogram for the current channel
-        TH1D *h_en = mat_en->ProjectionY(Form("h_%.2i", i), i + 1, i + 1);
-
-        std::vector<double_t> EngDiff = {};
-        std::vector<double_t> EngDiffErr = {};
-        std::vector<double_t> EngX = {};
-
-        // Fit all the peaks in our calibration and collect their centroids
-        for (int k = 0; k < nPeaks; k++) {
-            double_t CalPeak, DataPeak, CalWidth;
-            double_t DataPeakErr;
-            CalPeak = gPeaks[k];
-            CalWidth = gWidths[k];
-
-            // We use TSpectrum::Search() to grab all the peaks. Output is
-            // ordered from the most intense peak to the least.
-            if (gPrintFlag)
-                printf("Fitting peak %g .", gPeaks[k]);
-            TSpectrum s;
-            h_en->GetXaxis()->SetRangeUser(CalPeak - CalWidth,
-                                           CalPeak + CalWidth);
-            s.Search(h_en, 2, "", 0.15);    // Hist, Sigma, Opt, Threshold
-            DataPeak = s.GetPositionX()[0]; // Grab most intense peak
-
-            if ( DataPeak < 1 ) { // Errors commonly fall under this condition
-                printf("Could not find Peak, Skipping.\n");
-                continue;
-            }
-
-            if (gPrintFlag)
-                printf("Roughly at %g ", DataPeak);
-            h_en->GetXaxis()->UnZoom();
-
-            // Fit the peak
-            TPeak *CurPeak =
-                new TPeak(DataPeak, DataPeak - CalWidth, DataPeak + CalWidth);
-            CurPeak->Fit(h_en, "MQ+"); // Quiet Flag
-            DataPeak = CurPeak->GetCentroid();
-            DataPeakErr = CurPeak->GetCentroidErr();
-
-            // Report the peak
-            if (gPrintFlag)
-                printf("... found at %g, ", DataPeak);
-            // We compute the quantanty that will be subtracted by the data
-            EngDiff.push_back( DataPeak - CalPeak );
-            EngDiffErr.push_back(DataPeakErr);
-            if (gPrintFlag)
-                printf(" difference of %g\n", EngDiff.back());
-            EngX.push_back(DataPeak);
-
-            // Loop Cleanup
-            delete CurPeak;
-        }
+    std::vector<ChannelResiduals> Residuals(gNChannels);
+    printf("Fitting %d channels with %d threads\n", gNChannels, nThreads);
+    ChannelPool Pool(nThreads);
+    Pool.Run(gNChannels,
+             [&](int i) { FitChannel(Hists[i], Residuals[i]); });
 
-        // Boundary conditions to prevent too much exterpolation
-        EngX.push_back(EngX.back() + 10);
-        EngDiffErr.push_back(0.0);
-        EngDiff.push_back(0.0);
-        EngX.push_back(EngX.back() + 20);
-        EngDiffErr.push_back(0.0);
-        EngDiff.push_back(0.0);
+    for (int i = 0; i < gNChannels; i++) {
+        const ChannelResiduals &res = Residuals[i];
+        printf("Starting new channel %d:\n", i);
+        printf("%s", res.Log.c_str());
 
         // Make a TGraph that can be used for interpolating the values
-        TGraph* TempGraph = new TGraph(EngX.size(), EngX.data(), EngDiff.data());
+        TGraph* TempGraph = new TGraph(res.EngX.size(), res.EngX.data(),
+                                       res.EngDiff.data());
         TempGraph->SetTitle("");
         LNonlinearitiesGraphs->Add(TempGraph);
 
         // Make a graph that represents this channel's offsets and errors
-        TGraphErrors* TempGraphErr = new TGraphErrors(EngX.size(), EngX.data(),
-                EngDiff.data(), EngDiffErr.data(), EngDiffErr.data() );
+        TGraphErrors* TempGraphErr = new TGraphErrors(res.EngX.size(),
+                res.EngX.data(), res.EngDiff.data(), res.EngDiffErr.data(),
+                res.EngDiffErr.data() );
         LNonlinearitiesGraphsErr->Add(TempGraphErr);
     }
+    int Slowest = Pool.Slowest();
+    printf("Fits took %.2f s, the slowest channel %d took %.2f s\n",
+           Pool.TotalTime(), Slowest, Pool.Time(Slowest));
 
     // We want to make an extra directory to store all of our energy
     // residuals in. The assumption is made that these TGraphs are